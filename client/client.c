@@ -12,6 +12,7 @@
 #endif
 
 #define WS_CSTYLE WS_OVERLAPPEDWINDOW ^ WS_THICKFRAME ^ WS_MAXIMIZEBOX
+#define QUERY_ATTEMPTS 3
 
 //	Variabili globali:
 HINSTANCE hInst;		// Istanza corrente
@@ -41,7 +42,8 @@ INT_PTR CALLBACK    About(HWND, UINT, WPARAM, LPARAM);
 BOOL				ButtonClickHandler(HWND, LPCTSTR*);
 BOOL				UpdateSeats(HWND, BOOL);
 BOOL				QueryServer(LPCTSTR, LPTSTR*);
-BOOL				GetSeatsQuery(LPTSTR*, HBITMAP);
+BOOL				QueryServerIdempotent(LPCTSTR, LPTSTR*);
+BOOL				GetSeatsQuery(LPTSTR*, HBITMAP, LPCTSTR);
 void				ErrorHandler(int e);
 
 int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _In_ LPTSTR lpCmdLine, _In_ int nCmdShow) {
@@ -519,7 +521,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 				if (asprintf(&queries[0], TEXT("BOOK -1")) == -1) {
 					ErrorHandler(GetLastError());
 				}
-				if (!GetSeatsQuery(&queries[0], hBitmapSelected)) {
+				if (!GetSeatsQuery(&queries[0], hBitmapSelected, TEXT(""))) {
 					free(queries[0]);
 					free(queries);
 					free(bookingCode);
@@ -533,35 +535,29 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 				free(queries);
 			}
 			else if ((HWND)lParam == hButton2) {
-				int i = 1;
+				BOOL added;
+				BOOL removed;
 
-				if ((queries = malloc(sizeof(LPTSTR) * 3)) == NULL) {
+				if ((queries = malloc(sizeof(LPTSTR) * 2)) == NULL) {
 					ErrorHandler(GetLastError());
 				}
-				if (asprintf(&queries[0], TEXT("BOOK %s"), bookingCode) == -1) {
+				if (asprintf(&queries[0], TEXT("MODIFY %s"), bookingCode) == -1) {
 					ErrorHandler(GetLastError());
 				}
-				if (!GetSeatsQuery(&queries[0], hBitmapSelected)) {
+				//	The seats are moved with a single atomic query
+				added = GetSeatsQuery(&queries[0], hBitmapSelected, TEXT("+"));
+				removed = GetSeatsQuery(&queries[0], hBitmapRemove, TEXT("-"));
+				if (!added && !removed) {
 					free(queries[0]);
-					queries[0] = NULL;
-					queries[1] = NULL;
-					i = 0;
-				}
-				if (asprintf(&queries[i], TEXT("DELETE %s"), bookingCode) == -1) {
-					ErrorHandler(GetLastError());
-				}
-				if (!GetSeatsQuery(&queries[i], hBitmapRemove)) {
-					free(queries[i]);
-					queries[i] = NULL;
+					free(queries);
+					free(bookingCode);
+					return 0;
 				}
-				queries[2] = NULL;
+				queries[1] = NULL;
 				if (!ButtonClickHandler(hWnd, queries)) {
 					ErrorHandler(GetLastError());
 				}
 				free(queries[0]);
-				if (i) {
-					free(queries[1]);
-				}
 				free(queries);
 			}
 			else if ((HWND)lParam == hButton3) {
@@ -574,21 +570,16 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 					MB_YESNO | MB_ICONWARNING | MB_DEFBUTTON2 | MB_APPLMODAL
 				);
 				if (MessageBoxResult == IDYES) {
-					BOOL booking;
+					if (!_tcscmp(bookingCode, TEXT(""))) {
+						free(bookingCode);
+						return 0;
+					}
 					if ((queries = malloc(sizeof(LPTSTR) * 2)) == NULL) {
 						ErrorHandler(GetLastError());
 					}
-					if (asprintf(&queries[0], TEXT("DELETE %s"), bookingCode) == -1) {
+					if (asprintf(&queries[0], TEXT("CANCEL %s"), bookingCode) == -1) {
 						ErrorHandler(GetLastError());
 					}
-					booking = GetSeatsQuery(&queries[0], hBitmapBooked);
-					booking |= GetSeatsQuery(&queries[0], hBitmapRemove);
-					if (!booking) {
-						free(queries[0]);
-						free(queries);
-						free(bookingCode);
-						return 0;
-					}
 					queries[1] = NULL;
 					if (!ButtonClickHandler(hWnd, queries)) {
 						ErrorHandler(GetLastError());
@@ -687,7 +678,7 @@ BOOL UpdateSeats(HWND hWnd, BOOL reset) {
 	return TRUE;
 }
 
-BOOL GetSeatsQuery(LPTSTR* lppQuery, HBITMAP hBitmapType) {
+BOOL GetSeatsQuery(LPTSTR* lppQuery, HBITMAP hBitmapType, LPCTSTR lpPrefix) {
 	BOOL result = FALSE;
 	HBITMAP hBitmap = NULL;
 	LPTSTR lpTmp = NULL;
@@ -697,7 +688,7 @@ BOOL GetSeatsQuery(LPTSTR* lppQuery, HBITMAP hBitmapType) {
 		if (hBitmap == hBitmapType) {
 			result = TRUE;
 			lpTmp = *lppQuery;
-			if (asprintf(lppQuery, TEXT("%s %d"), *lppQuery, i) == -1) {
+			if (asprintf(lppQuery, TEXT("%s %s%d"), *lppQuery, lpPrefix, i) == -1) {
 				ErrorHandler(GetLastError());
 			}
 			free(lpTmp);
@@ -711,7 +702,7 @@ BOOL ButtonClickHandler(HWND hWnd, LPCTSTR* queries) {
 	LPTSTR buffer;
 	
 	for (int i = 0; queries[i] != NULL; i++) {
-		if (!QueryServer(queries[i], &buffer)) {
+		if (!QueryServerIdempotent(queries[i], &buffer)) {
 			ErrorHandler(WSAGetLastError());
 		}
 		if (!(_tcscmp(buffer, TEXT("OPERATION FAILED")))) {
@@ -722,7 +713,16 @@ BOOL ButtonClickHandler(HWND hWnd, LPCTSTR* queries) {
 				MB_OK | MB_ICONERROR | MB_APPLMODAL
 			);
 		}
-		if ((_tcscmp(buffer, TEXT("OPERATION SUCCEDED")))) {
+		// BUSY <seat> reports a seat locked by a concurrent booking, it is not a booking code
+		else if (!(_tcsncmp(buffer, TEXT("BUSY "), 5))) {
+			MessageBox(
+				hWnd,
+				TEXT("Un posto selezionato e' in fase di prenotazione da parte di un altro utente.\nRiprovare"),
+				NULL,
+				MB_OK | MB_ICONWARNING | MB_APPLMODAL
+			);
+		}
+		else if ((_tcscmp(buffer, TEXT("OPERATION SUCCEDED")))) {
 			if (!SetBooking(hBooking, buffer)) {
 				ErrorHandler(GetLastError());
 			}
@@ -759,6 +759,25 @@ BOOL QueryServer(LPCTSTR query, LPTSTR* result) {
 	return TRUE;
 }
 
+/*
+* Send a mutating query tagged with an idempotency key, the query is retried
+* with the same key so that the server applies it at most once.
+*/
+BOOL QueryServerIdempotent(LPCTSTR query, LPTSTR* result) {
+	static unsigned int counter = 0;
+	LPTSTR keyedQuery;
+	BOOL success = FALSE;
+
+	if (asprintf(&keyedQuery, TEXT("KEY %lu-%llu-%u %s"), GetCurrentProcessId(), GetTickCount64(), counter++, query) == -1) {
+		return FALSE;
+	}
+	for (int i = 0; i < QUERY_ATTEMPTS && !success; i++) {
+		success = QueryServer(keyedQuery, result);
+	}
+	free(keyedQuery);
+	return success;
+}
+
 void ErrorHandler(int e) {
 	LPTSTR p_errmsg = NULL;
 	FormatMessage(
@@ -36,6 +36,8 @@ void* avl_tree_search(const avl_tree_t handle, const void* key);
 
 int avl_tree_insert(const avl_tree_t handle, const void* key, const void* value);
 
+int avl_tree_build(const avl_tree_t handle, void** keys, void** values, const long n);
+
 int avl_tree_delete(const avl_tree_t handle, const void* key);
 
 int avl_tree_delete_node(const avl_tree_t handle, avl_tree_node_t node);
@@ -18,6 +18,8 @@ static void balance_delete(const avl_tree_t handle, const avl_tree_node_t node);
 static int cut_single_son(const avl_tree_t handle, const avl_tree_node_t node);
 static int subtree_nodes_number(const avl_tree_t node);
 static int defualt_comparison_function(const void* key1, const void* key2);
+static avl_tree_node_t build_subtree(void** keys, void** values, const long first, const long last, const avl_tree_node_t father);
+static void destroy_subtree(const avl_tree_node_t node);
 
 avl_tree_t avl_tree_init(const avl_tree_comparison_function* comparison_function) {
 	struct avl_tree* tree;
@@ -251,6 +253,22 @@ int avl_tree_insert(const avl_tree_t handle, const void* key, const void* value)
 	return 0;
 }
 
+/*
+* Fill an empty tree with keys sorted in strictly ascending order, the tree
+* is built balanced in linear time without any rotation.
+*/
+int avl_tree_build(const avl_tree_t handle, void** keys, void** values, const long n) {
+	struct avl_tree* tree = (struct avl_tree*)handle;
+	if (tree->root || n < 0) {
+		return 1;
+	}
+	if (n && (tree->root = build_subtree(keys, values, 0, n - 1, NULL)) == NULL) {
+		return 1;
+	}
+	tree->n = (int)n;
+	return 0;
+}
+
 int avl_tree_delete(const avl_tree_t handle, const void* key) {
 	struct avl_tree* tree = (struct avl_tree*)handle;
 	avl_tree_node_t node = avl_tree_search_node(tree, key);
@@ -359,7 +377,7 @@ static void rotate(const avl_tree_t handle, const avl_tree_node_t node) {
 		}
 	}
 	else if (balanced_factor == -2) {	//height of the node's right son is 2 times greater than the left one
-		if (avl_tree_node_get_balance_factor(avl_tree_node_get_left_son(node)) >= 0) {	//RR balancing
+		if (avl_tree_node_get_balance_factor(avl_tree_node_get_right_son(node)) <= 0) {	//RR balancing
 			left_rotation(tree, node);
 		}
 		else {	//RL balancing
@@ -440,3 +458,35 @@ static int defualt_comparison_function(const void* key1, const void* key2) {
 	}
 	return 0;
 }
+
+static avl_tree_node_t build_subtree(void** keys, void** values, const long first, const long last, const avl_tree_node_t father) {
+	long middle = first + (last - first) / 2;
+	avl_tree_node_t node;
+	avl_tree_node_t left_son = NULL;
+	avl_tree_node_t right_son = NULL;
+	if ((node = avl_tree_node_init(keys[middle], values[middle])) == NULL) {
+		return NULL;
+	}
+	avl_tree_node_set_father(node, father);
+	if (middle > first && (left_son = build_subtree(keys, values, first, middle - 1, node)) == NULL) {
+		avl_tree_node_destroy(node);
+		return NULL;
+	}
+	if (middle < last && (right_son = build_subtree(keys, values, middle + 1, last, node)) == NULL) {
+		destroy_subtree(left_son);
+		avl_tree_node_destroy(node);
+		return NULL;
+	}
+	avl_tree_node_set_left_son(node, left_son);
+	avl_tree_node_set_right_son(node, right_son);
+	avl_tree_node_update_height(node);
+	return node;
+}
+
+static void destroy_subtree(const avl_tree_node_t node) {
+	if (node) {
+		destroy_subtree(avl_tree_node_get_left_son(node));
+		destroy_subtree(avl_tree_node_get_right_son(node));
+		avl_tree_node_destroy(node);
+	}
+}
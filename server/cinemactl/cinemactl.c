@@ -12,6 +12,8 @@
 
 #define is_child(pid) !pid
 
+#define QUERY_LEN 4096
+
 #define COLOR_GREEN "\e[1;92m"
 #define COLOR_DEFAULT "\e[0m"
 
@@ -21,7 +23,9 @@ enum operation {
 	START,
 	STOP,
 	STATUS,
-	QUERY
+	QUERY,
+	LOAD,
+	BACKUP
 };
 
 static enum operation get_operation(int argc, char* argv[]);
@@ -31,6 +35,8 @@ static int server_start();
 static int server_stop();
 static int server_status();
 static int server_query(char*, char**);
+static int script_load(char*, char*);
+static int server_backup(char*);
 
 static int format_time_string(char** timestr);
 
@@ -55,6 +61,12 @@ int main(int argc, char* argv[]) {
 		free(buff);
 		}
 		break;
+	case LOAD:
+		try(script_load(argv[2], argv[3]), 1, error);
+		break;
+	case BACKUP:
+		try(server_backup(argv[2]), 1, error);
+		break;
 	default:
 		try(usage(), 1, error);
 		return 1;
@@ -76,6 +88,10 @@ static enum operation get_operation(int argc, char* argv[]) {
 		return STATUS;
 	else if (argc == 3 && !strncasecmp(argv[1], "query", 5))
 		return QUERY;
+	else if (argc == 4 && !strncasecmp(argv[1], "load", 4))
+		return LOAD;
+	else if (argc == 3 && !strncasecmp(argv[1], "backup", 6))
+		return BACKUP;
 	else
 		return NOP;
 }
@@ -91,7 +107,9 @@ static int usage() {
 			\r stop\n\
 			\r status\n\
 			\r restart\n\
-			\r query [...]\n\n"
+			\r query [...]\n\
+			\r load [name] [file]\n\
+			\r backup [name]\n\n"
 		) < 0,
 		!0,
 		error
@@ -181,6 +199,77 @@ error:
 	return 1;
 }
 
+/*
+* Send the stored procedure read from the file to the server, the comments
+* starting with '#' are dropped and the tokens are joined by single spaces.
+*/
+static int script_load(char* name, char* filename) {
+	FILE* file;
+	char* query;
+	char* result;
+	char* line = NULL;
+	size_t size = 0;
+	size_t length;
+
+	try(file = fopen(filename, "r"), NULL, error);
+	try(query = malloc(sizeof(char) * (QUERY_LEN + 1)), NULL, cleanup1);
+	length = (size_t)snprintf(query, QUERY_LEN + 1, "LOAD %s", name);
+	while (getline(&line, &size, file) != -1) {
+		char* saveptr = NULL;
+		line[strcspn(line, "#")] = 0;
+		for (char* token = strtok_r(line, " \t\r\n", &saveptr); token; token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+			if (length + 1 + strlen(token) > QUERY_LEN) {
+				errno = E2BIG;
+				goto cleanup2;
+			}
+			length += (size_t)sprintf(query + length, " %s", token);
+		}
+	}
+	try(ferror(file), !0, cleanup2);
+	try(server_query(query, &result), 1, cleanup2);
+	printf("%s\n", result);
+	free(result);
+	free(line);
+	free(query);
+	fclose(file);
+	return 0;
+
+cleanup2:
+	free(line);
+	free(query);
+cleanup1:
+	fclose(file);
+error:
+	return 1;
+}
+
+/*
+* Ask the server for a consistent copy of its data file, written with the
+* received name in the backups directory of the server, etc/backups under
+* ~/.cinema.
+*/
+static int server_backup(char* name) {
+	char* query;
+	char* result;
+
+	// the query is split on spaces and the server accepts only a file name
+	if (strchr(name, ' ') || strchr(name, '/')) {
+		errno = EINVAL;
+		goto error;
+	}
+	try(asprintf(&query, "BACKUP %s", name), -1, error);
+	try(server_query(query, &result), 1, cleanup);
+	printf("%s\n", result);
+	free(result);
+	free(query);
+	return 0;
+
+cleanup:
+	free(query);
+error:
+	return 1;
+}
+
 static int format_time_string(char** timestr) {
 	time_t rawtime;
 	struct tm timeinfo;
@@ -0,0 +1,244 @@
+#include "booking_index.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <try.h>
+
+#define INITIAL_CAPACITY 64
+
+/*
+* Open addressing hash table with linear probing, a bucket is free when its
+* seat vector is NULL. Deleted buckets are refilled by shifting back the
+* following cluster so that lookups never need tombstones.
+*/
+
+struct bucket {
+	int id;
+	size_t n_seats;
+	size_t capacity;
+	int* seats;
+};
+
+struct booking_index {
+	struct bucket* buckets;
+	size_t capacity;
+	size_t n_bookings;
+	pthread_rwlock_t lock;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static size_t hash(const int id, const size_t capacity);
+static struct bucket* find_bucket(const struct booking_index* index, const int id);
+static int grow(struct booking_index* index);
+static void shift_back(struct booking_index* index, size_t hole);
+
+extern booking_index_t booking_index_init(void) {
+	struct booking_index* index;
+	index = calloc(1, sizeof * index);
+	if (index) {
+		try(index->buckets = calloc(INITIAL_CAPACITY, sizeof * index->buckets), NULL, error);
+		index->capacity = INITIAL_CAPACITY;
+		index->n_bookings = 0;
+		try_pthread_rwlock_init(&index->lock, cleanup);
+	}
+	return index;
+
+cleanup:
+	free(index->buckets);
+error:
+	free(index);
+	return NULL;
+}
+
+extern int booking_index_destroy(const booking_index_t handle) {
+	struct booking_index* index = (struct booking_index*)handle;
+
+	try_pthread_rwlock_destroy(&index->lock, error);
+	for (size_t i = 0; i < index->capacity; i++) {
+		free(index->buckets[i].seats);
+	}
+	free(index->buckets);
+	free(index);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int booking_index_insert(const booking_index_t handle, const int id, const int seat) {
+	struct booking_index* index = (struct booking_index*)handle;
+
+	struct bucket* bucket;
+	try_pthread_rwlock_wrlock(&index->lock, error);
+	if ((bucket = find_bucket(index, id)) == NULL) {
+		if (2 * (index->n_bookings + 1) > index->capacity) {
+			try(grow(index), !0, unlock);
+		}
+		size_t i = hash(id, index->capacity);
+		while (index->buckets[i].seats) {
+			i = (i + 1) & (index->capacity - 1);
+		}
+		bucket = &index->buckets[i];
+		try(bucket->seats = malloc(sizeof * bucket->seats * 4), NULL, unlock);
+		bucket->id = id;
+		bucket->n_seats = 0;
+		bucket->capacity = 4;
+		index->n_bookings++;
+	}
+	// keep the seats sorted so that they can be locked in order
+	size_t pos = 0;
+	while (pos < bucket->n_seats && bucket->seats[pos] < seat) {
+		pos++;
+	}
+	if (pos == bucket->n_seats || bucket->seats[pos] != seat) {
+		if (bucket->n_seats == bucket->capacity) {
+			int* seats;
+			try(seats = realloc(bucket->seats, sizeof * seats * bucket->capacity * 2), NULL, unlock);
+			bucket->seats = seats;
+			bucket->capacity *= 2;
+		}
+		memmove(&bucket->seats[pos + 1], &bucket->seats[pos], sizeof * bucket->seats * (bucket->n_seats - pos));
+		bucket->seats[pos] = seat;
+		bucket->n_seats++;
+	}
+	try_pthread_rwlock_unlock(&index->lock, error);
+	return 0;
+
+unlock:
+	pthread_rwlock_unlock(&index->lock);
+error:
+	return 1;
+}
+
+extern int booking_index_remove(const booking_index_t handle, const int id, const int seat) {
+	struct booking_index* index = (struct booking_index*)handle;
+
+	struct bucket* bucket;
+	try_pthread_rwlock_wrlock(&index->lock, error);
+	if ((bucket = find_bucket(index, id)) != NULL) {
+		for (size_t i = 0; i < bucket->n_seats; i++) {
+			if (bucket->seats[i] == seat) {
+				memmove(&bucket->seats[i], &bucket->seats[i + 1], sizeof * bucket->seats * (bucket->n_seats - i - 1));
+				bucket->n_seats--;
+				break;
+			}
+		}
+		if (!bucket->n_seats) {
+			free(bucket->seats);
+			bucket->seats = NULL;
+			index->n_bookings--;
+			shift_back(index, (size_t)(bucket - index->buckets));
+		}
+	}
+	try_pthread_rwlock_unlock(&index->lock, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int booking_index_clear(const booking_index_t handle) {
+	struct booking_index* index = (struct booking_index*)handle;
+
+	try_pthread_rwlock_wrlock(&index->lock, error);
+	for (size_t i = 0; i < index->capacity; i++) {
+		free(index->buckets[i].seats);
+		index->buckets[i].seats = NULL;
+	}
+	index->n_bookings = 0;
+	try_pthread_rwlock_unlock(&index->lock, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int booking_index_lookup(const booking_index_t handle, const int id, int** seats, size_t* n) {
+	struct booking_index* index = (struct booking_index*)handle;
+
+	struct bucket* bucket;
+	*seats = NULL;
+	*n = 0;
+	try_pthread_rwlock_rdlock(&index->lock, error);
+	if ((bucket = find_bucket(index, id)) != NULL) {
+		try(*seats = malloc(sizeof * *seats * bucket->n_seats), NULL, unlock);
+		memcpy(*seats, bucket->seats, sizeof * *seats * bucket->n_seats);
+		*n = bucket->n_seats;
+	}
+	try_pthread_rwlock_unlock(&index->lock, error);
+	return 0;
+
+unlock:
+	pthread_rwlock_unlock(&index->lock);
+error:
+	return 1;
+}
+
+/*
+* Fibonacci hashing of the ID: the high bits of the product depend on every
+* bit of the ID, capacity is always a power of two and at least 2.
+*/
+static size_t hash(const int id, const size_t capacity) {
+	return (size_t)(((uint64_t)(uint32_t)id * 11400714819323198485ull) >> (64 - __builtin_ctzll(capacity)));
+}
+
+static struct bucket* find_bucket(const struct booking_index* index, const int id) {
+	size_t i = hash(id, index->capacity);
+	while (index->buckets[i].seats) {
+		if (index->buckets[i].id == id) {
+			return &index->buckets[i];
+		}
+		i = (i + 1) & (index->capacity - 1);
+	}
+	return NULL;
+}
+
+/*
+* Double the capacity of the table rehashing every bucket.
+*/
+static int grow(struct booking_index* index) {
+	struct bucket* buckets;
+	size_t capacity = index->capacity * 2;
+
+	try(buckets = calloc(capacity, sizeof * buckets), NULL, error);
+	for (size_t i = 0; i < index->capacity; i++) {
+		if (index->buckets[i].seats) {
+			size_t j = hash(index->buckets[i].id, capacity);
+			while (buckets[j].seats) {
+				j = (j + 1) & (capacity - 1);
+			}
+			buckets[j] = index->buckets[i];
+		}
+	}
+	free(index->buckets);
+	index->buckets = buckets;
+	index->capacity = capacity;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Fill the hole left by a removed bucket moving back every following bucket
+* of the cluster which would be unreachable otherwise.
+*/
+static void shift_back(struct booking_index* index, size_t hole) {
+	size_t mask = index->capacity - 1;
+	size_t i = (hole + 1) & mask;
+	while (index->buckets[i].seats) {
+		size_t home = hash(index->buckets[i].id, index->capacity);
+		// move the bucket if its home is not in the cyclic range (hole, i]
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			index->buckets[hole] = index->buckets[i];
+			index->buckets[i].seats = NULL;
+			hole = i;
+		}
+		i = (i + 1) & mask;
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef void* booking_index_t;
+
+/*
+* Create an empty booking index mapping a booking ID to its seats.
+*
+* @return	index handle on success or return NULL and set properly errno
+*			on error.
+*/
+extern booking_index_t booking_index_init(void);
+
+/*
+* Destroy the booking index.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int booking_index_destroy(
+	const booking_index_t handle
+);
+
+/*
+* Link the seat to the booking ID.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int booking_index_insert(
+	const booking_index_t handle,
+	const int id,
+	const int seat
+);
+
+/*
+* Unlink the seat from the booking ID, the booking is dropped from the index
+* once it has no seats left.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int booking_index_remove(
+	const booking_index_t handle,
+	const int id,
+	const int seat
+);
+
+/*
+* Drop every booking from the index.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int booking_index_clear(
+	const booking_index_t handle
+);
+
+/*
+* Copy the seats linked to the booking ID in a malloc'd vector sorted in
+* ascending order, seats is set to NULL and n to 0 if the ID is unknown.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int booking_index_lookup(
+	const booking_index_t handle,
+	const int id,
+	int** seats,
+	size_t* n
+);
@@ -13,6 +13,8 @@
 
 #include "utils.h"
 #include "database.h"
+#include "storage.h"
+#include "show_cache.h"
 
 #include <connection.h>
 #include <resources.h>
@@ -21,15 +23,48 @@
 #include <data-structure/concurrent_queue.h>
 
 #define TIMEOUT 5
+#define DATA_FILE "etc/data.dat"
+#define CHECKPOINT_INTERVAL 60000
+#define SCRUB_RATE (1L << 20)	// bytes of the data file validated per second
+#define STORAGE_ENGINE STORAGE_ENGINE_FILE	// STORAGE_ENGINE_MEMORY keeps the records in memory only, STORAGE_ENGINE_LSM in sorted runs
+#define SHOWS_DIRECTORY "etc/shows"
+#define BACKUP_DIRECTORY "etc/backups"	// the backups directory of the database, next to DATA_FILE
+#define SHOW_MEMORY_CAP (64UL << 20)	// bytes of the resident shows before the coldest are evicted
+#define SHOW_OPEN_CAP 64	// resident shows with open bookings, up to four storage threads each
+#define SHOW_IDLE_TIMEOUT 600	// seconds a show stays in memory without requests
+
+struct listener_info {
+	connection_t connection;
+	int internal;	// nonzero for the socket of cinemactl
+};
 
 struct request_info {
 	pthread_t tid;
 	connection_t connection;
+	int internal;
 };
 
 // Global variables
 
+// the data file is mapped, every store is made durable by a group commit of the log
+// and a periodic checkpoint compacts the file and empties the log
+static const struct storage_options storage_options = {
+	.mode = STORAGE_MMAP,
+	.sync = STORAGE_SYNC_NONE,
+	.grow_step = 0,
+	.wal = 1,
+	.wal_sync = WAL_SYNC_GROUP,
+	.wal_interval = 0,
+	.checkpoint_interval = CHECKPOINT_INTERVAL,
+	.flush_interval = 0,
+	.flush_threshold = 0,
+	.verify_reads = 1,
+	.scrub_rate = SCRUB_RATE,
+	.engine = STORAGE_ENGINE,
+	.memtable_size = 0
+};
 static database_t database;
+static show_cache_t shows;
 static concurrent_queue_t request_queue;
 
 // Prototype declarations of functions included in this code module
@@ -43,6 +78,8 @@ void* request_handler(void* arg);
 static int setup_workspace(void);
 static int connect_database(void);
 static int setup_database(void);
+static int execute_request(const char* request, const int internal, char** response);
+static int is_command(const char* query, const char* command);
 static int setup_internet_connection(connection_t *connection);
 static int setup_internal_connection(connection_t *connection);
 
@@ -50,8 +87,8 @@ int main(int argc, char *argv[]){
 	pthread_t joiner_tid;
 	pthread_t internet_mngr_tid;
 	pthread_t internal_mngr_tid;
-	connection_t internet_connection;
-	connection_t internal_connection;
+	struct listener_info internet_listener = { .internal = 0 };
+	struct listener_info internal_listener = { .internal = 1 };
 	concurrent_flag_t is_server_running;
 
 	try(request_queue = concurrent_queue_init(), NULL);
@@ -62,12 +99,13 @@ int main(int argc, char *argv[]){
 	try(setup_workspace(), 1);
 	try(connect_database(), 1);
 	try(setup_database(), 1);
-	try(setup_internal_connection(&internal_connection), 1);
-	try(setup_internet_connection(&internet_connection), 1);
+	try(shows = show_cache_init(SHOWS_DIRECTORY, &storage_options, SHOW_MEMORY_CAP, SHOW_OPEN_CAP, SHOW_IDLE_TIMEOUT), NULL);
+	try(setup_internal_connection(&internal_listener.connection), 1);
+	try(setup_internet_connection(&internet_listener.connection), 1);
 	try(concurrent_flag_set(is_server_running), 1);
 	try(pthread_create(&joiner_tid, NULL, thread_joiner, is_server_running), !0);
-	try(pthread_create(&internal_mngr_tid, NULL, connection_mngr, internal_connection), !0);
-	try(pthread_create(&internet_mngr_tid, NULL, connection_mngr, internet_connection), !0);
+	try(pthread_create(&internal_mngr_tid, NULL, connection_mngr, &internal_listener), !0);
+	try(pthread_create(&internet_mngr_tid, NULL, connection_mngr, &internet_listener), !0);
 
 	syslog(LOG_INFO, "Service started");
 
@@ -83,8 +121,9 @@ int main(int argc, char *argv[]){
 #ifdef _DEBUG
 	syslog(LOG_DEBUG, "Main thread:\tAll thread joined");
 #endif
-	try(connection_close(internet_connection), -1);
-	try(connection_close(internal_connection), -1);
+	try(connection_close(internet_listener.connection), -1);
+	try(connection_close(internal_listener.connection), -1);
+	try(show_cache_destroy(shows), !0);
 	try(database_close(database), !0);
 	try(concurrent_flag_destroy(is_server_running), 1);
 	try(concurrent_queue_destroy(request_queue), 1);
@@ -97,19 +136,21 @@ int main(int argc, char *argv[]){
 static int setup_workspace(void) {
 	try(mkdir("etc", 0775), -1 * (errno != EEXIST), error);
 	try(mkdir("tmp", 0775), -1 * (errno != EEXIST), error);
+	try(mkdir(SHOWS_DIRECTORY, 0775), -1 * (errno != EEXIST), error);
+	try(mkdir(BACKUP_DIRECTORY, 0775), -1 * (errno != EEXIST), error);
 	return 0;
 error:
 	return 1;
 }
 
 static int connect_database(void) {
-	try(database = database_init("etc/data.dat"), NULL || (errno == ENOENT), error);
+	try(database = database_init(DATA_FILE, &storage_options), NULL || (errno == ENOENT), error);
 	if (!database) {
 		int fd;
-		try(fd = open("etc/data.dat", O_RDWR | O_CREAT | O_EXCL, 0660), -1, error);
+		try(fd = open(DATA_FILE, O_RDWR | O_CREAT | O_EXCL, 0660), -1, error);
 		try(close(fd), -1, error);
 
-		try(database = database_init("etc/data.dat"), NULL, error);
+		try(database = database_init(DATA_FILE, &storage_options), NULL, error);
 
 		char* result;
 		try(database_execute(database, "POPULATE", &result), 1, error);
@@ -148,6 +189,60 @@ error:
 	return 1;
 }
 
+/*
+* Execute the request against the main database, SHOWS reports the shows,
+* SHOW <name> <query> executes the query against the show and SEAL <name>
+* seals it. A BACKUP writes a file of the daemon, so it is accepted only
+* from the internal connection and never for a show. A LOAD replaces what
+* the CALL of every client runs and a SEAL can not be undone, so both are
+* accepted only from the internal connection too. Only the internal
+* connection creates a show on its first SHOW, the public clients reach the
+* existing shows.
+*/
+static int execute_request(const char* request, const int internal, char** response) {
+	if (!internal && (is_command(request, "BACKUP") || is_command(request, "LOAD"))) {
+		*response = strdup(MSG_FAIL);
+		return 0;
+	}
+	if (!strcmp(request, "SHOWS")) {
+		return show_cache_report(shows, response);
+	}
+	if (!strncmp(request, "SHOW ", 5)) {
+		char name[SHOW_NAME_LEN + 1];
+		const char* query = request + 5;
+		size_t length = strcspn(query, " ");
+		if (length > SHOW_NAME_LEN || !query[length]) {
+			*response = strdup(MSG_FAIL);
+			return 0;
+		}
+		if (is_command(query + length + 1, "BACKUP") || (!internal && is_command(query + length + 1, "LOAD"))) {
+			*response = strdup(MSG_FAIL);
+			return 0;
+		}
+		memcpy(name, query, length);
+		name[length] = 0;
+		return show_cache_execute(shows, name, query + length + 1, internal, response);
+	}
+	if (!strncmp(request, "SEAL ", 5)) {
+		if (!internal) {
+			*response = strdup(MSG_FAIL);
+			return 0;
+		}
+		return show_cache_seal(shows, request + 5, response);
+	}
+	return database_execute(database, request, response);
+}
+
+/*
+* Return nonzero if the first token of the query, as split by the database,
+* is the command.
+*/
+static int is_command(const char* query, const char* command) {
+	size_t length = strlen(command);
+	query += strspn(query, " ");
+	return !strncmp(query, command, length) && (query[length] == ' ' || !query[length]);
+}
+
 static int setup_internet_connection(connection_t* connection) {
 	char* address;
 	char* port;
@@ -226,7 +321,8 @@ void* thread_timer(void* arg) {
 }
 
 void* connection_mngr(void* arg) {
-	connection_t connection = arg;
+	struct listener_info* listener = arg;
+	connection_t connection = listener->connection;
 #ifdef _DEBUG
 	syslog(LOG_DEBUG, "Main thread:\tConnection manager thread started");
 #endif
@@ -254,9 +350,10 @@ void* connection_mngr(void* arg) {
 
 		// Create request handler thread
 		struct request_info* accepted_request;
-		try(accepted_request = malloc(sizeof * accepted_connection), NULL);
+		try(accepted_request = malloc(sizeof * accepted_request), NULL);
 		accepted_request->connection = accepted_connection;
-		try(pthread_create(&accepted_request->tid, NULL, request_handler, accepted_connection), !0);
+		accepted_request->internal = listener->internal;
+		try(pthread_create(&accepted_request->tid, NULL, request_handler, accepted_request), !0);
 		try(concurrent_queue_enqueue(request_queue, (void*)accepted_request), 1);
 
 		try(pthread_sigmask(SIG_UNBLOCK, &sigalrm, NULL), !0);
@@ -264,7 +361,8 @@ void* connection_mngr(void* arg) {
 }
 
 void* request_handler(void* arg) {
-	connection_t connection = arg;
+	struct request_info* info = arg;
+	connection_t connection = info->connection;
 	pthread_t timer_tid;
 	sigset_t sigalrm;
 	char* request;
@@ -287,7 +385,7 @@ void* request_handler(void* arg) {
 	syslog(LOG_DEBUG, "Request thread:\tStopped timer thread");
 #endif
 	// Elaborate the response
-	try(database_execute(database, request, &response), 1);
+	try(execute_request(request, info->internal, &response), 1);
 	free(request);
 	// Send the response
 	try(connection_send(connection, response), -1 - (errno == ECONNRESET) - (errno == EPIPE));
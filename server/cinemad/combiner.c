@@ -0,0 +1,165 @@
+#include "combiner.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+
+#include <try.h>
+
+#define N_SLOTS 64
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_CLAIMED,
+	SLOT_PENDING,
+	SLOT_TAKEN,
+	SLOT_DONE
+};
+
+struct slot {
+	atomic_int state;
+	void* request;
+	int ret;
+};
+
+struct combiner {
+	struct slot slots[N_SLOTS];
+	pthread_mutex_t combiner_role;
+	pthread_mutex_t mutex;
+	pthread_cond_t batch_done;
+	int combining;
+	combiner_apply_function* apply;
+	void* context;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static struct slot* claim_slot(struct combiner* combiner);
+static void combine(struct combiner* combiner);
+
+extern combiner_t combiner_init(combiner_apply_function* apply, void* context) {
+	struct combiner* combiner;
+	combiner = calloc(1, sizeof * combiner);
+	if (combiner) {
+		for (int i = 0; i < N_SLOTS; i++) {
+			atomic_init(&combiner->slots[i].state, SLOT_FREE);
+		}
+		try_pthread_mutex_init(&combiner->combiner_role, error);
+		try_pthread_mutex_init(&combiner->mutex, cleanup1);
+		try_pthread(pthread_cond_init(&combiner->batch_done, NULL), cleanup2);
+		combiner->combining = 0;
+		combiner->apply = apply;
+		combiner->context = context;
+	}
+	return combiner;
+
+cleanup2:
+	pthread_mutex_destroy(&combiner->mutex);
+cleanup1:
+	pthread_mutex_destroy(&combiner->combiner_role);
+error:
+	free(combiner);
+	return NULL;
+}
+
+extern int combiner_destroy(const combiner_t handle) {
+	struct combiner* combiner = (struct combiner*)handle;
+
+	try_pthread(pthread_cond_destroy(&combiner->batch_done), error);
+	try_pthread_mutex_destroy(&combiner->mutex, error);
+	try_pthread_mutex_destroy(&combiner->combiner_role, error);
+	free(combiner);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int combiner_execute(const combiner_t handle, void* request) {
+	struct combiner* combiner = (struct combiner*)handle;
+
+	struct slot* slot;
+	int ret;
+
+	slot = claim_slot(combiner);
+	slot->request = request;
+	atomic_store(&slot->state, SLOT_PENDING);
+
+	while (atomic_load(&slot->state) != SLOT_DONE) {
+		if (!pthread_mutex_trylock(&combiner->combiner_role)) {
+			try_pthread_mutex_lock(&combiner->mutex, error);
+			combiner->combining = 1;
+			try_pthread_mutex_unlock(&combiner->mutex, error);
+			combine(combiner);
+			try_pthread_mutex_lock(&combiner->mutex, error);
+			combiner->combining = 0;
+			try_pthread(pthread_cond_broadcast(&combiner->batch_done), error);
+			try_pthread_mutex_unlock(&combiner->mutex, error);
+			try_pthread_mutex_unlock(&combiner->combiner_role, error);
+		}
+		else {
+			try_pthread_mutex_lock(&combiner->mutex, error);
+			if (!combiner->combining) {
+				// the role is being taken or released, retry shortly
+				try_pthread_mutex_unlock(&combiner->mutex, error);
+				sched_yield();
+				continue;
+			}
+			while (atomic_load(&slot->state) != SLOT_DONE && combiner->combining) {
+				try_pthread(pthread_cond_wait(&combiner->batch_done, &combiner->mutex), error);
+			}
+			try_pthread_mutex_unlock(&combiner->mutex, error);
+		}
+	}
+	ret = slot->ret;
+	atomic_store(&slot->state, SLOT_FREE);
+	return ret;
+
+error:
+	return 1;
+}
+
+/*
+* Claim a free slot, spin while every slot is in use.
+*/
+static struct slot* claim_slot(struct combiner* combiner) {
+	for (;;) {
+		for (int i = 0; i < N_SLOTS; i++) {
+			int expected = SLOT_FREE;
+			if (atomic_compare_exchange_strong(&combiner->slots[i].state, &expected, SLOT_CLAIMED)) {
+				return &combiner->slots[i];
+			}
+		}
+		sched_yield();
+	}
+}
+
+/*
+* Apply every pending request as a single batch, must be called by the thread
+* holding the combiner role.
+*/
+static void combine(struct combiner* combiner) {
+	void* requests[N_SLOTS];
+	struct slot* taken[N_SLOTS];
+	size_t n = 0;
+	int ret;
+
+	for (int i = 0; i < N_SLOTS; i++) {
+		int expected = SLOT_PENDING;
+		if (atomic_compare_exchange_strong(&combiner->slots[i].state, &expected, SLOT_TAKEN)) {
+			taken[n] = &combiner->slots[i];
+			requests[n] = combiner->slots[i].request;
+			n++;
+		}
+	}
+	if (!n) {
+		return;
+	}
+	ret = combiner->apply(combiner->context, requests, n);
+	for (size_t i = 0; i < n; i++) {
+		taken[i]->ret = ret;
+		atomic_store(&taken[i]->state, SLOT_DONE);
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef void* combiner_t;
+
+/*
+* Function applying a batch of requests published by concurrent threads, it is
+* executed by a single thread at a time.
+*
+* @return	0 on success or return 1 and set properly errno on error, the
+*			value is returned to every thread which published a request of
+*			the batch.
+*/
+typedef int combiner_apply_function(void* context, void** requests, const size_t n);
+
+/*
+* Create a flat combining executor, concurrent requests are published in a
+* slot array and the thread holding the combiner role applies them together.
+*
+* @return	combiner handle on success or return NULL and set properly errno
+*			on error.
+*/
+extern combiner_t combiner_init(
+	combiner_apply_function* apply,
+	void* context
+);
+
+/*
+* Destroy the combiner, no request must be in flight.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int combiner_destroy(
+	const combiner_t handle
+);
+
+/*
+* Publish the request and wait until it has been applied, either by the
+* calling thread or by another thread holding the combiner role.
+*
+* @return	the value returned by the apply function for the batch which
+*			contained the request.
+*/
+extern int combiner_execute(
+	const combiner_t handle,
+	void* request
+);
@@ -0,0 +1,79 @@
+#include "crc32c.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#endif
+
+#define POLYNOMIAL 0x82f63b78u	// the Castagnoli polynomial, bit reversed
+
+typedef uint32_t crc32c_function(uint32_t crc, const unsigned char* bytes, size_t length);
+
+static uint32_t table[256];
+static crc32c_function* implementation;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static void select_implementation(void);
+static uint32_t crc32c_table(uint32_t crc, const unsigned char* bytes, size_t length);
+#ifdef CRC32C_SSE42
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* bytes, size_t length);
+#endif
+
+extern uint32_t crc32c(const uint32_t crc, const void* bytes, const size_t length) {
+	pthread_once(&once, &select_implementation);
+	return ~implementation(~crc, (const unsigned char*)bytes, length);
+}
+
+/*
+* Fill the lookup table and pick the instruction when the processor has it.
+*/
+static void select_implementation(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 1) ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+		}
+		table[i] = crc;
+	}
+	implementation = &crc32c_table;
+#ifdef CRC32C_SSE42
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		implementation = &crc32c_sse42;
+	}
+#endif
+}
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char* bytes, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#ifdef CRC32C_SSE42
+/*
+* Eight bytes at a time, the records are multiples of eight bytes long.
+*/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* bytes, size_t length) {
+	uint64_t crc64 = crc;
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, &bytes[i], sizeof word);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t)crc64;
+	for (; i < length; i++) {
+		crc = _mm_crc32_u8(crc, bytes[i]);
+	}
+	return crc;
+}
+#endif
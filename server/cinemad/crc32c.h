@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* Extend the CRC32C (Castagnoli) of the bytes preceding the received ones,
+* crc is 0 for the first bytes. The SSE4.2 crc32 instruction is used when
+* the processor has it, a lookup table otherwise.
+*
+* @return	the CRC32C of the bytes.
+*/
+extern uint32_t crc32c(
+	const uint32_t crc,
+	const void* bytes,
+	const size_t length
+);
@@ -3,17 +3,44 @@
 #include "database.h"
 
 #include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/file.h>
 #include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <syslog.h>
 
 #include <resources.h>
 #include <try.h>
 
 #include "storage.h"
+#include "layout.h"
+#include "booking_index.h"
+#include "combiner.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "script.h"
+#include "segment.h"
+
+#define SEAT_FREE 0
+#define SEAT_UNKNOWN -1
+
+// placeholder of the k-th ID allocated by a batch of bookings
+#define FRESH_ID(k) (-(k) - 2)
+#define FRESH_INDEX(id) (-(id) - 2)
+
+// results of the requests carrying an idempotency key are kept for retries
+#define DEDUP_CAPACITY 1024
+#define DEDUP_TTL 300
+#define MSG_BUSY "BUSY"
+#define SCRIPT_BUDGET 100000
+#define SCRIPT_ATTEMPTS 3
+#define SEALED_VERSION 1	// version of the map of a sealed show, which never changes
 
 struct cinema_info {
 	int rows;
@@ -22,11 +49,48 @@ struct cinema_info {
 
 struct database {
 	storage_t storage;
+	booking_index_t booking_index;
+	combiner_t combiner;
+	snapshot_t snapshot;
+	dedup_t dedup;
+	script_registry_t scripts;
 	struct cinema_info cinema_info;
+	struct venue_layout* layout;
+	char* layout_filename;
+	char* backup_directory;	// the only directory the backups are written in
+	atomic_int lock_timeout;	// milliseconds a request waits for its seats, -1 to wait forever
+	segment_t segment;	// the sealed show, NULL while its bookings are open
+};
+
+enum booking_type {
+	BOOKING_BOOK,
+	BOOKING_UNBOOK,
+	BOOKING_MODIFY
+};
+
+struct booking_request {
+	enum booking_type type;
+	int id;
+	int* seats;
+	size_t n_seats;
+	int* released;	// seats of the booking freed by a modify
+	size_t n_released;
+	int nowait;	// fail at once if a seat is locked by someone else
+	int timed;	// fail if the seats are not locked by the deadline
+	struct timespec deadline;
+	int outcome;	// the booked ID, 1 on a successful unbook or 0 on failure
+	int contended;	// the seat which could not be locked in time or -1
+};
+
+struct script_view {
+	struct database* database;
+	const struct seat_snapshot* snapshot;
 };
 
 /*	Prototype declarations of functions included in this code module	*/
 
+static int execute(const database_t handle, const int argc, char** argv, char** result);
+static int procedure_key(const database_t handle, const int argc, char** argv, char** result);
 static int parse_query(const char* query, char*** parsed);
 static int procedure_populate(const database_t handle, char** result);
 static int procedure_setup(const database_t handle, char** result);
@@ -37,17 +101,105 @@ static int procedure_set(const database_t handle, char** query, char** result);
 static int procedure_map(const database_t handle, char** query, char** result);
 static int procedure_book(const database_t handle, char** query, char** result);
 static int procedure_unbook(const database_t handle, char** query, char** result);
+static int procedure_modify(const database_t handle, char** query, char** result);
+static int procedure_seats(const database_t handle, char** query, char** result);
+static int procedure_cancel(const database_t handle, char** query, char** result);
+static int procedure_count(const database_t handle, char** result);
+static int procedure_rowstats(const database_t handle, char** result);
+static int procedure_recount(const database_t handle, char** result);
+static int procedure_sections(const database_t handle, char** result);
+static int procedure_checkpoint(const database_t handle, char** result);
+static int procedure_backup(const database_t handle, char** query, char** result);
+static int procedure_stats(const database_t handle, char** result);
+static int procedure_load(const database_t handle, char** query, char** result);
+static int procedure_call(const database_t handle, const int argc, char** query, char** result);
+static int script_seat_get(void* context, const long seat, int* id);
+static int script_row_range(void* context, const long row, long* first_seat, long* n_seats);
+static int map_section(const database_t handle, const int id, char** query, char** result);
+static int apply_bookings(void* context, void** requests, const size_t n);
+static long parse_seats(const database_t handle, char** query, int** seats);
+static long check_unchanged(const database_t handle, const int id, const int* seats, const size_t n, const unsigned long version, char** conflict);
+static int in_state(const int* seats, const int* state, const size_t n_seats, const int* subset, const size_t n, const int expected);
+static void set_state(const int* seats, int* state, const size_t n_seats, const int* subset, const size_t n, const int value);
+static int seat_comparison(const void* seat1, const void* seat2);
+static int allocate_ids(const database_t handle, const int n, int* first_id);
+static int store_seats(const database_t handle, const int* seats, const int* old_ids, const int* new_ids, const size_t n);
+static int is_seat(const database_t handle, const char* key, int* seat);
+static int hall_size(const database_t handle);
+static char seat_mark(const int book_id, const int id);
+static char* render_seats(const database_t handle, const struct section_snapshot* section, const size_t first_seat, const size_t n_seats, const char* gaps, const int id, char* cursor);
+static size_t popcount_range(const uint64_t* bitmap, const size_t start, const size_t end);
+static int load_number(const database_t handle, const char* key, int* value);
+static int load_seat(const database_t handle, const int seat, int* id);
+static void log_phase(const char* phase, struct timespec* start);
+static int index_seat(const database_t handle, const int seat, const int old_id, const int new_id);
+static int lock_seats(const database_t handle, const int* seats, const size_t n);
+static int lock_seats_timed(const database_t handle, struct booking_request** batch, const size_t n, const int* seats, const size_t n_seats, int* contended);
+static size_t drop_contended(struct booking_request** batch, const size_t n, const int seat);
+static size_t collect_seats(struct booking_request** batch, const size_t n, int* seats);
+static int has_seat(const struct booking_request* request, const int seat);
+static void set_deadline(const database_t handle, struct booking_request* request);
+static int unlock_seats(const database_t handle, const int* seats, const size_t n);
 
-extern database_t database_init(const char* filename) {
+extern database_t database_init(const char* filename, const struct storage_options* options) {
 	struct database* database;
+	struct timespec start;
 	database = calloc(1, sizeof * database);
 	if (database) {
-		try(database->storage = storage_init(filename), NULL, error);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		try(database->storage = storage_init(filename, options), NULL, error);
+		log_phase("storage load", &start);
+		try(database->booking_index = booking_index_init(), NULL, cleanup1);
+		try(database->combiner = combiner_init(&apply_bookings, database), NULL, cleanup2);
+		try(database->snapshot = snapshot_init(), NULL, cleanup3);
+		try(database->dedup = dedup_init(DEDUP_CAPACITY, DEDUP_TTL), NULL, cleanup4);
+		try(database->scripts = script_registry_init(SCRIPT_BUDGET), NULL, cleanup5);
+		try(database->layout = layout_rectangle(0, 0), NULL, cleanup6);
+		// the layout of the venue is kept in the directory of the data file
+		const char* basename = strrchr(filename, '/');
+		int dirlen = basename ? (int)(basename - filename + 1) : 0;
+		try(asprintf(&database->layout_filename, "%.*slayout", dirlen, filename), -1, cleanup7);
+		try(asprintf(&database->backup_directory, "%.*sbackups/", dirlen, filename), -1, cleanup8);
 		database->cinema_info.columns = 0;
 		database->cinema_info.rows = 0;
+		atomic_init(&database->lock_timeout, -1);
+	}
+	return database;
+
+cleanup8:
+	free(database->layout_filename);
+cleanup7:
+	layout_destroy(database->layout);
+cleanup6:
+	script_registry_destroy(database->scripts);
+cleanup5:
+	dedup_destroy(database->dedup);
+cleanup4:
+	snapshot_destroy(database->snapshot);
+cleanup3:
+	combiner_destroy(database->combiner);
+cleanup2:
+	booking_index_destroy(database->booking_index);
+cleanup1:
+	storage_close(database->storage);
+error:
+	free(database);
+	return NULL;
+}
+
+extern database_t database_open_sealed(const char* filename) {
+	struct database* database;
+	database = calloc(1, sizeof * database);
+	if (database) {
+		// the seats are read from the mapped runs, no snapshot is built
+		try(database->segment = segment_open(filename), NULL, error);
+		try(database->layout = segment_layout(database->segment), NULL, cleanup1);
+		atomic_init(&database->lock_timeout, -1);
 	}
 	return database;
 
+cleanup1:
+	segment_close(database->segment);
 error:
 	free(database);
 	return NULL;
@@ -56,7 +208,21 @@ error:
 extern int database_close(const database_t handle) {
 	struct database* database = (struct database*)handle;
 
+	if (database->segment) {
+		try(segment_close(database->segment), 1, error);
+		layout_destroy(database->layout);
+		free(database);
+		return 0;
+	}
 	try(storage_close(database->storage), 1, error);
+	try(booking_index_destroy(database->booking_index), 1, error);
+	try(combiner_destroy(database->combiner), 1, error);
+	try(snapshot_destroy(database->snapshot), 1, error);
+	try(dedup_destroy(database->dedup), 1, error);
+	try(script_registry_destroy(database->scripts), 1, error);
+	layout_destroy(database->layout);
+	free(database->layout_filename);
+	free(database->backup_directory);
 	free(database);
 	return 0;
 
@@ -73,6 +239,145 @@ extern int database_execute(const database_t handle, const char* query, char** r
 	if ((argc = parse_query(query, &argv)) == -1) {
 		return 1;
 	}
+	ret = execute(database, argc, argv, result);
+	free(*argv);
+	free(argv);
+	return ret;
+}
+
+extern int database_seat_get(const database_t handle, const int seat, int* id) {
+	struct database* database = (struct database*)handle;
+
+	if (seat < 0 || seat >= hall_size(database)) {
+		errno = EINVAL;
+		return 1;
+	}
+	if (database->segment) {
+		segment_read(database->segment, (size_t)seat, 1, id);
+		return 0;
+	}
+	try(storage_lock_shared_int(database->storage, (unsigned long)seat), !0, error);
+	try(load_seat(database, seat, id), !0, cleanup);
+	try(storage_unlock_int(database->storage, (unsigned long)seat), !0, error);
+	return 0;
+
+cleanup:
+	storage_unlock_int(database->storage, (unsigned long)seat);
+error:
+	return 1;
+}
+
+extern int database_seat_cas(const database_t handle, const int seat, const int expected_id, const int new_id, int* swapped) {
+	struct database* database = (struct database*)handle;
+	int id;
+
+	if (seat < 0 || seat >= hall_size(database) || new_id < 0) {
+		errno = EINVAL;
+		return 1;
+	}
+	if (database->segment) {
+		errno = EROFS;
+		return 1;
+	}
+	try(storage_lock_exclusive_int(database->storage, (unsigned long)seat), !0, error);
+	try(load_seat(database, seat, &id), !0, cleanup);
+	*swapped = (id == expected_id);
+	if (*swapped) {
+		try(store_seats(database, &seat, &id, &new_id, 1), !0, cleanup);
+	}
+	try(storage_unlock_int(database->storage, (unsigned long)seat), !0, error);
+	return 0;
+
+cleanup:
+	storage_unlock_int(database->storage, (unsigned long)seat);
+error:
+	return 1;
+}
+
+extern int database_next_id(const database_t handle, int* id) {
+	struct database* database = (struct database*)handle;
+
+	if (database->segment) {
+		errno = EROFS;
+		return 1;
+	}
+	return allocate_ids(handle, 1, id);
+}
+
+extern int database_memory(const database_t handle, size_t* bytes) {
+	struct database* database = (struct database*)handle;
+	struct storage_stats stats;
+	const struct seat_snapshot* snapshot;
+	int guard;
+
+	if (database->segment) {
+		*bytes = segment_size(database->segment);
+		return 0;
+	}
+	try(storage_get_stats(database->storage, &stats), !0, error);
+	// the booking index holds the seats of every booking
+	snapshot = snapshot_acquire(database->snapshot, &guard);
+	*bytes = stats.memory_bytes + snapshot->n_seats * sizeof(struct seat_state) + snapshot->n_booked * sizeof(int);
+	snapshot_release(database->snapshot, guard);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int database_seal(const database_t handle, const char* filename) {
+	struct database* database = (struct database*)handle;
+	const struct seat_snapshot* snapshot;
+	int guard;
+	int* ids;
+
+	if (database->segment) {
+		errno = EINVAL;
+		return 1;
+	}
+	snapshot = snapshot_acquire(database->snapshot, &guard);
+	if (!snapshot->n_seats) {
+		snapshot_release(database->snapshot, guard);
+		errno = EINVAL;
+		return 1;
+	}
+	try(ids = malloc(sizeof * ids * snapshot->n_seats), NULL, error);
+	for (size_t k = 0; k < snapshot->n_sections; k++) {
+		const struct section_snapshot* section = snapshot->sections[k];
+		for (size_t i = 0; i < section->n_seats; i++) {
+			ids[section->first_seat + i] = snapshot_section_seat(section, i)->id;
+		}
+	}
+	snapshot_release(database->snapshot, guard);
+	try(segment_write(filename, database->layout, ids), !0, cleanup);
+	free(ids);
+	return 0;
+
+cleanup:
+	{
+		int error = errno;
+		free(ids);
+		errno = error;
+		return 1;
+	}
+error:
+	snapshot_release(database->snapshot, guard);
+	return 1;
+}
+
+/*
+* Execute the tokenized query, set the result parameter.
+*/
+static int execute(const database_t handle, const int argc, char** argv, char** result) {
+	struct database* database = (struct database*)handle;
+
+	int ret;
+	// a sealed show only renders its map and its bookings
+	if (database->segment && (argc < 1 || (strcmp(argv[0], "MAP") && strcmp(argv[0], "SEATS") && strcmp(argv[0], "COUNT")
+		&& strcmp(argv[0], "ROWSTATS") && strcmp(argv[0], "SECTIONS")))) {
+		*result = strdup(MSG_FAIL);
+		ret = 0;
+	}
 	else if (argc == 1 && !strcmp(argv[0], "POPULATE")) {
 		ret = procedure_populate(database, result);
 	}
@@ -91,7 +396,7 @@ extern int database_execute(const database_t handle, const char* query, char** r
 	else if (argc == 3 && !strcmp(argv[0], "SET")) {
 		ret = procedure_set(database, &(argv[1]), result);
 	}
-	else if (argc == 2 && !strcmp(argv[0], "MAP")) {
+	else if ((argc >= 2 && argc <= 6) && !strcmp(argv[0], "MAP")) {
 		ret = procedure_map(database, &(argv[1]), result);
 	}
 	else if (argc > 2 && !strcmp(argv[0], "BOOK")) {
@@ -100,15 +405,89 @@ extern int database_execute(const database_t handle, const char* query, char** r
 	else if (argc > 2 && !strcmp(argv[0], "DELETE")) {
 		ret = procedure_unbook(database, &(argv[1]), result);
 	}
+	else if (argc > 2 && !strcmp(argv[0], "MODIFY")) {
+		ret = procedure_modify(database, &(argv[1]), result);
+	}
+	else if (argc == 2 && !strcmp(argv[0], "SEATS")) {
+		ret = procedure_seats(database, &(argv[1]), result);
+	}
+	else if ((argc == 2 || argc == 3) && !strcmp(argv[0], "CANCEL")) {
+		ret = procedure_cancel(database, &(argv[1]), result);
+	}
+	else if (argc == 1 && !strcmp(argv[0], "COUNT")) {
+		ret = procedure_count(database, result);
+	}
+	else if (argc == 1 && !strcmp(argv[0], "ROWSTATS")) {
+		ret = procedure_rowstats(database, result);
+	}
+	else if (argc == 1 && !strcmp(argv[0], "RECOUNT")) {
+		ret = procedure_recount(database, result);
+	}
+	else if (argc == 1 && !strcmp(argv[0], "SECTIONS")) {
+		ret = procedure_sections(database, result);
+	}
+	else if (argc == 1 && !strcmp(argv[0], "CHECKPOINT")) {
+		ret = procedure_checkpoint(database, result);
+	}
+	else if (argc == 2 && !strcmp(argv[0], "BACKUP")) {
+		ret = procedure_backup(database, &(argv[1]), result);
+	}
+	else if (argc == 1 && !strcmp(argv[0], "STATS")) {
+		ret = procedure_stats(database, result);
+	}
+	else if (argc > 2 && !strcmp(argv[0], "LOAD")) {
+		ret = procedure_load(database, &(argv[1]), result);
+	}
+	else if (argc >= 2 && !strcmp(argv[0], "CALL")) {
+		ret = procedure_call(database, argc - 2, &(argv[1]), result);
+	}
+	else if (argc > 2 && !strcmp(argv[0], "KEY")) {
+		ret = procedure_key(database, argc - 1, &(argv[1]), result);
+	}
 	else {
 		*result = strdup(MSG_FAIL);
 		ret = 0;
 	}
-	free(*argv);
-	free(argv);
 	return ret;
 }
 
+/*
+* Execute a mutating query carrying an idempotency key, a retried query gets
+* the result stored by its first execution without taking any seat lock or
+* allocating a new ID
+*/
+static int procedure_key(const database_t handle, const int argc, char** argv, char** result) {
+	struct database* database = (struct database*)handle;
+	int claimed;
+
+	if (strcmp(argv[1], "BOOK") && strcmp(argv[1], "DELETE") && strcmp(argv[1], "MODIFY") && strcmp(argv[1], "CANCEL") && strcmp(argv[1], "CALL")) {
+		goto fail;
+	}
+	if (strlen(argv[0]) > DEDUP_TOKEN_LEN) {
+		goto fail;
+	}
+	try(dedup_claim(database->dedup, argv[0], &claimed, result), !0, error);
+	if (!claimed) {
+		return 0;
+	}
+	try(execute(database, argc - 1, &(argv[1]), result), !0, cleanup);
+	// a request which could not lock its seats is not remembered, its retry runs again
+	if (!strncmp(*result, MSG_BUSY, strlen(MSG_BUSY))) {
+		try(dedup_release(database->dedup, argv[0]), !0, error);
+		return 0;
+	}
+	try(dedup_complete(database->dedup, argv[0], *result), !0, error);
+	return 0;
+
+fail:
+	*result = strdup(MSG_FAIL);
+	return 0;
+cleanup:
+	dedup_release(database->dedup, argv[0]);
+error:
+	return 1;
+}
+
 /*
 * Tokenize the received query in a string vector saved in parsed parameter.
 * 
@@ -140,31 +519,39 @@ error:
 }
 
 /*
-* Populate the database executing a predefined set of query
+* Populate the database storing a predefined set of records, the free seat
+* and the ID counter as integers and the cinema info with a single storage
+* batch. The seat is locked before the other keys to keep the lock order used
+* by the bookings
 */
 static int procedure_populate(const database_t handle, char** result) {
 	struct database* database = (struct database*)handle;
 
-	char* msg_init[] = {
-	"SET IP 127.0.0.1",
-	"SET PORT 55555",
-	"SET PID 0",
-	"SET TIMESTAMP 0",
-	"SET ROWS 1",
-	"SET COLUMNS 1",
-	"SET FILM Titolo",
-	"SET SHOWTIME 00:00",
-	"SET ID_COUNTER 0",
-	"SET 0 0",
-	NULL
-	};
-	for (int i = 0; msg_init[i]; i++) {
-		try(database_execute(database, msg_init[i], result), !0, error);
-		free(*result);
+	const unsigned long seat = 0;
+	const long id = 0;
+	const char* keys[] = { "IP", "PORT", "PID", "TIMESTAMP", "ROWS", "COLUMNS", "FILM", "SHOWTIME", "ID_COUNTER" };
+	const char* values[] = { "127.0.0.1", "55555", "0", "0", "1", "1", "Titolo", "00:00" };
+	const size_t n = sizeof keys / sizeof * keys;
+	size_t n_locked;
+
+	try(storage_lock_exclusive_int(database->storage, seat), !0, error);
+	for (n_locked = 0; n_locked < n; n_locked++) {
+		try(storage_lock_exclusive(database->storage, keys[n_locked]), !0, cleanup);
 	}
-	*result = strdup(MSG_SUCC);
+	try(storage_store_ints(database->storage, 1, &seat, &id), !0, cleanup);
+	try(storage_store_number(database->storage, "ID_COUNTER", 0), !0, cleanup);
+	try(storage_store_batch(database->storage, n - 1, keys, values, result), !0, cleanup);
+	while (n_locked) {
+		try(storage_unlock(database->storage, keys[--n_locked]), !0, error);
+	}
+	try(storage_unlock_int(database->storage, seat), !0, error);
 	return 0;
 
+cleanup:
+	while (n_locked) {
+		storage_unlock(database->storage, keys[--n_locked]);
+	}
+	storage_unlock_int(database->storage, seat);
 error:
 	return 1;
 }
@@ -174,80 +561,119 @@ error:
 */
 static int procedure_setup(const database_t handle, char** result) {
 	struct database* database = (struct database*)handle;
+	struct timespec start;
+	int missing = 0;
 
-	try(database_execute(database, "GET ROWS", result), 1, error);
-	try(strtoi(*result, &database->cinema_info.rows), !0, cleanup);
-	free(*result);
-	try(database_execute(database, "GET COLUMNS", result), 1, error);
-	try(strtoi(*result, &database->cinema_info.columns), !0, cleanup);
-	free(*result);
-
-	int clean = 0;
-	int rows = database->cinema_info.rows;
-	int cols = database->cinema_info.columns;
-	for (int i = 0; i < rows * cols; i++) {
-		char* query;
-		try(asprintf(&query, "GET %d", i), -1, error);
-		try(database_execute(database, query, result), 1, error);
-		if (!strncmp(*result, MSG_FAIL, strlen(MSG_FAIL))) {
-			clean = 1;
-			free(query);
-			free(*result);
-			try(asprintf(&query, "SET %d 0", i), -1, error);
-			try(database_execute(database, query, result), 1, error);
-		}
-		free(query);
-		free(*result);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	try(load_number(database, "ROWS", &database->cinema_info.rows), !0, error);
+	try(load_number(database, "COLUMNS", &database->cinema_info.columns), !0, error);
+	// the lock timeout is optional, without it the requests wait for their seats
+	int lock_timeout;
+	if (load_number(database, "LOCK_TIMEOUT", &lock_timeout) || lock_timeout < 0) {
+		lock_timeout = -1;
+	}
+	atomic_store(&database->lock_timeout, lock_timeout);
+	log_phase("cinema info", &start);
+
+	// without a layout file the venue is a rectangular hall
+	struct venue_layout* layout;
+	if ((layout = layout_load(database->layout_filename)) == NULL) {
+		if (errno != ENOENT) {
+			syslog(LOG_ERR, "Setup:	invalid venue layout %s", database->layout_filename);
+			goto error;
+		}
+		try(layout = layout_rectangle((size_t)database->cinema_info.rows, (size_t)database->cinema_info.columns), NULL, error);
 	}
-	if (clean) {
-		try(procedure_clean(database, result), !0, error);
+	// the seats are the keys of the integer key space of the storage
+	if (layout->n_seats > RECORD_INT_KEYS) {
+		syslog(LOG_ERR, "Setup:	venue layout of more than %lu seats", RECORD_INT_KEYS);
+		layout_destroy(layout);
+		goto error;
+	}
+	layout_destroy(database->layout);
+	database->layout = layout;
+	log_phase("venue layout", &start);
+
+	int* ids;
+	int n_seats = hall_size(database);
+	try(ids = calloc((size_t)n_seats + 1, sizeof * ids), NULL, error);
+	try(booking_index_clear(database->booking_index), !0, cleanup);
+	for (int i = 0; i < n_seats; i++) {
+		try(load_seat(database, i, &ids[i]), !0, cleanup);
+		if (ids[i] == SEAT_UNKNOWN) {
+			missing = 1;
+		}
+		else {
+			try(index_seat(database, i, SEAT_FREE, ids[i]), !0, cleanup);
+		}
+	}
+	log_phase("seat validation", &start);
+
+	// the bookings of a partial hall can not be trusted
+	if (missing) {
+		try(procedure_clean(database, result), !0, cleanup);
 		free(*result);
+		log_phase("seat initialization", &start);
+	}
+	else {
+		try(snapshot_reset(database->snapshot, ids, database->layout), !0, cleanup);
 	}
+	free(ids);
 	*result = strdup(MSG_SUCC);
 	return 0;
 
 cleanup:
-	free(*result);
+	free(ids);
 error:
 	return 1;
 }
 
 /*
-* Discard all booking
+* Discard all booking creating the missing seats, every seat is written with
+* a single storage batch of integers and then the ID counter is reset. A
+* crash between the two leaves the counter past every ID, which is harmless
 */
 static int procedure_clean(const database_t handle, char** result) {
 	struct database* database = (struct database*)handle;
 
-	char* tmp;
-	char* buffer;
-	char** query;
-	int rows = database->cinema_info.rows;
-	int cols = database->cinema_info.columns;
+	int* seats;
+	unsigned long* keys;
+	long* ids;
+	size_t n_seats = (size_t)hall_size(database);
 
-	for (int i = 0; i < rows * cols; i++) {
-		try(asprintf(&tmp, "%d 0", i), -1, error);
-		try(parse_query(tmp, &query), -1, cleanup1);
-		try(procedure_set(database, query, &buffer), !0, cleanup2);
-		free(*query);
-		free(query);
-		free(tmp);
-		free(buffer);
+	// the seats are followed by the IDs of the free hall
+	try(seats = calloc(n_seats * 2 + 1, sizeof * seats), NULL, error);
+	try(keys = malloc(sizeof * keys * (n_seats + 1)), NULL, cleanup1);
+	try(ids = calloc(n_seats + 1, sizeof * ids), NULL, cleanup2);
+	for (size_t i = 0; i < n_seats; i++) {
+		seats[i] = (int)i;
+		keys[i] = i;
 	}
-	try(parse_query("ID_COUNTER 0", &query), -1, error);
-	try(procedure_set(database, query, result), !0, cleanup3);
-	free(*query);
-	free(query);
+
+	try(lock_seats(database, seats, n_seats), !0, cleanup3);
+	try(storage_lock_exclusive(database->storage, "ID_COUNTER"), !0, cleanup4);
+	try(storage_store_ints(database->storage, n_seats, keys, ids), !0, cleanup5);
+	try(storage_store_number(database->storage, "ID_COUNTER", 0), !0, cleanup5);
+	try(booking_index_clear(database->booking_index), !0, cleanup5);
+	try(snapshot_reset(database->snapshot, &seats[n_seats], database->layout), !0, cleanup5);
+	try(storage_unlock(database->storage, "ID_COUNTER"), !0, cleanup4);
+	try(unlock_seats(database, seats, n_seats), !0, cleanup3);
+	try(*result = strdup(MSG_SUCC), NULL, cleanup3);
+	free(ids);
+	free(keys);
+	free(seats);
 	return 0;
 
+cleanup5:
+	storage_unlock(database->storage, "ID_COUNTER");
+cleanup4:
+	unlock_seats(database, seats, n_seats);
 cleanup3:
-	free(*query);
-	free(query);
-	return 1;
+	free(ids);
 cleanup2:
-	free(*query);
-	free(query);
+	free(keys);
 cleanup1:
-	free(tmp);
+	free(seats);
 error:
 	return 1;
 }
@@ -257,36 +683,33 @@ error:
 */
 static int procedure_get_id(const database_t handle, char** result) {
 	struct database* database = (struct database*)handle;
-	int current_id;
-	char* new_id;
-	char* buffer;
+	int id;
 
-	try(storage_lock_exclusive(database->storage, "ID_COUNTER"), !0, error);
-	try(storage_load(database->storage, "ID_COUNTER", &buffer), !0, error);
-	try(strtoi(buffer, &current_id), !0, cleanup1);
-	free(buffer);
-	try(asprintf(&new_id, "%d", current_id + 1), -1, error);
-	try(storage_store(database->storage, "ID_COUNTER", new_id, &buffer), !0, cleanup2);
-	*result = strdup(new_id);
-	free(new_id);
-	free(buffer);
-	try(storage_unlock(database->storage, "ID_COUNTER"), !0, error);
+	try(database_next_id(database, &id), !0, error);
+	try(asprintf(result, "%d", id), -1, error);
 	return 0;
 
-cleanup2:
-	free(new_id);
-	return 1;
-cleanup1:
-	free(buffer);
 error:
 	return 1;
 }
 
 /*
-* Standard get procedure
+* Standard get procedure, a seat is decoded and read through the typed API
 */
 static int procedure_get(const database_t handle, char** query, char** result) {
 	struct database* database = (struct database*)handle;
+	int seat;
+	int id;
+	if (is_seat(database, query[0], &seat)) {
+		try(database_seat_get(database, seat, &id), !0, error);
+		if (id == SEAT_UNKNOWN) {
+			*result = strdup(MSG_FAIL);
+		}
+		else {
+			try(asprintf(result, "%d", id), -1, error);
+		}
+		return 0;
+	}
 	try(storage_lock_shared(database->storage, query[0]), !0, error);
 	try(storage_load(database->storage, query[0], result), !0, error);
 	try(storage_unlock(database->storage, query[0]), !0, error);
@@ -297,150 +720,277 @@ error:
 }
 
 /*
-* Standard set procedure
+* Standard set procedure, a seat is decoded and written through the typed API
+* so that the booking index and the hall snapshot follow the new ID
 */
 static int procedure_set(const database_t handle, char** query, char** result) {
 	struct database* database = (struct database*)handle;
+	int seat;
+	if (is_seat(database, query[0], &seat)) {
+		int old_id;
+		int new_id;
+		int swapped = 0;
+		if (strtoi(query[1], &new_id) || new_id < 0) {
+			*result = strdup(MSG_FAIL);
+			return 0;
+		}
+		while (!swapped) {
+			try(database_seat_get(database, seat, &old_id), !0, error);
+			try(database_seat_cas(database, seat, old_id, new_id, &swapped), !0, error);
+		}
+		*result = strdup(MSG_SUCC);
+		return 0;
+	}
+	int lock_timeout = -1;
+	if (!strcmp(query[0], "LOCK_TIMEOUT") && (strtoi(query[1], &lock_timeout) || lock_timeout < 0)) {
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
 	try(storage_lock_exclusive(database->storage, query[0]), !0, error);
-	try(storage_store(database->storage, query[0], query[1], result), !0, error);
+	try(storage_store(database->storage, query[0], query[1], result), !0, cleanup);
 	try(storage_unlock(database->storage, query[0]), !0, error);
+	// the new lock timeout applies to the following requests
+	if (!strcmp(query[0], "LOCK_TIMEOUT")) {
+		atomic_store(&database->lock_timeout, lock_timeout);
+	}
 	return 0;
 
+cleanup:
+	storage_unlock(database->storage, query[0]);
 error:
 	return 1;
 }
 
 /*
-* Return the seats status map
+* Return the seats status map rendering the current snapshot of the hall, no
+* seat lock is taken. With the VERSION option the map is preceded by the
+* version of the snapshot, with the SECTION option only a section is rendered.
+* A sealed show renders the runs of its segment
 */
 static int procedure_map(const database_t handle, char** query, char** result) {
 	struct database* database = (struct database*)handle;
-	int n_seats;
+	const struct seat_snapshot* snapshot = NULL;
+	int guard = 0;
 	int id;
-	char* map = NULL;
+	size_t n_seats;
+	unsigned long version;
+	char* map;
+	char* cursor;
 
-	n_seats = database->cinema_info.rows * database->cinema_info.columns;
 	try(strtoi(query[0], &id), !0, fail);
+	if (query[1] && !strcmp(query[1], "SECTION")) {
+		return map_section(database, id, &(query[2]), result);
+	}
+	if (query[1] && (strcmp(query[1], "VERSION") || query[2])) {
+		goto fail;
+	}
+	if (database->segment) {
+		n_seats = database->layout->n_seats;
+		version = SEALED_VERSION;
+	}
+	else {
+		snapshot = snapshot_acquire(database->snapshot, &guard);
+		n_seats = snapshot->n_seats;
+		version = snapshot->version;
+	}
 	if (!n_seats) {
+		if (snapshot) {
+			snapshot_release(database->snapshot, guard);
+		}
 		goto fail;
 	}
-	try(map = malloc(sizeof * map * (size_t)n_seats * 2), NULL, error);
-	memset(map, 0, (size_t)(n_seats * 2));
-
-	int book_id;
-	char* tmp;
-	char* buffer;
-	for (int i = 0; i < n_seats; i++) {
-		try(asprintf(&tmp, "%d", i), -1, error);
-		try(procedure_get(database, &tmp, &buffer), !0, error);
-		free(tmp);
-		try(strtoi(buffer, &book_id), !0, fail_cleanup);
-		if (book_id) {
-			free(buffer);
-			if (book_id == id) {
-				asprintf(&buffer, "1");
-			}
-			else {
-				asprintf(&buffer, "2");
-			}
+	// the version takes at most 20 characters plus its separator
+	try(map = malloc(sizeof * map * (n_seats * 2 + 21)), NULL, error);
+	cursor = map;
+	if (query[1]) {
+		cursor += sprintf(cursor, "%lu ", version);
+	}
+	if (snapshot) {
+		for (size_t k = 0; k < snapshot->n_sections; k++) {
+			const struct section_snapshot* section = snapshot->sections[k];
+			cursor = render_seats(database, section, section->first_seat, section->n_seats, NULL, id, cursor);
 		}
-		map[2 * i] = buffer[0];
-		map[(2 * i) + 1] = ' ';
-		free(buffer);
+		snapshot_release(database->snapshot, guard);
 	}
-	map[(n_seats * 2) - 1] = 0;
+	else {
+		cursor = render_seats(database, NULL, 0, n_seats, NULL, id, cursor);
+	}
+	cursor[-1] = 0;
 	*result = map;
 	return 0;
 
-fail_cleanup:
-	free(buffer);
 fail:
 	*result = strdup(MSG_FAIL);
 	return 0;
 error:
+	if (snapshot) {
+		snapshot_release(database->snapshot, guard);
+	}
 	return 1;
 }
 
 /*
-* Return the ID on a successful operation
+* Render the viewport of a single section, the query is the name of the
+* section optionally followed by ROWS <first>-<last>. The reply is the version
+* of the snapshot followed by the rows separated by '|', a gap is rendered as
+* '.'
 */
-static int procedure_book(const database_t handle, char** query, char** result) {
+static int map_section(const database_t handle, const int id, char** query, char** result) {
 	struct database* database = (struct database*)handle;
+	const struct seat_snapshot* snapshot = NULL;
+	const struct section_snapshot* section = NULL;
+	const struct venue_section* venue_section;
+	const size_t* row_start;
+	int guard = 0;
+	long k;
+	int first = 0;
+	int last;
+	size_t first_seat;
+	unsigned long version;
+	char* map;
+	char* cursor;
 
-	char* id = query[0];
-	char** ordered_request;
-	size_t n_seats = 0;
-
-	// order request to avoid deadlock
-	// TODO: This should be extracted-------------------------------------------
-	size_t* tmp;	//tmp variable to order request
-	size_t rows = (size_t)database->cinema_info.rows;
-	size_t cols = (size_t)database->cinema_info.columns;
-
-	while (query[n_seats + 1]) {
-		n_seats++;
+	if (!query[0] || (query[1] && (strcmp(query[1], "ROWS") || !query[2] || query[3]))) {
+		goto fail;
 	}
-	try(tmp = calloc(1, sizeof * tmp * rows * cols), NULL, error);
-	for (int i = 0; i < n_seats; i++) {
-		int seat;
-		try(strtoi(query[i + 1], &seat), !0, fail_cleanup);
-		tmp[seat] = 1;
+	if ((k = layout_find_section(database->layout, query[0])) == -1) {
+		goto fail;
 	}
-	try(ordered_request = malloc(sizeof * ordered_request * n_seats), NULL, error);
-	int n_req = 0;
-	for (int i = 0; (i < rows * cols) && (n_req < n_seats); i++) {
-		if (tmp[i]) {
-			try(asprintf(&(ordered_request[n_req]), "%d", i), -1, error);
-			n_req++;
+	venue_section = &database->layout->sections[k];
+	last = (int)venue_section->n_rows - 1;
+	if (query[1]) {
+		if (sscanf(query[2], "%d-%d", &first, &last) != 2 || first < 0 || first > last || last >= (int)venue_section->n_rows) {
+			goto fail;
 		}
 	}
-	free(tmp);
-	if (n_req != n_seats) {
-		goto fail;
+	if (database->segment) {
+		first_seat = venue_section->first_seat;
+		row_start = venue_section->row_start;
+		version = SEALED_VERSION;
 	}
-	//--------------------------------------------------------------------------
+	else {
+		snapshot = snapshot_acquire(database->snapshot, &guard);
+		if ((size_t)k >= snapshot->n_sections) {
+			snapshot_release(database->snapshot, guard);
+			goto fail;
+		}
+		section = snapshot->sections[k];
+		first_seat = section->first_seat;
+		row_start = section->row_start;
+		version = snapshot->version;
+	}
+	// every position takes two characters, every row separator two more
+	size_t size = 22;
+	for (int r = first; r <= last; r++) {
+		const char* gaps = venue_section->row_gaps ? venue_section->row_gaps[r] : NULL;
+		size += 2 * (gaps ? strlen(gaps) : row_start[r + 1] - row_start[r]) + 2;
+	}
+	try(map = malloc(sizeof * map * size), NULL, error);
+	cursor = map + sprintf(map, "%lu ", version);
+	for (int r = first; r <= last; r++) {
+		const char* gaps = venue_section->row_gaps ? venue_section->row_gaps[r] : NULL;
+		if (r > first) {
+			cursor += sprintf(cursor, "| ");
+		}
+		cursor = render_seats(database, section, first_seat + row_start[r], row_start[r + 1] - row_start[r], gaps, id, cursor);
+	}
+	cursor[-1] = 0;
+	if (snapshot) {
+		snapshot_release(database->snapshot, guard);
+	}
+	*result = map;
+	return 0;
 
-	// 2PL locking
-	char* seat_id;
-	for (size_t i = 0; i < n_seats; i++) {
-		try(storage_lock_exclusive(database->storage, ordered_request[i]), !0, error);
+fail:
+	*result = strdup(MSG_FAIL);
+	return 0;
+error:
+	if (snapshot) {
+		snapshot_release(database->snapshot, guard);
 	}
-	for (size_t i = 0; i < n_seats; i++) {
-		try(storage_load(database->storage, ordered_request[i], &seat_id), !0, error);
-		if (strcmp(seat_id, "0")) {	// TODO: implement in a self explaining named macro
-			goto fail_unlock;
+	return 1;
+}
+
+/*
+* Return the ID on a successful operation. A query ending with
+* IF-UNCHANGED <version> is rejected without taking any lock if a requested
+* seat changed after the version of the map, the reply carries the current
+* version and the state of the conflicting seats. A query ending with NOWAIT
+* fails with BUSY <seat> instead of waiting for a seat locked by someone else
+*/
+static int procedure_book(const database_t handle, char** query, char** result) {
+	struct database* database = (struct database*)handle;
+	struct booking_request request;
+	long n_seats;
+	long conflict;
+	unsigned long version = 0;
+	int conditional = 0;
+
+	request.type = BOOKING_BOOK;
+	request.released = NULL;
+	request.n_released = 0;
+	request.nowait = 0;
+	try(strtoi(query[0], &request.id), !0, fail);
+	if (request.id <= 0 && request.id != -1) {
+		goto fail;
+	}
+	size_t n = 0;
+	while (query[n]) {
+		n++;
+	}
+	// the options follow the seats in any order
+	for (;;) {
+		if (n > 2 && !request.nowait && !strcmp(query[n - 1], "NOWAIT")) {
+			request.nowait = 1;
+			query[--n] = NULL;
+		}
+		else if (n > 3 && !conditional && !strcmp(query[n - 2], "IF-UNCHANGED")) {
+			char* endptr;
+			if (*query[n - 1] < '0' || *query[n - 1] > '9') {
+				goto fail;
+			}
+			version = strtoul(query[n - 1], &endptr, 10);
+			if (*endptr) {
+				goto fail;
+			}
+			n -= 2;
+			query[n] = NULL;
+			conditional = 1;
+		}
+		else {
+			break;
 		}
-		free(seat_id);
 	}
-	if (!strcmp(id, "-1")) {
-		try(database_execute(database, "ID", &id), !0, error);
+	set_deadline(database, &request);
+	try(n_seats = parse_seats(database, &(query[1]), &request.seats), -1, error);
+	if (!n_seats) {
+		goto fail;
 	}
-	for (int i = 0; i < n_seats; i++) {
-		char* buffer;
-		try(storage_store(database->storage, ordered_request[i], id, &buffer), !0, error);
-		free(buffer);
+	request.n_seats = (size_t)n_seats;
+	if (conditional) {
+		try(conflict = check_unchanged(database, request.id, request.seats, request.n_seats, version, result), -1, cleanup);
+		if (conflict) {
+			free(request.seats);
+			return 0;
+		}
 	}
-	*result = strdup(id);
-	for (int i = 0; i < n_seats; i++) {
-		try(storage_unlock(database->storage, ordered_request[i]), !0, error);
+	try(combiner_execute(database->combiner, &request), !0, cleanup);
+	free(request.seats);
+	if (request.contended != -1) {
+		try(asprintf(result, "%s %d", MSG_BUSY, request.contended), -1, error);
+		return 0;
 	}
-	for (int i = 0; i < n_seats; i++) {
-		free(ordered_request[i]);
+	if (!request.outcome) {
+		goto fail;
 	}
-	free(ordered_request);
+	try(asprintf(result, "%d", request.outcome), -1, error);
 	return 0;
 
-fail_unlock:
-	free(seat_id);
-	for (size_t i = 0; i < n_seats; i++) {
-		storage_unlock(database->storage, ordered_request[i]);
-	}
-	goto fail;
-fail_cleanup:
-	free(tmp);
 fail:
 	*result = strdup(MSG_FAIL);
 	return 0;
+cleanup:
+	free(request.seats);
 error:
 	return 1;
 }
@@ -450,34 +1000,1286 @@ error:
 */
 static int procedure_unbook(const database_t handle, char** query, char** result) {
 	struct database* database = (struct database*)handle;
-	char* id = query[0];
+	struct booking_request request;
+	long n_seats;
 
-	char* buffer;
-	for (int i = 1; query[i]; i++) {
-		try(procedure_get(database, &(query[i]), &buffer), !0, error);
-		try(strcmp(id, buffer), !0, fail);
-		free(buffer);
+	request.type = BOOKING_UNBOOK;
+	request.released = NULL;
+	request.n_released = 0;
+	request.nowait = 0;
+	try(strtoi(query[0], &request.id), !0, fail);
+	if (request.id <= 0) {
+		goto fail;
 	}
-
-	for (int i = 1; query[i]; i++) {
-		char** parsed_query;
-		char* tmp_query;
-		char* buffer;
-		try(asprintf(&tmp_query, "%s 0", query[i]), -1, error);
-		try(parse_query(tmp_query, &parsed_query), -1, error);
-		try(procedure_set(database, parsed_query, &buffer), !0, error);
-		free(*parsed_query);
-		free(parsed_query);
-		free(tmp_query);
-		free(buffer);
+	set_deadline(database, &request);
+	try(n_seats = parse_seats(database, &(query[1]), &request.seats), -1, error);
+	if (!n_seats) {
+		goto fail;
 	}
-	*result = strdup(MSG_SUCC);
+	request.n_seats = (size_t)n_seats;
+	try(combiner_execute(database->combiner, &request), !0, cleanup);
+	free(request.seats);
+	if (request.contended != -1) {
+		try(asprintf(result, "%s %d", MSG_BUSY, request.contended), -1, error);
+		return 0;
+	}
+	*result = strdup(request.outcome ? MSG_SUCC : MSG_FAIL);
 	return 0;
 
 fail:
-	free(buffer);
 	*result = strdup(MSG_FAIL);
 	return 0;
+cleanup:
+	free(request.seats);
 error:
 	return 1;
 }
+
+/*
+* Move a booking from the seats prefixed by '-' to the seats prefixed by '+'
+* as a single atomic operation, return the ID on success
+*/
+static int procedure_modify(const database_t handle, char** query, char** result) {
+	struct database* database = (struct database*)handle;
+	struct booking_request request;
+	char** tokens;
+	char** added;
+	char** removed;
+	size_t n_added = 0;
+	size_t n_removed = 0;
+	long n_seats;
+	int valid = 1;
+
+	request.type = BOOKING_MODIFY;
+	request.seats = NULL;
+	request.released = NULL;
+	request.nowait = 0;
+	try(strtoi(query[0], &request.id), !0, fail);
+	if (request.id <= 0) {
+		goto fail;
+	}
+	set_deadline(database, &request);
+	size_t n = 0;
+	while (query[n + 1]) {
+		n++;
+	}
+	// the two seat lists are NULL terminated halves of a single vector
+	try(tokens = malloc(sizeof * tokens * (n + 1) * 2), NULL, error);
+	added = tokens;
+	removed = &tokens[n + 1];
+	for (size_t i = 1; i <= n && valid; i++) {
+		if (query[i][0] == '+') {
+			added[n_added++] = &query[i][1];
+		}
+		else if (query[i][0] == '-') {
+			removed[n_removed++] = &query[i][1];
+		}
+		else {
+			valid = 0;
+		}
+	}
+	added[n_added] = NULL;
+	removed[n_removed] = NULL;
+	if (!valid || (!n_added && !n_removed)) {
+		free(tokens);
+		goto fail;
+	}
+	request.n_seats = 0;
+	request.n_released = 0;
+	if (n_added) {
+		try(n_seats = parse_seats(database, added, &request.seats), -1, cleanup1);
+		valid = (n_seats == (long)n_added);
+		request.n_seats = (size_t)n_seats;
+	}
+	if (n_removed) {
+		try(n_seats = parse_seats(database, removed, &request.released), -1, cleanup2);
+		valid = valid && (n_seats == (long)n_removed);
+		request.n_released = (size_t)n_seats;
+	}
+	free(tokens);
+	// a seat can not be both released and booked
+	for (size_t i = 0, j = 0; valid && i < request.n_seats && j < request.n_released;) {
+		if (request.seats[i] == request.released[j]) {
+			valid = 0;
+		}
+		else if (request.seats[i] < request.released[j]) {
+			i++;
+		}
+		else {
+			j++;
+		}
+	}
+	if (!valid) {
+		free(request.seats);
+		free(request.released);
+		goto fail;
+	}
+	try(combiner_execute(database->combiner, &request), !0, cleanup3);
+	free(request.seats);
+	free(request.released);
+	if (request.contended != -1) {
+		try(asprintf(result, "%s %d", MSG_BUSY, request.contended), -1, error);
+		return 0;
+	}
+	if (!request.outcome) {
+		goto fail;
+	}
+	try(asprintf(result, "%d", request.outcome), -1, error);
+	return 0;
+
+fail:
+	*result = strdup(MSG_FAIL);
+	return 0;
+cleanup3:
+	free(request.released);
+	free(request.seats);
+	return 1;
+cleanup2:
+	free(request.seats);
+cleanup1:
+	free(tokens);
+error:
+	return 1;
+}
+
+/*
+* Apply a batch of BOOK, DELETE and MODIFY requests in their publication order.
+* The seats of the whole batch are locked once in ascending order, the IDs of
+* the new bookings are allocated as a single range and every changed seat is
+* written with a single storage batch. A request which can not lock its seats
+* in time is dropped from the batch with its contended seat and the remaining
+* requests lock their seats again.
+*/
+static int apply_bookings(void* context, void** requests, const size_t n_requests) {
+	struct database* database = (struct database*)context;
+	struct booking_request** batch;
+
+	int* seats;
+	int* state;
+	int* initial;
+	size_t n_seats = 0;
+	size_t n = n_requests;
+	int n_fresh = 0;
+	int contended;
+
+	try(batch = malloc(sizeof * batch * n), NULL, error);
+	memcpy(batch, requests, sizeof * batch * n);
+	for (size_t i = 0; i < n; i++) {
+		batch[i]->outcome = 0;
+		batch[i]->contended = -1;
+		n_seats += batch[i]->n_seats + batch[i]->n_released;
+	}
+	try(seats = malloc(sizeof * seats * n_seats), NULL, cleanup0);
+	try(state = malloc(sizeof * state * n_seats * 2), NULL, cleanup1);
+	for (;;) {
+		n_seats = collect_seats(batch, n, seats);
+		if (!lock_seats_timed(database, batch, n, seats, n_seats, &contended)) {
+			break;
+		}
+		if (errno != EBUSY && errno != ETIMEDOUT) {
+			goto cleanup2;
+		}
+		n = drop_contended(batch, n, contended);
+	}
+	if (!n) {
+		free(state);
+		free(seats);
+		free(batch);
+		return 0;
+	}
+	initial = &state[n_seats];
+
+	for (size_t i = 0; i < n_seats; i++) {
+		try(load_seat(database, seats[i], &initial[i]), !0, cleanup3);
+		state[i] = initial[i];
+	}
+
+	// the new bookings are marked with a placeholder until the IDs are allocated
+	for (size_t i = 0; i < n; i++) {
+		struct booking_request* request = batch[i];
+		int expected = (request->type == BOOKING_UNBOOK) ? request->id : SEAT_FREE;
+		request->outcome = 0;
+		if (!in_state(seats, state, n_seats, request->seats, request->n_seats, expected)
+			|| !in_state(seats, state, n_seats, request->released, request->n_released, request->id)) {
+			continue;
+		}
+		int value = SEAT_FREE;
+		if (request->type == BOOKING_UNBOOK) {
+			request->outcome = 1;
+		}
+		else {
+			value = (request->id == -1) ? FRESH_ID(n_fresh++) : request->id;
+			request->outcome = value;
+		}
+		set_state(seats, state, n_seats, request->seats, request->n_seats, value);
+		set_state(seats, state, n_seats, request->released, request->n_released, SEAT_FREE);
+	}
+	if (n_fresh) {
+		int first_id;
+		try(allocate_ids(database, n_fresh, &first_id), !0, cleanup3);
+		for (size_t i = 0; i < n_seats; i++) {
+			if (state[i] < SEAT_UNKNOWN) {
+				state[i] = first_id + FRESH_INDEX(state[i]);
+			}
+		}
+		for (size_t i = 0; i < n; i++) {
+			if (batch[i]->outcome < SEAT_UNKNOWN) {
+				batch[i]->outcome = first_id + FRESH_INDEX(batch[i]->outcome);
+			}
+		}
+	}
+	try(store_seats(database, seats, initial, state, n_seats), !0, cleanup3);
+	try(unlock_seats(database, seats, n_seats), !0, cleanup2);
+	free(state);
+	free(seats);
+	free(batch);
+	return 0;
+
+cleanup3:
+	unlock_seats(database, seats, n_seats);
+cleanup2:
+	free(state);
+cleanup1:
+	free(seats);
+cleanup0:
+	free(batch);
+error:
+	return 1;
+}
+
+/*
+* Return the seats linked to a booking, a sealed show finds them in its
+* segment
+*/
+static int procedure_seats(const database_t handle, char** query, char** result) {
+	struct database* database = (struct database*)handle;
+	int id;
+	int* seats;
+	size_t n_seats;
+	char* list = NULL;
+
+	try(strtoi(query[0], &id), !0, fail);
+	if (id <= 0) {
+		goto fail;
+	}
+	if (database->segment) {
+		try(segment_lookup(database->segment, id, &seats, &n_seats), !0, error);
+	}
+	else {
+		try(booking_index_lookup(database->booking_index, id, &seats, &n_seats), !0, error);
+	}
+	if (!n_seats) {
+		goto fail;
+	}
+	// every seat takes at most 11 characters plus its separator
+	try(list = malloc(sizeof * list * n_seats * 12), NULL, cleanup);
+	char* cursor = list;
+	for (size_t i = 0; i < n_seats; i++) {
+		cursor += sprintf(cursor, i ? " %d" : "%d", seats[i]);
+	}
+	free(seats);
+	*result = list;
+	return 0;
+
+fail:
+	*result = strdup(MSG_FAIL);
+	return 0;
+cleanup:
+	free(seats);
+error:
+	return 1;
+}
+
+/*
+* Remove a booking locking only its own seats. A query ending with NOWAIT
+* fails with BUSY <seat> instead of waiting for a seat locked by someone else,
+* as one whose seats are not locked within the lock timeout does
+*/
+static int procedure_cancel(const database_t handle, char** query, char** result) {
+	struct database* database = (struct database*)handle;
+	struct booking_request request;
+	struct booking_request* batch = &request;
+	int id;
+	int* seats;
+	int* locked;
+	size_t n_seats;
+	size_t n_locked;
+	int contended;
+
+	try(strtoi(query[0], &id), !0, fail);
+	if (id <= 0) {
+		goto fail;
+	}
+	if (query[1] && strcmp(query[1], "NOWAIT")) {
+		goto fail;
+	}
+	request.released = NULL;
+	request.n_released = 0;
+	request.nowait = (query[1] != NULL);
+	set_deadline(database, &request);
+	try(booking_index_lookup(database->booking_index, id, &seats, &n_seats), !0, error);
+	// the booking can grow or shrink before its seats are locked, retry until
+	// the locked seats are still the ones linked to the booking
+	while (n_seats) {
+		request.seats = seats;
+		request.n_seats = n_seats;
+		if (lock_seats_timed(database, &batch, 1, seats, n_seats, &contended)) {
+			if (errno != EBUSY && errno != ETIMEDOUT) {
+				goto cleanup1;
+			}
+			free(seats);
+			try(asprintf(result, "%s %d", MSG_BUSY, contended), -1, error);
+			return 0;
+		}
+		locked = seats;
+		n_locked = n_seats;
+		try(booking_index_lookup(database->booking_index, id, &seats, &n_seats), !0, cleanup2);
+		if (n_seats == n_locked && !memcmp(seats, locked, sizeof * seats * n_seats)) {
+			free(seats);
+			break;
+		}
+		try(unlock_seats(database, locked, n_locked), !0, cleanup2);
+		free(locked);
+	}
+	if (!n_seats) {
+		free(seats);
+		goto fail;
+	}
+	// the old IDs of the seats are followed by the new ones
+	int* ids;
+	try(ids = malloc(sizeof * ids * n_locked * 2), NULL, cleanup3);
+	for (size_t i = 0; i < n_locked; i++) {
+		ids[i] = id;
+		ids[n_locked + i] = SEAT_FREE;
+	}
+	try(store_seats(database, locked, ids, &ids[n_locked], n_locked), !0, cleanup4);
+	free(ids);
+	try(unlock_seats(database, locked, n_locked), !0, cleanup2);
+	free(locked);
+	*result = strdup(MSG_SUCC);
+	return 0;
+
+fail:
+	*result = strdup(MSG_FAIL);
+	return 0;
+cleanup4:
+	free(ids);
+cleanup3:
+	unlock_seats(database, locked, n_locked);
+cleanup2:
+	free(locked);
+	return 1;
+cleanup1:
+	free(seats);
+error:
+	return 1;
+}
+
+/*
+* Return the number of free and booked seats of the hall from the counters of
+* the current snapshot, a sealed show counts the runs of its segment
+*/
+static int procedure_count(const database_t handle, char** result) {
+	struct database* database = (struct database*)handle;
+	const struct seat_snapshot* snapshot;
+	int guard;
+	int ret;
+
+	if (database->segment) {
+		size_t n_booked = segment_booked(database->segment, 0, database->layout->n_seats);
+		try(asprintf(result, "%zu %zu", database->layout->n_seats - n_booked, n_booked), -1, error);
+		return 0;
+	}
+	snapshot = snapshot_acquire(database->snapshot, &guard);
+	if (!snapshot->n_seats) {
+		snapshot_release(database->snapshot, guard);
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	ret = asprintf(result, "%zu %zu", snapshot->n_seats - snapshot->n_booked, snapshot->n_booked);
+	snapshot_release(database->snapshot, guard);
+	try(ret, -1, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Return <free>:<booked> for every row of the venue, section after section,
+* from the counters of the current snapshot, a sealed show counts the runs of
+* its segment
+*/
+static int procedure_rowstats(const database_t handle, char** result) {
+	struct database* database = (struct database*)handle;
+	const struct seat_snapshot* snapshot;
+	int guard;
+	char* stats;
+
+	if (database->segment) {
+		const struct venue_layout* layout = database->layout;
+		try(stats = malloc(sizeof * stats * layout->n_rows * 42), NULL, error2);
+		char* cursor = stats;
+		for (size_t k = 0; k < layout->n_sections; k++) {
+			const struct venue_section* section = &layout->sections[k];
+			for (size_t i = 0; i < section->n_rows; i++) {
+				size_t length = section->row_start[i + 1] - section->row_start[i];
+				size_t booked = segment_booked(database->segment, section->first_seat + section->row_start[i], length);
+				cursor += sprintf(cursor, (cursor != stats) ? " %zu:%zu" : "%zu:%zu", length - booked, booked);
+			}
+		}
+		*result = stats;
+		return 0;
+	}
+	snapshot = snapshot_acquire(database->snapshot, &guard);
+	if (!snapshot->n_seats) {
+		snapshot_release(database->snapshot, guard);
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	size_t n_rows = 0;
+	for (size_t k = 0; k < snapshot->n_sections; k++) {
+		n_rows += snapshot->sections[k]->n_rows;
+	}
+	// every counter takes at most 20 characters plus its separator
+	try(stats = malloc(sizeof * stats * n_rows * 42), NULL, error);
+	char* cursor = stats;
+	for (size_t k = 0; k < snapshot->n_sections; k++) {
+		const struct section_snapshot* section = snapshot->sections[k];
+		for (size_t i = 0; i < section->n_rows; i++) {
+			size_t booked = section->row_booked[i];
+			size_t length = section->row_start[i + 1] - section->row_start[i];
+			cursor += sprintf(cursor, (cursor != stats) ? " %zu:%zu" : "%zu:%zu", length - booked, booked);
+		}
+	}
+	snapshot_release(database->snapshot, guard);
+	*result = stats;
+	return 0;
+
+error:
+	snapshot_release(database->snapshot, guard);
+error2:
+	return 1;
+}
+
+/*
+* Return <name>:<free>:<booked> for every section of the venue from the
+* counters of the current snapshot, a sealed show counts the runs of its
+* segment
+*/
+static int procedure_sections(const database_t handle, char** result) {
+	struct database* database = (struct database*)handle;
+	const struct seat_snapshot* snapshot;
+	int guard;
+	char* stats;
+
+	if (database->segment) {
+		const struct venue_layout* layout = database->layout;
+		try(stats = malloc(sizeof * stats * layout->n_sections * (SECTION_NAME_LEN + 44)), NULL, error2);
+		char* cursor = stats;
+		for (size_t k = 0; k < layout->n_sections; k++) {
+			const struct venue_section* section = &layout->sections[k];
+			size_t booked = segment_booked(database->segment, section->first_seat, section->n_seats);
+			cursor += sprintf(cursor, k ? " %s:%zu:%zu" : "%s:%zu:%zu", section->name, section->n_seats - booked, booked);
+		}
+		*result = stats;
+		return 0;
+	}
+	snapshot = snapshot_acquire(database->snapshot, &guard);
+	if (!snapshot->n_seats || snapshot->n_sections != database->layout->n_sections) {
+		snapshot_release(database->snapshot, guard);
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	try(stats = malloc(sizeof * stats * snapshot->n_sections * (SECTION_NAME_LEN + 44)), NULL, error);
+	char* cursor = stats;
+	for (size_t k = 0; k < snapshot->n_sections; k++) {
+		const struct section_snapshot* section = snapshot->sections[k];
+		cursor += sprintf(cursor, k ? " %s:%zu:%zu" : "%s:%zu:%zu", database->layout->sections[k].name, section->n_seats - section->n_booked, section->n_booked);
+	}
+	snapshot_release(database->snapshot, guard);
+	*result = stats;
+	return 0;
+
+error:
+	snapshot_release(database->snapshot, guard);
+error2:
+	return 1;
+}
+
+/*
+* Verify the occupancy counters against the stored seats. The seats are
+* locked as shared so that no commit can publish while the booked seats are
+* collected in a bitmap, the counters of every row, section and of the whole
+* venue are then checked counting the bitmap a word at a time.
+*/
+static int procedure_recount(const database_t handle, char** result) {
+	struct database* database = (struct database*)handle;
+	const struct seat_snapshot* snapshot;
+	int guard;
+	uint64_t* bitmap;
+	size_t n_seats = (size_t)hall_size(database);
+	size_t n_locked = 0;
+	size_t n_booked = 0;
+	size_t n_mismatches = 0;
+
+	if (!n_seats) {
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	try(bitmap = calloc((n_seats + 63) / 64, sizeof * bitmap), NULL, error);
+	for (; n_locked < n_seats; n_locked++) {
+		int id;
+		try(storage_lock_shared_int(database->storage, n_locked), !0, cleanup);
+		try(load_seat(database, (int)n_locked, &id), !0, cleanup);
+		if (id > 0) {
+			bitmap[n_locked / 64] |= (uint64_t)1 << (n_locked % 64);
+		}
+	}
+	snapshot = snapshot_acquire(database->snapshot, &guard);
+	if (snapshot->n_seats != n_seats) {
+		n_mismatches++;
+	}
+	for (size_t k = 0; k < snapshot->n_sections && !n_mismatches; k++) {
+		const struct section_snapshot* section = snapshot->sections[k];
+		size_t section_booked = 0;
+		for (size_t i = 0; i < section->n_rows; i++) {
+			size_t booked = popcount_range(bitmap, section->first_seat + section->row_start[i], section->first_seat + section->row_start[i + 1]);
+			if (section->row_booked[i] != booked) {
+				n_mismatches++;
+			}
+			section_booked += booked;
+		}
+		if (section->n_booked != section_booked) {
+			n_mismatches++;
+		}
+	}
+	n_booked = popcount_range(bitmap, 0, n_seats);
+	if (n_booked != snapshot->n_booked) {
+		n_mismatches++;
+	}
+	if (n_mismatches) {
+		syslog(LOG_WARNING, "Recount:	%zu mismatches, %zu seats booked but %zu counted", n_mismatches, n_booked, snapshot->n_booked);
+	}
+	snapshot_release(database->snapshot, guard);
+	while (n_locked) {
+		try(storage_unlock_int(database->storage, --n_locked), !0, cleanup);
+	}
+	free(bitmap);
+	if (n_mismatches) {
+		try(asprintf(result, "MISMATCH %zu %zu", n_seats - n_booked, n_booked), -1, error);
+	}
+	else {
+		*result = strdup(MSG_SUCC);
+	}
+	return 0;
+
+cleanup:
+	while (n_locked) {
+		storage_unlock_int(database->storage, --n_locked);
+	}
+	free(bitmap);
+error:
+	return 1;
+}
+
+/*
+* Compact the storage file and empty the write-ahead log without waiting for
+* the next periodic checkpoint
+*/
+static int procedure_checkpoint(const database_t handle, char** result) {
+	struct database* database = (struct database*)handle;
+
+	try(storage_checkpoint(database->storage), !0, error);
+	try(*result = strdup(MSG_SUCC), NULL, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Write a consistent copy of the storage file to the named file of the
+* backups directory, next to the data file, while the bookings go on. The
+* name can not leave the directory, a backup which can not be written fails
+* without touching the storage
+*/
+static int procedure_backup(const database_t handle, char** query, char** result) {
+	struct database* database = (struct database*)handle;
+	char* filename;
+
+	if (!query[0][0] || strchr(query[0], '/') || !strcmp(query[0], ".") || !strcmp(query[0], "..")) {
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	try(asprintf(&filename, "%s%s", database->backup_directory, query[0]), -1, error);
+	if (storage_backup(database->storage, filename)) {
+		syslog(LOG_WARNING, "Backup:	%s failed: %m", filename);
+		free(filename);
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	free(filename);
+	*result = strdup(MSG_SUCC);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Return the counters of the storage as DIRTY <bytes> FLUSHES <n> FLUSHED
+* <bytes> LATENCY <last> <avg> <max> SCRUB <passes> <bytes> CORRUPT <found>
+* <repaired> BACKUP <n> <last stall> <max stall> MEMORY <bytes>, the flush
+* latencies and the backup stalls are in microseconds, the memory is the
+* estimate of the whole database
+*/
+static int procedure_stats(const database_t handle, char** result) {
+	struct database* database = (struct database*)handle;
+	struct storage_stats stats;
+	size_t memory;
+
+	try(storage_get_stats(database->storage, &stats), !0, error);
+	try(database_memory(database, &memory), !0, error);
+	try(asprintf(result, "DIRTY %zu FLUSHES %lu FLUSHED %zu LATENCY %lu %lu %lu SCRUB %lu %zu CORRUPT %lu %lu BACKUP %lu %lu %lu MEMORY %zu",
+		stats.dirty_bytes, stats.flushes, stats.flushed_bytes, stats.flush_latency_last, stats.flush_latency_avg, stats.flush_latency_max,
+		stats.scrub_passes, stats.scrubbed_bytes, stats.corrupt_records, stats.repaired_records,
+		stats.backups, stats.backup_stall_last, stats.backup_stall_max, memory), -1, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Register a stored procedure, the query is its name followed by the tokens
+* of its source
+*/
+static int procedure_load(const database_t handle, char** query, char** result) {
+	struct database* database = (struct database*)handle;
+
+	if (script_define(database->scripts, query[0], &(query[1]))) {
+		if (errno != EINVAL) {
+			return 1;
+		}
+		syslog(LOG_WARNING, "Load:	script %s rejected", query[0]);
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	*result = strdup(MSG_SUCC);
+	return 0;
+}
+
+/*
+* Run a stored procedure against the current snapshot of the hall. The seats
+* held by a committing script are booked with a single BOOK request, if one
+* of them was taken in the meantime the script runs again on a new snapshot.
+* Return the ID of the booking, the value returned by the script or BUSY
+* <seat> as a BOOK does when a held seat stays locked past the lock timeout
+*/
+static int procedure_call(const database_t handle, const int argc, char** query, char** result) {
+	struct database* database = (struct database*)handle;
+	struct script_env env;
+	struct script_view view;
+	struct script_result outcome;
+	long args[SCRIPT_MAX_ARGS];
+	int guard;
+
+	if (argc > SCRIPT_MAX_ARGS) {
+		goto fail;
+	}
+	for (int i = 0; i < argc; i++) {
+		char* endptr;
+		errno = 0;
+		args[i] = strtol(query[i + 1], &endptr, 10);
+		if (*endptr || endptr == query[i + 1] || errno == ERANGE) {
+			goto fail;
+		}
+	}
+	view.database = database;
+	env.context = &view;
+	env.seat_get = &script_seat_get;
+	env.row_range = &script_row_range;
+	for (int attempt = 0; attempt < SCRIPT_ATTEMPTS; attempt++) {
+		struct booking_request request;
+		view.snapshot = snapshot_acquire(database->snapshot, &guard);
+		env.n_seats = (long)view.snapshot->n_seats;
+		env.n_rows = (long)database->layout->n_rows;
+		if (script_run(database->scripts, query[0], args, (size_t)argc, &env, &outcome)) {
+			snapshot_release(database->snapshot, guard);
+			if (errno == ENOENT) {
+				goto fail;
+			}
+			return 1;
+		}
+		snapshot_release(database->snapshot, guard);
+		if (outcome.outcome == SCRIPT_FAIL) {
+			goto fail;
+		}
+		if (outcome.outcome == SCRIPT_RETURN) {
+			try(asprintf(result, "%ld", outcome.value), -1, error);
+			return 0;
+		}
+		if (outcome.value > INT_MAX || (outcome.value <= 0 && outcome.value != -1)) {
+			goto fail;
+		}
+		request.type = BOOKING_BOOK;
+		request.id = (int)outcome.value;
+		request.seats = outcome.holds;
+		request.n_seats = outcome.n_holds;
+		request.released = NULL;
+		request.n_released = 0;
+		request.nowait = 0;
+		qsort(request.seats, request.n_seats, sizeof * request.seats, &seat_comparison);
+		set_deadline(database, &request);
+		try(combiner_execute(database->combiner, &request), !0, error);
+		if (request.contended != -1) {
+			try(asprintf(result, "%s %d", MSG_BUSY, request.contended), -1, error);
+			return 0;
+		}
+		if (request.outcome) {
+			try(asprintf(result, "%d", request.outcome), -1, error);
+			return 0;
+		}
+	}
+
+fail:
+	*result = strdup(MSG_FAIL);
+	return 0;
+error:
+	return 1;
+}
+
+static int script_seat_get(void* context, const long seat, int* id) {
+	struct script_view* view = (struct script_view*)context;
+	const struct seat_state* state;
+
+	if ((state = snapshot_seat(view->snapshot, (size_t)seat)) == NULL) {
+		errno = EINVAL;
+		return 1;
+	}
+	*id = state->id;
+	return 0;
+}
+
+/*
+* Find the seats of a row of the venue, the rows are numbered across the
+* sections.
+*/
+static int script_row_range(void* context, const long row, long* first_seat, long* n_seats) {
+	struct script_view* view = (struct script_view*)context;
+	const struct venue_layout* layout = view->database->layout;
+	size_t r = (size_t)row;
+
+	for (size_t k = 0; k < layout->n_sections; k++) {
+		const struct venue_section* section = &layout->sections[k];
+		if (r < section->n_rows) {
+			*first_seat = (long)(section->first_seat + section->row_start[r]);
+			*n_seats = (long)(section->row_start[r + 1] - section->row_start[r]);
+			return 0;
+		}
+		r -= section->n_rows;
+	}
+	errno = EINVAL;
+	return 1;
+}
+
+/*
+* Check if the key identifies a seat of the hall, set the seat parameter.
+*
+* @return	1 if the key is a seat or 0 otherwise.
+*/
+static int is_seat(const database_t handle, const char* key, int* seat) {
+	struct database* database = (struct database*)handle;
+	char* endptr;
+	long value;
+
+	if (*key < '0' || *key > '9') {
+		return 0;
+	}
+	value = strtol(key, &endptr, 10);
+	if (*endptr || value >= hall_size(database)) {
+		return 0;
+	}
+	*seat = (int)value;
+	return 1;
+}
+
+/*
+* Convert the seats of the query in a vector sorted in ascending order.
+*
+* @return	the number of seats on success, 0 if a seat is not valid or it is
+*			repeated, or return -1 and set properly errno on error.
+*/
+static long parse_seats(const database_t handle, char** query, int** seats) {
+	struct database* database = (struct database*)handle;
+	size_t n = 0;
+
+	while (query[n]) {
+		n++;
+	}
+	try(*seats = malloc(sizeof * *seats * n), NULL, error);
+	for (size_t i = 0; i < n; i++) {
+		if (!is_seat(database, query[i], &(*seats)[i])) {
+			goto fail;
+		}
+	}
+	qsort(*seats, n, sizeof * *seats, &seat_comparison);
+	for (size_t i = 1; i < n; i++) {
+		if ((*seats)[i - 1] == (*seats)[i]) {
+			goto fail;
+		}
+	}
+	return (long)n;
+
+fail:
+	free(*seats);
+	*seats = NULL;
+	return 0;
+error:
+	return -1;
+}
+
+/*
+* Check on the current snapshot if a seat changed after the version, on a
+* conflict set the conflict parameter to "CONFLICT <version>" followed by
+* <seat>:<state> for every changed seat, the state is rendered as in the map.
+*
+* @return	0 if no seat changed, 1 on a conflict or return -1 and set
+*			properly errno on error.
+*/
+static long check_unchanged(const database_t handle, const int id, const int* seats, const size_t n, const unsigned long version, char** conflict) {
+	struct database* database = (struct database*)handle;
+	const struct seat_snapshot* snapshot;
+	int guard;
+	char* cursor;
+
+	snapshot = snapshot_acquire(database->snapshot, &guard);
+	// a version which has never been published can not be trusted
+	if (version > snapshot->version) {
+		snapshot_release(database->snapshot, guard);
+		try(*conflict = strdup(MSG_FAIL), NULL, error);
+		return 1;
+	}
+	size_t n_changed = 0;
+	for (size_t i = 0; i < n; i++) {
+		const struct seat_state* seat = snapshot_seat(snapshot, (size_t)seats[i]);
+		if (seat && seat->version > version) {
+			n_changed++;
+		}
+	}
+	if (!n_changed) {
+		snapshot_release(database->snapshot, guard);
+		return 0;
+	}
+	// every seat takes at most 11 characters plus its state and separators
+	try(*conflict = malloc(sizeof * *conflict * (30 + n_changed * 14)), NULL, cleanup);
+	cursor = *conflict + sprintf(*conflict, "CONFLICT %lu", snapshot->version);
+	for (size_t i = 0; i < n; i++) {
+		const struct seat_state* seat = snapshot_seat(snapshot, (size_t)seats[i]);
+		if (seat && seat->version > version) {
+			cursor += sprintf(cursor, " %d:%c", seats[i], seat_mark(seat->id, id));
+		}
+	}
+	snapshot_release(database->snapshot, guard);
+	return 1;
+
+cleanup:
+	snapshot_release(database->snapshot, guard);
+error:
+	return -1;
+}
+
+/*
+* Check if every seat of the subset is in the expected state, the state of
+* seats[i] is state[i].
+*
+* @return	1 if every seat is in the expected state or 0 otherwise.
+*/
+static int in_state(const int* seats, const int* state, const size_t n_seats, const int* subset, const size_t n, const int expected) {
+	for (size_t i = 0; i < n; i++) {
+		const int* seat = bsearch(&subset[i], seats, n_seats, sizeof * seats, &seat_comparison);
+		if (state[seat - seats] != expected) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+* Set the state of every seat of the subset, the state of seats[i] is
+* state[i].
+*/
+static void set_state(const int* seats, int* state, const size_t n_seats, const int* subset, const size_t n, const int value) {
+	for (size_t i = 0; i < n; i++) {
+		const int* seat = bsearch(&subset[i], seats, n_seats, sizeof * seats, &seat_comparison);
+		state[seat - seats] = value;
+	}
+}
+
+static int seat_comparison(const void* seat1, const void* seat2) {
+	int a = *(const int*)seat1;
+	int b = *(const int*)seat2;
+	return (a > b) - (a < b);
+}
+
+/*
+* Allocate a range of n consecutive booking IDs, set the first of them.
+*/
+static int allocate_ids(const database_t handle, const int n, int* first_id) {
+	struct database* database = (struct database*)handle;
+	long current_id;
+
+	try(storage_lock_exclusive(database->storage, "ID_COUNTER"), !0, error);
+	try(storage_load_number(database->storage, "ID_COUNTER", &current_id), !0, cleanup);
+	if (current_id < INT_MIN || current_id > INT_MAX - n) {
+		errno = ERANGE;
+		goto cleanup;
+	}
+	try(storage_store_number(database->storage, "ID_COUNTER", current_id + n), !0, cleanup);
+	try(storage_unlock(database->storage, "ID_COUNTER"), !0, error);
+	*first_id = (int)current_id + 1;
+	return 0;
+
+cleanup:
+	storage_unlock(database->storage, "ID_COUNTER");
+error:
+	return 1;
+}
+
+/*
+* Write with a single storage batch every seat whose ID changed, move it in
+* the booking index and publish the new hall snapshot, the seats must be
+* locked as exclusive.
+*/
+static int store_seats(const database_t handle, const int* seats, const int* old_ids, const int* new_ids, const size_t n) {
+	struct database* database = (struct database*)handle;
+	unsigned long* keys;
+	long* values;
+	size_t n_changed = 0;
+
+	try(keys = malloc(sizeof * keys * (n + 1)), NULL, error);
+	try(values = malloc(sizeof * values * (n + 1)), NULL, cleanup1);
+	for (size_t i = 0; i < n; i++) {
+		if (old_ids[i] != new_ids[i]) {
+			keys[n_changed] = (unsigned long)seats[i];
+			values[n_changed] = new_ids[i];
+			n_changed++;
+		}
+	}
+	if (n_changed) {
+		try(storage_store_ints(database->storage, n_changed, keys, values), !0, cleanup2);
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (old_ids[i] != new_ids[i]) {
+			try(index_seat(database, seats[i], old_ids[i], new_ids[i]), !0, cleanup2);
+		}
+	}
+	if (n_changed) {
+		try(snapshot_publish(database->snapshot, seats, new_ids, n), !0, cleanup2);
+	}
+	free(values);
+	free(keys);
+	return 0;
+
+cleanup2:
+	free(values);
+cleanup1:
+	free(keys);
+error:
+	return 1;
+}
+
+/*
+* Load the numeric value linked to the key.
+*
+* @return	0 on success or return 1 if the key is missing or not a number.
+*/
+static int load_number(const database_t handle, const char* key, int* value) {
+	struct database* database = (struct database*)handle;
+	long number;
+
+	try(storage_load_number(database->storage, key, &number), !0, error);
+	if (number < INT_MIN || number > INT_MAX) {
+		errno = ERANGE;
+		goto error;
+	}
+	*value = (int)number;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Load the ID linked to the seat, SEAT_UNKNOWN if the seat is missing or its
+* value is not a valid ID.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int load_seat(const database_t handle, const int seat, int* id) {
+	struct database* database = (struct database*)handle;
+	long value;
+
+	if (storage_load_int(database->storage, (unsigned long)seat, &value)) {
+		if (errno != ENOENT && errno != ERANGE) {
+			return 1;
+		}
+		value = SEAT_UNKNOWN;
+	}
+	*id = (value < 0 || value > INT_MAX) ? SEAT_UNKNOWN : (int)value;
+	return 0;
+}
+
+/*
+* Log the time elapsed since start by a startup phase and restart the clock.
+*/
+static void log_phase(const char* phase, struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (double)(now.tv_sec - start->tv_sec) * 1e3 + (double)(now.tv_nsec - start->tv_nsec) / 1e6;
+	syslog(LOG_INFO, "Startup:\t%s took %.3f ms", phase, elapsed);
+	*start = now;
+}
+
+/*
+* Move the seat between the bookings in the booking index, a not positive ID
+* stands for a free seat.
+*/
+static int index_seat(const database_t handle, const int seat, const int old_id, const int new_id) {
+	struct database* database = (struct database*)handle;
+
+	if (old_id > 0) {
+		try(booking_index_remove(database->booking_index, old_id, seat), !0, error);
+	}
+	if (new_id > 0) {
+		try(booking_index_insert(database->booking_index, new_id, seat), !0, error);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Lock as exclusive the seats, they must be sorted in ascending order to
+* avoid deadlock. On failure the seats already locked are released.
+*/
+static int lock_seats(const database_t handle, const int* seats, const size_t n) {
+	struct database* database = (struct database*)handle;
+	size_t n_locked = 0;
+
+	for (; n_locked < n; n_locked++) {
+		try(storage_lock_exclusive_int(database->storage, (unsigned long)seats[n_locked]), !0, error);
+	}
+	return 0;
+
+error:
+	{
+		int error = errno;
+		unlock_seats(database, seats, n_locked);
+		errno = error;
+	}
+	return 1;
+}
+
+/*
+* Lock as exclusive the seats of the batch, sorted in ascending order. A seat
+* requested by a NOWAIT request is only tried, otherwise it is waited for until
+* the earliest deadline of the requests which need it, or for as long as it
+* takes if none of them has a deadline. On failure the seats already locked
+* are released and the contended parameter is set if a seat was contended.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EBUSY or ETIMEDOUT if a seat could not be locked in time.
+*/
+static int lock_seats_timed(const database_t handle, struct booking_request** batch, const size_t n, const int* seats, const size_t n_seats, int* contended) {
+	struct database* database = (struct database*)handle;
+	size_t n_locked = 0;
+
+	for (; n_locked < n_seats; n_locked++) {
+		size_t i = n_locked;
+		const struct timespec* deadline = NULL;
+		int nowait = 0;
+		for (size_t j = 0; j < n && !nowait; j++) {
+			if (!has_seat(batch[j], seats[i])) {
+				continue;
+			}
+			nowait = batch[j]->nowait;
+			if (batch[j]->timed && (!deadline || batch[j]->deadline.tv_sec < deadline->tv_sec
+				|| (batch[j]->deadline.tv_sec == deadline->tv_sec && batch[j]->deadline.tv_nsec < deadline->tv_nsec))) {
+				deadline = &batch[j]->deadline;
+			}
+		}
+		if (nowait || deadline) {
+			if (storage_lock_exclusive_timed_int(database->storage, (unsigned long)seats[i], nowait ? NULL : deadline)) {
+				*contended = seats[i];
+				goto error;
+			}
+		}
+		else {
+			try(storage_lock_exclusive_int(database->storage, (unsigned long)seats[i]), !0, error);
+		}
+	}
+	return 0;
+
+error:
+	{
+		int error = errno;
+		unlock_seats(database, seats, n_locked);
+		errno = error;
+	}
+	return 1;
+}
+
+/*
+* Fail the NOWAIT and the expired requests which need the contended seat and
+* remove them from the batch, keeping the publication order of the others.
+*
+* @return	the number of requests left in the batch.
+*/
+static size_t drop_contended(struct booking_request** batch, const size_t n, const int seat) {
+	struct timespec now;
+	size_t n_left = 0;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	for (size_t i = 0; i < n; i++) {
+		struct booking_request* request = batch[i];
+		int expired = request->timed && (request->deadline.tv_sec < now.tv_sec
+			|| (request->deadline.tv_sec == now.tv_sec && request->deadline.tv_nsec <= now.tv_nsec));
+		if ((request->nowait || expired) && has_seat(request, seat)) {
+			request->contended = seat;
+		}
+		else {
+			batch[n_left++] = request;
+		}
+	}
+	return n_left;
+}
+
+/*
+* Collect the union of the seats of the batch in ascending order.
+*
+* @return	the number of collected seats.
+*/
+static size_t collect_seats(struct booking_request** batch, const size_t n, int* seats) {
+	size_t n_seats = 0;
+	for (size_t i = 0; i < n; i++) {
+		memcpy(&seats[n_seats], batch[i]->seats, sizeof * seats * batch[i]->n_seats);
+		n_seats += batch[i]->n_seats;
+		memcpy(&seats[n_seats], batch[i]->released, sizeof * seats * batch[i]->n_released);
+		n_seats += batch[i]->n_released;
+	}
+	qsort(seats, n_seats, sizeof * seats, &seat_comparison);
+	size_t n_union = 0;
+	for (size_t i = 0; i < n_seats; i++) {
+		if (!n_union || seats[n_union - 1] != seats[i]) {
+			seats[n_union++] = seats[i];
+		}
+	}
+	return n_union;
+}
+
+/*
+* Check if the request needs the seat, its seat vectors are sorted.
+*/
+static int has_seat(const struct booking_request* request, const int seat) {
+	return (request->n_seats && bsearch(&seat, request->seats, request->n_seats, sizeof seat, &seat_comparison))
+		|| (request->n_released && bsearch(&seat, request->released, request->n_released, sizeof seat, &seat_comparison));
+}
+
+/*
+* Set the deadline of the request from the configured lock timeout, a
+* request started while no timeout is configured waits for its seats.
+*/
+static void set_deadline(const database_t handle, struct booking_request* request) {
+	struct database* database = (struct database*)handle;
+	int lock_timeout = atomic_load(&database->lock_timeout);
+
+	request->timed = (lock_timeout >= 0);
+	if (request->timed) {
+		clock_gettime(CLOCK_REALTIME, &request->deadline);
+		request->deadline.tv_sec += lock_timeout / 1000;
+		request->deadline.tv_nsec += (long)(lock_timeout % 1000) * 1000000;
+		if (request->deadline.tv_nsec >= 1000000000) {
+			request->deadline.tv_sec++;
+			request->deadline.tv_nsec -= 1000000000;
+		}
+	}
+}
+
+static int unlock_seats(const database_t handle, const int* seats, const size_t n) {
+	struct database* database = (struct database*)handle;
+
+	for (size_t i = 0; i < n; i++) {
+		try(storage_unlock_int(database->storage, (unsigned long)seats[i]), !0, error);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Return the number of seats of the venue.
+*/
+static int hall_size(const database_t handle) {
+	struct database* database = (struct database*)handle;
+	return (int)database->layout->n_seats;
+}
+
+/*
+* Render the seat for the client: '0' if free, '1' if booked by the client
+* with the received ID and '2' otherwise.
+*/
+static char seat_mark(const int book_id, const int id) {
+	return (book_id == SEAT_FREE) ? '0' : (book_id == id) ? '1' : '2';
+}
+
+/*
+* Write the mark of n_seats seats starting from first_seat, each followed by a
+* space. A row with gaps writes a position for every character of gaps, a '.'
+* for a gap. The seats are read from the section of the snapshot or, for a
+* sealed show, decoded from the runs of the segment a chunk at a time.
+*
+* @return	the cursor past the written marks.
+*/
+static char* render_seats(const database_t handle, const struct section_snapshot* section, const size_t first_seat, const size_t n_seats, const char* gaps, const int id, char* cursor) {
+	struct database* database = (struct database*)handle;
+	int ids[SNAPSHOT_CHUNK_SEATS];
+	size_t n_positions = gaps ? strlen(gaps) : n_seats;
+
+	for (size_t position = 0, seat = 0; position < n_positions; position++) {
+		if (gaps && gaps[position] == '.') {
+			*cursor++ = '.';
+		}
+		else if (section) {
+			*cursor++ = seat_mark(snapshot_section_seat(section, first_seat - section->first_seat + seat++)->id, id);
+		}
+		else {
+			if (!(seat % SNAPSHOT_CHUNK_SEATS)) {
+				size_t n = n_seats - seat;
+				segment_read(database->segment, first_seat + seat, (n < SNAPSHOT_CHUNK_SEATS) ? n : SNAPSHOT_CHUNK_SEATS, ids);
+			}
+			*cursor++ = seat_mark(ids[seat++ % SNAPSHOT_CHUNK_SEATS], id);
+		}
+		*cursor++ = ' ';
+	}
+	return cursor;
+}
+
+/*
+* Count the bits set in the range [start, end) of the bitmap.
+*/
+static size_t popcount_range(const uint64_t* bitmap, const size_t start, const size_t end) {
+	size_t count = 0;
+	for (size_t i = start; i < end;) {
+		size_t word = i / 64;
+		size_t bit = i % 64;
+		size_t n = (end - i < 64 - bit) ? end - i : 64 - bit;
+		uint64_t mask = (n == 64) ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << bit;
+		count += (size_t)__builtin_popcountll(bitmap[word] & mask);
+		i += n;
+	}
+	return count;
+}
@@ -1,15 +1,33 @@
 #pragma once
 
+#include <stddef.h>
+
 typedef void* database_t;
 
+struct storage_options;
+
 /*
-* Create database.
+* Create database, the options select how the storage accesses the file, NULL
+* selects the stream mode.
 * 
 * @return	database handle on success or return NULL and set properly errno 
 *			on error.
 */
 extern database_t database_init(
-	const char *filename
+	const char *filename,
+	const struct storage_options* options
+);
+
+/*
+* Open the sealed show stored in the segment file, its map and its bookings
+* are served from the runs of the mapped segment, decoding only those a query
+* reads, and every query changing them fails.
+*
+* @return	database handle on success or return NULL and set properly errno
+*			on error.
+*/
+extern database_t database_open_sealed(
+	const char* filename
 );
 
 /*
@@ -31,3 +49,60 @@ extern int database_execute(
 	const char *query, 
 	char **result
 );
+
+/*
+* Get the ID of the booking linked to the seat, 0 if the seat is free.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int database_seat_get(
+	const database_t handle,
+	const int seat,
+	int* id
+);
+
+/*
+* Link the seat to the new ID only if it is still linked to the expected one,
+* set the swapped parameter.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int database_seat_cas(
+	const database_t handle,
+	const int seat,
+	const int expected_id,
+	const int new_id,
+	int* swapped
+);
+
+/*
+* Allocate a new booking ID.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int database_next_id(
+	const database_t handle,
+	int* id
+);
+
+/*
+* Estimate the memory held by the database for the storage, the snapshot of
+* the hall and the booking index, or for the mapped segment of a sealed show.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int database_memory(
+	const database_t handle,
+	size_t* bytes
+);
+
+/*
+* Write the current map of the hall and its bookings to a segment file which
+* database_open_sealed serves, no booking must be in flight.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int database_seal(
+	const database_t handle,
+	const char* filename
+);
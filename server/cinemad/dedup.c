@@ -0,0 +1,231 @@
+#include "dedup.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <try.h>
+
+#define NO_ENTRY SIZE_MAX
+
+/*
+* The entries are claimed in a ring following the arrival order of the
+* requests, so the slot to reuse is always the oldest one. A hash table of
+* chained entry indexes finds the entry linked to a token.
+*/
+
+enum entry_state {
+	ENTRY_FREE,
+	ENTRY_CLAIMED,
+	ENTRY_DONE
+};
+
+struct entry {
+	char token[DEDUP_TOKEN_LEN + 1];
+	enum entry_state state;
+	char* result;
+	time_t expiration;
+	size_t next;
+};
+
+struct dedup {
+	struct entry* entries;
+	size_t capacity;
+	size_t* buckets;
+	size_t n_buckets;
+	size_t head;
+	time_t ttl;
+	pthread_mutex_t mutex;
+	pthread_cond_t released;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static size_t hash(const char* token, const size_t n_buckets);
+static size_t find_entry(const struct dedup* dedup, const char* token);
+static void unlink_entry(struct dedup* dedup, const size_t i);
+static time_t now(void);
+
+extern dedup_t dedup_init(const size_t capacity, const time_t ttl) {
+	struct dedup* dedup;
+	dedup = calloc(1, sizeof * dedup);
+	if (dedup) {
+		dedup->capacity = capacity;
+		dedup->n_buckets = 1;
+		while (dedup->n_buckets < 2 * capacity) {
+			dedup->n_buckets *= 2;
+		}
+		try(dedup->entries = calloc(capacity, sizeof * dedup->entries), NULL, error);
+		try(dedup->buckets = malloc(sizeof * dedup->buckets * dedup->n_buckets), NULL, cleanup1);
+		for (size_t i = 0; i < dedup->n_buckets; i++) {
+			dedup->buckets[i] = NO_ENTRY;
+		}
+		dedup->head = 0;
+		dedup->ttl = ttl;
+		try_pthread_mutex_init(&dedup->mutex, cleanup2);
+		try_pthread(pthread_cond_init(&dedup->released, NULL), cleanup3);
+	}
+	return dedup;
+
+cleanup3:
+	pthread_mutex_destroy(&dedup->mutex);
+cleanup2:
+	free(dedup->buckets);
+cleanup1:
+	free(dedup->entries);
+error:
+	free(dedup);
+	return NULL;
+}
+
+extern int dedup_destroy(const dedup_t handle) {
+	struct dedup* dedup = (struct dedup*)handle;
+
+	try_pthread(pthread_cond_destroy(&dedup->released), error);
+	try_pthread_mutex_destroy(&dedup->mutex, error);
+	for (size_t i = 0; i < dedup->capacity; i++) {
+		free(dedup->entries[i].result);
+	}
+	free(dedup->buckets);
+	free(dedup->entries);
+	free(dedup);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int dedup_claim(const dedup_t handle, const char* token, int* claimed, char** result) {
+	struct dedup* dedup = (struct dedup*)handle;
+
+	size_t i;
+	if (strlen(token) > DEDUP_TOKEN_LEN) {
+		errno = EINVAL;
+		return 1;
+	}
+	try_pthread_mutex_lock(&dedup->mutex, error);
+	for (;;) {
+		if ((i = find_entry(dedup, token)) != NO_ENTRY) {
+			struct entry* entry = &dedup->entries[i];
+			if (entry->state == ENTRY_CLAIMED) {
+				try_pthread(pthread_cond_wait(&dedup->released, &dedup->mutex), unlock);
+				continue;
+			}
+			if (entry->expiration > now()) {
+				try(*result = strdup(entry->result), NULL, unlock);
+				*claimed = 0;
+				break;
+			}
+			unlink_entry(dedup, i);
+		}
+		// the oldest entry is reused, a request still in flight is waited for
+		struct entry* entry = &dedup->entries[dedup->head];
+		if (entry->state == ENTRY_CLAIMED) {
+			try_pthread(pthread_cond_wait(&dedup->released, &dedup->mutex), unlock);
+			continue;
+		}
+		if (entry->state == ENTRY_DONE) {
+			unlink_entry(dedup, dedup->head);
+		}
+		strcpy(entry->token, token);
+		entry->state = ENTRY_CLAIMED;
+		size_t bucket = hash(token, dedup->n_buckets);
+		entry->next = dedup->buckets[bucket];
+		dedup->buckets[bucket] = dedup->head;
+		dedup->head = (dedup->head + 1) % dedup->capacity;
+		*claimed = 1;
+		break;
+	}
+	try_pthread_mutex_unlock(&dedup->mutex, error);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&dedup->mutex);
+error:
+	return 1;
+}
+
+extern int dedup_complete(const dedup_t handle, const char* token, const char* result) {
+	struct dedup* dedup = (struct dedup*)handle;
+
+	size_t i;
+	char* copy;
+	try(copy = strdup(result), NULL, error);
+	try_pthread_mutex_lock(&dedup->mutex, cleanup);
+	if ((i = find_entry(dedup, token)) != NO_ENTRY) {
+		dedup->entries[i].result = copy;
+		dedup->entries[i].expiration = now() + dedup->ttl;
+		dedup->entries[i].state = ENTRY_DONE;
+		copy = NULL;
+	}
+	try_pthread(pthread_cond_broadcast(&dedup->released), unlock);
+	try_pthread_mutex_unlock(&dedup->mutex, cleanup);
+	free(copy);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&dedup->mutex);
+cleanup:
+	free(copy);
+error:
+	return 1;
+}
+
+extern int dedup_release(const dedup_t handle, const char* token) {
+	struct dedup* dedup = (struct dedup*)handle;
+
+	size_t i;
+	try_pthread_mutex_lock(&dedup->mutex, error);
+	if ((i = find_entry(dedup, token)) != NO_ENTRY) {
+		unlink_entry(dedup, i);
+	}
+	try_pthread(pthread_cond_broadcast(&dedup->released), unlock);
+	try_pthread_mutex_unlock(&dedup->mutex, error);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&dedup->mutex);
+error:
+	return 1;
+}
+
+/*
+* FNV-1a hashing of the token, n_buckets is always a power of two.
+*/
+static size_t hash(const char* token, const size_t n_buckets) {
+	uint32_t hash = 2166136261u;
+	for (const unsigned char* c = (const unsigned char*)token; *c; c++) {
+		hash = (hash ^ *c) * 16777619u;
+	}
+	return (size_t)hash & (n_buckets - 1);
+}
+
+static size_t find_entry(const struct dedup* dedup, const char* token) {
+	size_t i = dedup->buckets[hash(token, dedup->n_buckets)];
+	while (i != NO_ENTRY && strcmp(dedup->entries[i].token, token)) {
+		i = dedup->entries[i].next;
+	}
+	return i;
+}
+
+/*
+* Remove the entry from its chain and free it.
+*/
+static void unlink_entry(struct dedup* dedup, const size_t i) {
+	size_t* link = &dedup->buckets[hash(dedup->entries[i].token, dedup->n_buckets)];
+	while (*link != i) {
+		link = &dedup->entries[*link].next;
+	}
+	*link = dedup->entries[i].next;
+	free(dedup->entries[i].result);
+	dedup->entries[i].result = NULL;
+	dedup->entries[i].state = ENTRY_FREE;
+}
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
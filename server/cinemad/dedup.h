@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <time.h>
+
+#define DEDUP_TOKEN_LEN 64
+
+typedef void* dedup_t;
+
+/*
+* Create a dedup table remembering the result of at most capacity requests,
+* a result expires ttl seconds after it has been stored.
+*
+* @return	dedup handle on success or return NULL and set properly errno
+*			on error.
+*/
+extern dedup_t dedup_init(
+	const size_t capacity,
+	const time_t ttl
+);
+
+/*
+* Destroy the dedup table, no request must be in flight.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int dedup_destroy(
+	const dedup_t handle
+);
+
+/*
+* Claim the token for the calling request. If a result is still stored for
+* the token set the result parameter to a copy of it and claimed to 0,
+* otherwise set claimed to 1 and the caller must either complete or release
+* the token. A request presenting a token claimed by another request waits
+* until the token is completed or released.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int dedup_claim(
+	const dedup_t handle,
+	const char* token,
+	int* claimed,
+	char** result
+);
+
+/*
+* Store the result of the request which claimed the token.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int dedup_complete(
+	const dedup_t handle,
+	const char* token,
+	const char* result
+);
+
+/*
+* Forget the token claimed by a request which could not be executed.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int dedup_release(
+	const dedup_t handle,
+	const char* token
+);
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <time.h>
+
+#include "storage.h"
+
+/*
+* The operations of a storage engine, the storage forwards every call to the
+* engine selected by its options. The handle returned by init is opaque to
+* the storage and is passed back to every other operation, the operations
+* follow the contract of the storage function of the same name.
+*/
+struct engine {
+	void* (*init)(const char* filename, const struct storage_options* options);
+	int (*close)(void* handle);
+	int (*store_batch)(void* handle, const size_t n, const char** keys, const char** values, char** result);
+	int (*store_ints)(void* handle, const size_t n, const unsigned long* keys, const long* values);
+	int (*store_number)(void* handle, const char* key, const long value);
+	int (*checkpoint)(void* handle);
+	int (*backup)(void* handle, const char* filename);
+	int (*get_stats)(void* handle, struct storage_stats* stats);
+	int (*load)(void* handle, const char* key, char** result);
+	int (*load_int)(void* handle, const unsigned long key, long* value);
+	int (*load_number)(void* handle, const char* key, long* value);
+	int (*foreach)(void* handle, storage_foreach_function* function, void* context);
+	int (*lock_shared)(void* handle, const char* key);
+	int (*lock_exclusive)(void* handle, const char* key);
+	int (*lock_exclusive_timed)(void* handle, const char* key, const struct timespec* deadline);
+	int (*unlock)(void* handle, const char* key);
+	int (*lock_shared_int)(void* handle, const unsigned long key);
+	int (*lock_exclusive_int)(void* handle, const unsigned long key);
+	int (*lock_exclusive_timed_int)(void* handle, const unsigned long key, const struct timespec* deadline);
+	int (*unlock_int)(void* handle, const unsigned long key);
+};
+
+/*
+* Write the image to a temporary file which atomically replaces the file once
+* it is durable, the engines write their checkpoints and backups with it
+* and the sealed shows their segments.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int engine_write_file(
+	const char* filename,
+	const char* image,
+	const size_t size
+);
+
+/*
+* Make the entry of the file in its directory durable.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int engine_sync_directory(
+	const char* filename
+);
+
+/*
+* The records live in the data file, read and written as selected by the
+* mode of the options.
+*/
+extern const struct engine file_engine;
+
+/*
+* The records live in memory only. The data file, if it exists, seeds the
+* records at startup and is never written, a backup is the only way to
+* persist them. The file must be of the current version of the format, the
+* file engine upgrades the older ones.
+*/
+extern const struct engine memory_engine;
+
+/*
+* The stores are logged and buffered in memory, then written to immutable
+* runs sorted by key which a background thread merges level by level. The
+* data file becomes the list of the runs, which live next to it with their
+* logs; a data file of records is imported into runs at startup.
+*/
+extern const struct engine lsm_engine;
@@ -0,0 +1,2553 @@
+#include "engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#include <try.h>
+
+#include "index_table.h"
+#include "record.h"
+#include "wal.h"
+
+#define GROW_STEP (1 << 20)
+#define WAL_INTERVAL 10
+#define INT_PAGE_BITS 12
+#define INT_PAGE_LEN (1UL << INT_PAGE_BITS)
+#define INT_PAGES (RECORD_INT_KEYS >> INT_PAGE_BITS)
+#define LOAD_THREADS_MAX 16
+#define FLUSH_PAGE_LEN 4096
+#define FLUSH_THRESHOLD (1UL << 20)
+#define SCRUB_CHUNK_LEN (64 * 1024)
+#define LOAD_CHUNK_MIN (1L << 22)	// bytes of records parsed by a loader thread at least
+#define LEGACY_FIELD_LEN 16
+#define LEGACY_RECORD_LEN (2 * LEGACY_FIELD_LEN)
+
+/*
+* Live records gathered by a checkpoint, the image holds the records of the
+* integer key space followed by those of the name key space, both in the
+* order of their keys.
+*/
+struct compaction {
+	const char* buffer_cache;
+	char* image;
+	size_t size;
+	struct index_record** records;
+	long* offsets;	// offset of every gathered record in the image
+	size_t n_records;
+};
+
+/*
+* State of a storage_foreach, error holds the errno of the record which
+* stopped it.
+*/
+struct iteration {
+	const char* buffer_cache;
+	storage_foreach_function* function;
+	void* context;
+	int error;
+};
+
+/*
+* The offset is the start of the record in the file, it is atomic because a
+* checkpoint moves the records while the lock free paths test it for -1. The
+* lock is the one taken by the callers, the mutex orders the stores of the
+* record in the log, the file and the buffer cache.
+*/
+struct index_record {
+	atomic_long offset;
+	pthread_rwlock_t lock;
+	pthread_mutex_t mutex;
+};
+
+typedef _Atomic(struct index_record*) int_slot_t;
+
+/*
+* A record of the name key space found by the startup loader.
+*/
+struct load_entry {
+	char* key;
+	struct index_record* record;
+};
+
+/*
+* The range of the buffer cache parsed by a loader thread. The records of
+* the name key space found in the range are left in entries sorted by key,
+* error holds the errno of a failure.
+*/
+struct load_chunk {
+	struct storage* storage;
+	size_t begin;
+	size_t end;
+	struct load_entry* entries;
+	size_t n;
+	int error;
+};
+
+/*
+* The buffer cache holds the header and the records, buffer_cache_size is
+* their length and capacity the length of the buffer. In mmap mode the buffer
+* cache is the mapping of the file and the rest of the file is preallocated
+* space filled with zeros, in stream mode it is a copy of the file whose
+* records are written with positional writes on the same descriptor.
+*
+* A store holds the mutexes of its records, a store which only overwrites
+* records holds lock_buffer_cache as shared so that the stores of different
+* records proceed in parallel. A store which appends records holds it as
+* exclusive, since it moves the end of the records and can grow or remap
+* the buffer cache.
+*
+* The records of the name key space are indexed by the index table, those of
+* the integer key space by a two level table addressed by the key. Its pages
+* and records are published with a compare and swap on their first use and
+* live as long as the storage, so they are looked up without any lock.
+*
+* When the stores are logged every store appends one record holding all of
+* its writes to the write-ahead log and commits it before it is applied, so
+* no write reaches the file before the record which redoes it is durable.
+* Holding the mutexes of its records across the three keeps the order of
+* the log equal to the order of the applied stores of every record. The
+* stores hold lock_log as shared, a checkpoint holds it as exclusive to wait
+* for the stores already logged. The log is emptied whenever the file is
+* made durable. A commit does not sync the log in WAL_SYNC_INTERVAL and
+* WAL_SYNC_NONE modes, there log_ahead is set and the file is written back:
+* a flush syncs the log before writing the dirty pages.
+*
+* In write-back mode dirty holds a flag for every page of the buffer cache,
+* set by the stores under lock_buffer_cache and cleared by a flush which
+* copies the dirty pages holding it as exclusive and writes them after
+* releasing it. mutex_write_back serializes the flushes and is taken before
+* lock_buffer_cache, a checkpoint holds it so that no flush writes to the
+* file it replaces. The counters of the flushes are guarded by mutex_flush.
+* An append can reallocate dirty, so the paths which only check the mode
+* without holding lock_buffer_cache test write_back, set once at startup.
+*
+* The scrubber reads the file a chunk at a time holding lock_buffer_cache as
+* shared, so that no checkpoint replaces the file meanwhile; every checkpoint
+* changes the generation and restarts the pass. A record read while it was
+* written can look corrupt, so a mismatch is checked again excluding every
+* writer and flush.
+*
+* A backup holds lock_buffer_cache as exclusive only to copy the records,
+* the copy is written to the backup file after releasing it. mutex_backup
+* serializes the backups, so that two of them never share a temporary file.
+*
+* A checkpoint excludes every reader and writer, rewrites the live records in
+* the order of their keys to a new file which replaces the old one, then
+* empties the log. A restart loads the compacted file and replays only the
+* stores logged after the last checkpoint.
+*/
+struct storage {
+	char* buffer_cache;
+	long buffer_cache_size;
+	index_table_t index_table;
+	_Atomic(int_slot_t*) int_pages[INT_PAGES];
+	pthread_rwlock_t lock_buffer_cache;
+	enum storage_mode mode;
+	enum storage_sync sync;
+	int fd;
+	size_t capacity;
+	size_t grow_step;
+	wal_t wal;
+	pthread_rwlock_t lock_log;
+	char* filename;
+	long checkpoint_interval;
+	int stopping;
+	pthread_mutex_t mutex_checkpoint;
+	pthread_cond_t checkpoint;
+	pthread_t checkpointer;
+	long flush_interval;
+	size_t flush_threshold;
+	int write_back;
+	int log_ahead;
+	atomic_uchar* dirty;
+	size_t capacity_pages;
+	atomic_size_t n_dirty;
+	pthread_mutex_t mutex_write_back;
+	int flusher_stopping;
+	pthread_mutex_t mutex_flush;
+	pthread_cond_t flush;
+	pthread_t flusher;
+	unsigned long flushes;
+	size_t flushed_bytes;
+	unsigned long flush_latency_last;
+	unsigned long flush_latency_total;
+	unsigned long flush_latency_max;
+	int verify_reads;
+	long scrub_rate;
+	unsigned long generation;
+	int scrubber_stopping;
+	pthread_mutex_t mutex_scrub;
+	pthread_cond_t scrub;
+	pthread_t scrubber;
+	atomic_ulong scrub_passes;
+	atomic_size_t scrubbed_bytes;
+	atomic_ulong corrupt_records;
+	atomic_ulong repaired_records;
+	pthread_mutex_t mutex_backup;
+	atomic_ulong backups;
+	atomic_ulong backup_stall_last;
+	atomic_ulong backup_stall_max;
+};
+
+/*
+* The position of the scrubber in the pass over the file.
+*/
+struct scrub_cursor {
+	char* chunk;
+	long offset;
+	unsigned long generation;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static storage_t file_init(const char* filename, const struct storage_options* options);
+static int file_close(const storage_t handle);
+static int file_store_batch(const storage_t handle, const size_t n, const char** keys, const char** values, char** result);
+static int file_store_ints(const storage_t handle, const size_t n, const unsigned long* keys, const long* values);
+static int file_store_number(const storage_t handle, const char* key, const long value);
+static int file_checkpoint(const storage_t handle);
+static int file_backup(const storage_t handle, const char* filename);
+static int file_get_stats(const storage_t handle, struct storage_stats* stats);
+static int file_load(const storage_t handle, const char* key, char** result);
+static int file_load_int(const storage_t handle, const unsigned long key, long* value);
+static int file_load_number(const storage_t handle, const char* key, long* value);
+static int file_foreach(const storage_t handle, storage_foreach_function* function, void* context);
+static int file_lock_shared(const storage_t handle, const char* key);
+static int file_lock_exclusive(const storage_t handle, const char* key);
+static int file_lock_exclusive_timed(const storage_t handle, const char* key, const struct timespec* deadline);
+static int file_unlock(const storage_t handle, const char* key);
+static int file_lock_shared_int(const storage_t handle, const unsigned long key);
+static int file_lock_exclusive_int(const storage_t handle, const unsigned long key);
+static int file_lock_exclusive_timed_int(const storage_t handle, const unsigned long key, const struct timespec* deadline);
+static int file_unlock_int(const storage_t handle, const unsigned long key);
+static int lexicographical_comparison(const void* key1, const void* key2);
+static int prepare_file(const storage_t handle);
+static int migrate_file(const storage_t handle, const unsigned long version);
+static int update_buffer_cache(const storage_t handle);
+static int load_table(const storage_t handle, const size_t limit);
+static size_t split_records(const storage_t handle, const size_t end, struct load_chunk* chunks);
+static void* load_chunk(void* arg);
+static int load_entry_comparison(const void* entry1, const void* entry2);
+static struct load_entry* merge_runs(struct load_chunk* chunks, const size_t n_chunks, size_t* n);
+static index_record_t record_init();
+static int record_destroy(void* key, void* value);
+static struct index_record* int_record(const storage_t handle, const unsigned long key, const int create);
+static int destroy_int_records(const storage_t handle);
+static struct index_record* find_record(const storage_t handle, const struct record* record, const int create);
+static int load_value_number(const storage_t handle, const struct index_record* record, long* value);
+static int visit_record(void* key, void* value, void* context);
+static int lock_timed(struct index_record* record, const struct timespec* deadline);
+static int map_file(const storage_t handle);
+static int reserve(const storage_t handle, const size_t n_bytes);
+static int write_records(const storage_t handle, const size_t n, const struct record* records, struct index_record** index_records, const size_t new_bytes);
+static int sync_range(const storage_t handle, const long first, const long last);
+static int truncate_padding(const storage_t handle);
+static int pread_all(const int fd, char* bytes, const size_t length, const off_t offset);
+static int pwrite_all(const int fd, const char* bytes, const size_t length, const off_t offset);
+static int find_records(const storage_t handle, const struct record* records, const size_t n, struct index_record*** index_records, size_t* new_bytes);
+static struct index_record** lock_records(struct index_record** index_records, const size_t n, size_t* n_locked);
+static void unlock_records(struct index_record** locked, const size_t n_locked);
+static int record_address_comparison(const void* record1, const void* record2);
+static int store_records(const storage_t handle, const struct record* records, const size_t n);
+static int log_and_store(const storage_t handle, const struct record* records, const size_t n);
+static int open_log(const storage_t handle, const char* filename, const struct storage_options* options);
+static int replay_record(void* context, const char* payload, const size_t length);
+static int sync_file(const storage_t handle);
+static void collect_int_records(const storage_t handle, struct compaction* compaction);
+static int collect_record(void* key, void* value, void* context);
+static int replace_file(const storage_t handle, char* image, const size_t size);
+static int start_checkpointer(const storage_t handle);
+static int write_back(const storage_t handle, const long offset, const size_t length);
+static int mark_dirty(const storage_t handle, const long offset, const size_t length);
+static int resize_dirty(const storage_t handle, const size_t capacity);
+static int flush_dirty(const storage_t handle);
+static int start_flusher(const storage_t handle);
+static int stop_flusher(const storage_t handle);
+static void* flusher_routine(void* arg);
+static void* checkpointer_routine(void* arg);
+static int verify_read(const storage_t handle, const char* bytes);
+static int scrub_chunk(const storage_t handle, struct scrub_cursor* cursor);
+static int check_record(const storage_t handle, const unsigned long generation, const long offset);
+static int start_scrubber(const storage_t handle);
+static int stop_scrubber(const storage_t handle);
+static void* scrubber_routine(void* arg);
+static size_t int_memory(const storage_t handle);
+
+static storage_t file_init(const char* filename, const struct storage_options* options) {
+	struct storage* storage;
+	storage = calloc(1, sizeof * storage);
+	if (storage) {
+		storage->buffer_cache = NULL;
+		storage->buffer_cache_size = 0;
+		storage->mode = options ? options->mode : STORAGE_STREAM;
+		storage->sync = options ? options->sync : STORAGE_SYNC_NONE;
+		storage->grow_step = (options && options->grow_step) ? options->grow_step : GROW_STEP;
+		storage->fd = -1;
+		storage->checkpoint_interval = options ? options->checkpoint_interval : 0;
+		storage->flush_interval = (options && storage->mode == STORAGE_STREAM) ? options->flush_interval : 0;
+		storage->flush_threshold = (options && options->flush_threshold) ? options->flush_threshold : FLUSH_THRESHOLD;
+		storage->verify_reads = options ? options->verify_reads : 0;
+		storage->scrub_rate = options ? options->scrub_rate : 0;
+		// a commit which does not sync the log keeps the stores out of the file until a flush syncs it
+		if (options && options->wal && (options->wal_sync == WAL_SYNC_INTERVAL || options->wal_sync == WAL_SYNC_NONE)) {
+			if (storage->mode == STORAGE_MMAP) {
+				errno = EINVAL;
+				goto error;
+			}
+			storage->log_ahead = 1;
+			if (storage->flush_interval <= 0) {
+				storage->flush_interval = options->wal_interval ? options->wal_interval : WAL_INTERVAL;
+			}
+		}
+		try(storage->filename = strdup(filename), NULL, error);
+		try(storage->fd = open(filename, O_RDWR), -1, error);
+		try(prepare_file(storage), !0, cleanup1);
+		try_pthread_rwlock_init(&storage->lock_buffer_cache, cleanup1);
+		try_pthread_mutex_init(&storage->mutex_backup, cleanup3);
+		try(storage->index_table = index_table_init(&record_init, &record_destroy, &lexicographical_comparison), NULL, cleanup4);
+		if (storage->mode == STORAGE_MMAP) {
+			try(map_file(storage), !0, cleanup5);
+			try(load_table(storage, storage->capacity), !0, cleanup6);
+		}
+		else {
+			// the index is built from the buffer cache read with a single pass
+			try(update_buffer_cache(storage), !0, cleanup5);
+			try(load_table(storage, (size_t)storage->buffer_cache_size), !0, cleanup7);
+			try(truncate_padding(storage), !0, cleanup7);
+			if (storage->flush_interval > 0) {
+				try(start_flusher(storage), !0, cleanup7);
+			}
+		}
+		if (options && options->wal) {
+			try(open_log(storage, filename, options), !0, cleanup9);
+		}
+		if (storage->scrub_rate > 0) {
+			try(start_scrubber(storage), !0, cleanup8);
+		}
+		if (storage->checkpoint_interval > 0) {
+			try(start_checkpointer(storage), !0, cleanup10);
+		}
+	}
+	return storage;
+	// This is still quite broken
+cleanup10:
+	if (storage->scrub_rate > 0) {
+		stop_scrubber(storage);
+	}
+cleanup8:
+	if (storage->wal) {
+		wal_close(storage->wal);
+		pthread_rwlock_destroy(&storage->lock_log);
+	}
+cleanup9:
+	if (storage->write_back) {
+		stop_flusher(storage);
+	}
+cleanup7:
+	if (storage->mode == STORAGE_STREAM) {
+		free(storage->buffer_cache);
+		goto cleanup5;
+	}
+cleanup6:
+	munmap(storage->buffer_cache, storage->capacity);
+	storage->buffer_cache = NULL;
+cleanup5:
+	{
+		int error = errno;
+		index_table_destroy(storage->index_table);
+		destroy_int_records(storage);
+		errno = error;
+	}
+cleanup4:
+	pthread_mutex_destroy(&storage->mutex_backup);
+cleanup3:
+	pthread_rwlock_destroy(&storage->lock_buffer_cache);
+cleanup1:
+	close(storage->fd);
+error:
+	free(storage->filename);
+	free(storage);
+	return NULL;
+}
+
+static int file_close(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	if (storage->scrub_rate > 0) {
+		try(stop_scrubber(storage), !0, error);
+	}
+	if (storage->checkpoint_interval > 0) {
+		try_pthread_mutex_lock(&storage->mutex_checkpoint, error);
+		storage->stopping = 1;
+		try_pthread(pthread_cond_signal(&storage->checkpoint), error);
+		try_pthread_mutex_unlock(&storage->mutex_checkpoint, error);
+		try_pthread(pthread_join(storage->checkpointer, NULL), error);
+		try_pthread(pthread_cond_destroy(&storage->checkpoint), error);
+		try_pthread_mutex_destroy(&storage->mutex_checkpoint, error);
+	}
+	if (storage->write_back) {
+		try(stop_flusher(storage), !0, error);
+	}
+	if (storage->wal) {
+		// the logged stores are in the file once it is durable
+		try(sync_file(storage), !0, error);
+		try(wal_reset(storage->wal), !0, error);
+		try(wal_close(storage->wal), !0, error);
+		try_pthread_rwlock_destroy(&storage->lock_log, error);
+	}
+	try_pthread_rwlock_destroy(&storage->lock_buffer_cache, error);
+	try_pthread_mutex_destroy(&storage->mutex_backup, error);
+	index_table_destroy(storage->index_table);
+	try(destroy_int_records(storage), !0, error);
+	if (storage->mode == STORAGE_MMAP) {
+		// the preallocated space is given back so that the file holds only records
+		try(msync(storage->buffer_cache, storage->capacity, MS_SYNC), -1, error);
+		try(munmap(storage->buffer_cache, storage->capacity), -1, error);
+		try(ftruncate(storage->fd, storage->buffer_cache_size), -1, error);
+		try(close(storage->fd), -1, error);
+		free(storage->filename);
+		free(storage);
+		return 0;
+	}
+	try(close(storage->fd), -1, error);
+	free(storage->buffer_cache);
+	free(storage->filename);
+	free(storage);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int file_store_batch(const storage_t handle, const size_t n, const char** keys, const char** values, char** result) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct record* records;
+
+	try(records = malloc(sizeof * records * (n + 1)), NULL, error);
+	for (size_t i = 0; i < n; i++) {
+		// a key or a value which can not be represented fails the whole batch
+		if (record_encode(keys[i], values[i], &records[i])) {
+			free(records);
+			*result = strdup(MSG_FAIL);
+			return 0;
+		}
+	}
+	try(log_and_store(storage, records, n), !0, cleanup);
+	free(records);
+	*result = strdup(MSG_SUCC);
+	return 0;
+
+cleanup:
+	free(records);
+error:
+	return 1;
+}
+
+static int file_store_ints(const storage_t handle, const size_t n, const unsigned long* keys, const long* values) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct record* records;
+
+	for (size_t i = 0; i < n; i++) {
+		if (keys[i] >= RECORD_INT_KEYS) {
+			errno = EINVAL;
+			return 1;
+		}
+	}
+	try(records = malloc(sizeof * records * (n + 1)), NULL, error);
+	for (size_t i = 0; i < n; i++) {
+		record_encode_int(keys[i], values[i], &records[i]);
+	}
+	try(log_and_store(storage, records, n), !0, cleanup);
+	free(records);
+	return 0;
+
+cleanup:
+	free(records);
+error:
+	return 1;
+}
+
+static int file_store_number(const storage_t handle, const char* key, const long value) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct record record;
+
+	try(record_encode_number(key, value, &record), !0, error);
+	try(log_and_store(storage, &record, 1), !0, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int file_checkpoint(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct compaction compaction;
+	size_t max_records;
+
+	if (storage->wal) {
+		try_pthread_rwlock_wrlock(&storage->lock_log, error);
+	}
+	if (storage->write_back) {
+		try_pthread_mutex_lock(&storage->mutex_write_back, cleanup1);
+	}
+	try_pthread_rwlock_wrlock(&storage->lock_buffer_cache, cleanup3);
+	compaction.buffer_cache = storage->buffer_cache;
+	compaction.image = NULL;
+	compaction.records = NULL;
+	compaction.offsets = NULL;
+	compaction.size = RECORD_HEADER_LEN;
+	compaction.n_records = 0;
+	max_records = (size_t)storage->buffer_cache_size / RECORD_MIN_LEN + 1;
+	try(compaction.image = calloc(1, (size_t)storage->buffer_cache_size + 1), NULL, cleanup2);
+	try(compaction.records = calloc(max_records, sizeof * compaction.records), NULL, cleanup2);
+	try(compaction.offsets = calloc(max_records, sizeof * compaction.offsets), NULL, cleanup2);
+	record_write_header(compaction.image);
+	collect_int_records(storage, &compaction);
+	try(index_table_foreach(storage->index_table, &collect_record, &compaction), !0, cleanup2);
+	try(engine_write_file(storage->filename, compaction.image, compaction.size), !0, cleanup2);
+	try(replace_file(storage, compaction.image, compaction.size), !0, cleanup2);
+	// the image belongs to the storage from now on
+	compaction.image = NULL;
+	for (size_t i = 0; i < compaction.n_records; i++) {
+		compaction.records[i]->offset = compaction.offsets[i];
+	}
+	if (storage->wal) {
+		try(wal_reset(storage->wal), !0, cleanup2);
+	}
+	free(compaction.offsets);
+	free(compaction.records);
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+	if (storage->write_back) {
+		pthread_mutex_unlock(&storage->mutex_write_back);
+	}
+	if (storage->wal) {
+		pthread_rwlock_unlock(&storage->lock_log);
+	}
+	return 0;
+
+cleanup2:
+	free(compaction.offsets);
+	free(compaction.records);
+	free(compaction.image);
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+cleanup3:
+	if (storage->write_back) {
+		pthread_mutex_unlock(&storage->mutex_write_back);
+	}
+cleanup1:
+	if (storage->wal) {
+		pthread_rwlock_unlock(&storage->lock_log);
+	}
+error:
+	return 1;
+}
+
+static int file_backup(const storage_t handle, const char* filename) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct stat file_stat;
+	struct stat backup_stat;
+	struct timespec start;
+	struct timespec end;
+	unsigned long stall;
+	char* image;
+	size_t size;
+
+	// a checkpoint replaces the descriptor but never the name of the file
+	try(stat(storage->filename, &file_stat), -1, error);
+	// replacing the file of the storage would detach it from its descriptor
+	if (!stat(filename, &backup_stat) && backup_stat.st_dev == file_stat.st_dev && backup_stat.st_ino == file_stat.st_ino) {
+		errno = EINVAL;
+		return 1;
+	}
+	try_pthread_mutex_lock(&storage->mutex_backup, error);
+	try_pthread_rwlock_wrlock(&storage->lock_buffer_cache, cleanup1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size = (size_t)storage->buffer_cache_size;
+	if ((image = malloc(size + 1)) == NULL) {
+		pthread_rwlock_unlock(&storage->lock_buffer_cache);
+		goto cleanup1;
+	}
+	memcpy(image, storage->buffer_cache, size);
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stall = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+	try(engine_write_file(filename, image, size), !0, cleanup2);
+	atomic_fetch_add(&storage->backups, 1);
+	atomic_store(&storage->backup_stall_last, stall);
+	if (stall > atomic_load(&storage->backup_stall_max)) {
+		atomic_store(&storage->backup_stall_max, stall);
+	}
+	free(image);
+	try_pthread_mutex_unlock(&storage->mutex_backup, error);
+	return 0;
+
+cleanup2:
+	free(image);
+cleanup1:
+	pthread_mutex_unlock(&storage->mutex_backup);
+error:
+	return 1;
+}
+
+static int file_get_stats(const storage_t handle, struct storage_stats* stats) {
+	struct storage* storage = (struct storage*)handle;
+
+	memset(stats, 0, sizeof * stats);
+	stats->scrub_passes = atomic_load(&storage->scrub_passes);
+	stats->scrubbed_bytes = atomic_load(&storage->scrubbed_bytes);
+	stats->corrupt_records = atomic_load(&storage->corrupt_records);
+	stats->repaired_records = atomic_load(&storage->repaired_records);
+	stats->backups = atomic_load(&storage->backups);
+	stats->backup_stall_last = atomic_load(&storage->backup_stall_last);
+	stats->backup_stall_max = atomic_load(&storage->backup_stall_max);
+	try_pthread_rwlock_rdlock(&storage->lock_buffer_cache, error);
+	stats->memory_bytes = (size_t)storage->buffer_cache_size + storage->capacity_pages + int_memory(storage);
+	try_pthread_rwlock_unlock(&storage->lock_buffer_cache, error);
+	if (!storage->write_back) {
+		return 0;
+	}
+	stats->dirty_bytes = atomic_load(&storage->n_dirty) * FLUSH_PAGE_LEN;
+	try_pthread_mutex_lock(&storage->mutex_flush, error);
+	stats->flushes = storage->flushes;
+	stats->flushed_bytes = storage->flushed_bytes;
+	stats->flush_latency_last = storage->flush_latency_last;
+	stats->flush_latency_avg = storage->flushes ? storage->flush_latency_total / storage->flushes : 0;
+	stats->flush_latency_max = storage->flush_latency_max;
+	try_pthread_mutex_unlock(&storage->mutex_flush, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int file_load(const storage_t handle, const char* key, char** result) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct record record;
+	struct index_record* index_record;
+	long offset;
+
+	if (record_encode_key(key, &record)) {
+		goto fail;
+	}
+	if ((index_record = find_record(storage, &record, 0)) == NULL) {
+		if (errno == ENOENT) {
+			goto fail;
+		}
+		goto error;
+	}
+	// the offset is read under the lock because a checkpoint moves the records
+	try_pthread_rwlock_rdlock(&storage->lock_buffer_cache, error);
+	if ((offset = index_record->offset) == -1) {
+		// the record is dropped by storage_unlock, the caller still holds its lock
+		try_pthread_rwlock_unlock(&storage->lock_buffer_cache, error);
+		goto fail;
+	}
+	try(verify_read(storage, &storage->buffer_cache[offset]), !0, unlock);
+	try(record_value_string(&storage->buffer_cache[offset], result), !0, unlock);
+	try_pthread_rwlock_unlock(&storage->lock_buffer_cache, error);
+	return 0;
+
+fail:
+	*result = strdup(MSG_FAIL);
+	return 0;
+unlock:
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+error:
+	return 1;
+}
+
+static int file_load_int(const storage_t handle, const unsigned long key, long* value) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct index_record* record;
+
+	try(record = int_record(storage, key, 0), NULL, error);
+	return load_value_number(storage, record, value);
+
+error:
+	return 1;
+}
+
+static int file_load_number(const storage_t handle, const char* key, long* value) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct record record;
+	struct index_record* index_record;
+
+	try(record_encode_key(key, &record), !0, error);
+	try(index_record = find_record(storage, &record, 0), NULL, error);
+	return load_value_number(storage, index_record, value);
+
+error:
+	return 1;
+}
+
+static int file_foreach(const storage_t handle, storage_foreach_function* function, void* context) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct iteration iteration = { NULL, function, context, 0 };
+	int ret = 0;
+
+	// the overwrites hold the lock as shared, an exclusive hold waits for them
+	try_pthread_rwlock_wrlock(&storage->lock_buffer_cache, error);
+	iteration.buffer_cache = storage->buffer_cache;
+	for (size_t i = 0; !ret && i < INT_PAGES; i++) {
+		int_slot_t* page = atomic_load(&storage->int_pages[i]);
+		for (size_t j = 0; !ret && page && j < INT_PAGE_LEN; j++) {
+			struct index_record* record = atomic_load(&page[j]);
+			if (record) {
+				ret = visit_record(NULL, record, &iteration);
+			}
+		}
+	}
+	if (!ret) {
+		ret = index_table_foreach(storage->index_table, &visit_record, &iteration);
+	}
+	try_pthread_rwlock_unlock(&storage->lock_buffer_cache, error);
+	if (ret) {
+		errno = iteration.error ? iteration.error : errno;
+		return 1;
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+static int file_lock_shared(const storage_t handle, const char* key) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct record record;
+	struct index_record* index_record;
+	try(record_encode_key(key, &record), !0, on_success);
+	try(index_record = find_record(storage, &record, 1), NULL, error);
+	try_pthread_rwlock_rdlock(&index_record->lock, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int file_lock_exclusive(const storage_t handle, const char* key) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct record record;
+	struct index_record* index_record;
+	try(record_encode_key(key, &record), !0, on_success);
+	try(index_record = find_record(storage, &record, 1), NULL, error);
+	try_pthread_rwlock_wrlock(&index_record->lock, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int file_lock_exclusive_timed(const storage_t handle, const char* key, const struct timespec* deadline) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct record record;
+	struct index_record* index_record;
+	try(record_encode_key(key, &record), !0, on_success);
+	try(index_record = find_record(storage, &record, 1), NULL, error);
+	try(lock_timed(index_record, deadline), !0, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int file_unlock(const storage_t handle, const char* key) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct record record;
+	struct index_record* index_record;
+	try(record_encode_key(key, &record), !0, on_success);
+	try(index_record = find_record(storage, &record, 1), NULL, error);
+	try_pthread_rwlock_unlock(&index_record->lock, error);
+	// the records of the integer key space are never dropped
+	if (record.space == RECORD_SPACE_NAME && index_record->offset == -1) {
+		index_table_delete(storage->index_table, record.name);
+	}
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int file_lock_shared_int(const storage_t handle, const unsigned long key) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct index_record* record;
+	try(record = int_record(storage, key, 1), NULL, error);
+	try_pthread_rwlock_rdlock(&record->lock, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int file_lock_exclusive_int(const storage_t handle, const unsigned long key) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct index_record* record;
+	try(record = int_record(storage, key, 1), NULL, error);
+	try_pthread_rwlock_wrlock(&record->lock, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int file_lock_exclusive_timed_int(const storage_t handle, const unsigned long key, const struct timespec* deadline) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct index_record* record;
+	try(record = int_record(storage, key, 1), NULL, error);
+	try(lock_timed(record, deadline), !0, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int file_unlock_int(const storage_t handle, const unsigned long key) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct index_record* record;
+	try(record = int_record(storage, key, 0), NULL, error);
+	try_pthread_rwlock_unlock(&record->lock, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Function to compare two strings
+*/
+static int lexicographical_comparison(const void* key1, const void* key2) {
+	char* str1 = (char*)key1;
+	char* str2 = (char*)key2;
+	for (int i = 0; ; i++) {
+		if (!str1[i] && !str2[i]) {
+			return 0;
+		}
+		else if (str1[i] && !str2[i]) {
+			return 1;
+		}
+		else if (!str1[i] && str2[i]) {
+			return -1;
+		}
+		else if (str1[i] < str2[i]) {
+			return -1;
+		}
+		else if (str1[i] > str2[i]) {
+			return 1;
+		}
+	}
+}
+
+/*
+* Give the file the header of the current format: an empty file gets the
+* header, a file without it is migrated from the legacy format and a file of
+* version 2 is upgraded.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to ENOTSUP if the file belongs to another version of the
+*			format.
+*/
+static int prepare_file(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	char header[RECORD_HEADER_LEN];
+	unsigned long version;
+	ssize_t n;
+
+	try(n = pread(storage->fd, header, sizeof header, 0), -1, error);
+	if (!n) {
+		record_write_header(header);
+		try(pwrite_all(storage->fd, header, sizeof header, 0), !0, error);
+		return 0;
+	}
+	version = ((size_t)n < sizeof header) ? 0 : record_header_version(header);
+	if (version == RECORD_VERSION) {
+		return 0;
+	}
+	if (version && version != RECORD_VERSION_UNCHECKED) {
+		errno = ENOTSUP;
+		goto error;
+	}
+	return migrate_file(storage, version);
+
+error:
+	return 1;
+}
+
+/*
+* Rewrite in the current format a file of version 2 or of the legacy format,
+* version 0, whose records are a key and a value stored as strings padded
+* with zeros to 16 bytes. The write-ahead log of an older version can not be
+* replayed so it must be empty.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EILSEQ if the log is not empty or a record can not be
+*			represented.
+*/
+static int migrate_file(const storage_t handle, const unsigned long version) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct stat st;
+	char* log_filename;
+	char* legacy;
+	char* image;
+	size_t size = RECORD_HEADER_LEN;
+	int fd;
+
+	try(log_filename = malloc(strlen(storage->filename) + sizeof ".wal"), NULL, error);
+	sprintf(log_filename, "%s.wal", storage->filename);
+	if (!stat(log_filename, &st) && st.st_size) {
+		free(log_filename);
+		errno = EILSEQ;
+		goto error;
+	}
+	free(log_filename);
+	try(fstat(storage->fd, &st), -1, error);
+	try(legacy = calloc(1, (size_t)st.st_size + 1), NULL, error);
+	try(pread_all(storage->fd, legacy, (size_t)st.st_size, 0), !0, cleanup1);
+	// no record grows by more than half of its length
+	try(image = calloc(1, RECORD_HEADER_LEN + (size_t)st.st_size / 2 * 3 + RECORD_MAX_LEN), NULL, cleanup1);
+	record_write_header(image);
+	for (size_t i = RECORD_HEADER_LEN; version && i < (size_t)st.st_size && legacy[i];) {
+		struct record record;
+		size_t length;
+		if (record_upgrade(&legacy[i], (size_t)st.st_size - i, &record, &length)) {
+			goto cleanup2;
+		}
+		memcpy(&image[size], record.bytes, record.length);
+		size += record.length;
+		i += length;
+	}
+	for (size_t i = 0; !version && i + LEGACY_RECORD_LEN <= (size_t)st.st_size && legacy[i]; i += LEGACY_RECORD_LEN) {
+		char key[LEGACY_FIELD_LEN + 1] = { 0 };
+		char value[LEGACY_FIELD_LEN + 1] = { 0 };
+		struct record record;
+		memcpy(key, &legacy[i], LEGACY_FIELD_LEN);
+		memcpy(value, &legacy[i + LEGACY_FIELD_LEN], LEGACY_FIELD_LEN);
+		if (record_encode(key, value, &record)) {
+			errno = EILSEQ;
+			goto cleanup2;
+		}
+		memcpy(&image[size], record.bytes, record.length);
+		size += record.length;
+	}
+	try(engine_write_file(storage->filename, image, size), !0, cleanup2);
+	try(fd = open(storage->filename, O_RDWR), -1, cleanup2);
+	close(storage->fd);
+	storage->fd = fd;
+	free(image);
+	free(legacy);
+	return 0;
+
+cleanup2:
+	free(image);
+cleanup1:
+	free(legacy);
+error:
+	return 1;
+}
+
+/*
+* Read the file in the buffer cache.
+*/
+static int update_buffer_cache(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct stat st;
+	free(storage->buffer_cache);
+	try(fstat(storage->fd, &st), -1, error);
+	try(storage->buffer_cache = calloc(1, sizeof(char) * (size_t)(st.st_size + 1)), NULL, error);
+	storage->buffer_cache_size = (long)st.st_size;
+	storage->capacity = (size_t)st.st_size;
+	try(pread_all(storage->fd, storage->buffer_cache, (size_t)st.st_size, 0), !0, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/* Function to create a record data type return NULL on failure and set properly
+ * errno on error.
+ */
+static index_record_t record_init() {
+	struct index_record* record;
+	record = calloc(1, sizeof * record);
+	if (record) {
+		record->offset = -1;
+		try_pthread_rwlock_init(&record->lock, error);
+		try_pthread_mutex_init(&record->mutex, cleanup);
+	}
+	return record;
+cleanup:
+	pthread_rwlock_destroy(&record->lock);
+error:
+	free(record);
+	return NULL;
+}
+
+/* Function to destroy a record data type return 1 on failure and set properly 
+ * errno on error.
+*/
+static int record_destroy(void* key, void* value) {
+	struct index_record* record = (struct index_record*)value;
+	try_pthread_rwlock_destroy(&record->lock, error);
+	try_pthread_mutex_destroy(&record->mutex, error);
+	free(key);
+	free(record);
+	return 0;
+error:
+	return 1;
+}
+
+/*
+* Find the record of the integer key space linked to the key, a missing
+* record is created only if create is set. A page or a record created by two
+* threads at once is published by the first one, the other is released.
+*
+* @return	the record on success or return NULL and set properly errno on
+*			error, errno is set to EINVAL if the key is out of the integer key
+*			space and to ENOENT if the record is missing.
+*/
+static struct index_record* int_record(const storage_t handle, const unsigned long key, const int create) {
+	struct storage* storage = (struct storage*)handle;
+
+	int_slot_t* page;
+	int_slot_t* expected_page = NULL;
+	struct index_record* record = NULL;
+	struct index_record* expected_record = NULL;
+
+	if (key >= RECORD_INT_KEYS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((page = atomic_load(&storage->int_pages[key >> INT_PAGE_BITS]))) {
+		record = atomic_load(&page[key & (INT_PAGE_LEN - 1)]);
+	}
+	if (record || !create) {
+		if (!record) {
+			errno = ENOENT;
+		}
+		return record;
+	}
+	if (page == NULL) {
+		try(page = calloc(INT_PAGE_LEN, sizeof * page), NULL, error);
+		if (!atomic_compare_exchange_strong(&storage->int_pages[key >> INT_PAGE_BITS], &expected_page, page)) {
+			free(page);
+			page = expected_page;
+		}
+	}
+	try(record = record_init(), NULL, error);
+	if (!atomic_compare_exchange_strong(&page[key & (INT_PAGE_LEN - 1)], &expected_record, record)) {
+		record_destroy(NULL, record);
+		record = expected_record;
+	}
+	return record;
+
+error:
+	return NULL;
+}
+
+static int destroy_int_records(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	for (size_t i = 0; i < INT_PAGES; i++) {
+		int_slot_t* page = atomic_load(&storage->int_pages[i]);
+		for (size_t j = 0; page && j < INT_PAGE_LEN; j++) {
+			struct index_record* record = atomic_load(&page[j]);
+			if (record) {
+				try(record_destroy(NULL, record), !0, error);
+			}
+		}
+		free(page);
+		atomic_store(&storage->int_pages[i], NULL);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Find the record linked to the key of the received record in its key space.
+* A missing record of the name key space is always created, one of the
+* integer key space only if create is set.
+*
+* @return	the record on success or return NULL and set properly errno on
+*			error.
+*/
+static struct index_record* find_record(const storage_t handle, const struct record* record, const int create) {
+	struct storage* storage = (struct storage*)handle;
+
+	char* key;
+
+	if (record->space == RECORD_SPACE_INT) {
+		return int_record(storage, record->number, create);
+	}
+	try(key = strdup(record->name), NULL, error);
+	return index_table_search(storage->index_table, key);
+
+error:
+	return NULL;
+}
+
+/*
+* Read the integer value of the record.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to ENOENT if the record is not stored.
+*/
+static int load_value_number(const storage_t handle, const struct index_record* record, long* value) {
+	struct storage* storage = (struct storage*)handle;
+
+	long offset;
+
+	try_pthread_rwlock_rdlock(&storage->lock_buffer_cache, error);
+	if ((offset = record->offset) == -1) {
+		errno = ENOENT;
+		goto unlock;
+	}
+	try(verify_read(storage, &storage->buffer_cache[offset]), !0, unlock);
+	try(record_value_number(&storage->buffer_cache[offset], value), !0, unlock);
+	try_pthread_rwlock_unlock(&storage->lock_buffer_cache, error);
+	return 0;
+
+unlock:
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+error:
+	return 1;
+}
+
+/*
+* Pass the key and the value of the record to the function of the iteration
+* if it is stored in the file.
+*
+* @return	0 to go on or return 1 and set the error of the iteration to stop.
+*/
+static int visit_record(void* key, void* value, void* context) {
+	struct index_record* index_record = (struct index_record*)value;
+	struct iteration* iteration = (struct iteration*)context;
+
+	const char* bytes;
+	struct record record;
+	char number[24];
+	char* result;
+	int ret;
+	(void)key;
+
+	if (index_record->offset == -1) {
+		return 0;
+	}
+	bytes = &iteration->buffer_cache[index_record->offset];
+	if (record_decode(bytes, RECORD_MAX_LEN, &record) || record_value_string(bytes, &result)) {
+		iteration->error = errno;
+		return 1;
+	}
+	if (record.space == RECORD_SPACE_INT) {
+		snprintf(number, sizeof number, "%lu", record.number);
+	}
+	ret = iteration->function((record.space == RECORD_SPACE_INT) ? number : record.name, result, iteration->context);
+	free(result);
+	if (ret) {
+		iteration->error = ECANCELED;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* Lock as exclusive the lock of the record without waiting past the deadline,
+* a NULL deadline only tries the lock once.
+*/
+static int lock_timed(struct index_record* record, const struct timespec* deadline) {
+	int ret;
+
+	while ((ret = deadline ? pthread_rwlock_timedwrlock(&record->lock, deadline) : pthread_rwlock_trywrlock(&record->lock)) == EINTR);
+	if (ret) {
+		errno = ret;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* Map the file reserving at least a grow step past its records.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int map_file(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+	struct stat st;
+	int ret;
+
+	try(fstat(storage->fd, &st), -1, error);
+	storage->capacity = ((size_t)st.st_size / storage->grow_step + 1) * storage->grow_step;
+	if ((ret = posix_fallocate(storage->fd, 0, (off_t)storage->capacity))) {
+		errno = ret;
+		goto error;
+	}
+	try(storage->buffer_cache = mmap(NULL, storage->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, storage->fd, 0), MAP_FAILED, error);
+	return 0;
+
+error:
+	storage->buffer_cache = NULL;
+	return 1;
+}
+
+/*
+* Initialize the indexes of both key spaces from the records in the buffer
+* cache, the records follow the header and end at the first zero byte or at
+* the limit. Set the buffer cache size to the end of the records.
+*
+* The records are split in chunks parsed by parallel threads, each thread
+* creates the records of the integer key space and sorts those of the name
+* key space it found. The sorted runs are merged and the index table is
+* built from them in bulk.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EILSEQ if a record is not valid.
+*/
+static int load_table(const storage_t handle, const size_t limit) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct load_chunk chunks[LOAD_THREADS_MAX] = { 0 };
+	pthread_t threads[LOAD_THREADS_MAX];
+	int started[LOAD_THREADS_MAX] = { 0 };
+	struct load_entry* entries = NULL;
+	char** keys = NULL;
+	struct index_record** records = NULL;
+	size_t n_chunks;
+	size_t n = 0;
+	size_t end = RECORD_HEADER_LEN;
+	int error = 0;
+
+	while (end < limit && storage->buffer_cache[end]) {
+		size_t length = record_length(&storage->buffer_cache[end]);
+		if (!length || length > limit - end) {
+			errno = EILSEQ;
+			return 1;
+		}
+		end += length;
+	}
+	n_chunks = split_records(storage, end, chunks);
+	// the first chunk is parsed by the calling thread
+	for (size_t i = 1; i < n_chunks; i++) {
+		started[i] = !pthread_create(&threads[i], NULL, &load_chunk, &chunks[i]);
+	}
+	load_chunk(&chunks[0]);
+	for (size_t i = 1; i < n_chunks; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+		else {
+			load_chunk(&chunks[i]);
+		}
+	}
+	for (size_t i = 0; i < n_chunks && !error; i++) {
+		error = chunks[i].error;
+	}
+	if (error) {
+		errno = error;
+		goto cleanup1;
+	}
+	try(entries = merge_runs(chunks, n_chunks, &n), NULL, cleanup1);
+	try(keys = malloc(sizeof * keys * (n + 1)), NULL, cleanup2);
+	try(records = malloc(sizeof * records * (n + 1)), NULL, cleanup3);
+	for (size_t i = 0; i < n; i++) {
+		keys[i] = entries[i].key;
+		records[i] = entries[i].record;
+	}
+	try(index_table_build(storage->index_table, (void**)keys, (index_record_t*)records, (long)n), !0, cleanup4);
+	storage->buffer_cache_size = (long)end;
+	free(records);
+	free(keys);
+	free(entries);
+	return 0;
+
+cleanup4:
+	free(records);
+cleanup3:
+	free(keys);
+cleanup2:
+	for (size_t i = 0; i < n; i++) {
+		record_destroy(entries[i].key, entries[i].record);
+	}
+	free(entries);
+	return 1;
+cleanup1:
+	for (size_t i = 0; i < n_chunks; i++) {
+		for (size_t j = 0; j < chunks[i].n; j++) {
+			record_destroy(chunks[i].entries[j].key, chunks[i].entries[j].record);
+		}
+		free(chunks[i].entries);
+	}
+	return 1;
+}
+
+/*
+* Split the records preceding the end in chunks of similar length, at least
+* LOAD_CHUNK_MIN bytes long, one for every online processor.
+*
+* @return	the number of chunks.
+*/
+static size_t split_records(const storage_t handle, const size_t end, struct load_chunk* chunks) {
+	struct storage* storage = (struct storage*)handle;
+
+	long n_processors = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t length = end - RECORD_HEADER_LEN;
+	size_t n_chunks = length / LOAD_CHUNK_MIN;
+	size_t i = 0;
+
+	n_chunks = (n_processors > 0 && n_chunks > (size_t)n_processors) ? (size_t)n_processors : n_chunks;
+	n_chunks = (n_chunks > LOAD_THREADS_MAX) ? LOAD_THREADS_MAX : n_chunks;
+	n_chunks = n_chunks ? n_chunks : 1;
+	chunks[0].begin = RECORD_HEADER_LEN;
+	for (size_t offset = RECORD_HEADER_LEN; offset < end; offset += record_length(&storage->buffer_cache[offset])) {
+		if (offset - RECORD_HEADER_LEN >= (i + 1) * (length / n_chunks) && i + 1 < n_chunks) {
+			chunks[i++].end = offset;
+			chunks[i].begin = offset;
+		}
+	}
+	chunks[i].end = end;
+	for (size_t j = 0; j <= i; j++) {
+		chunks[j].storage = storage;
+	}
+	return i + 1;
+}
+
+/*
+* Parse the records of a chunk, the record of an integer key found twice
+* keeps the last offset.
+*/
+static void* load_chunk(void* arg) {
+	struct load_chunk* chunk = (struct load_chunk*)arg;
+	struct storage* storage = chunk->storage;
+
+	struct record record;
+	int sorted = 1;
+
+	errno = 0;
+	try(chunk->entries = malloc(sizeof * chunk->entries * ((chunk->end - chunk->begin) / RECORD_MAX_LEN + 1)), NULL, error);
+	for (size_t offset = chunk->begin; offset < chunk->end; offset += record.length) {
+		try(record_decode(&storage->buffer_cache[offset], chunk->end - offset, &record), !0, error);
+		if (record.space == RECORD_SPACE_INT) {
+			struct index_record* index_record;
+			long current;
+			try(index_record = int_record(storage, record.number, 1), NULL, error);
+			current = atomic_load(&index_record->offset);
+			while (current < (long)offset && !atomic_compare_exchange_weak(&index_record->offset, &current, (long)offset));
+			continue;
+		}
+		struct load_entry* entry = &chunk->entries[chunk->n];
+		try(entry->key = strdup(record.name), NULL, error);
+		if ((entry->record = record_init()) == NULL) {
+			free(entry->key);
+			goto error;
+		}
+		entry->record->offset = (long)offset;
+		chunk->n++;
+		sorted = sorted && (chunk->n == 1 || load_entry_comparison(entry - 1, entry) < 0);
+	}
+	// a file written by a checkpoint is already sorted
+	if (!sorted) {
+		qsort(chunk->entries, chunk->n, sizeof * chunk->entries, &load_entry_comparison);
+	}
+	return NULL;
+
+error:
+	chunk->error = errno ? errno : ENOMEM;
+	return NULL;
+}
+
+/*
+* Order the entries by key and the entries of the same key by offset.
+*/
+static int load_entry_comparison(const void* entry1, const void* entry2) {
+	const struct load_entry* a = (const struct load_entry*)entry1;
+	const struct load_entry* b = (const struct load_entry*)entry2;
+	int result = lexicographical_comparison(a->key, b->key);
+
+	if (result) {
+		return result;
+	}
+	return (a->record->offset > b->record->offset) - (a->record->offset < b->record->offset);
+}
+
+/*
+* Merge the sorted runs of the chunks in a single run of distinct keys, of a
+* key found twice the entry with the last offset is kept and the other is
+* released. The entries of the chunks are moved to the merged run.
+*
+* @return	the merged run on success or return NULL and set properly errno
+*			on error.
+*/
+static struct load_entry* merge_runs(struct load_chunk* chunks, const size_t n_chunks, size_t* n) {
+	struct load_entry* run;
+	size_t heads[LOAD_THREADS_MAX] = { 0 };
+	size_t total = 0;
+
+	for (size_t i = 0; i < n_chunks; i++) {
+		total += chunks[i].n;
+	}
+	try(run = malloc(sizeof * run * (total + 1)), NULL, error);
+	*n = 0;
+	for (size_t k = 0; k < total; k++) {
+		size_t min = n_chunks;
+		for (size_t i = 0; i < n_chunks; i++) {
+			if (heads[i] < chunks[i].n && (min == n_chunks || load_entry_comparison(&chunks[i].entries[heads[i]], &chunks[min].entries[heads[min]]) < 0)) {
+				min = i;
+			}
+		}
+		struct load_entry* entry = &chunks[min].entries[heads[min]++];
+		if (*n && !lexicographical_comparison(run[*n - 1].key, entry->key)) {
+			record_destroy(run[*n - 1].key, run[*n - 1].record);
+			(*n)--;
+		}
+		run[(*n)++] = *entry;
+	}
+	for (size_t i = 0; i < n_chunks; i++) {
+		free(chunks[i].entries);
+		chunks[i].entries = NULL;
+		chunks[i].n = 0;
+	}
+	return run;
+
+error:
+	return NULL;
+}
+
+/*
+* Grow the buffer cache so that n bytes of records can be appended. The
+* mapped file is extended by whole grow steps and mapped again, the buffer
+* of the stream mode doubles. Must be called holding the buffer cache lock
+* as exclusive.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int reserve(const storage_t handle, const size_t n_bytes) {
+	struct storage* storage = (struct storage*)handle;
+	size_t capacity;
+	char* buffer;
+	int ret;
+
+	if ((size_t)storage->buffer_cache_size + n_bytes <= storage->capacity) {
+		return 0;
+	}
+	if (storage->mode == STORAGE_STREAM) {
+		capacity = 2 * storage->capacity;
+		capacity = (capacity < (size_t)storage->buffer_cache_size + n_bytes) ? (size_t)storage->buffer_cache_size + n_bytes : capacity;
+		try(buffer = realloc(storage->buffer_cache, capacity), NULL, error);
+		storage->buffer_cache = buffer;
+		storage->capacity = capacity;
+		if (storage->write_back) {
+			try(resize_dirty(storage, capacity), !0, error);
+		}
+		return 0;
+	}
+	capacity = storage->capacity;
+	while ((size_t)storage->buffer_cache_size + n_bytes > capacity) {
+		capacity += storage->grow_step;
+	}
+	if ((ret = posix_fallocate(storage->fd, (off_t)storage->capacity, (off_t)(capacity - storage->capacity)))) {
+		errno = ret;
+		goto error;
+	}
+	try(buffer = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, storage->fd, 0), MAP_FAILED, error);
+	munmap(storage->buffer_cache, storage->capacity);
+	storage->buffer_cache = buffer;
+	storage->capacity = capacity;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Write the records of the batch in place and append the new ones past the
+* last record, the caller holds the mutexes of the records. A batch which
+* only overwrites records holds the buffer cache lock as shared, one which
+* appends holds it as exclusive. In stream mode the bytes are written back
+* to the file at their offset, the new records with a single write; in mmap mode
+* the sync policy is applied to the touched range. The offset of a new
+* record is published once its bytes are written.
+*/
+static int write_records(const storage_t handle, const size_t n, const struct record* records, struct index_record** index_records, const size_t new_bytes) {
+	struct storage* storage = (struct storage*)handle;
+	long first = LONG_MAX;
+	long last = 0;
+	long end;
+
+	if (new_bytes) {
+		try_pthread_rwlock_wrlock(&storage->lock_buffer_cache, error);
+		try(reserve(storage, new_bytes), 1, unlock);
+	}
+	else {
+		try_pthread_rwlock_rdlock(&storage->lock_buffer_cache, error);
+	}
+	end = storage->buffer_cache_size;
+	for (size_t i = 0; i < n; i++) {
+		long offset = index_records[i]->offset;
+		if (offset == -1) {
+			offset = storage->buffer_cache_size;
+			memcpy(&storage->buffer_cache[offset], records[i].bytes, records[i].length);
+			storage->buffer_cache_size += (long)records[i].length;
+			index_records[i]->offset = offset;
+		}
+		else {
+			memcpy(&storage->buffer_cache[offset], records[i].bytes, records[i].length);
+			// a repeated key appended by this batch is written with the new records
+			if (storage->mode == STORAGE_STREAM && offset < end) {
+				try(write_back(storage, offset, records[i].length), !0, unlock);
+			}
+		}
+		first = (offset < first) ? offset : first;
+		last = (offset + (long)records[i].length > last) ? offset + (long)records[i].length : last;
+	}
+	if (storage->mode == STORAGE_STREAM && storage->buffer_cache_size > end) {
+		try(write_back(storage, end, (size_t)(storage->buffer_cache_size - end)), !0, unlock);
+	}
+	if (storage->mode == STORAGE_MMAP) {
+		try(sync_range(storage, first, last), 1, unlock);
+	}
+	try_pthread_rwlock_unlock(&storage->lock_buffer_cache, error);
+	return 0;
+
+unlock:
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+error:
+	return 1;
+}
+
+
+
+/*
+* Apply the sync policy to the pages holding the bytes in [first, last).
+*/
+static int sync_range(const storage_t handle, const long first, const long last) {
+	struct storage* storage = (struct storage*)handle;
+	long page = sysconf(_SC_PAGESIZE);
+	long start = first / page * page;
+
+	if (storage->sync == STORAGE_SYNC_NONE || first >= last) {
+		return 0;
+	}
+	try(msync(&storage->buffer_cache[start], (size_t)(last - start), (storage->sync == STORAGE_SYNC_FULL) ? MS_SYNC : MS_ASYNC), -1, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Drop the zeros left past the records by the mmap mode, so that the file
+* ends right after the last record. Must follow load_table.
+*/
+static int truncate_padding(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+	struct stat st;
+
+	try(fstat(storage->fd, &st), -1, error);
+	if (storage->buffer_cache_size < st.st_size) {
+		try(ftruncate(storage->fd, storage->buffer_cache_size), -1, error);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Read length bytes of the file from the offset.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EIO if the file ends first.
+*/
+static int pread_all(const int fd, char* bytes, const size_t length, const off_t offset) {
+	for (size_t done = 0; done < length;) {
+		ssize_t n;
+		if ((n = pread(fd, bytes + done, length - done, offset + (off_t)done)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		if (!n) {
+			errno = EIO;
+			return 1;
+		}
+		done += (size_t)n;
+	}
+	return 0;
+}
+
+/*
+* Write the bytes to the file at the offset.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int pwrite_all(const int fd, const char* bytes, const size_t length, const off_t offset) {
+	for (size_t done = 0; done < length;) {
+		ssize_t n;
+		if ((n = pwrite(fd, bytes + done, length - done, offset + (off_t)done)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		done += (size_t)n;
+	}
+	return 0;
+}
+
+/*
+* Find the records of the batch, creating the missing ones, and set new_bytes
+* to the length of those which are not stored yet.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int find_records(const storage_t handle, const struct record* records, const size_t n, struct index_record*** index_records, size_t* new_bytes) {
+	struct storage* storage = (struct storage*)handle;
+
+	*new_bytes = 0;
+	try(*index_records = malloc(sizeof * *index_records * (n + 1)), NULL, error);
+	for (size_t i = 0; i < n; i++) {
+		try((*index_records)[i] = find_record(storage, &records[i], 1), NULL, cleanup);
+		*new_bytes += ((*index_records)[i]->offset == -1) ? records[i].length : 0;
+	}
+	return 0;
+
+cleanup:
+	free(*index_records);
+error:
+	return 1;
+}
+
+/*
+* Lock the mutexes of the records in the order of their addresses, a record
+* repeated in the batch is locked once.
+*
+* @return	the vector of the locked records on success or return NULL and
+*			set properly errno on error.
+*/
+static struct index_record** lock_records(struct index_record** index_records, const size_t n, size_t* n_locked) {
+	struct index_record** locked;
+	size_t n_unique = 0;
+
+	try(locked = malloc(sizeof * locked * (n + 1)), NULL, error);
+	memcpy(locked, index_records, sizeof * locked * n);
+	qsort(locked, n, sizeof * locked, &record_address_comparison);
+	for (size_t i = 0; i < n; i++) {
+		if (!n_unique || locked[n_unique - 1] != locked[i]) {
+			locked[n_unique++] = locked[i];
+		}
+	}
+	for (*n_locked = 0; *n_locked < n_unique; (*n_locked)++) {
+		try_pthread_mutex_lock(&locked[*n_locked]->mutex, cleanup);
+	}
+	return locked;
+
+cleanup:
+	unlock_records(locked, *n_locked);
+error:
+	return NULL;
+}
+
+static void unlock_records(struct index_record** locked, const size_t n_locked) {
+	for (size_t i = n_locked; i > 0; i--) {
+		pthread_mutex_unlock(&locked[i - 1]->mutex);
+	}
+	free(locked);
+}
+
+static int record_address_comparison(const void* record1, const void* record2) {
+	uintptr_t a = (uintptr_t)*(struct index_record* const*)record1;
+	uintptr_t b = (uintptr_t)*(struct index_record* const*)record2;
+	return (a > b) - (a < b);
+}
+
+/*
+* Store the records without logging them.
+*/
+static int store_records(const storage_t handle, const struct record* records, const size_t n) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct index_record** index_records;
+	struct index_record** locked;
+	size_t n_locked;
+	size_t new_bytes;
+
+	try(find_records(storage, records, n, &index_records, &new_bytes), !0, error);
+	try(locked = lock_records(index_records, n, &n_locked), NULL, cleanup1);
+	try(write_records(storage, n, records, index_records, new_bytes), 1, cleanup2);
+	unlock_records(locked, n_locked);
+	free(index_records);
+	return 0;
+
+cleanup2:
+	unlock_records(locked, n_locked);
+cleanup1:
+	free(index_records);
+error:
+	return 1;
+}
+
+/*
+* Store the records, when the stores are logged they are appended to the log
+* as a single record first and applied once it is durable.
+*/
+static int log_and_store(const storage_t handle, const struct record* records, const size_t n) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct index_record** index_records;
+	struct index_record** locked;
+	size_t n_locked;
+	size_t new_bytes;
+	char* payload;
+	size_t length = 0;
+	unsigned long lsn;
+
+	if (!storage->wal) {
+		return store_records(storage, records, n);
+	}
+	for (size_t i = 0; i < n; i++) {
+		length += records[i].length;
+	}
+	try(payload = malloc(length + 1), NULL, error);
+	length = 0;
+	for (size_t i = 0; i < n; i++) {
+		memcpy(&payload[length], records[i].bytes, records[i].length);
+		length += records[i].length;
+	}
+	try(find_records(storage, records, n, &index_records, &new_bytes), !0, cleanup1);
+	try_pthread_rwlock_rdlock(&storage->lock_log, cleanup2);
+	try(locked = lock_records(index_records, n, &n_locked), NULL, cleanup3);
+	try(wal_append(storage->wal, payload, length, &lsn), !0, cleanup4);
+	// the store reaches the file only once its record is durable
+	try(wal_commit(storage->wal, lsn), !0, cleanup4);
+	try(write_records(storage, n, records, index_records, new_bytes), 1, cleanup4);
+	unlock_records(locked, n_locked);
+	try_pthread_rwlock_unlock(&storage->lock_log, cleanup2);
+	free(index_records);
+	free(payload);
+	return 0;
+
+cleanup4:
+	unlock_records(locked, n_locked);
+cleanup3:
+	pthread_rwlock_unlock(&storage->lock_log);
+cleanup2:
+	free(index_records);
+cleanup1:
+	free(payload);
+error:
+	return 1;
+}
+
+/*
+* Open the write-ahead log next to the file, replay the stores it holds and
+* empty it once they are durable in the file.
+*/
+static int open_log(const storage_t handle, const char* filename, const struct storage_options* options) {
+	struct storage* storage = (struct storage*)handle;
+
+	char* log_filename;
+	wal_t wal;
+
+	try(log_filename = malloc(strlen(filename) + sizeof ".wal"), NULL, error);
+	sprintf(log_filename, "%s.wal", filename);
+	try(wal = wal_open(log_filename, options->wal_sync, options->wal_interval ? options->wal_interval : WAL_INTERVAL), NULL, cleanup1);
+	try(wal_replay(wal, &replay_record, storage), !0, cleanup2);
+	try(sync_file(storage), !0, cleanup2);
+	try(wal_reset(wal), !0, cleanup2);
+	try_pthread_rwlock_init(&storage->lock_log, cleanup2);
+	// the flusher reads the log holding mutex_write_back
+	if (storage->write_back) {
+		try_pthread_mutex_lock(&storage->mutex_write_back, cleanup3);
+	}
+	storage->wal = wal;
+	if (storage->write_back) {
+		pthread_mutex_unlock(&storage->mutex_write_back);
+	}
+	free(log_filename);
+	return 0;
+
+cleanup3:
+	pthread_rwlock_destroy(&storage->lock_log);
+cleanup2:
+	wal_close(wal);
+cleanup1:
+	free(log_filename);
+error:
+	return 1;
+}
+
+/*
+* Apply a logged store, the payload holds its records.
+*/
+static int replay_record(void* context, const char* payload, const size_t length) {
+	struct storage* storage = (struct storage*)context;
+
+	struct record* records;
+	size_t n = 0;
+
+	try(records = malloc(sizeof * records * (length / RECORD_MIN_LEN + 1)), NULL, error);
+	for (size_t offset = 0; offset < length; offset += records[n++].length) {
+		try(record_decode(&payload[offset], length - offset, &records[n]), !0, cleanup);
+	}
+	try(store_records(storage, records, n), 1, cleanup);
+	free(records);
+	return 0;
+
+cleanup:
+	free(records);
+error:
+	return 1;
+}
+
+/*
+* Make the records of the file durable.
+*/
+static int sync_file(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	if (storage->mode == STORAGE_MMAP) {
+		try(msync(storage->buffer_cache, storage->capacity, MS_SYNC), -1, error);
+		return 0;
+	}
+	if (storage->write_back) {
+		try(flush_dirty(storage), !0, error);
+	}
+	try(fsync(storage->fd), -1, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Append the records of the integer key space stored in the file to the image
+* of the checkpoint in the order of their keys.
+*/
+static void collect_int_records(const storage_t handle, struct compaction* compaction) {
+	struct storage* storage = (struct storage*)handle;
+
+	for (size_t i = 0; i < INT_PAGES; i++) {
+		int_slot_t* page = atomic_load(&storage->int_pages[i]);
+		for (size_t j = 0; page && j < INT_PAGE_LEN; j++) {
+			struct index_record* record = atomic_load(&page[j]);
+			if (record) {
+				collect_record(NULL, record, compaction);
+			}
+		}
+	}
+}
+
+/*
+* Append the record to the image of the checkpoint if it is stored in the
+* file.
+*/
+static int collect_record(void* key, void* value, void* context) {
+	struct index_record* record = (struct index_record*)value;
+	struct compaction* compaction = (struct compaction*)context;
+	(void)key;
+
+	if (record->offset != -1) {
+		const char* bytes = &compaction->buffer_cache[record->offset];
+		size_t length = record_length(bytes);
+		memcpy(&compaction->image[compaction->size], bytes, length);
+		compaction->records[compaction->n_records] = record;
+		compaction->offsets[compaction->n_records++] = (long)compaction->size;
+		compaction->size += length;
+	}
+	return 0;
+}
+
+extern int engine_write_file(const char* filename, const char* image, const size_t size) {
+	char* temporary_filename;
+	int fd;
+
+	try(temporary_filename = malloc(strlen(filename) + sizeof ".tmp"), NULL, error);
+	sprintf(temporary_filename, "%s.tmp", filename);
+	try(fd = open(temporary_filename, O_WRONLY | O_CREAT | O_TRUNC, 0660), -1, cleanup1);
+	for (size_t done = 0; done < size;) {
+		ssize_t n;
+		if ((n = write(fd, image + done, size - done)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto cleanup2;
+		}
+		done += (size_t)n;
+	}
+	try(fsync(fd), -1, cleanup2);
+	try(close(fd), -1, cleanup3);
+	try(rename(temporary_filename, filename), -1, cleanup3);
+	try(engine_sync_directory(filename), !0, cleanup1);
+	free(temporary_filename);
+	return 0;
+
+cleanup2:
+	close(fd);
+cleanup3:
+	unlink(temporary_filename);
+cleanup1:
+	free(temporary_filename);
+error:
+	return 1;
+}
+
+/*
+* Switch to the file written by the checkpoint, the image becomes the buffer
+* cache in stream mode. Must be called holding the buffer cache lock as
+* exclusive.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int replace_file(const storage_t handle, char* image, const size_t size) {
+	struct storage* storage = (struct storage*)handle;
+
+	char* mapping = storage->buffer_cache;
+	size_t capacity = storage->capacity;
+	int fd = storage->fd;
+
+	try(storage->fd = open(storage->filename, O_RDWR), -1, error);
+	if (storage->mode == STORAGE_MMAP) {
+		if (map_file(storage)) {
+			close(storage->fd);
+			storage->buffer_cache = mapping;
+			storage->capacity = capacity;
+			storage->fd = fd;
+			goto error;
+		}
+		munmap(mapping, capacity);
+		free(image);
+	}
+	else {
+		free(storage->buffer_cache);
+		storage->buffer_cache = image;
+		storage->capacity = size;
+		// the new file holds every store
+		for (size_t i = 0; storage->write_back && i < storage->capacity_pages; i++) {
+			atomic_store(&storage->dirty[i], 0);
+		}
+		atomic_store(&storage->n_dirty, 0);
+	}
+	close(fd);
+	storage->buffer_cache_size = (long)size;
+	storage->generation++;
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int engine_sync_directory(const char* filename) {
+	const char* separator = strrchr(filename, '/');
+	char* directory;
+	int fd;
+
+	try(directory = separator ? strndup(filename, (size_t)(separator - filename) + 1) : strdup("."), NULL, error);
+	try(fd = open(directory, O_RDONLY | O_DIRECTORY), -1, cleanup1);
+	try(fsync(fd), -1, cleanup2);
+	close(fd);
+	free(directory);
+	return 0;
+
+cleanup2:
+	close(fd);
+cleanup1:
+	free(directory);
+error:
+	return 1;
+}
+
+static int start_checkpointer(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	storage->stopping = 0;
+	try_pthread_mutex_init(&storage->mutex_checkpoint, error);
+	try_pthread(pthread_cond_init(&storage->checkpoint, NULL), cleanup1);
+	try_pthread(pthread_create(&storage->checkpointer, NULL, &checkpointer_routine, storage), cleanup2);
+	return 0;
+
+cleanup2:
+	pthread_cond_destroy(&storage->checkpoint);
+cleanup1:
+	pthread_mutex_destroy(&storage->mutex_checkpoint);
+error:
+	return 1;
+}
+
+/*
+* Take a checkpoint every interval until the storage is closed, a failed
+* checkpoint leaves the previous file and log in place and is tried again at
+* the next interval.
+*/
+static void* checkpointer_routine(void* arg) {
+	struct storage* storage = (struct storage*)arg;
+
+	try_pthread_mutex_lock(&storage->mutex_checkpoint, error);
+	while (!storage->stopping) {
+		struct timespec deadline;
+		int ret;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += storage->checkpoint_interval / 1000;
+		deadline.tv_nsec += (storage->checkpoint_interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		ret = pthread_cond_timedwait(&storage->checkpoint, &storage->mutex_checkpoint, &deadline);
+		if (ret == ETIMEDOUT && !storage->stopping) {
+			try_pthread_mutex_unlock(&storage->mutex_checkpoint, error);
+			file_checkpoint(storage);
+			try_pthread_mutex_lock(&storage->mutex_checkpoint, error);
+		}
+		else if (ret && ret != ETIMEDOUT) {
+			goto unlock;
+		}
+	}
+	pthread_mutex_unlock(&storage->mutex_checkpoint);
+	return NULL;
+
+unlock:
+	pthread_mutex_unlock(&storage->mutex_checkpoint);
+error:
+	return NULL;
+}
+
+/*
+* Write the bytes of the buffer cache at the offset to the file, in
+* write-back mode their pages are only marked dirty. Must be called holding
+* the buffer cache lock.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int write_back(const storage_t handle, const long offset, const size_t length) {
+	struct storage* storage = (struct storage*)handle;
+
+	if (storage->write_back) {
+		return mark_dirty(storage, offset, length);
+	}
+	return pwrite_all(storage->fd, &storage->buffer_cache[offset], length, (off_t)offset);
+}
+
+/*
+* Mark the pages holding the bytes as dirty and wake the flusher when the
+* dirty bytes reach the threshold. Must be called holding the buffer cache
+* lock.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int mark_dirty(const storage_t handle, const long offset, const size_t length) {
+	struct storage* storage = (struct storage*)handle;
+	size_t threshold = storage->flush_threshold / FLUSH_PAGE_LEN + 1;
+
+	for (size_t page = (size_t)offset / FLUSH_PAGE_LEN; page <= ((size_t)offset + length - 1) / FLUSH_PAGE_LEN; page++) {
+		if (!atomic_exchange(&storage->dirty[page], 1) && atomic_fetch_add(&storage->n_dirty, 1) + 1 == threshold) {
+			try_pthread_mutex_lock(&storage->mutex_flush, error);
+			try_pthread(pthread_cond_signal(&storage->flush), unlock);
+			try_pthread_mutex_unlock(&storage->mutex_flush, error);
+		}
+	}
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&storage->mutex_flush);
+error:
+	return 1;
+}
+
+/*
+* Resize the dirty flags to cover a buffer cache of the received capacity,
+* the new pages are clean. Must be called holding the buffer cache lock as
+* exclusive.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int resize_dirty(const storage_t handle, const size_t capacity) {
+	struct storage* storage = (struct storage*)handle;
+
+	atomic_uchar* dirty;
+	size_t n_pages = storage->dirty ? storage->capacity_pages : 0;
+	size_t new_pages = capacity / FLUSH_PAGE_LEN + 1;
+
+	if (new_pages <= n_pages) {
+		return 0;
+	}
+	try(dirty = realloc(storage->dirty, sizeof * dirty * new_pages), NULL, error);
+	for (size_t i = n_pages; i < new_pages; i++) {
+		atomic_init(&dirty[i], 0);
+	}
+	storage->dirty = dirty;
+	storage->capacity_pages = new_pages;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Write every run of dirty pages to the file with a single write. The runs
+* are copied holding the buffer cache lock as exclusive, so that they hold
+* only whole stores, and written after releasing it. The pages of a run
+* which is not written are marked dirty again.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int flush_dirty(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct timespec start;
+	struct timespec end;
+	struct iovec* runs;
+	off_t* offsets;
+	char* copy;
+	size_t n_dirty;
+	size_t n_runs = 0;
+	size_t size = 0;
+	size_t next = 0;
+	size_t i = 0;
+	unsigned long latency;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	try_pthread_mutex_lock(&storage->mutex_write_back, error);
+	try_pthread_rwlock_wrlock(&storage->lock_buffer_cache, cleanup1);
+	if ((n_dirty = atomic_load(&storage->n_dirty)) == 0) {
+		pthread_rwlock_unlock(&storage->lock_buffer_cache);
+		pthread_mutex_unlock(&storage->mutex_write_back);
+		return 0;
+	}
+	try(copy = malloc(n_dirty * FLUSH_PAGE_LEN), NULL, cleanup2);
+	try(runs = malloc(sizeof * runs * n_dirty), NULL, cleanup3);
+	try(offsets = malloc(sizeof * offsets * n_dirty), NULL, cleanup4);
+	for (size_t page = 0; page * FLUSH_PAGE_LEN < (size_t)storage->buffer_cache_size; page++) {
+		size_t first = page * FLUSH_PAGE_LEN;
+		size_t length = ((size_t)storage->buffer_cache_size - first < FLUSH_PAGE_LEN) ? (size_t)storage->buffer_cache_size - first : FLUSH_PAGE_LEN;
+		if (!atomic_exchange(&storage->dirty[page], 0)) {
+			continue;
+		}
+		if (!n_runs || page != next) {
+			offsets[n_runs] = (off_t)first;
+			runs[n_runs].iov_base = &copy[size];
+			runs[n_runs++].iov_len = 0;
+		}
+		memcpy(&copy[size], &storage->buffer_cache[first], length);
+		runs[n_runs - 1].iov_len += length;
+		size += length;
+		next = page + 1;
+	}
+	atomic_store(&storage->n_dirty, 0);
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+	// the records of the copied stores are made durable before the stores
+	if (storage->log_ahead && storage->wal) {
+		try(wal_sync(storage->wal), !0, cleanup5);
+	}
+	for (; i < n_runs; i++) {
+		try(pwrite_all(storage->fd, runs[i].iov_base, runs[i].iov_len, offsets[i]), !0, cleanup5);
+	}
+	free(offsets);
+	free(runs);
+	free(copy);
+	pthread_mutex_unlock(&storage->mutex_write_back);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	latency = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+	try_pthread_mutex_lock(&storage->mutex_flush, error);
+	storage->flushes++;
+	storage->flushed_bytes += size;
+	storage->flush_latency_last = latency;
+	storage->flush_latency_total += latency;
+	storage->flush_latency_max = (latency > storage->flush_latency_max) ? latency : storage->flush_latency_max;
+	try_pthread_mutex_unlock(&storage->mutex_flush, error);
+	return 0;
+
+cleanup5:
+	pthread_rwlock_rdlock(&storage->lock_buffer_cache);
+	for (; i < n_runs; i++) {
+		mark_dirty(storage, (long)offsets[i], runs[i].iov_len);
+	}
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+	free(offsets);
+	free(runs);
+	free(copy);
+	pthread_mutex_unlock(&storage->mutex_write_back);
+	return 1;
+cleanup4:
+	free(runs);
+cleanup3:
+	free(copy);
+cleanup2:
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+cleanup1:
+	pthread_mutex_unlock(&storage->mutex_write_back);
+error:
+	return 1;
+}
+
+static int start_flusher(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	storage->flusher_stopping = 0;
+	atomic_init(&storage->n_dirty, 0);
+	try(resize_dirty(storage, storage->capacity), !0, error);
+	try_pthread_mutex_init(&storage->mutex_write_back, cleanup1);
+	try_pthread_mutex_init(&storage->mutex_flush, cleanup2);
+	try_pthread(pthread_cond_init(&storage->flush, NULL), cleanup3);
+	try_pthread(pthread_create(&storage->flusher, NULL, &flusher_routine, storage), cleanup4);
+	storage->write_back = 1;
+	return 0;
+
+cleanup4:
+	pthread_cond_destroy(&storage->flush);
+cleanup3:
+	pthread_mutex_destroy(&storage->mutex_flush);
+cleanup2:
+	pthread_mutex_destroy(&storage->mutex_write_back);
+cleanup1:
+	free(storage->dirty);
+	storage->dirty = NULL;
+error:
+	return 1;
+}
+
+/*
+* Stop the flusher and write the pages left dirty.
+*/
+static int stop_flusher(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	try_pthread_mutex_lock(&storage->mutex_flush, error);
+	storage->flusher_stopping = 1;
+	try_pthread(pthread_cond_signal(&storage->flush), error);
+	try_pthread_mutex_unlock(&storage->mutex_flush, error);
+	try_pthread(pthread_join(storage->flusher, NULL), error);
+	try(flush_dirty(storage), !0, error);
+	try_pthread(pthread_cond_destroy(&storage->flush), error);
+	try_pthread_mutex_destroy(&storage->mutex_flush, error);
+	try_pthread_mutex_destroy(&storage->mutex_write_back, error);
+	free(storage->dirty);
+	storage->dirty = NULL;
+	storage->write_back = 0;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Flush the dirty pages every interval, or as soon as a store wakes the
+* flusher, until the storage is closed. A failed flush leaves the pages dirty
+* for the next one.
+*/
+static void* flusher_routine(void* arg) {
+	struct storage* storage = (struct storage*)arg;
+
+	try_pthread_mutex_lock(&storage->mutex_flush, error);
+	while (!storage->flusher_stopping) {
+		struct timespec deadline;
+		int ret;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += storage->flush_interval / 1000;
+		deadline.tv_nsec += (storage->flush_interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		ret = pthread_cond_timedwait(&storage->flush, &storage->mutex_flush, &deadline);
+		if ((!ret || ret == ETIMEDOUT) && !storage->flusher_stopping) {
+			try_pthread_mutex_unlock(&storage->mutex_flush, error);
+			flush_dirty(storage);
+			try_pthread_mutex_lock(&storage->mutex_flush, error);
+		}
+		else if (ret && ret != ETIMEDOUT) {
+			goto unlock;
+		}
+	}
+	pthread_mutex_unlock(&storage->mutex_flush);
+	return NULL;
+
+unlock:
+	pthread_mutex_unlock(&storage->mutex_flush);
+error:
+	return NULL;
+}
+
+/*
+* Verify the checksum of a record read from the buffer cache if the reads
+* are verified. Must be called holding the buffer cache lock.
+*
+* @return	0 on success or return 1 and set errno to EILSEQ if the record is
+*			corrupt.
+*/
+static int verify_read(const storage_t handle, const char* bytes) {
+	struct storage* storage = (struct storage*)handle;
+
+	if (storage->verify_reads && record_verify(bytes)) {
+		atomic_fetch_add(&storage->corrupt_records, 1);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* Validate the records of the next chunk of the file, the pass restarts from
+* the first record once it reaches the last one or the file is replaced. A
+* damaged tag leaves the rest of the records unparsable, so it ends the pass.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int scrub_chunk(const storage_t handle, struct scrub_cursor* cursor) {
+	struct storage* storage = (struct storage*)handle;
+
+	struct stat st;
+	unsigned long generation;
+	long end;
+	size_t length = 0;
+	size_t done = 0;
+
+	try_pthread_rwlock_rdlock(&storage->lock_buffer_cache, error);
+	if (cursor->generation != storage->generation) {
+		cursor->generation = storage->generation;
+		cursor->offset = RECORD_HEADER_LEN;
+	}
+	generation = cursor->generation;
+	// in write-back mode the file can end before the buffer cache
+	try(fstat(storage->fd, &st), -1, unlock);
+	end = (storage->buffer_cache_size < (long)st.st_size) ? storage->buffer_cache_size : (long)st.st_size;
+	if (cursor->offset < end) {
+		length = (size_t)(end - cursor->offset);
+		length = (length < SCRUB_CHUNK_LEN) ? length : SCRUB_CHUNK_LEN;
+		try(pread_all(storage->fd, cursor->chunk, length, (off_t)cursor->offset), !0, unlock);
+	}
+	try_pthread_rwlock_unlock(&storage->lock_buffer_cache, error);
+	while (done < length) {
+		size_t record_size = record_length(&cursor->chunk[done]);
+		if (!record_size) {
+			try(check_record(storage, generation, cursor->offset + (long)done), !0, error);
+			done = (size_t)(end - cursor->offset);
+			break;
+		}
+		if (done + record_size > length) {
+			// the record ends in the next chunk
+			break;
+		}
+		if (record_verify(&cursor->chunk[done])) {
+			try(check_record(storage, generation, cursor->offset + (long)done), !0, error);
+		}
+		done += record_size;
+	}
+	atomic_fetch_add(&storage->scrubbed_bytes, done);
+	cursor->offset += (long)done;
+	if (cursor->offset >= end) {
+		atomic_fetch_add(&storage->scrub_passes, 1);
+		cursor->offset = RECORD_HEADER_LEN;
+	}
+	return 0;
+
+unlock:
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+error:
+	return 1;
+}
+
+/*
+* Read again the record at the offset excluding every writer and flush, and
+* count it as corrupt if its checksum still does not match. In stream mode
+* the record is repaired from the buffer cache when its copy there is valid.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int check_record(const storage_t handle, const unsigned long generation, const long offset) {
+	struct storage* storage = (struct storage*)handle;
+
+	char bytes[RECORD_MAX_LEN] = { 0 };
+	const char* cached;
+	size_t length;
+	ssize_t n;
+
+	if (storage->write_back) {
+		try_pthread_mutex_lock(&storage->mutex_write_back, error);
+	}
+	try_pthread_rwlock_wrlock(&storage->lock_buffer_cache, cleanup);
+	// the pass restarts on the file which replaced this one
+	if (storage->generation != generation) {
+		goto done;
+	}
+	try(n = pread(storage->fd, bytes, sizeof bytes, (off_t)offset), -1, unlock);
+	length = record_length(bytes);
+	if (length && length <= (size_t)n && !record_verify(bytes)) {
+		goto done;
+	}
+	atomic_fetch_add(&storage->corrupt_records, 1);
+	cached = &storage->buffer_cache[offset];
+	if (storage->mode == STORAGE_STREAM && offset < storage->buffer_cache_size && record_length(cached) && !record_verify(cached)) {
+		if (storage->log_ahead && storage->wal) {
+			try(wal_sync(storage->wal), !0, unlock);
+		}
+		try(pwrite_all(storage->fd, cached, record_length(cached), (off_t)offset), !0, unlock);
+		atomic_fetch_add(&storage->repaired_records, 1);
+	}
+done:
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+	if (storage->write_back) {
+		pthread_mutex_unlock(&storage->mutex_write_back);
+	}
+	return 0;
+
+unlock:
+	pthread_rwlock_unlock(&storage->lock_buffer_cache);
+cleanup:
+	if (storage->write_back) {
+		pthread_mutex_unlock(&storage->mutex_write_back);
+	}
+error:
+	return 1;
+}
+
+static int start_scrubber(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	storage->scrubber_stopping = 0;
+	try_pthread_mutex_init(&storage->mutex_scrub, error);
+	try_pthread(pthread_cond_init(&storage->scrub, NULL), cleanup1);
+	try_pthread(pthread_create(&storage->scrubber, NULL, &scrubber_routine, storage), cleanup2);
+	return 0;
+
+cleanup2:
+	pthread_cond_destroy(&storage->scrub);
+cleanup1:
+	pthread_mutex_destroy(&storage->mutex_scrub);
+error:
+	return 1;
+}
+
+static int stop_scrubber(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	try_pthread_mutex_lock(&storage->mutex_scrub, error);
+	storage->scrubber_stopping = 1;
+	try_pthread(pthread_cond_signal(&storage->scrub), error);
+	try_pthread_mutex_unlock(&storage->mutex_scrub, error);
+	try_pthread(pthread_join(storage->scrubber, NULL), error);
+	try_pthread(pthread_cond_destroy(&storage->scrub), error);
+	try_pthread_mutex_destroy(&storage->mutex_scrub, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Validate a chunk of the file, then wait as long as the rate allows for a
+* chunk, until the storage is closed. A failed chunk is tried again.
+*/
+static void* scrubber_routine(void* arg) {
+	struct storage* storage = (struct storage*)arg;
+
+	struct scrub_cursor cursor = { NULL, RECORD_HEADER_LEN, storage->generation };
+	long long delay = (long long)SCRUB_CHUNK_LEN * 1000000000LL / storage->scrub_rate;
+
+	try(cursor.chunk = malloc(SCRUB_CHUNK_LEN), NULL, error);
+	try_pthread_mutex_lock(&storage->mutex_scrub, cleanup);
+	while (!storage->scrubber_stopping) {
+		struct timespec deadline;
+		int ret = 0;
+		try_pthread_mutex_unlock(&storage->mutex_scrub, cleanup);
+		scrub_chunk(storage, &cursor);
+		try_pthread_mutex_lock(&storage->mutex_scrub, cleanup);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += (time_t)(delay / 1000000000LL);
+		deadline.tv_nsec += (long)(delay % 1000000000LL);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!storage->scrubber_stopping && !(ret = pthread_cond_timedwait(&storage->scrub, &storage->mutex_scrub, &deadline)));
+		if (ret && ret != ETIMEDOUT) {
+			goto unlock;
+		}
+	}
+	pthread_mutex_unlock(&storage->mutex_scrub);
+	free(cursor.chunk);
+	return NULL;
+
+unlock:
+	pthread_mutex_unlock(&storage->mutex_scrub);
+cleanup:
+	free(cursor.chunk);
+error:
+	return NULL;
+}
+
+/*
+* Estimate the memory of the pages and the records of the integer key space,
+* those of the name key space are a handful and are not counted.
+*/
+static size_t int_memory(const storage_t handle) {
+	struct storage* storage = (struct storage*)handle;
+
+	size_t bytes = 0;
+	for (size_t i = 0; i < INT_PAGES; i++) {
+		int_slot_t* page = atomic_load(&storage->int_pages[i]);
+		for (size_t j = 0; page && j < INT_PAGE_LEN; j++) {
+			if (atomic_load(&page[j])) {
+				bytes += sizeof(struct index_record);
+			}
+		}
+		bytes += page ? INT_PAGE_LEN * sizeof * page : 0;
+	}
+	return bytes;
+}
+
+const struct engine file_engine = {
+	&file_init,
+	&file_close,
+	&file_store_batch,
+	&file_store_ints,
+	&file_store_number,
+	&file_checkpoint,
+	&file_backup,
+	&file_get_stats,
+	&file_load,
+	&file_load_int,
+	&file_load_number,
+	&file_foreach,
+	&file_lock_shared,
+	&file_lock_exclusive,
+	&file_lock_exclusive_timed,
+	&file_unlock,
+	&file_lock_shared_int,
+	&file_lock_exclusive_int,
+	&file_lock_exclusive_timed_int,
+	&file_unlock_int
+};
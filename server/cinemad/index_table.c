@@ -96,6 +96,21 @@ error:
 	return 1;
 }
 
+/*
+* Fill an empty index with keys sorted in strictly ascending order.
+*/
+extern int index_table_build(const index_table_t handle, void** keys, index_record_t* records, const long n) {
+	struct index_table* index_table = (struct index_table*)handle;
+	int result;
+	try_pthread_rwlock_wrlock(&index_table->lock, error);
+	result = avl_tree_build(index_table->avl_tree, keys, records, n);
+	try_pthread_rwlock_unlock(&index_table->lock, error);
+	return result;
+
+error:
+	return 1;
+}
+
 extern index_record_t index_table_search(const index_table_t handle, void* key) {
 	struct index_table* index_table = (struct index_table*)handle;
 	void* result;
@@ -119,3 +134,57 @@ extern index_record_t index_table_search(const index_table_t handle, void* key)
 error:
 	return NULL;
 }
+
+/*
+* Search the record linked to the key without creating it, the key is not
+* consumed.
+*
+* @return	the record or NULL if the key is missing.
+*/
+extern index_record_t index_table_find(const index_table_t handle, const void* key) {
+	struct index_table* index_table = (struct index_table*)handle;
+	void* result;
+	try_pthread_rwlock_rdlock(&index_table->lock, error);
+	result = avl_tree_search(index_table->avl_tree, key);
+	try_pthread_rwlock_unlock(&index_table->lock, error);
+	return result;
+
+error:
+	return NULL;
+}
+
+/*
+* Call the function on every record in the order of the keys, the traversal
+* stops at the first call which does not return 0.
+*/
+extern int index_table_foreach(const index_table_t handle, int (*function)(void* key, void* value, void* context), void* context) {
+	struct index_table* index_table = (struct index_table*)handle;
+	avl_tree_node_t node;
+	_stack_t stack;
+	int result = 0;
+
+	try(stack = stack_init(), NULL, error);
+	try_pthread_rwlock_rdlock(&index_table->lock, cleanup);
+	node = avl_tree_get_root(index_table->avl_tree);
+	while ((node || !stack_is_empty(stack)) && !result) {
+		if (node) {
+			try(stack_push(stack, node), !0, unlock);
+			node = avl_tree_node_get_left_son(node);
+		}
+		else {
+			node = stack_pop(stack);
+			result = function(avl_tree_node_get_key(node), avl_tree_node_get_value(node), context);
+			node = avl_tree_node_get_right_son(node);
+		}
+	}
+	try_pthread_rwlock_unlock(&index_table->lock, cleanup);
+	stack_destroy(stack);
+	return result;
+
+unlock:
+	pthread_rwlock_unlock(&index_table->lock);
+cleanup:
+	stack_destroy(stack);
+error:
+	return 1;
+}
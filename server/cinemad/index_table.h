@@ -24,7 +24,25 @@ extern int index_table_delete(
     const void* key
 );
 
+extern int index_table_build(
+    const index_table_t handle,
+    void** keys,
+    index_record_t* records,
+    const long n
+);
+
 extern index_record_t index_table_search(
     const index_table_t handle,
     void* key
 );
+
+extern index_record_t index_table_find(
+    const index_table_t handle,
+    const void* key
+);
+
+extern int index_table_foreach(
+    const index_table_t handle,
+    int (*function)(void* key, void* value, void* context),
+    void* context
+);
@@ -0,0 +1,325 @@
+#include "layout.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <try.h>
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static struct venue_layout* read_layout(FILE* file);
+static int parse_section(struct venue_layout* layout, char* line);
+static int parse_row(const char* token, size_t* n_seats, char** gaps);
+static int add_section(struct venue_layout* layout, const char* name, const size_t n_rows, const size_t* row_seats, char** row_gaps);
+
+extern struct venue_layout* layout_load(const char* filename) {
+	struct venue_layout* layout;
+	FILE* file;
+
+	try(file = fopen(filename, "r"), NULL, error);
+	if ((layout = read_layout(file)) == NULL) {
+		int error = errno;
+		fclose(file);
+		errno = error;
+		return NULL;
+	}
+	fclose(file);
+	return layout;
+
+error:
+	return NULL;
+}
+
+extern struct venue_layout* layout_parse(const char* text) {
+	struct venue_layout* layout;
+	FILE* file;
+
+	try(file = fmemopen((void*)text, strlen(text), "r"), NULL, error);
+	if ((layout = read_layout(file)) == NULL) {
+		int error = errno;
+		fclose(file);
+		errno = error;
+		return NULL;
+	}
+	fclose(file);
+	return layout;
+
+error:
+	return NULL;
+}
+
+extern char* layout_format(const struct venue_layout* layout) {
+	char* text;
+	char* cursor;
+	size_t size = 1;
+
+	// a row takes at most the characters of its positions and a separator
+	// for each of them, or 20 characters without gaps
+	for (size_t k = 0; k < layout->n_sections; k++) {
+		const struct venue_section* section = &layout->sections[k];
+		size += SECTION_NAME_LEN + 1;
+		for (size_t r = 0; r < section->n_rows; r++) {
+			size += 21 + ((section->row_gaps && section->row_gaps[r]) ? 2 * strlen(section->row_gaps[r]) : 0);
+		}
+	}
+	try(text = malloc(sizeof * text * size), NULL, error);
+	cursor = text;
+	for (size_t k = 0; k < layout->n_sections; k++) {
+		const struct venue_section* section = &layout->sections[k];
+		cursor += sprintf(cursor, "%s", section->name);
+		for (size_t r = 0; r < section->n_rows; r++) {
+			const char* gaps = section->row_gaps ? section->row_gaps[r] : NULL;
+			if (!gaps) {
+				cursor += sprintf(cursor, " %zu", section->row_start[r + 1] - section->row_start[r]);
+				continue;
+			}
+			// the runs of the row alternate seats and gaps
+			for (const char* position = gaps; *position;) {
+				size_t run = strspn(position, (*position == '#') ? "#" : ".");
+				cursor += sprintf(cursor, (position == gaps) ? " %zu" : ":%zu", run);
+				position += run;
+			}
+		}
+		*cursor++ = '\n';
+	}
+	*cursor = 0;
+	return text;
+
+error:
+	return NULL;
+}
+
+extern struct venue_layout* layout_rectangle(const size_t rows, const size_t columns) {
+	struct venue_layout* layout;
+	size_t* row_seats;
+
+	try(layout = calloc(1, sizeof * layout), NULL, error);
+	if (rows && columns) {
+		try(row_seats = malloc(sizeof * row_seats * rows), NULL, cleanup);
+		for (size_t i = 0; i < rows; i++) {
+			row_seats[i] = columns;
+		}
+		if (add_section(layout, "HALL", rows, row_seats, NULL)) {
+			free(row_seats);
+			goto cleanup;
+		}
+		free(row_seats);
+	}
+	return layout;
+
+cleanup:
+	layout_destroy(layout);
+error:
+	return NULL;
+}
+
+extern void layout_destroy(struct venue_layout* layout) {
+	for (size_t i = 0; i < layout->n_sections; i++) {
+		struct venue_section* section = &layout->sections[i];
+		if (section->row_gaps) {
+			for (size_t j = 0; j < section->n_rows; j++) {
+				free(section->row_gaps[j]);
+			}
+		}
+		free(section->row_gaps);
+		free(section->row_start);
+	}
+	free(layout->sections);
+	free(layout);
+}
+
+extern long layout_find_section(const struct venue_layout* layout, const char* name) {
+	for (size_t i = 0; i < layout->n_sections; i++) {
+		if (!strcmp(layout->sections[i].name, name)) {
+			return (long)i;
+		}
+	}
+	return -1;
+}
+
+/*
+* Read the sections of the layout from the file, one per line.
+*
+* @return	the layout on success or return NULL and set properly errno on
+*			error, errno is set to EINVAL if the layout is not valid.
+*/
+static struct venue_layout* read_layout(FILE* file) {
+	struct venue_layout* layout;
+	char* line = NULL;
+	size_t size = 0;
+
+	try(layout = calloc(1, sizeof * layout), NULL, error);
+	while (getline(&line, &size, file) != -1) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[strspn(line, " \t")] == 0 || line[strspn(line, " \t")] == '#') {
+			continue;
+		}
+		try(parse_section(layout, line), !0, cleanup);
+	}
+	if (ferror(file)) {
+		goto cleanup;
+	}
+	if (!layout->n_seats) {
+		errno = EINVAL;
+		goto cleanup;
+	}
+	free(line);
+	return layout;
+
+cleanup:
+	{
+		int error = errno;
+		free(line);
+		layout_destroy(layout);
+		errno = error;
+	}
+error:
+	return NULL;
+}
+
+/*
+* Parse a line of the layout file and append its section to the layout.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int parse_section(struct venue_layout* layout, char* line) {
+	char* saveptr = NULL;
+	char* name;
+	char* token;
+	size_t n_rows = 0;
+	size_t* row_seats = NULL;
+	char** row_gaps = NULL;
+	int has_gaps = 0;
+
+	name = strtok_r(line, " \t", &saveptr);
+	if (strlen(name) > SECTION_NAME_LEN || layout_find_section(layout, name) != -1) {
+		errno = EINVAL;
+		return 1;
+	}
+	while ((token = strtok_r(NULL, " \t", &saveptr)) != NULL) {
+		size_t* seats;
+		char** gaps;
+		try(seats = realloc(row_seats, sizeof * seats * (n_rows + 1)), NULL, cleanup);
+		row_seats = seats;
+		try(gaps = realloc(row_gaps, sizeof * gaps * (n_rows + 1)), NULL, cleanup);
+		row_gaps = gaps;
+		row_gaps[n_rows] = NULL;
+		n_rows++;
+		try(parse_row(token, &row_seats[n_rows - 1], &row_gaps[n_rows - 1]), !0, cleanup);
+		has_gaps |= (row_gaps[n_rows - 1] != NULL);
+	}
+	if (!n_rows) {
+		errno = EINVAL;
+		goto cleanup;
+	}
+	if (!has_gaps) {
+		free(row_gaps);
+		row_gaps = NULL;
+	}
+	try(add_section(layout, name, n_rows, row_seats, row_gaps), !0, cleanup);
+	free(row_seats);
+	return 0;
+
+cleanup:
+	if (row_gaps) {
+		for (size_t i = 0; i < n_rows; i++) {
+			free(row_gaps[i]);
+		}
+	}
+	free(row_gaps);
+	free(row_seats);
+	return 1;
+}
+
+/*
+* Parse a row made of runs which alternate seats and gaps, set the gaps
+* parameter to NULL if the row is a single run of seats.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int parse_row(const char* token, size_t* n_seats, char** gaps) {
+	size_t runs[2] = { 0, 0 };
+	size_t n_runs = 0;
+	const char* cursor = token;
+	char* endptr;
+
+	*gaps = NULL;
+	// the first pass validates the runs and counts the positions of the row
+	do {
+		if (*cursor < '0' || *cursor > '9') {
+			goto invalid;
+		}
+		unsigned long run = strtoul(cursor, &endptr, 10);
+		if (!run || run > INT_MAX || (*endptr && *endptr != ':')) {
+			goto invalid;
+		}
+		runs[n_runs % 2] += run;
+		n_runs++;
+		cursor = *endptr ? endptr + 1 : endptr;
+	} while (*endptr);
+	if (n_runs % 2 == 0 || runs[0] > INT_MAX) {
+		goto invalid;
+	}
+	*n_seats = runs[0];
+	if (n_runs > 1) {
+		char* position;
+		try(*gaps = malloc(sizeof * *gaps * (runs[0] + runs[1] + 1)), NULL, error);
+		position = *gaps;
+		cursor = token;
+		for (size_t i = 0; i < n_runs; i++) {
+			unsigned long run = strtoul(cursor, &endptr, 10);
+			memset(position, (i % 2) ? '.' : '#', run);
+			position += run;
+			cursor = endptr + 1;
+		}
+		*position = 0;
+	}
+	return 0;
+
+invalid:
+	errno = EINVAL;
+error:
+	return 1;
+}
+
+/*
+* Append a section to the layout, the section takes ownership of row_gaps.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int add_section(struct venue_layout* layout, const char* name, const size_t n_rows, const size_t* row_seats, char** row_gaps) {
+	struct venue_section* sections;
+	struct venue_section* section;
+	size_t* row_start;
+
+	try(row_start = malloc(sizeof * row_start * (n_rows + 1)), NULL, error);
+	row_start[0] = 0;
+	for (size_t i = 0; i < n_rows; i++) {
+		row_start[i + 1] = row_start[i] + row_seats[i];
+	}
+	if (layout->n_seats + row_start[n_rows] > INT_MAX) {
+		errno = EINVAL;
+		goto cleanup;
+	}
+	try(sections = realloc(layout->sections, sizeof * sections * (layout->n_sections + 1)), NULL, cleanup);
+	layout->sections = sections;
+	section = &layout->sections[layout->n_sections];
+	strcpy(section->name, name);
+	section->first_seat = layout->n_seats;
+	section->n_seats = row_start[n_rows];
+	section->n_rows = n_rows;
+	section->row_start = row_start;
+	section->row_gaps = row_gaps;
+	layout->n_sections++;
+	layout->n_seats += section->n_seats;
+	layout->n_rows += n_rows;
+	return 0;
+
+cleanup:
+	free(row_start);
+error:
+	return 1;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+
+#define SECTION_NAME_LEN 15
+
+/*
+* Section of the venue, its seats are numbered row by row starting from
+* first_seat. row_start[r] is the first seat of the r-th row relative to the
+* section and row_start[n_rows] is the number of seats of the section.
+* row_gaps[r] is NULL for a row without gaps, otherwise it is a string with a
+* '#' for every seat and a '.' for every gap of the row.
+*/
+struct venue_section {
+	char name[SECTION_NAME_LEN + 1];
+	size_t first_seat;
+	size_t n_seats;
+	size_t n_rows;
+	size_t* row_start;
+	char** row_gaps;
+};
+
+/*
+* Venue split in sections, the seats of a section are contiguous.
+*/
+struct venue_layout {
+	size_t n_seats;
+	size_t n_rows;
+	size_t n_sections;
+	struct venue_section* sections;
+};
+
+/*
+* Load the layout described by the file. Every line describes a section as
+* its name followed by its rows, a row is a list of runs separated by ':'
+* which alternate seats and gaps, e.g. "A 10 12 5:2:5".
+*
+* @return	the layout on success or return NULL and set properly errno on
+*			error, errno is set to EINVAL if the file is not valid.
+*/
+extern struct venue_layout* layout_load(
+	const char* filename
+);
+
+/*
+* Parse a layout written as the content of a layout file.
+*
+* @return	the layout on success or return NULL and set properly errno on
+*			error, errno is set to EINVAL if the text is not valid.
+*/
+extern struct venue_layout* layout_parse(
+	const char* text
+);
+
+/*
+* Write the layout as the content of a layout file, one line per section,
+* in a malloc'd string.
+*
+* @return	the text on success or return NULL and set properly errno on
+*			error.
+*/
+extern char* layout_format(
+	const struct venue_layout* layout
+);
+
+/*
+* Create the layout of a rectangular hall with a single section.
+*
+* @return	the layout on success or return NULL and set properly errno on
+*			error.
+*/
+extern struct venue_layout* layout_rectangle(
+	const size_t rows,
+	const size_t columns
+);
+
+/*
+* Destroy the layout.
+*/
+extern void layout_destroy(
+	struct venue_layout* layout
+);
+
+/*
+* Find the section by its name.
+*
+* @return	the index of the section or -1 if the layout has no such section.
+*/
+extern long layout_find_section(
+	const struct venue_layout* layout,
+	const char* name
+);
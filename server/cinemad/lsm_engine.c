@@ -0,0 +1,2970 @@
+#include "engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <try.h>
+
+#include "crc32c.h"
+#include "index_table.h"
+#include "record.h"
+#include "wal.h"
+
+#define MANIFEST_MAGIC "CLSM"
+#define RUN_MAGIC "CLSR"
+#define LSM_VERSION 1
+#define MANIFEST_HEADER_LEN 28
+#define MANIFEST_ENTRY_LEN 12
+#define KEY_LEN (RECORD_NAME_LEN + 2)	// the tag of the key space, the key and the terminator
+#define MEMTABLE_LEN (1UL << 22)
+#define RUN_LEN (1UL << 23)	// bytes of records of a run written by a compaction
+#define BLOCK_LEN 4096
+#define INDEX_ENTRY_LEN 32
+#define FOOTER_LEN 80
+#define BLOOM_BITS 10	// bits of the bloom filter of a run per record
+#define BLOOM_HASHES 7
+#define LEVELS 7
+#define L0_RUNS 4	// runs of level 0 which start a compaction into level 1
+#define L0_STOP_RUNS 12	// runs of level 0 which stop the flushes until a compaction
+#define L1_LEN (1UL << 25)	// bytes of level 1 which start a compaction into level 2
+#define FANOUT 10	// growth of the budget of a level over the previous one
+#define LOCK_BUCKETS 1024
+#define WRITE_BUFFER_LEN (1UL << 20)
+#define WAL_INTERVAL 10
+#define INT_PAGE_BITS 12
+#define INT_PAGE_LEN (1UL << INT_PAGE_BITS)
+#define INT_PAGES (RECORD_INT_KEYS >> INT_PAGE_BITS)
+#define RETRY_INTERVAL 1000	// milliseconds before a failed flush or compaction is tried again
+
+/*
+* A block of a run holds whole records, the index of the run keeps its
+* offset, its length and the key of its first record.
+*/
+struct block {
+	uint64_t offset;
+	uint32_t length;
+	char first[KEY_LEN];
+};
+
+/*
+* An immutable file of records sorted by key. The file starts with the
+* header of the data file and the records, followed by the index of the
+* blocks, the bloom filter of the keys and a footer holding their positions
+* and a checksum of them. The index and the bloom filter are kept in memory,
+* the records are read a block at a time.
+*
+* A run is referenced by its level and by every view which copied the level,
+* the last release closes it and removes the file if a compaction made it
+* obsolete.
+*/
+struct run {
+	unsigned long seq;
+	char* filename;
+	int fd;
+	size_t size;
+	size_t n_records;
+	struct block* blocks;
+	size_t n_blocks;
+	char last[KEY_LEN];
+	unsigned char* bloom;
+	uint64_t bloom_bits;
+	atomic_int refs;
+	atomic_int obsolete;
+};
+
+/*
+* The runs of level 0 overlap and are kept newest first, those of the other
+* levels are disjoint and kept in the order of their keys.
+*/
+struct level {
+	struct run** runs;
+	size_t n_runs;
+};
+
+/*
+* The value of a key of a memtable, the record encoded as in the data file.
+*/
+struct entry {
+	size_t length;
+	char bytes[RECORD_MAX_LEN];
+};
+
+/*
+* The stores buffered in memory and the log which makes them durable until
+* they are written to a run. The records of the name key space are indexed
+* by the index table, those of the integer key space by a two level table
+* addressed by the key, as in the memory engine, which keeps them in the
+* order of their keys too. committing counts the stores waiting for the log,
+* each inserts its records once its log record is durable, so the memtable
+* is written to a run and its log closed once none is left.
+*/
+struct memtable {
+	index_table_t table;
+	struct entry** int_pages[INT_PAGES];
+	size_t bytes;
+	size_t n_records;
+	wal_t wal;
+	unsigned long log;
+	pthread_mutex_t mutex_commit;
+	pthread_cond_t committed;
+	unsigned long committing;
+};
+
+/*
+* A record copied from a memtable.
+*/
+struct item {
+	char key[KEY_LEN];
+	size_t length;
+	char bytes[RECORD_MAX_LEN];
+};
+
+/*
+* A point in time copy of the storage: the records of the memtables and a
+* reference to every run.
+*/
+struct view {
+	struct item* items[2];
+	size_t n_items[2];
+	struct level levels[LEVELS];
+};
+
+/*
+* Sequential reader of the records of an array of items or of a sequence of
+* disjoint runs in the order of their keys. key, bytes and length describe
+* the current record until the next call of cursor_next.
+*/
+struct cursor {
+	struct item* items;
+	size_t n_items;
+	size_t item;
+	struct run** runs;
+	size_t n_runs;
+	size_t run;
+	size_t block;
+	char buffer[BLOCK_LEN];
+	size_t buffer_length;
+	size_t position;
+	int done;
+	char key[KEY_LEN];
+	const char* bytes;
+	size_t length;
+};
+
+/*
+* Function receiving the records of a merge, the newest version of every key
+* in the order of the keys.
+*/
+typedef int merge_function(void* context, const char* key, const char* bytes, const size_t length);
+
+struct run_writer {
+	unsigned long seq;
+	char* filename;
+	int fd;
+	char* buffer;
+	size_t buffered;
+	uint64_t offset;
+	struct block* blocks;
+	size_t n_blocks;
+	size_t capacity_blocks;
+	size_t block_length;
+	uint64_t* hashes;
+	size_t n_records;
+	size_t capacity_records;
+	char last[KEY_LEN];
+};
+
+/*
+* The runs written by a merge, a new run is started every RUN_LEN bytes.
+*/
+struct output {
+	struct lsm* lsm;
+	struct run_writer* writer;
+	struct run** runs;
+	size_t n_runs;
+	size_t capacity;
+};
+
+struct iteration {
+	storage_foreach_function* function;
+	void* context;
+};
+
+struct backup_stream {
+	int fd;
+	char* buffer;
+	size_t length;
+};
+
+/*
+* A lock of the lock table lives as long as a thread holds or waits for it,
+* refs counts them.
+*/
+struct lock_entry {
+	char key[KEY_LEN];
+	unsigned long refs;
+	pthread_rwlock_t lock;
+	struct lock_entry* next;
+};
+
+struct lock_bucket {
+	pthread_mutex_t mutex;
+	struct lock_entry* entries;
+};
+
+/*
+* The stores are logged and buffered in the memtable. Once it holds
+* memtable_size bytes it becomes the immutable memtable, which the flusher
+* thread writes to a new run of level 0, and a new memtable with a new log
+* replaces it; a store waits if the previous memtable is not written yet.
+* The compactor thread merges the runs of a level which exceeds its budget
+* with the overlapping runs of the next level, meanwhile the flushes go on
+* until level 0 holds L0_STOP_RUNS runs. The data file is the manifest
+* listing the runs of every level, the next sequence number of the runs and
+* the first log not written to a run, it is replaced after every flush and
+* compaction.
+*
+* The keys of both key spaces are mapped to strings which sort the integer
+* keys first, so that a single order covers the memtables and the runs. A
+* lookup searches the memtable, the immutable memtable, the runs of level 0
+* from the newest and then the single run of every other level whose range
+* holds the key, skipping the runs whose bloom filter rules the key out.
+*
+* The stores hold lock_memtable as exclusive, the lookups as shared; a lookup
+* takes lock_version as shared before releasing lock_memtable, so that no
+* flush moves a record from the immutable memtable to a run in between. The
+* flushes and the compactions replace the levels and the manifest holding
+* mutex_manifest, which also guards log, and swap the levels holding
+* lock_version as exclusive, so that holding either is enough to read them.
+* mutex_work guards the immutable memtable, the flush counters and the state
+* of the threads.
+*
+* The keys are locked through a table of locks counted by reference, so that
+* only the keys in use take memory.
+*/
+struct lsm {
+	char* filename;
+	size_t memtable_size;
+	enum wal_sync wal_sync;
+	long wal_interval;
+	long checkpoint_interval;
+	struct memtable* memtable;
+	struct memtable* immutable;
+	pthread_rwlock_t lock_memtable;
+	struct level levels[LEVELS];
+	pthread_rwlock_t lock_version;
+	pthread_mutex_t mutex_manifest;
+	char compact_keys[LEVELS][KEY_LEN];
+	atomic_ulong next_seq;
+	unsigned long log;
+	struct lock_bucket locks[LOCK_BUCKETS];
+	pthread_mutex_t mutex_work;
+	pthread_cond_t flush;
+	pthread_cond_t work;
+	pthread_cond_t flushed;
+	pthread_t flusher;
+	pthread_t compactor;
+	int stopping;
+	int flush_error;
+	size_t l0_runs;
+	int compaction_pending;
+	unsigned long rotations;
+	unsigned long flushes;
+	size_t flushed_bytes;
+	unsigned long flush_latency_last;
+	unsigned long flush_latency_total;
+	unsigned long flush_latency_max;
+	pthread_mutex_t mutex_backup;
+	atomic_ulong backups;
+	atomic_ulong backup_stall_last;
+	atomic_ulong backup_stall_max;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static void* lsm_init(const char* filename, const struct storage_options* options);
+static int lsm_close(void* handle);
+static int lsm_store_batch(void* handle, const size_t n, const char** keys, const char** values, char** result);
+static int lsm_store_ints(void* handle, const size_t n, const unsigned long* keys, const long* values);
+static int lsm_store_number(void* handle, const char* key, const long value);
+static int lsm_checkpoint(void* handle);
+static int lsm_backup(void* handle, const char* filename);
+static int lsm_get_stats(void* handle, struct storage_stats* stats);
+static int lsm_load(void* handle, const char* key, char** result);
+static int lsm_load_int(void* handle, const unsigned long key, long* value);
+static int lsm_load_number(void* handle, const char* key, long* value);
+static int lsm_foreach(void* handle, storage_foreach_function* function, void* context);
+static int lsm_lock_shared(void* handle, const char* key);
+static int lsm_lock_exclusive(void* handle, const char* key);
+static int lsm_lock_exclusive_timed(void* handle, const char* key, const struct timespec* deadline);
+static int lsm_unlock(void* handle, const char* key);
+static int lsm_lock_shared_int(void* handle, const unsigned long key);
+static int lsm_lock_exclusive_int(void* handle, const unsigned long key);
+static int lsm_lock_exclusive_timed_int(void* handle, const unsigned long key, const struct timespec* deadline);
+static int lsm_unlock_int(void* handle, const unsigned long key);
+static int key_comparison(const void* key1, const void* key2);
+static index_record_t entry_init();
+static int entry_destroy(void* key, void* value);
+static void int_key(const unsigned long number, char* key);
+static void record_key(const struct record* record, char* key);
+static uint64_t hash_key(const char* key);
+static void put_u32(char* bytes, const uint32_t value);
+static void put_u64(char* bytes, const uint64_t value);
+static uint32_t get_u32(const char* bytes);
+static uint64_t get_u64(const char* bytes);
+static int pread_all(const int fd, char* bytes, const size_t length, const off_t offset);
+static int write_all(const int fd, const char* bytes, const size_t length);
+static char* numbered_filename(const struct lsm* lsm, const unsigned long number, const char* extension);
+static int open_store(struct lsm* lsm);
+static int read_manifest(struct lsm* lsm, const char* bytes, const size_t size);
+static int write_manifest(struct lsm* lsm, const struct level* levels, const unsigned long log);
+static int import_file(struct lsm* lsm, const char* bytes, const size_t size);
+static int replay_logs(struct lsm* lsm);
+static int replay_record(void* context, const char* payload, const size_t length);
+static void remove_orphans(struct lsm* lsm, const unsigned long log);
+static int listed_run(const struct lsm* lsm, const unsigned long seq);
+static struct memtable* memtable_init(const struct lsm* lsm, const unsigned long log, const int logged);
+static int memtable_destroy(struct memtable* memtable);
+static struct entry* memtable_find(const struct memtable* memtable, const char* key);
+static int memtable_foreach(const struct memtable* memtable, int (*function)(void* key, void* value, void* context), void* context);
+static int insert_records(struct memtable* memtable, const struct record* records, const size_t n);
+static size_t memtable_memory(const struct memtable* memtable);
+static int store_records(struct lsm* lsm, const struct record* records, const size_t n);
+static int rotate(struct lsm* lsm);
+static int start_flush(struct lsm* lsm, unsigned long* target);
+static int wait_flush(struct lsm* lsm, const unsigned long target);
+static int find_bytes(struct lsm* lsm, const char* key, char* bytes);
+static int find_in_runs(struct lsm* lsm, const char* key, char* bytes);
+static struct run* level_find(const struct level* level, const char* key);
+static int run_find(struct run* run, const char* key, char* bytes);
+static void bloom_add(unsigned char* bloom, const uint64_t bits, const uint64_t hash);
+static int bloom_contains(const unsigned char* bloom, const uint64_t bits, const uint64_t hash);
+static struct run_writer* run_writer_open(struct lsm* lsm);
+static int run_writer_add(struct run_writer* writer, const char* key, const char* bytes, const size_t length);
+static struct run* run_writer_finish(struct run_writer* writer);
+static void run_writer_abort(struct run_writer* writer);
+static struct run* run_open(const struct lsm* lsm, const unsigned long seq);
+static void run_release(struct run* run);
+static struct run* write_memtable(struct lsm* lsm, struct memtable* memtable);
+static int write_entry(void* key, void* value, void* context);
+static int flush_immutable(struct lsm* lsm, struct memtable* memtable);
+static int levels_copy(const struct level* levels, struct level* copy);
+static void levels_free(struct level* levels);
+static void levels_swap(struct level* levels1, struct level* levels2);
+static void levels_release(struct level* levels);
+static int level_insert(struct level* level, struct run* run, const size_t position);
+static size_t level_position(const struct level* level, const struct run* run);
+static void level_remove(struct level* level, const struct run* run);
+static size_t level_size(const struct level* level);
+static int compact(struct lsm* lsm, int* compacted);
+static int emit_output(void* context, const char* key, const char* bytes, const size_t length);
+static int output_entry(void* key, void* value, void* context);
+static int output_finish(struct output* output);
+static void output_abort(struct output* output);
+static int cursor_next(struct cursor* cursor);
+static int merge(struct cursor* cursors, const size_t n, merge_function* emit, void* context);
+static int take_view(struct lsm* lsm, struct view* view);
+static int collect_items(struct memtable* memtable, struct item** items, size_t* n);
+static int collect_item(void* key, void* value, void* context);
+static void release_view(struct view* view);
+static struct cursor* view_cursors(struct view* view, size_t* n);
+static int emit_foreach(void* context, const char* key, const char* bytes, const size_t length);
+static int emit_backup(void* context, const char* key, const char* bytes, const size_t length);
+static int init_locks(struct lsm* lsm);
+static void destroy_locks(struct lsm* lsm);
+static int lock_key(struct lsm* lsm, const char* key, const int exclusive, const int timed, const struct timespec* deadline);
+static int unlock_key(struct lsm* lsm, const char* key);
+static int start_threads(struct lsm* lsm);
+static void* flusher_routine(void* arg);
+static void* compactor_routine(void* arg);
+
+static void* lsm_init(const char* filename, const struct storage_options* options) {
+	struct lsm* lsm;
+	lsm = calloc(1, sizeof * lsm);
+	if (lsm) {
+		lsm->memtable_size = (options && options->memtable_size) ? options->memtable_size : MEMTABLE_LEN;
+		// without the log option the log is left to the kernel writeback, as the stores of the file engine
+		lsm->wal_sync = (options && options->wal) ? options->wal_sync : WAL_SYNC_NONE;
+		lsm->wal_interval = (options && options->wal_interval) ? options->wal_interval : WAL_INTERVAL;
+		lsm->checkpoint_interval = options ? options->checkpoint_interval : 0;
+		try(lsm->filename = strdup(filename), NULL, error);
+		try_pthread_rwlock_init(&lsm->lock_memtable, cleanup1);
+		try_pthread_rwlock_init(&lsm->lock_version, cleanup2);
+		try_pthread_mutex_init(&lsm->mutex_manifest, cleanup3);
+		try_pthread_mutex_init(&lsm->mutex_backup, cleanup4);
+		try(init_locks(lsm), !0, cleanup5);
+		try(open_store(lsm), !0, cleanup6);
+		try(replay_logs(lsm), !0, cleanup6);
+		remove_orphans(lsm, lsm->log);
+		try(lsm->memtable = memtable_init(lsm, lsm->log, 1), NULL, cleanup6);
+		try(start_threads(lsm), !0, cleanup7);
+	}
+	return lsm;
+
+cleanup7:
+	{
+		int error = errno;
+		memtable_destroy(lsm->memtable);
+		errno = error;
+	}
+cleanup6:
+	levels_release(lsm->levels);
+	destroy_locks(lsm);
+cleanup5:
+	pthread_mutex_destroy(&lsm->mutex_backup);
+cleanup4:
+	pthread_mutex_destroy(&lsm->mutex_manifest);
+cleanup3:
+	pthread_rwlock_destroy(&lsm->lock_version);
+cleanup2:
+	pthread_rwlock_destroy(&lsm->lock_memtable);
+cleanup1:
+	free(lsm->filename);
+error:
+	free(lsm);
+	return NULL;
+}
+
+/*
+* The memtables are not written to runs, their logs are replayed at the next
+* startup.
+*/
+static int lsm_close(void* handle) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	try_pthread_mutex_lock(&lsm->mutex_work, error);
+	lsm->stopping = 1;
+	pthread_cond_signal(&lsm->flush);
+	pthread_cond_signal(&lsm->work);
+	try_pthread_mutex_unlock(&lsm->mutex_work, error);
+	try_pthread(pthread_join(lsm->flusher, NULL), error);
+	try_pthread(pthread_join(lsm->compactor, NULL), error);
+	pthread_cond_destroy(&lsm->flushed);
+	pthread_cond_destroy(&lsm->work);
+	pthread_cond_destroy(&lsm->flush);
+	pthread_mutex_destroy(&lsm->mutex_work);
+	if (lsm->immutable) {
+		try(memtable_destroy(lsm->immutable), !0, error);
+	}
+	try(memtable_destroy(lsm->memtable), !0, error);
+	levels_release(lsm->levels);
+	destroy_locks(lsm);
+	try_pthread_mutex_destroy(&lsm->mutex_backup, error);
+	try_pthread_mutex_destroy(&lsm->mutex_manifest, error);
+	try_pthread_rwlock_destroy(&lsm->lock_version, error);
+	try_pthread_rwlock_destroy(&lsm->lock_memtable, error);
+	free(lsm->filename);
+	free(lsm);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int lsm_store_batch(void* handle, const size_t n, const char** keys, const char** values, char** result) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct record* records;
+
+	try(records = malloc(sizeof * records * (n + 1)), NULL, error);
+	for (size_t i = 0; i < n; i++) {
+		// a key or a value which can not be represented fails the whole batch
+		if (record_encode(keys[i], values[i], &records[i])) {
+			free(records);
+			*result = strdup(MSG_FAIL);
+			return 0;
+		}
+	}
+	try(store_records(lsm, records, n), !0, cleanup);
+	free(records);
+	*result = strdup(MSG_SUCC);
+	return 0;
+
+cleanup:
+	free(records);
+error:
+	return 1;
+}
+
+static int lsm_store_ints(void* handle, const size_t n, const unsigned long* keys, const long* values) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct record* records;
+
+	for (size_t i = 0; i < n; i++) {
+		if (keys[i] >= RECORD_INT_KEYS) {
+			errno = EINVAL;
+			return 1;
+		}
+	}
+	try(records = malloc(sizeof * records * (n + 1)), NULL, error);
+	for (size_t i = 0; i < n; i++) {
+		record_encode_int(keys[i], values[i], &records[i]);
+	}
+	try(store_records(lsm, records, n), !0, cleanup);
+	free(records);
+	return 0;
+
+cleanup:
+	free(records);
+error:
+	return 1;
+}
+
+static int lsm_store_number(void* handle, const char* key, const long value) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct record record;
+
+	try(record_encode_number(key, value, &record), !0, error);
+	try(store_records(lsm, &record, 1), !0, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Write the memtable to a run and wait for it, so that the logs are emptied.
+*/
+static int lsm_checkpoint(void* handle) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	unsigned long target;
+
+	while (start_flush(lsm, &target)) {
+		if (errno != EAGAIN) {
+			return 1;
+		}
+		try(wait_flush(lsm, ULONG_MAX), !0, error);
+	}
+	return wait_flush(lsm, target);
+
+error:
+	return 1;
+}
+
+/*
+* Write every record to a data file in the order of the keys, the stores wait
+* only while the memtables are copied.
+*/
+static int lsm_backup(void* handle, const char* filename) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct stat st;
+	struct stat backup_st;
+	struct view view;
+	struct cursor* cursors;
+	size_t n;
+	struct backup_stream stream;
+	struct timespec start;
+	struct timespec end;
+	unsigned long stall;
+	char* temporary_filename;
+
+	// the data file holds the manifest, a backup over it would lose every run
+	try(stat(lsm->filename, &st), -1, error);
+	if (!stat(filename, &backup_st) && st.st_dev == backup_st.st_dev && st.st_ino == backup_st.st_ino) {
+		errno = EINVAL;
+		goto error;
+	}
+	try(temporary_filename = malloc(strlen(filename) + sizeof ".tmp"), NULL, error);
+	sprintf(temporary_filename, "%s.tmp", filename);
+	try(stream.buffer = malloc(WRITE_BUFFER_LEN), NULL, cleanup1);
+	try_pthread_mutex_lock(&lsm->mutex_backup, cleanup2);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	try(take_view(lsm, &view), !0, cleanup3);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stall = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+	try(cursors = view_cursors(&view, &n), NULL, cleanup4);
+	try(stream.fd = open(temporary_filename, O_WRONLY | O_CREAT | O_TRUNC, 0660), -1, cleanup5);
+	record_write_header(stream.buffer);
+	stream.length = RECORD_HEADER_LEN;
+	try(merge(cursors, n, &emit_backup, &stream), !0, cleanup6);
+	try(write_all(stream.fd, stream.buffer, stream.length), !0, cleanup6);
+	try(fsync(stream.fd), -1, cleanup6);
+	try(close(stream.fd), -1, cleanup7);
+	try(rename(temporary_filename, filename), -1, cleanup7);
+	try(engine_sync_directory(filename), !0, cleanup5);
+	free(cursors);
+	release_view(&view);
+	atomic_fetch_add(&lsm->backups, 1);
+	atomic_store(&lsm->backup_stall_last, stall);
+	if (stall > atomic_load(&lsm->backup_stall_max)) {
+		atomic_store(&lsm->backup_stall_max, stall);
+	}
+	pthread_mutex_unlock(&lsm->mutex_backup);
+	free(stream.buffer);
+	free(temporary_filename);
+	return 0;
+
+cleanup6:
+	close(stream.fd);
+cleanup7:
+	unlink(temporary_filename);
+cleanup5:
+	free(cursors);
+cleanup4:
+	release_view(&view);
+cleanup3:
+	pthread_mutex_unlock(&lsm->mutex_backup);
+cleanup2:
+	free(stream.buffer);
+cleanup1:
+	free(temporary_filename);
+error:
+	return 1;
+}
+
+/*
+* The dirty bytes are those of the memtables and the flushes are their
+* writes to runs. The memory is that of the memtables and of the indexes and
+* the bloom filters of the runs.
+*/
+static int lsm_get_stats(void* handle, struct storage_stats* stats) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	memset(stats, 0, sizeof * stats);
+	try_pthread_rwlock_rdlock(&lsm->lock_memtable, error);
+	stats->dirty_bytes = lsm->memtable->bytes + (lsm->immutable ? lsm->immutable->bytes : 0);
+	stats->memory_bytes = memtable_memory(lsm->memtable) + (lsm->immutable ? memtable_memory(lsm->immutable) : 0);
+	try_pthread_rwlock_unlock(&lsm->lock_memtable, error);
+	// the runs keep only their index and bloom filter in memory
+	try_pthread_rwlock_rdlock(&lsm->lock_version, error);
+	for (size_t i = 0; i < LEVELS; i++) {
+		for (size_t j = 0; j < lsm->levels[i].n_runs; j++) {
+			const struct run* run = lsm->levels[i].runs[j];
+			stats->memory_bytes += run->n_blocks * sizeof * run->blocks + (size_t)((run->bloom_bits + 7) / 8);
+		}
+	}
+	try_pthread_rwlock_unlock(&lsm->lock_version, error);
+	try_pthread_mutex_lock(&lsm->mutex_work, error);
+	stats->flushes = lsm->flushes;
+	stats->flushed_bytes = lsm->flushed_bytes;
+	stats->flush_latency_last = lsm->flush_latency_last;
+	stats->flush_latency_avg = lsm->flushes ? lsm->flush_latency_total / lsm->flushes : 0;
+	stats->flush_latency_max = lsm->flush_latency_max;
+	try_pthread_mutex_unlock(&lsm->mutex_work, error);
+	stats->backups = atomic_load(&lsm->backups);
+	stats->backup_stall_last = atomic_load(&lsm->backup_stall_last);
+	stats->backup_stall_max = atomic_load(&lsm->backup_stall_max);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int lsm_load(void* handle, const char* key, char** result) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct record record;
+	char sort_key[KEY_LEN];
+	char bytes[RECORD_MAX_LEN];
+
+	if (record_encode_key(key, &record)) {
+		goto fail;
+	}
+	record_key(&record, sort_key);
+	if (find_bytes(lsm, sort_key, bytes)) {
+		if (errno == ENOENT) {
+			goto fail;
+		}
+		goto error;
+	}
+	try(record_value_string(bytes, result), !0, error);
+	return 0;
+
+fail:
+	*result = strdup(MSG_FAIL);
+	return 0;
+error:
+	return 1;
+}
+
+static int lsm_load_int(void* handle, const unsigned long key, long* value) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	char sort_key[KEY_LEN];
+	char bytes[RECORD_MAX_LEN];
+
+	if (key >= RECORD_INT_KEYS) {
+		errno = EINVAL;
+		return 1;
+	}
+	int_key(key, sort_key);
+	try(find_bytes(lsm, sort_key, bytes), !0, error);
+	return record_value_number(bytes, value);
+
+error:
+	return 1;
+}
+
+static int lsm_load_number(void* handle, const char* key, long* value) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct record record;
+	char sort_key[KEY_LEN];
+	char bytes[RECORD_MAX_LEN];
+
+	try(record_encode_key(key, &record), !0, error);
+	record_key(&record, sort_key);
+	try(find_bytes(lsm, sort_key, bytes), !0, error);
+	return record_value_number(bytes, value);
+
+error:
+	return 1;
+}
+
+/*
+* The iteration runs on a view of the storage, the stores wait only while
+* the memtables are copied.
+*/
+static int lsm_foreach(void* handle, storage_foreach_function* function, void* context) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct iteration iteration = { function, context };
+	struct view view;
+	struct cursor* cursors;
+	size_t n;
+
+	try(take_view(lsm, &view), !0, error);
+	try(cursors = view_cursors(&view, &n), NULL, cleanup1);
+	try(merge(cursors, n, &emit_foreach, &iteration), !0, cleanup2);
+	free(cursors);
+	release_view(&view);
+	return 0;
+
+cleanup2:
+	free(cursors);
+cleanup1:
+	{
+		int error = errno;
+		release_view(&view);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+static int lsm_lock_shared(void* handle, const char* key) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct record record;
+	char sort_key[KEY_LEN];
+	try(record_encode_key(key, &record), !0, on_success);
+	record_key(&record, sort_key);
+	try(lock_key(lsm, sort_key, 0, 0, NULL), !0, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int lsm_lock_exclusive(void* handle, const char* key) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct record record;
+	char sort_key[KEY_LEN];
+	try(record_encode_key(key, &record), !0, on_success);
+	record_key(&record, sort_key);
+	try(lock_key(lsm, sort_key, 1, 0, NULL), !0, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int lsm_lock_exclusive_timed(void* handle, const char* key, const struct timespec* deadline) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct record record;
+	char sort_key[KEY_LEN];
+	try(record_encode_key(key, &record), !0, on_success);
+	record_key(&record, sort_key);
+	try(lock_key(lsm, sort_key, 1, 1, deadline), !0, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int lsm_unlock(void* handle, const char* key) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	struct record record;
+	char sort_key[KEY_LEN];
+	try(record_encode_key(key, &record), !0, on_success);
+	record_key(&record, sort_key);
+	try(unlock_key(lsm, sort_key), !0, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int lsm_lock_shared_int(void* handle, const unsigned long key) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	char sort_key[KEY_LEN];
+	if (key >= RECORD_INT_KEYS) {
+		errno = EINVAL;
+		return 1;
+	}
+	int_key(key, sort_key);
+	return lock_key(lsm, sort_key, 0, 0, NULL);
+}
+
+static int lsm_lock_exclusive_int(void* handle, const unsigned long key) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	char sort_key[KEY_LEN];
+	if (key >= RECORD_INT_KEYS) {
+		errno = EINVAL;
+		return 1;
+	}
+	int_key(key, sort_key);
+	return lock_key(lsm, sort_key, 1, 0, NULL);
+}
+
+static int lsm_lock_exclusive_timed_int(void* handle, const unsigned long key, const struct timespec* deadline) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	char sort_key[KEY_LEN];
+	if (key >= RECORD_INT_KEYS) {
+		errno = EINVAL;
+		return 1;
+	}
+	int_key(key, sort_key);
+	return lock_key(lsm, sort_key, 1, 1, deadline);
+}
+
+static int lsm_unlock_int(void* handle, const unsigned long key) {
+	struct lsm* lsm = (struct lsm*)handle;
+
+	char sort_key[KEY_LEN];
+	if (key >= RECORD_INT_KEYS) {
+		errno = EINVAL;
+		return 1;
+	}
+	int_key(key, sort_key);
+	return unlock_key(lsm, sort_key);
+}
+
+/*
+* Compare two keys, the index table needs exactly -1, 0 or 1.
+*/
+static int key_comparison(const void* key1, const void* key2) {
+	int result = strcmp((const char*)key1, (const char*)key2);
+	return (result > 0) - (result < 0);
+}
+
+static index_record_t entry_init() {
+	return calloc(1, sizeof(struct entry));
+}
+
+static int entry_destroy(void* key, void* value) {
+	free(key);
+	free(value);
+	return 0;
+}
+
+/*
+* Map a key of the integer key space to its sort key, the tag sorts it before
+* every key of the name key space and the fixed width hexadecimal digits in
+* the order of the numbers.
+*/
+static void int_key(const unsigned long number, char* key) {
+	key[0] = '\x01';
+	for (int i = 0; i < 6; i++) {
+		key[6 - i] = "0123456789abcdef"[(number >> (4 * i)) & 0xf];
+	}
+	key[7] = '\0';
+}
+
+static void record_key(const struct record* record, char* key) {
+	if (record->space == RECORD_SPACE_INT) {
+		int_key(record->number, key);
+	}
+	else {
+		snprintf(key, KEY_LEN, "\x02%s", record->name);
+	}
+}
+
+/*
+* FNV-1a hash of the key.
+*/
+static uint64_t hash_key(const char* key) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (const unsigned char* c = (const unsigned char*)key; *c; c++) {
+		hash = (hash ^ *c) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void put_u32(char* bytes, const uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = (char)(value >> (8 * i));
+	}
+}
+
+static void put_u64(char* bytes, const uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		bytes[i] = (char)(value >> (8 * i));
+	}
+}
+
+static uint32_t get_u32(const char* bytes) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value |= (uint32_t)(unsigned char)bytes[i] << (8 * i);
+	}
+	return value;
+}
+
+static uint64_t get_u64(const char* bytes) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t)(unsigned char)bytes[i] << (8 * i);
+	}
+	return value;
+}
+
+/*
+* Read the bytes of the file at the offset, a file shorter than expected
+* fails with EIO.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int pread_all(const int fd, char* bytes, const size_t length, const off_t offset) {
+	for (size_t done = 0; done < length;) {
+		ssize_t n;
+		if ((n = pread(fd, bytes + done, length - done, offset + (off_t)done)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		if (!n) {
+			errno = EIO;
+			return 1;
+		}
+		done += (size_t)n;
+	}
+	return 0;
+}
+
+static int write_all(const int fd, const char* bytes, const size_t length) {
+	for (size_t done = 0; done < length;) {
+		ssize_t n;
+		if ((n = write(fd, bytes + done, length - done)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		done += (size_t)n;
+	}
+	return 0;
+}
+
+/*
+* Return the name of a run or of a log, the data file name followed by the
+* number and the extension, or return NULL and set properly errno on error.
+*/
+static char* numbered_filename(const struct lsm* lsm, const unsigned long number, const char* extension) {
+	size_t length = (size_t)snprintf(NULL, 0, "%s.%lu.%s", lsm->filename, number, extension) + 1;
+	char* filename;
+	if ((filename = malloc(length))) {
+		snprintf(filename, length, "%s.%lu.%s", lsm->filename, number, extension);
+	}
+	return filename;
+}
+
+/*
+* Load the manifest from the data file. An empty data file starts an empty
+* storage and a data file of records, as written by the other engines or by
+* a backup, is imported into runs of the last level.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EILSEQ if the file is not valid and to ENOTSUP if it
+*			belongs to another version of the format.
+*/
+static int open_store(struct lsm* lsm) {
+	struct stat st;
+	char* bytes;
+	int fd;
+
+	try(fd = open(lsm->filename, O_RDONLY), -1, error);
+	try(fstat(fd, &st), -1, cleanup1);
+	lsm->next_seq = 1;
+	lsm->log = 1;
+	if (st.st_size == 0) {
+		close(fd);
+		remove_orphans(lsm, ULONG_MAX);
+		return write_manifest(lsm, lsm->levels, lsm->log);
+	}
+	try(bytes = malloc((size_t)st.st_size), NULL, cleanup1);
+	try(pread_all(fd, bytes, (size_t)st.st_size, 0), !0, cleanup2);
+	if ((size_t)st.st_size >= sizeof MANIFEST_MAGIC && !memcmp(bytes, MANIFEST_MAGIC, 4)) {
+		try(read_manifest(lsm, bytes, (size_t)st.st_size), !0, cleanup2);
+	}
+	else {
+		// the logs of a previous storage must not be replayed over the records
+		remove_orphans(lsm, ULONG_MAX);
+		if ((size_t)st.st_size < RECORD_HEADER_LEN) {
+			errno = EILSEQ;
+			goto cleanup2;
+		}
+		try(record_check_header(bytes), !0, cleanup2);
+		try(import_file(lsm, bytes, (size_t)st.st_size), !0, cleanup2);
+	}
+	free(bytes);
+	try(close(fd), -1, error);
+	return 0;
+
+cleanup2:
+	free(bytes);
+cleanup1:
+	close(fd);
+error:
+	return 1;
+}
+
+static int read_manifest(struct lsm* lsm, const char* bytes, const size_t size) {
+	size_t n_runs;
+
+	if (size < MANIFEST_HEADER_LEN + sizeof(uint32_t)) {
+		errno = EILSEQ;
+		return 1;
+	}
+	if (get_u32(&bytes[4]) != LSM_VERSION) {
+		errno = ENOTSUP;
+		return 1;
+	}
+	n_runs = get_u32(&bytes[24]);
+	if (size != MANIFEST_HEADER_LEN + n_runs * MANIFEST_ENTRY_LEN + sizeof(uint32_t) || crc32c(0, bytes, size - sizeof(uint32_t)) != get_u32(&bytes[size - sizeof(uint32_t)])) {
+		errno = EILSEQ;
+		return 1;
+	}
+	lsm->next_seq = get_u64(&bytes[8]);
+	lsm->log = get_u64(&bytes[16]);
+	for (size_t i = 0; i < n_runs; i++) {
+		const char* entry = &bytes[MANIFEST_HEADER_LEN + i * MANIFEST_ENTRY_LEN];
+		uint32_t level = get_u32(entry);
+		struct run* run;
+		if (level >= LEVELS) {
+			errno = EILSEQ;
+			return 1;
+		}
+		try(run = run_open(lsm, get_u64(&entry[4])), NULL, error);
+		// the manifest lists every level in its order
+		if (level_insert(&lsm->levels[level], run, lsm->levels[level].n_runs)) {
+			run_release(run);
+			return 1;
+		}
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Replace the manifest in the data file with the levels.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int write_manifest(struct lsm* lsm, const struct level* levels, const unsigned long log) {
+	size_t n_runs = 0;
+	size_t size;
+	char* image;
+	char* entry;
+
+	for (size_t i = 0; i < LEVELS; i++) {
+		n_runs += levels[i].n_runs;
+	}
+	size = MANIFEST_HEADER_LEN + n_runs * MANIFEST_ENTRY_LEN + sizeof(uint32_t);
+	try(image = malloc(size), NULL, error);
+	memcpy(image, MANIFEST_MAGIC, 4);
+	put_u32(&image[4], LSM_VERSION);
+	put_u64(&image[8], atomic_load(&lsm->next_seq));
+	put_u64(&image[16], log);
+	put_u32(&image[24], (uint32_t)n_runs);
+	entry = &image[MANIFEST_HEADER_LEN];
+	for (size_t i = 0; i < LEVELS; i++) {
+		for (size_t j = 0; j < levels[i].n_runs; j++) {
+			put_u32(entry, (uint32_t)i);
+			put_u64(&entry[4], levels[i].runs[j]->seq);
+			entry += MANIFEST_ENTRY_LEN;
+		}
+	}
+	put_u32(entry, crc32c(0, image, size - sizeof(uint32_t)));
+	try(engine_write_file(lsm->filename, image, size), !0, cleanup);
+	free(image);
+	return 0;
+
+cleanup:
+	free(image);
+error:
+	return 1;
+}
+
+/*
+* Write the records of a data file to disjoint runs of the last level and
+* replace the data file with their manifest, a key stored twice keeps its
+* last record.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int import_file(struct lsm* lsm, const char* bytes, const size_t size) {
+	struct memtable* memtable;
+	struct output output = { lsm, NULL, NULL, 0, 0 };
+	struct record record;
+
+	try(memtable = memtable_init(lsm, lsm->log, 0), NULL, error);
+	for (size_t offset = RECORD_HEADER_LEN; offset < size && bytes[offset]; offset += record.length) {
+		try(record_decode(&bytes[offset], size - offset, &record), !0, cleanup1);
+		try(insert_records(memtable, &record, 1), !0, cleanup1);
+	}
+	try(memtable_foreach(memtable, &output_entry, &output), !0, cleanup2);
+	try(output_finish(&output), !0, cleanup2);
+	lsm->levels[LEVELS - 1].runs = output.runs;
+	lsm->levels[LEVELS - 1].n_runs = output.n_runs;
+	output.runs = NULL;
+	output.n_runs = 0;
+	try(write_manifest(lsm, lsm->levels, lsm->log), !0, cleanup1);
+	memtable_destroy(memtable);
+	return 0;
+
+cleanup2:
+	output_abort(&output);
+cleanup1:
+	{
+		int error = errno;
+		memtable_destroy(memtable);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Replay the logs from the first one the manifest needs into a memtable and
+* write it to a run of level 0, so that the storage starts with no log.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int replay_logs(struct lsm* lsm) {
+	struct memtable* memtable;
+	struct run* run = NULL;
+	char* filename;
+	unsigned long log;
+
+	try(memtable = memtable_init(lsm, lsm->log, 0), NULL, error);
+	for (log = lsm->log; ; log++) {
+		wal_t wal;
+		try(filename = numbered_filename(lsm, log, "wal"), NULL, cleanup1);
+		if (access(filename, F_OK)) {
+			free(filename);
+			break;
+		}
+		try(wal = wal_open(filename, WAL_SYNC_NONE, WAL_INTERVAL), NULL, cleanup2);
+		if (wal_replay(wal, &replay_record, memtable)) {
+			int error = errno;
+			wal_close(wal);
+			errno = error;
+			goto cleanup2;
+		}
+		try(wal_close(wal), !0, cleanup2);
+		free(filename);
+	}
+	if (log != lsm->log) {
+		if (memtable->n_records) {
+			try(run = write_memtable(lsm, memtable), NULL, cleanup1);
+			try(level_insert(&lsm->levels[0], run, 0), !0, cleanup3);
+		}
+		try(write_manifest(lsm, lsm->levels, log), !0, cleanup1);
+		for (unsigned long i = lsm->log; i < log; i++) {
+			if ((filename = numbered_filename(lsm, i, "wal"))) {
+				unlink(filename);
+				free(filename);
+			}
+		}
+		lsm->log = log;
+	}
+	memtable_destroy(memtable);
+	return 0;
+
+cleanup3:
+	run->obsolete = 1;
+	run_release(run);
+	goto cleanup1;
+cleanup2:
+	free(filename);
+cleanup1:
+	{
+		int error = errno;
+		memtable_destroy(memtable);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Apply a logged store, the payload holds its records.
+*/
+static int replay_record(void* context, const char* payload, const size_t length) {
+	struct memtable* memtable = (struct memtable*)context;
+
+	struct record* records;
+	size_t n = 0;
+
+	try(records = malloc(sizeof * records * (length / RECORD_MIN_LEN + 1)), NULL, error);
+	for (size_t offset = 0; offset < length; offset += records[n++].length) {
+		try(record_decode(&payload[offset], length - offset, &records[n]), !0, cleanup);
+	}
+	try(insert_records(memtable, records, n), !0, cleanup);
+	free(records);
+	return 0;
+
+cleanup:
+	free(records);
+error:
+	return 1;
+}
+
+/*
+* Remove the runs which the manifest does not list and the logs numbered
+* below log, left behind by a crash or by a previous storage in place of the
+* data file. A failure leaves them in place.
+*/
+static void remove_orphans(struct lsm* lsm, const unsigned long log) {
+	const char* separator = strrchr(lsm->filename, '/');
+	const char* base = separator ? separator + 1 : lsm->filename;
+	size_t base_length = strlen(base);
+	char* directory;
+	struct dirent* entry;
+	DIR* dir;
+
+	if ((directory = separator ? strndup(lsm->filename, (size_t)(separator - lsm->filename) + 1) : strdup(".")) == NULL) {
+		return;
+	}
+	if ((dir = opendir(directory)) == NULL) {
+		free(directory);
+		return;
+	}
+	while ((entry = readdir(dir))) {
+		const char* number = &entry->d_name[base_length + 1];
+		char* end;
+		unsigned long value;
+		if (strncmp(entry->d_name, base, base_length) || entry->d_name[base_length] != '.' || *number < '0' || *number > '9') {
+			continue;
+		}
+		value = strtoul(number, &end, 10);
+		if ((!strcmp(end, ".run") && !listed_run(lsm, value)) || (!strcmp(end, ".wal") && value < log)) {
+			unlinkat(dirfd(dir), entry->d_name, 0);
+		}
+	}
+	closedir(dir);
+	free(directory);
+}
+
+static int listed_run(const struct lsm* lsm, const unsigned long seq) {
+	for (size_t i = 0; i < LEVELS; i++) {
+		for (size_t j = 0; j < lsm->levels[i].n_runs; j++) {
+			if (lsm->levels[i].runs[j]->seq == seq) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+* Create an empty memtable, if logged is set with a new log numbered log.
+*
+* @return	the memtable on success or return NULL and set properly errno on
+*			error.
+*/
+static struct memtable* memtable_init(const struct lsm* lsm, const unsigned long log, const int logged) {
+	struct memtable* memtable;
+	char* filename;
+	memtable = calloc(1, sizeof * memtable);
+	if (memtable) {
+		memtable->log = log;
+		try(memtable->table = index_table_init(&entry_init, &entry_destroy, &key_comparison), NULL, error);
+		try_pthread_mutex_init(&memtable->mutex_commit, cleanup1);
+		try_pthread(pthread_cond_init(&memtable->committed, NULL), cleanup2);
+		if (logged) {
+			try(filename = numbered_filename(lsm, log, "wal"), NULL, cleanup3);
+			memtable->wal = wal_open(filename, lsm->wal_sync, lsm->wal_interval);
+			free(filename);
+			try(memtable->wal, NULL, cleanup3);
+		}
+	}
+	return memtable;
+
+cleanup3:
+	pthread_cond_destroy(&memtable->committed);
+cleanup2:
+	pthread_mutex_destroy(&memtable->mutex_commit);
+cleanup1:
+	{
+		int error = errno;
+		index_table_destroy(memtable->table);
+		errno = error;
+	}
+error:
+	free(memtable);
+	return NULL;
+}
+
+/*
+* Destroy the memtable and close its log, which is left in place.
+*/
+static int memtable_destroy(struct memtable* memtable) {
+	int ret = 0;
+
+	if (memtable->wal) {
+		ret = wal_close(memtable->wal);
+	}
+	for (size_t i = 0; i < INT_PAGES; i++) {
+		if (memtable->int_pages[i]) {
+			for (size_t j = 0; j < INT_PAGE_LEN; j++) {
+				free(memtable->int_pages[i][j]);
+			}
+			free(memtable->int_pages[i]);
+		}
+	}
+	index_table_destroy(memtable->table);
+	pthread_cond_destroy(&memtable->committed);
+	pthread_mutex_destroy(&memtable->mutex_commit);
+	free(memtable);
+	return ret;
+}
+
+/*
+* Return the entry of the key, NULL if the memtable does not hold it.
+*/
+static struct entry* memtable_find(const struct memtable* memtable, const char* key) {
+	if (key[0] == '\x01') {
+		unsigned long number = strtoul(&key[1], NULL, 16);
+		struct entry** page = memtable->int_pages[number >> INT_PAGE_BITS];
+		return page ? page[number & (INT_PAGE_LEN - 1)] : NULL;
+	}
+	return index_table_find(memtable->table, key);
+}
+
+/*
+* Call the function on every entry of the memtable in the order of the keys,
+* stopping at the first which fails.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int memtable_foreach(const struct memtable* memtable, int (*function)(void* key, void* value, void* context), void* context) {
+	char key[KEY_LEN];
+
+	// the integer keys sort before the names
+	for (size_t i = 0; i < INT_PAGES; i++) {
+		if (memtable->int_pages[i] == NULL) {
+			continue;
+		}
+		for (size_t j = 0; j < INT_PAGE_LEN; j++) {
+			if (memtable->int_pages[i][j]) {
+				int_key((i << INT_PAGE_BITS) | j, key);
+				try(function(key, memtable->int_pages[i][j], context), !0, error);
+			}
+		}
+	}
+	return index_table_foreach(memtable->table, function, context);
+
+error:
+	return 1;
+}
+
+/*
+* Copy the records into the memtable. Must be called holding the memtable
+* lock as exclusive unless the memtable is private.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int insert_records(struct memtable* memtable, const struct record* records, const size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		struct entry* entry;
+		if (records[i].space == RECORD_SPACE_INT) {
+			struct entry*** page = &memtable->int_pages[records[i].number >> INT_PAGE_BITS];
+			struct entry** slot;
+			if (*page == NULL) {
+				try(*page = calloc(INT_PAGE_LEN, sizeof * *page), NULL, error);
+			}
+			slot = &(*page)[records[i].number & (INT_PAGE_LEN - 1)];
+			if (*slot == NULL) {
+				try(*slot = entry_init(), NULL, error);
+			}
+			entry = *slot;
+		}
+		else {
+			char key[KEY_LEN];
+			char* copy;
+			record_key(&records[i], key);
+			try(copy = strdup(key), NULL, error);
+			try(entry = index_table_search(memtable->table, copy), NULL, error);
+		}
+		if (!entry->length) {
+			memtable->n_records++;
+		}
+		memtable->bytes += records[i].length - entry->length;
+		memcpy(entry->bytes, records[i].bytes, records[i].length);
+		entry->length = records[i].length;
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Estimate the memory of the entries and the pages of the memtable.
+*/
+static size_t memtable_memory(const struct memtable* memtable) {
+	size_t bytes = memtable->n_records * sizeof(struct entry);
+	for (size_t i = 0; i < INT_PAGES; i++) {
+		bytes += memtable->int_pages[i] ? INT_PAGE_LEN * sizeof * memtable->int_pages[i] : 0;
+	}
+	return bytes;
+}
+
+/*
+* Log the records as a single record of the log and insert them into its
+* memtable once the log record is durable, the caller holds the exclusive
+* locks of the keys so the memtable receives the stores of a key in the
+* order of the log. A full memtable is replaced first, waiting for the
+* previous one to be written.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int store_records(struct lsm* lsm, const struct record* records, const size_t n) {
+	struct memtable* memtable;
+	char* payload;
+	size_t length = 0;
+	unsigned long lsn;
+	int ret;
+
+	for (size_t i = 0; i < n; i++) {
+		length += records[i].length;
+	}
+	try(payload = malloc(length + 1), NULL, error);
+	length = 0;
+	for (size_t i = 0; i < n; i++) {
+		memcpy(&payload[length], records[i].bytes, records[i].length);
+		length += records[i].length;
+	}
+	for (;;) {
+		try_pthread_rwlock_wrlock(&lsm->lock_memtable, cleanup1);
+		if (lsm->memtable->bytes < lsm->memtable_size || !rotate(lsm)) {
+			break;
+		}
+		{
+			int error = errno;
+			pthread_rwlock_unlock(&lsm->lock_memtable);
+			errno = error;
+		}
+		if (errno != EAGAIN) {
+			goto cleanup1;
+		}
+		try(wait_flush(lsm, ULONG_MAX), !0, cleanup1);
+	}
+	memtable = lsm->memtable;
+	try(wal_append(memtable->wal, payload, length, &lsn), !0, cleanup2);
+	try_pthread_mutex_lock(&memtable->mutex_commit, cleanup2);
+	memtable->committing++;
+	pthread_mutex_unlock(&memtable->mutex_commit);
+	pthread_rwlock_unlock(&lsm->lock_memtable);
+	free(payload);
+	// the memtable, even if it became immutable meanwhile, is not written before the store leaves it
+	if ((ret = wal_commit(memtable->wal, lsn)) == 0) {
+		pthread_rwlock_wrlock(&lsm->lock_memtable);
+		ret = insert_records(memtable, records, n);
+		{
+			int error = errno;
+			pthread_rwlock_unlock(&lsm->lock_memtable);
+			errno = error;
+		}
+	}
+	{
+		int error = errno;
+		pthread_mutex_lock(&memtable->mutex_commit);
+		if (!--memtable->committing) {
+			pthread_cond_broadcast(&memtable->committed);
+		}
+		pthread_mutex_unlock(&memtable->mutex_commit);
+		errno = error;
+	}
+	return ret;
+
+cleanup2:
+	{
+		int error = errno;
+		pthread_rwlock_unlock(&lsm->lock_memtable);
+		errno = error;
+	}
+cleanup1:
+	free(payload);
+error:
+	return 1;
+}
+
+/*
+* Make the memtable immutable and replace it with an empty one logged to the
+* next log. Must be called holding the memtable lock as exclusive.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EAGAIN if the previous memtable is not written yet.
+*/
+static int rotate(struct lsm* lsm) {
+	struct memtable* memtable;
+	int busy;
+
+	try_pthread_mutex_lock(&lsm->mutex_work, error);
+	busy = lsm->immutable != NULL;
+	try_pthread_mutex_unlock(&lsm->mutex_work, error);
+	if (busy) {
+		errno = EAGAIN;
+		return 1;
+	}
+	try(memtable = memtable_init(lsm, lsm->memtable->log + 1, 1), NULL, error);
+	try_pthread_mutex_lock(&lsm->mutex_work, cleanup);
+	lsm->immutable = lsm->memtable;
+	lsm->memtable = memtable;
+	lsm->rotations++;
+	pthread_cond_signal(&lsm->flush);
+	try_pthread_mutex_unlock(&lsm->mutex_work, error);
+	return 0;
+
+cleanup:
+	{
+		int error = errno;
+		memtable_destroy(memtable);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Make the memtable immutable if it holds any record and set target to the
+* number of flushes which writes it.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EAGAIN if the previous memtable is not written yet.
+*/
+static int start_flush(struct lsm* lsm, unsigned long* target) {
+	try_pthread_rwlock_wrlock(&lsm->lock_memtable, error);
+	if (lsm->memtable->n_records && rotate(lsm)) {
+		goto unlock;
+	}
+	*target = lsm->rotations;
+	try_pthread_rwlock_unlock(&lsm->lock_memtable, error);
+	return 0;
+
+unlock:
+	{
+		int error = errno;
+		pthread_rwlock_unlock(&lsm->lock_memtable);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Wait until the immutable memtable is written or target memtables have
+* been written.
+*
+* @return	0 on success or return 1 and set errno to the error of the last
+*			flush if it failed.
+*/
+static int wait_flush(struct lsm* lsm, const unsigned long target) {
+	int error;
+
+	try_pthread_mutex_lock(&lsm->mutex_work, fail);
+	while (lsm->immutable && lsm->flushes < target && !lsm->flush_error) {
+		try_pthread(pthread_cond_wait(&lsm->flushed, &lsm->mutex_work), unlock);
+	}
+	error = (lsm->immutable && lsm->flushes < target) ? lsm->flush_error : 0;
+	try_pthread_mutex_unlock(&lsm->mutex_work, fail);
+	if (error) {
+		errno = error;
+		return 1;
+	}
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&lsm->mutex_work);
+fail:
+	return 1;
+}
+
+/*
+* Copy the bytes of the newest record of the key.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to ENOENT if the key is not stored.
+*/
+static int find_bytes(struct lsm* lsm, const char* key, char* bytes) {
+	struct entry* entry;
+	int ret;
+
+	try_pthread_rwlock_rdlock(&lsm->lock_memtable, error);
+	entry = memtable_find(lsm->memtable, key);
+	if (!entry && lsm->immutable) {
+		entry = memtable_find(lsm->immutable, key);
+	}
+	if (entry) {
+		memcpy(bytes, entry->bytes, entry->length);
+		try_pthread_rwlock_unlock(&lsm->lock_memtable, error);
+		return 0;
+	}
+	// the runs are pinned before a flush can move the immutable memtable to them
+	try_pthread_rwlock_rdlock(&lsm->lock_version, unlock);
+	pthread_rwlock_unlock(&lsm->lock_memtable);
+	ret = find_in_runs(lsm, key, bytes);
+	{
+		int error = errno;
+		pthread_rwlock_unlock(&lsm->lock_version);
+		errno = error;
+	}
+	return ret;
+
+unlock:
+	pthread_rwlock_unlock(&lsm->lock_memtable);
+error:
+	return 1;
+}
+
+/*
+* Search the runs from the newest. Must be called holding the version lock.
+*/
+static int find_in_runs(struct lsm* lsm, const char* key, char* bytes) {
+	for (size_t i = 0; i < lsm->levels[0].n_runs; i++) {
+		if (!run_find(lsm->levels[0].runs[i], key, bytes)) {
+			return 0;
+		}
+		if (errno != ENOENT) {
+			return 1;
+		}
+	}
+	for (size_t i = 1; i < LEVELS; i++) {
+		struct run* run = level_find(&lsm->levels[i], key);
+		if (run && !run_find(run, key, bytes)) {
+			return 0;
+		}
+		if (run && errno != ENOENT) {
+			return 1;
+		}
+	}
+	errno = ENOENT;
+	return 1;
+}
+
+/*
+* Return the run of a level of disjoint runs whose range holds the key, NULL
+* if there is none.
+*/
+static struct run* level_find(const struct level* level, const char* key) {
+	size_t low = 0;
+	size_t high = level->n_runs;
+
+	// the last run whose first key is not greater than the key
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (strcmp(level->runs[middle]->blocks[0].first, key) <= 0) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	if (!low || strcmp(key, level->runs[low - 1]->last) > 0) {
+		return NULL;
+	}
+	return level->runs[low - 1];
+}
+
+/*
+* Copy the bytes of the record of the key from the run, reading the single
+* block which can hold it.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to ENOENT if the run does not hold the key.
+*/
+static int run_find(struct run* run, const char* key, char* bytes) {
+	char buffer[BLOCK_LEN];
+	struct record record;
+	struct block* block;
+	size_t low = 0;
+	size_t high = run->n_blocks;
+	int int_search = key[0] == '\x01';
+	unsigned long number = int_search ? strtoul(&key[1], NULL, 16) : 0;
+
+	if (!run->n_blocks || strcmp(key, run->blocks[0].first) < 0 || strcmp(key, run->last) > 0 || !bloom_contains(run->bloom, run->bloom_bits, hash_key(key))) {
+		errno = ENOENT;
+		return 1;
+	}
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (strcmp(run->blocks[middle].first, key) <= 0) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	block = &run->blocks[low - 1];
+	try(pread_all(run->fd, buffer, block->length, (off_t)block->offset), !0, error);
+	for (size_t offset = 0; offset < block->length; offset += record.length) {
+		int comparison;
+		// only the checksum of the record found is verified
+		try(record_decode_key(&buffer[offset], block->length - offset, &record), !0, error);
+		if (record.space == RECORD_SPACE_INT) {
+			comparison = int_search ? (record.number > number) - (record.number < number) : -1;
+		}
+		else if (int_search) {
+			comparison = 1;
+		}
+		else {
+			char record_sort_key[KEY_LEN];
+			record_key(&record, record_sort_key);
+			comparison = strcmp(record_sort_key, key);
+		}
+		if (comparison == 0) {
+			try(record_verify(&buffer[offset]), !0, error);
+			memcpy(bytes, &buffer[offset], record.length);
+			return 0;
+		}
+		if (comparison > 0) {
+			break;
+		}
+	}
+	errno = ENOENT;
+	return 1;
+
+error:
+	return 1;
+}
+
+static void bloom_add(unsigned char* bloom, const uint64_t bits, const uint64_t hash) {
+	uint32_t hash1 = (uint32_t)hash;
+	uint32_t hash2 = (uint32_t)(hash >> 32) | 1;
+	for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+		uint64_t bit = ((uint64_t)hash1 + (uint64_t)i * hash2) % bits;
+		bloom[bit / 8] |= (unsigned char)(1 << (bit % 8));
+	}
+}
+
+static int bloom_contains(const unsigned char* bloom, const uint64_t bits, const uint64_t hash) {
+	uint32_t hash1 = (uint32_t)hash;
+	uint32_t hash2 = (uint32_t)(hash >> 32) | 1;
+	for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+		uint64_t bit = ((uint64_t)hash1 + (uint64_t)i * hash2) % bits;
+		if (!(bloom[bit / 8] & (1 << (bit % 8)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+* Create the file of a new run, the records must be added in the order of
+* their keys.
+*
+* @return	the writer on success or return NULL and set properly errno on
+*			error.
+*/
+static struct run_writer* run_writer_open(struct lsm* lsm) {
+	struct run_writer* writer;
+	writer = calloc(1, sizeof * writer);
+	if (writer) {
+		writer->seq = atomic_fetch_add(&lsm->next_seq, 1);
+		try(writer->filename = numbered_filename(lsm, writer->seq, "run"), NULL, error);
+		try(writer->buffer = malloc(WRITE_BUFFER_LEN), NULL, cleanup1);
+		try(writer->fd = open(writer->filename, O_RDWR | O_CREAT | O_TRUNC, 0660), -1, cleanup2);
+		record_write_header(writer->buffer);
+		writer->buffered = RECORD_HEADER_LEN;
+		writer->offset = RECORD_HEADER_LEN;
+	}
+	return writer;
+
+cleanup2:
+	free(writer->buffer);
+cleanup1:
+	free(writer->filename);
+error:
+	free(writer);
+	return NULL;
+}
+
+static int run_writer_add(struct run_writer* writer, const char* key, const char* bytes, const size_t length) {
+	if (!writer->n_blocks || writer->block_length + length > BLOCK_LEN) {
+		struct block* block;
+		if (writer->n_blocks == writer->capacity_blocks) {
+			size_t capacity = writer->capacity_blocks ? 2 * writer->capacity_blocks : 64;
+			try(block = realloc(writer->blocks, sizeof * block * capacity), NULL, error);
+			writer->blocks = block;
+			writer->capacity_blocks = capacity;
+		}
+		block = &writer->blocks[writer->n_blocks++];
+		block->offset = writer->offset;
+		block->length = 0;
+		memset(block->first, 0, KEY_LEN);
+		strcpy(block->first, key);
+		writer->block_length = 0;
+	}
+	if (writer->n_records == writer->capacity_records) {
+		size_t capacity = writer->capacity_records ? 2 * writer->capacity_records : 1024;
+		uint64_t* hashes;
+		try(hashes = realloc(writer->hashes, sizeof * hashes * capacity), NULL, error);
+		writer->hashes = hashes;
+		writer->capacity_records = capacity;
+	}
+	writer->hashes[writer->n_records++] = hash_key(key);
+	if (writer->buffered + length > WRITE_BUFFER_LEN) {
+		try(write_all(writer->fd, writer->buffer, writer->buffered), !0, error);
+		writer->buffered = 0;
+	}
+	memcpy(&writer->buffer[writer->buffered], bytes, length);
+	writer->buffered += length;
+	writer->blocks[writer->n_blocks - 1].length += (uint32_t)length;
+	writer->block_length += length;
+	writer->offset += length;
+	strcpy(writer->last, key);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Write the index, the bloom filter and the footer of the run and make it
+* durable, the writer is released in any case.
+*
+* @return	the run on success or return NULL and set properly errno on error.
+*/
+static struct run* run_writer_finish(struct run_writer* writer) {
+	struct run* run;
+	uint64_t bloom_bits = (writer->n_records * BLOOM_BITS < 64) ? 64 : writer->n_records * BLOOM_BITS;
+	size_t bloom_length = (size_t)((bloom_bits + 7) / 8);
+	size_t tail_length = writer->n_blocks * INDEX_ENTRY_LEN + bloom_length + FOOTER_LEN;
+	char* tail;
+	char* footer;
+
+	try(run = calloc(1, sizeof * run), NULL, error);
+	try(run->bloom = calloc(1, bloom_length), NULL, cleanup1);
+	try(tail = calloc(1, tail_length), NULL, cleanup2);
+	for (size_t i = 0; i < writer->n_records; i++) {
+		bloom_add(run->bloom, bloom_bits, writer->hashes[i]);
+	}
+	for (size_t i = 0; i < writer->n_blocks; i++) {
+		char* entry = &tail[i * INDEX_ENTRY_LEN];
+		put_u64(entry, writer->blocks[i].offset);
+		put_u32(&entry[8], writer->blocks[i].length);
+		memcpy(&entry[12], writer->blocks[i].first, KEY_LEN);
+	}
+	memcpy(&tail[writer->n_blocks * INDEX_ENTRY_LEN], run->bloom, bloom_length);
+	footer = &tail[tail_length - FOOTER_LEN];
+	memcpy(footer, RUN_MAGIC, 4);
+	put_u32(&footer[4], LSM_VERSION);
+	put_u64(&footer[8], writer->n_records);
+	put_u64(&footer[16], writer->n_blocks);
+	put_u64(&footer[24], writer->offset);
+	put_u64(&footer[32], bloom_bits);
+	put_u32(&footer[40], BLOOM_HASHES);
+	memcpy(&footer[44], writer->last, KEY_LEN);
+	put_u32(&footer[FOOTER_LEN - 4], crc32c(0, tail, tail_length - sizeof(uint32_t)));
+	try(write_all(writer->fd, writer->buffer, writer->buffered), !0, cleanup3);
+	try(write_all(writer->fd, tail, tail_length), !0, cleanup3);
+	try(fsync(writer->fd), -1, cleanup3);
+	run->seq = writer->seq;
+	run->filename = writer->filename;
+	run->fd = writer->fd;
+	run->size = (size_t)writer->offset + tail_length;
+	run->n_records = writer->n_records;
+	run->blocks = writer->blocks;
+	run->n_blocks = writer->n_blocks;
+	memcpy(run->last, writer->last, KEY_LEN);
+	run->bloom_bits = bloom_bits;
+	atomic_init(&run->refs, 1);
+	atomic_init(&run->obsolete, 0);
+	free(tail);
+	free(writer->hashes);
+	free(writer->buffer);
+	free(writer);
+	return run;
+
+cleanup3:
+	free(tail);
+cleanup2:
+	free(run->bloom);
+cleanup1:
+	free(run);
+error:
+	{
+		int error = errno;
+		run_writer_abort(writer);
+		errno = error;
+	}
+	return NULL;
+}
+
+/*
+* Remove the file of the run and release the writer.
+*/
+static void run_writer_abort(struct run_writer* writer) {
+	close(writer->fd);
+	unlink(writer->filename);
+	free(writer->filename);
+	free(writer->buffer);
+	free(writer->blocks);
+	free(writer->hashes);
+	free(writer);
+}
+
+/*
+* Open the run and load its index and bloom filter.
+*
+* @return	the run on success or return NULL and set properly errno on error,
+*			errno is set to EILSEQ if the file is not a valid run and to
+*			ENOTSUP if it belongs to another version of the format.
+*/
+static struct run* run_open(const struct lsm* lsm, const unsigned long seq) {
+	struct run* run;
+	struct stat st;
+	char header[RECORD_HEADER_LEN];
+	char footer[FOOTER_LEN];
+	char* tail;
+	size_t tail_length;
+	uint64_t index_offset;
+	size_t bloom_length;
+
+	try(run = calloc(1, sizeof * run), NULL, error);
+	run->seq = seq;
+	try(run->filename = numbered_filename(lsm, seq, "run"), NULL, cleanup1);
+	try(run->fd = open(run->filename, O_RDONLY), -1, cleanup2);
+	try(fstat(run->fd, &st), -1, cleanup3);
+	run->size = (size_t)st.st_size;
+	if (run->size < RECORD_HEADER_LEN + FOOTER_LEN) {
+		errno = EILSEQ;
+		goto cleanup3;
+	}
+	try(pread_all(run->fd, header, RECORD_HEADER_LEN, 0), !0, cleanup3);
+	try(record_check_header(header), !0, cleanup3);
+	try(pread_all(run->fd, footer, FOOTER_LEN, (off_t)(run->size - FOOTER_LEN)), !0, cleanup3);
+	if (memcmp(footer, RUN_MAGIC, 4)) {
+		errno = EILSEQ;
+		goto cleanup3;
+	}
+	if (get_u32(&footer[4]) != LSM_VERSION) {
+		errno = ENOTSUP;
+		goto cleanup3;
+	}
+	run->n_records = get_u64(&footer[8]);
+	run->n_blocks = get_u64(&footer[16]);
+	index_offset = get_u64(&footer[24]);
+	run->bloom_bits = get_u64(&footer[32]);
+	bloom_length = (size_t)((run->bloom_bits + 7) / 8);
+	if (index_offset < RECORD_HEADER_LEN || index_offset > run->size || run->n_blocks > run->size / INDEX_ENTRY_LEN || !run->bloom_bits || bloom_length > run->size
+		|| get_u32(&footer[40]) != BLOOM_HASHES || index_offset + run->n_blocks * INDEX_ENTRY_LEN + bloom_length + FOOTER_LEN != run->size) {
+		errno = EILSEQ;
+		goto cleanup3;
+	}
+	tail_length = run->size - (size_t)index_offset;
+	try(tail = malloc(tail_length), NULL, cleanup3);
+	try(pread_all(run->fd, tail, tail_length, (off_t)index_offset), !0, cleanup4);
+	if (crc32c(0, tail, tail_length - sizeof(uint32_t)) != get_u32(&tail[tail_length - sizeof(uint32_t)])) {
+		errno = EILSEQ;
+		goto cleanup4;
+	}
+	try(run->blocks = malloc(sizeof * run->blocks * (run->n_blocks + 1)), NULL, cleanup4);
+	try(run->bloom = malloc(bloom_length), NULL, cleanup5);
+	for (size_t i = 0; i < run->n_blocks; i++) {
+		const char* entry = &tail[i * INDEX_ENTRY_LEN];
+		run->blocks[i].offset = get_u64(entry);
+		run->blocks[i].length = get_u32(&entry[8]);
+		memcpy(run->blocks[i].first, &entry[12], KEY_LEN);
+		run->blocks[i].first[KEY_LEN - 1] = '\0';
+		if (run->blocks[i].length > BLOCK_LEN || run->blocks[i].offset + run->blocks[i].length > index_offset) {
+			errno = EILSEQ;
+			goto cleanup6;
+		}
+	}
+	memcpy(run->bloom, &tail[run->n_blocks * INDEX_ENTRY_LEN], bloom_length);
+	memcpy(run->last, &footer[44], KEY_LEN);
+	run->last[KEY_LEN - 1] = '\0';
+	atomic_init(&run->refs, 1);
+	atomic_init(&run->obsolete, 0);
+	free(tail);
+	return run;
+
+cleanup6:
+	free(run->bloom);
+cleanup5:
+	free(run->blocks);
+cleanup4:
+	free(tail);
+cleanup3:
+	close(run->fd);
+cleanup2:
+	free(run->filename);
+cleanup1:
+	free(run);
+error:
+	return NULL;
+}
+
+/*
+* Drop a reference to the run, the last one closes it and removes its file if
+* it is obsolete.
+*/
+static void run_release(struct run* run) {
+	if (atomic_fetch_sub(&run->refs, 1) != 1) {
+		return;
+	}
+	close(run->fd);
+	if (atomic_load(&run->obsolete)) {
+		unlink(run->filename);
+	}
+	free(run->filename);
+	free(run->blocks);
+	free(run->bloom);
+	free(run);
+}
+
+/*
+* Write the records of the memtable, which must not change meanwhile, to a
+* new run.
+*
+* @return	the run on success or return NULL and set properly errno on error.
+*/
+static struct run* write_memtable(struct lsm* lsm, struct memtable* memtable) {
+	struct run_writer* writer;
+
+	try(writer = run_writer_open(lsm), NULL, error);
+	if (memtable_foreach(memtable, &write_entry, writer)) {
+		int error = errno;
+		run_writer_abort(writer);
+		errno = error;
+		goto error;
+	}
+	return run_writer_finish(writer);
+
+error:
+	return NULL;
+}
+
+static int write_entry(void* key, void* value, void* context) {
+	struct entry* entry = (struct entry*)value;
+	return run_writer_add((struct run_writer*)context, (const char*)key, entry->bytes, entry->length);
+}
+
+/*
+* Write the immutable memtable to a new run of level 0, then drop it and its
+* log. Must be called by the flusher.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int flush_immutable(struct lsm* lsm, struct memtable* memtable) {
+	struct level levels[LEVELS];
+	struct run* run = NULL;
+	struct timespec start;
+	struct timespec end;
+	unsigned long latency;
+	char* filename;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// the stores still waiting for the log insert their records first
+	try_pthread_mutex_lock(&memtable->mutex_commit, error);
+	while (memtable->committing) {
+		try_pthread(pthread_cond_wait(&memtable->committed, &memtable->mutex_commit), unlock);
+	}
+	try_pthread_mutex_unlock(&memtable->mutex_commit, error);
+	// no store reaches a run before its log record is durable
+	try(wal_sync(memtable->wal), !0, error);
+	if (memtable->n_records) {
+		try(run = write_memtable(lsm, memtable), NULL, error);
+	}
+	try_pthread_mutex_lock(&lsm->mutex_manifest, cleanup1);
+	try(levels_copy(lsm->levels, levels), !0, cleanup2);
+	if (run) {
+		try(level_insert(&levels[0], run, 0), !0, cleanup3);
+	}
+	try(write_manifest(lsm, levels, memtable->log + 1), !0, cleanup3);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	latency = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+	// the manifest is durable, the new levels can not be rolled back any more
+	pthread_rwlock_wrlock(&lsm->lock_memtable);
+	pthread_rwlock_wrlock(&lsm->lock_version);
+	levels_swap(lsm->levels, levels);
+	lsm->log = memtable->log + 1;
+	pthread_mutex_lock(&lsm->mutex_work);
+	lsm->immutable = NULL;
+	lsm->l0_runs = lsm->levels[0].n_runs;
+	lsm->compaction_pending = 1;
+	pthread_cond_signal(&lsm->work);
+	lsm->flush_error = 0;
+	lsm->flushes++;
+	lsm->flushed_bytes += memtable->bytes;
+	lsm->flush_latency_last = latency;
+	lsm->flush_latency_total += latency;
+	if (latency > lsm->flush_latency_max) {
+		lsm->flush_latency_max = latency;
+	}
+	pthread_cond_broadcast(&lsm->flushed);
+	pthread_mutex_unlock(&lsm->mutex_work);
+	pthread_rwlock_unlock(&lsm->lock_version);
+	pthread_rwlock_unlock(&lsm->lock_memtable);
+	pthread_mutex_unlock(&lsm->mutex_manifest);
+	levels_free(levels);
+	filename = numbered_filename(lsm, memtable->log, "wal");
+	memtable_destroy(memtable);
+	if (filename) {
+		unlink(filename);
+		free(filename);
+	}
+	return 0;
+
+cleanup3:
+	levels_free(levels);
+cleanup2:
+	pthread_mutex_unlock(&lsm->mutex_manifest);
+cleanup1:
+	if (run) {
+		int error = errno;
+		atomic_store(&run->obsolete, 1);
+		run_release(run);
+		errno = error;
+	}
+error:
+	return 1;
+unlock:
+	pthread_mutex_unlock(&memtable->mutex_commit);
+	return 1;
+}
+
+static int levels_copy(const struct level* levels, struct level* copy) {
+	for (size_t i = 0; i < LEVELS; i++) {
+		copy[i].n_runs = levels[i].n_runs;
+		if ((copy[i].runs = malloc(sizeof * copy[i].runs * (levels[i].n_runs + 1))) == NULL) {
+			for (size_t j = 0; j < i; j++) {
+				free(copy[j].runs);
+			}
+			return 1;
+		}
+		if (levels[i].n_runs) {
+			memcpy(copy[i].runs, levels[i].runs, sizeof * copy[i].runs * levels[i].n_runs);
+		}
+	}
+	return 0;
+}
+
+/*
+* Free the arrays of the levels, the runs are not released.
+*/
+static void levels_free(struct level* levels) {
+	for (size_t i = 0; i < LEVELS; i++) {
+		free(levels[i].runs);
+		levels[i].runs = NULL;
+		levels[i].n_runs = 0;
+	}
+}
+
+static void levels_swap(struct level* levels1, struct level* levels2) {
+	for (size_t i = 0; i < LEVELS; i++) {
+		struct level level = levels1[i];
+		levels1[i] = levels2[i];
+		levels2[i] = level;
+	}
+}
+
+/*
+* Release every run of the levels and free their arrays.
+*/
+static void levels_release(struct level* levels) {
+	for (size_t i = 0; i < LEVELS; i++) {
+		for (size_t j = 0; j < levels[i].n_runs; j++) {
+			run_release(levels[i].runs[j]);
+		}
+	}
+	levels_free(levels);
+}
+
+static int level_insert(struct level* level, struct run* run, const size_t position) {
+	struct run** runs;
+
+	try(runs = realloc(level->runs, sizeof * runs * (level->n_runs + 2)), NULL, error);
+	memmove(&runs[position + 1], &runs[position], sizeof * runs * (level->n_runs - position));
+	runs[position] = run;
+	level->runs = runs;
+	level->n_runs++;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Return the position of the run in a level of disjoint runs sorted by key.
+*/
+static size_t level_position(const struct level* level, const struct run* run) {
+	size_t position = 0;
+	while (position < level->n_runs && strcmp(level->runs[position]->blocks[0].first, run->blocks[0].first) < 0) {
+		position++;
+	}
+	return position;
+}
+
+static void level_remove(struct level* level, const struct run* run) {
+	for (size_t i = 0; i < level->n_runs; i++) {
+		if (level->runs[i] == run) {
+			memmove(&level->runs[i], &level->runs[i + 1], sizeof * level->runs * (level->n_runs - i - 1));
+			level->n_runs--;
+			return;
+		}
+	}
+}
+
+static size_t level_size(const struct level* level) {
+	size_t size = 0;
+	for (size_t i = 0; i < level->n_runs; i++) {
+		size += level->runs[i]->size;
+	}
+	return size;
+}
+
+/*
+* Merge the runs of the first level over its budget with the overlapping runs
+* of the next level: every run of level 0 once it holds L0_RUNS runs, or the
+* next run in the order of the keys of a deeper level. A run which overlaps
+* no run of the next level is moved without rewriting it. The flusher only
+* adds runs to level 0 meanwhile, so the runs picked stay in their levels
+* until the merged runs replace them. Set compacted if a level changed. Must
+* be called by the compactor.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int compact(struct lsm* lsm, int* compacted) {
+	struct output output = { lsm, NULL, NULL, 0, 0 };
+	struct level levels[LEVELS];
+	struct level* level;
+	struct level* next;
+	struct run** runs;
+	size_t start = 0;
+	size_t n_inputs = 1;
+	size_t n_overlaps;
+	size_t first;
+	size_t end;
+	const char* low;
+	const char* high;
+	size_t budget = L1_LEN;
+	size_t depth;
+	int merged;
+
+	*compacted = 0;
+	try_pthread_mutex_lock(&lsm->mutex_manifest, error);
+	if (lsm->levels[0].n_runs >= L0_RUNS) {
+		depth = 0;
+	}
+	else {
+		for (depth = 1; depth < LEVELS - 1 && level_size(&lsm->levels[depth]) <= budget; depth++) {
+			budget *= FANOUT;
+		}
+		if (depth == LEVELS - 1) {
+			pthread_mutex_unlock(&lsm->mutex_manifest);
+			return 0;
+		}
+	}
+	level = &lsm->levels[depth];
+	next = &lsm->levels[depth + 1];
+	if (depth == 0) {
+		n_inputs = level->n_runs;
+	}
+	else {
+		// the levels are compacted round robin over their keys
+		while (start < level->n_runs && strcmp(level->runs[start]->blocks[0].first, lsm->compact_keys[depth]) <= 0) {
+			start++;
+		}
+		if (start == level->n_runs) {
+			start = 0;
+		}
+		strcpy(lsm->compact_keys[depth], level->runs[start]->last);
+	}
+	low = level->runs[start]->blocks[0].first;
+	high = level->runs[start]->last;
+	for (size_t i = start + 1; i < start + n_inputs; i++) {
+		low = (strcmp(level->runs[i]->blocks[0].first, low) < 0) ? level->runs[i]->blocks[0].first : low;
+		high = (strcmp(level->runs[i]->last, high) > 0) ? level->runs[i]->last : high;
+	}
+	for (first = 0; first < next->n_runs && strcmp(next->runs[first]->last, low) < 0; first++);
+	for (end = first; end < next->n_runs && strcmp(next->runs[end]->blocks[0].first, high) <= 0; end++);
+	n_overlaps = end - first;
+	if ((runs = malloc(sizeof * runs * (n_inputs + n_overlaps))) == NULL) {
+		pthread_mutex_unlock(&lsm->mutex_manifest);
+		goto error;
+	}
+	// the inputs from the newest, followed by the overlapping runs
+	memcpy(runs, &level->runs[start], sizeof * runs * n_inputs);
+	memcpy(&runs[n_inputs], &next->runs[first], sizeof * runs * n_overlaps);
+	pthread_mutex_unlock(&lsm->mutex_manifest);
+	merged = !depth || n_overlaps;
+	if (merged) {
+		struct cursor* cursors;
+		try(cursors = calloc(n_inputs + 1, sizeof * cursors), NULL, cleanup1);
+		for (size_t i = 0; i < n_inputs; i++) {
+			cursors[i].runs = &runs[i];
+			cursors[i].n_runs = 1;
+		}
+		cursors[n_inputs].runs = &runs[n_inputs];
+		cursors[n_inputs].n_runs = n_overlaps;
+		if (merge(cursors, n_inputs + 1, &emit_output, &output) || output_finish(&output)) {
+			int error = errno;
+			free(cursors);
+			errno = error;
+			goto cleanup2;
+		}
+		free(cursors);
+	}
+	try_pthread_mutex_lock(&lsm->mutex_manifest, cleanup2);
+	try(levels_copy(lsm->levels, levels), !0, cleanup3);
+	for (size_t i = 0; i < n_inputs; i++) {
+		level_remove(&levels[depth], runs[i]);
+	}
+	for (size_t i = 0; i < n_overlaps; i++) {
+		level_remove(&levels[depth + 1], runs[n_inputs + i]);
+	}
+	if (merged) {
+		for (size_t i = 0; i < output.n_runs; i++) {
+			try(level_insert(&levels[depth + 1], output.runs[i], level_position(&levels[depth + 1], output.runs[i])), !0, cleanup4);
+		}
+	}
+	else {
+		try(level_insert(&levels[depth + 1], runs[0], level_position(&levels[depth + 1], runs[0])), !0, cleanup4);
+	}
+	try(write_manifest(lsm, levels, lsm->log), !0, cleanup4);
+	pthread_rwlock_wrlock(&lsm->lock_version);
+	levels_swap(lsm->levels, levels);
+	pthread_rwlock_unlock(&lsm->lock_version);
+	pthread_mutex_lock(&lsm->mutex_work);
+	lsm->l0_runs = lsm->levels[0].n_runs;
+	pthread_cond_signal(&lsm->flush);
+	pthread_mutex_unlock(&lsm->mutex_work);
+	pthread_mutex_unlock(&lsm->mutex_manifest);
+	levels_free(levels);
+	if (merged) {
+		for (size_t i = 0; i < n_inputs + n_overlaps; i++) {
+			atomic_store(&runs[i]->obsolete, 1);
+			run_release(runs[i]);
+		}
+	}
+	free(output.runs);
+	free(runs);
+	*compacted = 1;
+	return 0;
+
+cleanup4:
+	levels_free(levels);
+cleanup3:
+	pthread_mutex_unlock(&lsm->mutex_manifest);
+cleanup2:
+	output_abort(&output);
+cleanup1:
+	free(runs);
+error:
+	return 1;
+}
+
+static int emit_output(void* context, const char* key, const char* bytes, const size_t length) {
+	struct output* output = (struct output*)context;
+
+	if (!output->writer) {
+		try(output->writer = run_writer_open(output->lsm), NULL, error);
+	}
+	try(run_writer_add(output->writer, key, bytes, length), !0, error);
+	if (output->writer->offset >= RUN_LEN) {
+		try(output_finish(output), !0, error);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+static int output_entry(void* key, void* value, void* context) {
+	struct entry* entry = (struct entry*)value;
+	return emit_output(context, (const char*)key, entry->bytes, entry->length);
+}
+
+/*
+* Finish the run being written, if any.
+*/
+static int output_finish(struct output* output) {
+	struct run* run;
+
+	if (!output->writer) {
+		return 0;
+	}
+	if (output->n_runs == output->capacity) {
+		size_t capacity = output->capacity ? 2 * output->capacity : 8;
+		struct run** runs;
+		try(runs = realloc(output->runs, sizeof * runs * capacity), NULL, error);
+		output->runs = runs;
+		output->capacity = capacity;
+	}
+	run = run_writer_finish(output->writer);
+	output->writer = NULL;
+	try(run, NULL, error);
+	output->runs[output->n_runs++] = run;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Remove the runs written so far.
+*/
+static void output_abort(struct output* output) {
+	int error = errno;
+
+	if (output->writer) {
+		run_writer_abort(output->writer);
+		output->writer = NULL;
+	}
+	for (size_t i = 0; i < output->n_runs; i++) {
+		atomic_store(&output->runs[i]->obsolete, 1);
+		run_release(output->runs[i]);
+	}
+	free(output->runs);
+	output->runs = NULL;
+	output->n_runs = 0;
+	errno = error;
+}
+
+static int cursor_next(struct cursor* cursor) {
+	struct record record;
+
+	if (cursor->items) {
+		if (cursor->item == cursor->n_items) {
+			cursor->done = 1;
+			return 0;
+		}
+		strcpy(cursor->key, cursor->items[cursor->item].key);
+		cursor->bytes = cursor->items[cursor->item].bytes;
+		cursor->length = cursor->items[cursor->item].length;
+		cursor->item++;
+		return 0;
+	}
+	while (cursor->position == cursor->buffer_length) {
+		struct block* block;
+		if (cursor->run == cursor->n_runs) {
+			cursor->done = 1;
+			return 0;
+		}
+		if (cursor->block == cursor->runs[cursor->run]->n_blocks) {
+			cursor->run++;
+			cursor->block = 0;
+			continue;
+		}
+		block = &cursor->runs[cursor->run]->blocks[cursor->block++];
+		try(pread_all(cursor->runs[cursor->run]->fd, cursor->buffer, block->length, (off_t)block->offset), !0, error);
+		cursor->buffer_length = block->length;
+		cursor->position = 0;
+	}
+	try(record_decode(&cursor->buffer[cursor->position], cursor->buffer_length - cursor->position, &record), !0, error);
+	record_key(&record, cursor->key);
+	cursor->bytes = &cursor->buffer[cursor->position];
+	cursor->length = record.length;
+	cursor->position += record.length;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Pass the records of the cursors to the function in the order of the keys,
+* a key held by several cursors is passed once with the record of the first
+* of them, so the cursors go from the newest to the oldest.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int merge(struct cursor* cursors, const size_t n, merge_function* emit, void* context) {
+	char key[KEY_LEN];
+
+	for (size_t i = 0; i < n; i++) {
+		try(cursor_next(&cursors[i]), !0, error);
+	}
+	for (;;) {
+		struct cursor* newest = NULL;
+		for (size_t i = 0; i < n; i++) {
+			if (!cursors[i].done && (!newest || strcmp(cursors[i].key, newest->key) < 0)) {
+				newest = &cursors[i];
+			}
+		}
+		if (!newest) {
+			return 0;
+		}
+		strcpy(key, newest->key);
+		try(emit(context, key, newest->bytes, newest->length), !0, error);
+		for (size_t i = 0; i < n; i++) {
+			if (!cursors[i].done && !strcmp(cursors[i].key, key)) {
+				try(cursor_next(&cursors[i]), !0, error);
+			}
+		}
+	}
+
+error:
+	return 1;
+}
+
+/*
+* Copy the memtables and take a reference to every run.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int take_view(struct lsm* lsm, struct view* view) {
+	memset(view, 0, sizeof * view);
+	try_pthread_rwlock_rdlock(&lsm->lock_memtable, error);
+	try(collect_items(lsm->memtable, &view->items[0], &view->n_items[0]), !0, unlock);
+	if (lsm->immutable) {
+		try(collect_items(lsm->immutable, &view->items[1], &view->n_items[1]), !0, unlock);
+	}
+	try_pthread_rwlock_rdlock(&lsm->lock_version, unlock);
+	pthread_rwlock_unlock(&lsm->lock_memtable);
+	if (levels_copy(lsm->levels, view->levels)) {
+		int error = errno;
+		pthread_rwlock_unlock(&lsm->lock_version);
+		errno = error;
+		goto cleanup;
+	}
+	for (size_t i = 0; i < LEVELS; i++) {
+		for (size_t j = 0; j < view->levels[i].n_runs; j++) {
+			atomic_fetch_add(&view->levels[i].runs[j]->refs, 1);
+		}
+	}
+	pthread_rwlock_unlock(&lsm->lock_version);
+	return 0;
+
+unlock:
+	{
+		int error = errno;
+		pthread_rwlock_unlock(&lsm->lock_memtable);
+		errno = error;
+	}
+cleanup:
+	free(view->items[0]);
+	free(view->items[1]);
+error:
+	return 1;
+}
+
+static int collect_items(struct memtable* memtable, struct item** items, size_t* n) {
+	struct item* cursor;
+
+	try(*items = malloc(sizeof * *items * (memtable->n_records + 1)), NULL, error);
+	cursor = *items;
+	if (memtable_foreach(memtable, &collect_item, &cursor)) {
+		int error = errno;
+		free(*items);
+		*items = NULL;
+		errno = error;
+		goto error;
+	}
+	*n = (size_t)(cursor - *items);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int collect_item(void* key, void* value, void* context) {
+	struct item** cursor = (struct item**)context;
+	struct entry* entry = (struct entry*)value;
+
+	strcpy((*cursor)->key, (const char*)key);
+	(*cursor)->length = entry->length;
+	memcpy((*cursor)->bytes, entry->bytes, entry->length);
+	(*cursor)++;
+	return 0;
+}
+
+static void release_view(struct view* view) {
+	free(view->items[0]);
+	free(view->items[1]);
+	levels_release(view->levels);
+}
+
+/*
+* Return the cursors over the view from the newest records, the disjoint runs
+* of a level share a cursor, or return NULL and set properly errno on error.
+*/
+static struct cursor* view_cursors(struct view* view, size_t* n) {
+	struct cursor* cursors;
+
+	*n = 2 + view->levels[0].n_runs + (LEVELS - 1);
+	try(cursors = calloc(*n, sizeof * cursors), NULL, error);
+	for (size_t i = 0; i < 2; i++) {
+		cursors[i].items = view->items[i];
+		cursors[i].n_items = view->n_items[i];
+	}
+	for (size_t i = 0; i < view->levels[0].n_runs; i++) {
+		cursors[2 + i].runs = &view->levels[0].runs[i];
+		cursors[2 + i].n_runs = 1;
+	}
+	for (size_t i = 1; i < LEVELS; i++) {
+		cursors[1 + view->levels[0].n_runs + i].runs = view->levels[i].runs;
+		cursors[1 + view->levels[0].n_runs + i].n_runs = view->levels[i].n_runs;
+	}
+	return cursors;
+
+error:
+	return NULL;
+}
+
+static int emit_foreach(void* context, const char* key, const char* bytes, const size_t length) {
+	struct iteration* iteration = (struct iteration*)context;
+
+	struct record record;
+	char number[24];
+	char* value;
+	int ret;
+	(void)key;
+
+	try(record_decode(bytes, length, &record), !0, error);
+	try(record_value_string(bytes, &value), !0, error);
+	if (record.space == RECORD_SPACE_INT) {
+		snprintf(number, sizeof number, "%lu", record.number);
+	}
+	ret = iteration->function((record.space == RECORD_SPACE_INT) ? number : record.name, value, iteration->context);
+	free(value);
+	if (ret) {
+		errno = ECANCELED;
+		return 1;
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+static int emit_backup(void* context, const char* key, const char* bytes, const size_t length) {
+	struct backup_stream* stream = (struct backup_stream*)context;
+	(void)key;
+
+	if (stream->length + length > WRITE_BUFFER_LEN) {
+		try(write_all(stream->fd, stream->buffer, stream->length), !0, error);
+		stream->length = 0;
+	}
+	memcpy(&stream->buffer[stream->length], bytes, length);
+	stream->length += length;
+	return 0;
+
+error:
+	return 1;
+}
+
+static int init_locks(struct lsm* lsm) {
+	size_t i;
+
+	for (i = 0; i < LOCK_BUCKETS; i++) {
+		try_pthread_mutex_init(&lsm->locks[i].mutex, error);
+		lsm->locks[i].entries = NULL;
+	}
+	return 0;
+
+error:
+	while (i--) {
+		pthread_mutex_destroy(&lsm->locks[i].mutex);
+	}
+	return 1;
+}
+
+static void destroy_locks(struct lsm* lsm) {
+	for (size_t i = 0; i < LOCK_BUCKETS; i++) {
+		while (lsm->locks[i].entries) {
+			struct lock_entry* entry = lsm->locks[i].entries;
+			lsm->locks[i].entries = entry->next;
+			pthread_rwlock_destroy(&entry->lock);
+			free(entry);
+		}
+		pthread_mutex_destroy(&lsm->locks[i].mutex);
+	}
+}
+
+/*
+* Lock the lock of the key, creating it on its first use. A timed lock does
+* not wait past the deadline and only tries the lock once if the deadline is
+* NULL.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int lock_key(struct lsm* lsm, const char* key, const int exclusive, const int timed, const struct timespec* deadline) {
+	struct lock_bucket* bucket = &lsm->locks[hash_key(key) % LOCK_BUCKETS];
+	struct lock_entry* entry;
+	int ret;
+
+	try_pthread_mutex_lock(&bucket->mutex, error);
+	for (entry = bucket->entries; entry && strcmp(entry->key, key); entry = entry->next);
+	if (!entry) {
+		try(entry = calloc(1, sizeof * entry), NULL, unlock);
+		strcpy(entry->key, key);
+		if ((ret = pthread_rwlock_init(&entry->lock, NULL))) {
+			free(entry);
+			errno = ret;
+			goto unlock;
+		}
+		entry->next = bucket->entries;
+		bucket->entries = entry;
+	}
+	entry->refs++;
+	try_pthread_mutex_unlock(&bucket->mutex, error);
+	if (!exclusive) {
+		ret = pthread_rwlock_rdlock(&entry->lock);
+	}
+	else if (!timed) {
+		ret = pthread_rwlock_wrlock(&entry->lock);
+	}
+	else {
+		while ((ret = deadline ? pthread_rwlock_timedwrlock(&entry->lock, deadline) : pthread_rwlock_trywrlock(&entry->lock)) == EINTR);
+	}
+	if (ret) {
+		// the reference taken for the failed lock is dropped
+		pthread_mutex_lock(&bucket->mutex);
+		if (!--entry->refs) {
+			struct lock_entry** link;
+			for (link = &bucket->entries; *link != entry; link = &(*link)->next);
+			*link = entry->next;
+			pthread_rwlock_destroy(&entry->lock);
+			free(entry);
+		}
+		pthread_mutex_unlock(&bucket->mutex);
+		errno = ret;
+		return 1;
+	}
+	return 0;
+
+unlock:
+	{
+		int error = errno;
+		pthread_mutex_unlock(&bucket->mutex);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Unlock the lock of the key, the last holder destroys it.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EPERM if the key is not locked.
+*/
+static int unlock_key(struct lsm* lsm, const char* key) {
+	struct lock_bucket* bucket = &lsm->locks[hash_key(key) % LOCK_BUCKETS];
+	struct lock_entry** link;
+	struct lock_entry* entry;
+
+	try_pthread_mutex_lock(&bucket->mutex, error);
+	for (link = &bucket->entries; *link && strcmp((*link)->key, key); link = &(*link)->next);
+	if ((entry = *link) == NULL) {
+		pthread_mutex_unlock(&bucket->mutex);
+		errno = EPERM;
+		return 1;
+	}
+	pthread_rwlock_unlock(&entry->lock);
+	if (!--entry->refs) {
+		*link = entry->next;
+		pthread_rwlock_destroy(&entry->lock);
+		free(entry);
+	}
+	try_pthread_mutex_unlock(&bucket->mutex, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int start_threads(struct lsm* lsm) {
+	lsm->stopping = 0;
+	lsm->l0_runs = lsm->levels[0].n_runs;
+	lsm->compaction_pending = 1;
+	try_pthread_mutex_init(&lsm->mutex_work, error);
+	try_pthread(pthread_cond_init(&lsm->flush, NULL), cleanup1);
+	try_pthread(pthread_cond_init(&lsm->work, NULL), cleanup2);
+	try_pthread(pthread_cond_init(&lsm->flushed, NULL), cleanup3);
+	try_pthread(pthread_create(&lsm->flusher, NULL, &flusher_routine, lsm), cleanup4);
+	try_pthread(pthread_create(&lsm->compactor, NULL, &compactor_routine, lsm), cleanup5);
+	return 0;
+
+cleanup5:
+	pthread_mutex_lock(&lsm->mutex_work);
+	lsm->stopping = 1;
+	pthread_cond_signal(&lsm->flush);
+	pthread_mutex_unlock(&lsm->mutex_work);
+	pthread_join(lsm->flusher, NULL);
+cleanup4:
+	pthread_cond_destroy(&lsm->flushed);
+cleanup3:
+	pthread_cond_destroy(&lsm->work);
+cleanup2:
+	pthread_cond_destroy(&lsm->flush);
+cleanup1:
+	pthread_mutex_destroy(&lsm->mutex_work);
+error:
+	return 1;
+}
+
+/*
+* Write every immutable memtable to a run until the storage is closed, unless
+* level 0 holds L0_STOP_RUNS runs. Every checkpoint interval the memtable is
+* written even if it is not full, so that the logs stay short. A failed flush
+* is tried again after RETRY_INTERVAL, the stores waiting for it fail with
+* its error.
+*/
+static void* flusher_routine(void* arg) {
+	struct lsm* lsm = (struct lsm*)arg;
+	int failed = 0;
+
+	try_pthread_mutex_lock(&lsm->mutex_work, error);
+	while (!lsm->stopping) {
+		struct timespec deadline;
+		long interval;
+		int ret;
+		if (!failed && lsm->immutable && lsm->l0_runs < L0_STOP_RUNS) {
+			struct memtable* immutable = lsm->immutable;
+			try_pthread_mutex_unlock(&lsm->mutex_work, error);
+			ret = flush_immutable(lsm, immutable);
+			{
+				int error = errno;
+				try_pthread_mutex_lock(&lsm->mutex_work, error);
+				if (ret) {
+					lsm->flush_error = error;
+					pthread_cond_broadcast(&lsm->flushed);
+				}
+			}
+			failed = ret;
+			continue;
+		}
+		interval = failed ? RETRY_INTERVAL : lsm->checkpoint_interval;
+		if (!interval) {
+			try_pthread(pthread_cond_wait(&lsm->flush, &lsm->mutex_work), unlock);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += interval / 1000;
+		deadline.tv_nsec += (interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		ret = pthread_cond_timedwait(&lsm->flush, &lsm->mutex_work, &deadline);
+		if (ret == ETIMEDOUT && !failed && !lsm->stopping && !lsm->immutable) {
+			unsigned long target;
+			try_pthread_mutex_unlock(&lsm->mutex_work, error);
+			start_flush(lsm, &target);
+			try_pthread_mutex_lock(&lsm->mutex_work, error);
+		}
+		else if (ret && ret != ETIMEDOUT) {
+			goto unlock;
+		}
+		failed = 0;
+	}
+	pthread_mutex_unlock(&lsm->mutex_work);
+	return NULL;
+
+unlock:
+	pthread_mutex_unlock(&lsm->mutex_work);
+error:
+	return NULL;
+}
+
+/*
+* Compact the levels after every flush until none exceeds its budget, until
+* the storage is closed. A failed compaction is tried again after
+* RETRY_INTERVAL.
+*/
+static void* compactor_routine(void* arg) {
+	struct lsm* lsm = (struct lsm*)arg;
+
+	try_pthread_mutex_lock(&lsm->mutex_work, error);
+	while (!lsm->stopping) {
+		int compacted;
+		int ret;
+		if (!lsm->compaction_pending) {
+			try_pthread(pthread_cond_wait(&lsm->work, &lsm->mutex_work), unlock);
+			continue;
+		}
+		lsm->compaction_pending = 0;
+		try_pthread_mutex_unlock(&lsm->mutex_work, error);
+		ret = compact(lsm, &compacted);
+		try_pthread_mutex_lock(&lsm->mutex_work, error);
+		if (ret) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += RETRY_INTERVAL / 1000;
+			deadline.tv_nsec += (RETRY_INTERVAL % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			if ((ret = pthread_cond_timedwait(&lsm->work, &lsm->mutex_work, &deadline)) && ret != ETIMEDOUT) {
+				goto unlock;
+			}
+		}
+		lsm->compaction_pending |= ret || compacted;
+	}
+	pthread_mutex_unlock(&lsm->mutex_work);
+	return NULL;
+
+unlock:
+	pthread_mutex_unlock(&lsm->mutex_work);
+error:
+	return NULL;
+}
+
+const struct engine lsm_engine = {
+	&lsm_init,
+	&lsm_close,
+	&lsm_store_batch,
+	&lsm_store_ints,
+	&lsm_store_number,
+	&lsm_checkpoint,
+	&lsm_backup,
+	&lsm_get_stats,
+	&lsm_load,
+	&lsm_load_int,
+	&lsm_load_number,
+	&lsm_foreach,
+	&lsm_lock_shared,
+	&lsm_lock_exclusive,
+	&lsm_lock_exclusive_timed,
+	&lsm_unlock,
+	&lsm_lock_shared_int,
+	&lsm_lock_exclusive_int,
+	&lsm_lock_exclusive_timed_int,
+	&lsm_unlock_int
+};
@@ -0,0 +1,515 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "storage.h"
+#include "record.h"
+
+#include <try.h>
+
+#define N_INTS 20000
+#define N_NAMES 200
+#define BATCH_LEN 100
+#define SMALL_MEMTABLE 4096	// bytes of the memtable which make the stores write many runs
+#define MANIFEST_MAGIC_LEN 4	// a data file without the magic is imported as records
+#define MANIFEST_VERSION_LEN 4
+#define TEST_DIR_TEMPLATE "/tmp/lsm_test.XXXXXX"
+
+/*
+* The expected content of the storage: the value of every integer key and
+* of every name key, written by the passes of a test.
+*/
+struct model {
+	long ints[N_INTS];
+	long names[N_NAMES];
+};
+
+struct visit {
+	const struct model* model;
+	size_t n_ints;
+	size_t n_names;
+	char last[RECORD_NAME_LEN + 1];
+	int failed;
+};
+
+struct lsm_case {
+	const char* name;
+	int (*run)(const char* path, const char* filename);
+};
+
+// Prototype declarations of functions included in this code module
+
+static int test_round_trip(const char* path, const char* filename);
+static int test_replay(const char* path, const char* filename);
+static int test_corrupt_record(const char* path, const char* filename);
+static int test_corrupt_run(const char* path, const char* filename);
+static int test_corrupt_manifest(const char* path, const char* filename);
+static void fill_pass(struct model* model, const long pass);
+static int store_pass(const storage_t storage, struct model* model, const long pass);
+static int check_model(const storage_t storage, const struct model* model);
+static int visit_key(const char* key, const char* value, void* context);
+static int open_checked(const char* filename, const struct storage_options* options, const struct model* model);
+static int flip_runs(const char* path, const long offset);
+static int flip_byte(const char* filename, const long offset);
+static int clear_dir(const char* path);
+
+/*
+* Usage: lsm_test
+*
+* Store keys of both key spaces through memtables small enough to write and
+* merge many runs, then reopen the storage, replay the logs of a process
+* which never closed it, and corrupt a record, the footer of a run and the
+* manifest, checking that every damage is reported with EILSEQ.
+*/
+int main(void) {
+	const struct lsm_case cases[] = {
+		{ "round trip", &test_round_trip },
+		{ "replay", &test_replay },
+		{ "corrupt record", &test_corrupt_record },
+		{ "corrupt run", &test_corrupt_run },
+		{ "corrupt manifest", &test_corrupt_manifest },
+	};
+	int failures = 0;
+
+	for (size_t i = 0; i < sizeof cases / sizeof * cases; i++) {
+		char path[] = TEST_DIR_TEMPLATE;
+		char filename[sizeof path + sizeof "/data"];
+		FILE* stream;
+
+		try(mkdtemp(path), NULL, error);
+		sprintf(filename, "%s/data", path);
+		try(stream = fopen(filename, "w"), NULL, error);
+		try(fclose(stream), EOF, error);
+		errno = 0;
+		if (cases[i].run(path, filename)) {
+			if (errno) {
+				perror("lsm_test");
+			}
+			fprintf(stderr, "lsm_test: %s: FAILED\n", cases[i].name);
+			failures++;
+		}
+		try(clear_dir(path), !0, error);
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+
+error:
+	perror("lsm_test");
+	return EXIT_FAILURE;
+}
+
+/*
+* Store three passes over the keys through a small memtable, which flushes
+* and compacts runs while they are stored, and check the storage before and
+* after it is reopened.
+*/
+static int test_round_trip(const char* path, const char* filename) {
+	const struct storage_options options = { .engine = STORAGE_ENGINE_LSM, .memtable_size = SMALL_MEMTABLE };
+	struct model* model;
+	storage_t storage;
+
+	(void)path;
+	try(model = calloc(1, sizeof * model), NULL, error);
+	try(storage = storage_init(filename, &options), NULL, cleanup1);
+	for (long pass = 1; pass <= 3; pass++) {
+		try(store_pass(storage, model, pass), !0, cleanup2);
+	}
+	try(check_model(storage, model), !0, cleanup2);
+	try(storage_close(storage), !0, cleanup1);
+	try(open_checked(filename, &options, model), !0, cleanup1);
+	free(model);
+	return 0;
+
+cleanup2:
+	storage_close(storage);
+cleanup1:
+	free(model);
+error:
+	return 1;
+}
+
+/*
+* Store in a child which exits without closing the storage, every store it
+* acknowledged is replayed from the logs, those of the memtables not yet
+* written to a run as well as those of a memtable which was.
+*/
+static int test_replay(const char* path, const char* filename) {
+	const struct storage_options options[] = {
+		{ .engine = STORAGE_ENGINE_LSM, .wal = 1, .wal_sync = WAL_SYNC_ALWAYS },
+		{ .engine = STORAGE_ENGINE_LSM, .wal = 1, .wal_sync = WAL_SYNC_GROUP, .memtable_size = SMALL_MEMTABLE },
+	};
+	struct model* model;
+
+	(void)filename;
+	try(model = calloc(1, sizeof * model), NULL, error);
+	for (size_t i = 0; i < sizeof options / sizeof * options; i++) {
+		char replayed[4096];
+		FILE* stream;
+		pid_t pid;
+		int status;
+
+		snprintf(replayed, sizeof replayed, "%s/replay.%zu", path, i);
+		try(stream = fopen(replayed, "w"), NULL, cleanup);
+		try(fclose(stream), EOF, cleanup);
+		try(pid = fork(), -1, cleanup);
+		if (!pid) {
+			storage_t storage;
+
+			if (!(storage = storage_init(replayed, &options[i]))) {
+				_exit(EXIT_FAILURE);
+			}
+			for (long pass = 1; pass <= 2; pass++) {
+				if (store_pass(storage, model, pass)) {
+					_exit(EXIT_FAILURE);
+				}
+			}
+			_exit(EXIT_SUCCESS);
+		}
+		try(waitpid(pid, &status, 0), -1, cleanup);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			fprintf(stderr, "lsm_test: the child failed to store\n");
+			goto cleanup;
+		}
+		// the child stored the last pass over the previous one
+		fill_pass(model, 2);
+		try(open_checked(replayed, &options[i], model), !0, cleanup);
+	}
+	free(model);
+	return 0;
+
+cleanup:
+	free(model);
+error:
+	return 1;
+}
+
+/*
+* Flip a byte of the value of the first record of every run, the load of its
+* key fails with EILSEQ while the other keys of the run are still loaded.
+*/
+static int test_corrupt_record(const char* path, const char* filename) {
+	const struct storage_options options = { .engine = STORAGE_ENGINE_LSM };
+	struct model* model;
+	storage_t storage;
+	long value;
+
+	try(model = calloc(1, sizeof * model), NULL, error);
+	try(storage = storage_init(filename, &options), NULL, cleanup1);
+	try(store_pass(storage, model, 1), !0, cleanup2);
+	try(storage_checkpoint(storage), !0, cleanup2);
+	try(storage_close(storage), !0, cleanup1);
+	// the first record of a run is the smallest key, the integer key 0
+	try(flip_runs(path, RECORD_HEADER_LEN + RECORD_MIN_LEN / 2), !0, cleanup1);
+	try(storage = storage_init(filename, &options), NULL, cleanup1);
+	if (!storage_load_int(storage, 0, &value) || errno != EILSEQ) {
+		fprintf(stderr, "lsm_test: corrupted record loaded\n");
+		goto cleanup2;
+	}
+	for (size_t k = 1; k < N_INTS; k++) {
+		try(storage_load_int(storage, k, &value), !0, cleanup2);
+		if (value != model->ints[k]) {
+			fprintf(stderr, "lsm_test: key %zu holds %ld, %ld expected\n", k, value, model->ints[k]);
+			goto cleanup2;
+		}
+	}
+	try(storage_close(storage), !0, cleanup1);
+	free(model);
+	return 0;
+
+cleanup2:
+	storage_close(storage);
+cleanup1:
+	free(model);
+error:
+	return 1;
+}
+
+/*
+* Flip the last byte of every run, which belongs to the checksum of its
+* index, the storage can not be opened.
+*/
+static int test_corrupt_run(const char* path, const char* filename) {
+	const struct storage_options options = { .engine = STORAGE_ENGINE_LSM };
+	struct model* model;
+	storage_t storage;
+
+	try(model = calloc(1, sizeof * model), NULL, error);
+	try(storage = storage_init(filename, &options), NULL, cleanup1);
+	try(store_pass(storage, model, 1), !0, cleanup2);
+	try(storage_checkpoint(storage), !0, cleanup2);
+	try(storage_close(storage), !0, cleanup1);
+	try(flip_runs(path, -1), !0, cleanup1);
+	free(model);
+	if ((storage = storage_init(filename, &options)) || errno != EILSEQ) {
+		fprintf(stderr, "lsm_test: storage opened with a corrupted run\n");
+		if (storage) {
+			storage_close(storage);
+		}
+		return 1;
+	}
+	return 0;
+
+cleanup2:
+	storage_close(storage);
+cleanup1:
+	free(model);
+error:
+	return 1;
+}
+
+/*
+* Flip every byte of the manifest past its magic in turn, the storage can not
+* be opened, with ENOTSUP for a byte of the version and EILSEQ for the others.
+*/
+static int test_corrupt_manifest(const char* path, const char* filename) {
+	const struct storage_options options = { .engine = STORAGE_ENGINE_LSM };
+	struct model* model;
+	storage_t storage;
+	struct stat st;
+
+	(void)path;
+	try(model = calloc(1, sizeof * model), NULL, error);
+	try(storage = storage_init(filename, &options), NULL, cleanup1);
+	try(store_pass(storage, model, 1), !0, cleanup2);
+	try(storage_checkpoint(storage), !0, cleanup2);
+	try(storage_close(storage), !0, cleanup1);
+	free(model);
+	try(stat(filename, &st), -1, error);
+	for (long offset = MANIFEST_MAGIC_LEN; offset < (long)st.st_size; offset++) {
+		int expected = (offset < MANIFEST_MAGIC_LEN + MANIFEST_VERSION_LEN) ? ENOTSUP : EILSEQ;
+		try(flip_byte(filename, offset), !0, error);
+		if ((storage = storage_init(filename, &options)) || errno != expected) {
+			fprintf(stderr, "lsm_test: storage opened with byte %ld of the manifest flipped\n", offset);
+			if (storage) {
+				storage_close(storage);
+			}
+			return 1;
+		}
+		try(flip_byte(filename, offset), !0, error);
+	}
+	return 0;
+
+cleanup2:
+	storage_close(storage);
+cleanup1:
+	free(model);
+error:
+	return 1;
+}
+
+/*
+* Fill the model with the values of the pass, every pass overwrites every
+* value of the previous one.
+*/
+static void fill_pass(struct model* model, const long pass) {
+	for (size_t k = 0; k < N_INTS; k++) {
+		model->ints[k] = pass * N_INTS + (long)k;
+	}
+	for (size_t k = 0; k < N_NAMES; k++) {
+		model->names[k] = -(pass * N_NAMES + (long)k);
+	}
+}
+
+/*
+* Fill the model with the values of the pass and store them, the integer
+* keys in batches and the name keys one at a time.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int store_pass(const storage_t storage, struct model* model, const long pass) {
+	unsigned long keys[BATCH_LEN];
+	char key[RECORD_NAME_LEN + 1];
+
+	fill_pass(model, pass);
+	for (size_t k = 0; k < N_INTS; k += BATCH_LEN) {
+		size_t n = (N_INTS - k < BATCH_LEN) ? N_INTS - k : BATCH_LEN;
+		for (size_t i = 0; i < n; i++) {
+			keys[i] = k + i;
+		}
+		try(storage_store_ints(storage, n, keys, &model->ints[k]), !0, error);
+	}
+	for (size_t k = 0; k < N_NAMES; k++) {
+		snprintf(key, sizeof key, "NAME_%zu", k);
+		try(storage_store_number(storage, key, model->names[k]), !0, error);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Load every key and visit the whole storage, which must hold exactly the
+* keys of the model in the order of their key spaces and of their keys.
+*
+* @return	0 if the storage holds the model or return 1 otherwise.
+*/
+static int check_model(const storage_t storage, const struct model* model) {
+	struct visit visit = { .model = model };
+	char key[RECORD_NAME_LEN + 1];
+	long value;
+
+	for (size_t k = 0; k < N_INTS; k++) {
+		try(storage_load_int(storage, k, &value), !0, error);
+		if (value != model->ints[k]) {
+			fprintf(stderr, "lsm_test: key %zu holds %ld, %ld expected\n", k, value, model->ints[k]);
+			return 1;
+		}
+	}
+	for (size_t k = 0; k < N_NAMES; k++) {
+		snprintf(key, sizeof key, "NAME_%zu", k);
+		try(storage_load_number(storage, key, &value), !0, error);
+		if (value != model->names[k]) {
+			fprintf(stderr, "lsm_test: key %s holds %ld, %ld expected\n", key, value, model->names[k]);
+			return 1;
+		}
+	}
+	try(storage_foreach(storage, &visit_key, &visit), !0, error);
+	if (visit.failed || visit.n_ints != N_INTS || visit.n_names != N_NAMES) {
+		fprintf(stderr, "lsm_test: %zu integer keys and %zu name keys visited\n", visit.n_ints, visit.n_names);
+		return 1;
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Check a visited key against the model, the integer keys come first in
+* ascending order, then the name keys in ascending order.
+*/
+static int visit_key(const char* key, const char* value, void* context) {
+	struct visit* visit = (struct visit*)context;
+	char expected[32];
+	size_t k;
+
+	if (!visit->n_names && sscanf(key, "%zu", &k) == 1 && k == visit->n_ints && k < N_INTS) {
+		snprintf(expected, sizeof expected, "%ld", visit->model->ints[k]);
+		visit->n_ints++;
+	}
+	else if (sscanf(key, "NAME_%zu", &k) == 1 && k < N_NAMES && strcmp(key, visit->last) > 0) {
+		snprintf(expected, sizeof expected, "%ld", visit->model->names[k]);
+		snprintf(visit->last, sizeof visit->last, "%s", key);
+		visit->n_names++;
+	}
+	else {
+		fprintf(stderr, "lsm_test: key %s visited out of order\n", key);
+		visit->failed = 1;
+		return 1;
+	}
+	if (strcmp(value, expected)) {
+		fprintf(stderr, "lsm_test: key %s visited with %s, %s expected\n", key, value, expected);
+		visit->failed = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* Open the storage, check it against the model and close it.
+*
+* @return	0 if the storage holds the model or return 1 otherwise.
+*/
+static int open_checked(const char* filename, const struct storage_options* options, const struct model* model) {
+	storage_t storage;
+	int ret;
+
+	try(storage = storage_init(filename, options), NULL, error);
+	ret = check_model(storage, model);
+	try(storage_close(storage), !0, error);
+	return ret;
+
+error:
+	return 1;
+}
+
+/*
+* Flip the byte at the offset of every run in the directory, a negative
+* offset counts from the end of the run.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno
+*			is set to ENOENT if the directory holds no run.
+*/
+static int flip_runs(const char* path, const long offset) {
+	char filename[4096];
+	struct dirent* entry;
+	struct stat st;
+	size_t n_runs = 0;
+	DIR* dir;
+
+	try(dir = opendir(path), NULL, error);
+	while ((entry = readdir(dir))) {
+		size_t length = strlen(entry->d_name);
+		if (length < sizeof ".run" || strcmp(entry->d_name + length - (sizeof ".run" - 1), ".run")) {
+			continue;
+		}
+		snprintf(filename, sizeof filename, "%s/%s", path, entry->d_name);
+		try(stat(filename, &st), -1, cleanup);
+		try(flip_byte(filename, (offset < 0) ? (long)st.st_size + offset : offset), !0, cleanup);
+		n_runs++;
+	}
+	try(closedir(dir), -1, error);
+	if (!n_runs) {
+		errno = ENOENT;
+		return 1;
+	}
+	return 0;
+
+cleanup:
+	closedir(dir);
+error:
+	return 1;
+}
+
+/*
+* Flip the lowest bit of the byte at the offset of the file.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int flip_byte(const char* filename, const long offset) {
+	FILE* stream;
+	int byte;
+
+	try(stream = fopen(filename, "r+"), NULL, error);
+	try(fseek(stream, offset, SEEK_SET), -1, cleanup);
+	try(byte = fgetc(stream), EOF, cleanup);
+	try(fseek(stream, offset, SEEK_SET), -1, cleanup);
+	try(fputc(byte ^ 0x01, stream), EOF, cleanup);
+	try(fclose(stream), EOF, error);
+	return 0;
+
+cleanup:
+	fclose(stream);
+error:
+	return 1;
+}
+
+/*
+* Remove the directory and the files in it.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int clear_dir(const char* path) {
+	char filename[4096];
+	struct dirent* entry;
+	DIR* dir;
+
+	try(dir = opendir(path), NULL, error);
+	while ((entry = readdir(dir))) {
+		if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+			snprintf(filename, sizeof filename, "%s/%s", path, entry->d_name);
+			unlink(filename);
+		}
+	}
+	try(closedir(dir), -1, error);
+	try(rmdir(path), -1, error);
+	return 0;
+
+error:
+	return 1;
+}
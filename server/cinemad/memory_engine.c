@@ -0,0 +1,874 @@
+#include "engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <try.h>
+
+#include "index_table.h"
+#include "record.h"
+
+#define INT_PAGE_BITS 12
+#define INT_PAGE_LEN (1UL << INT_PAGE_BITS)
+#define INT_PAGES (RECORD_INT_KEYS >> INT_PAGE_BITS)
+
+/*
+* The bytes hold the record encoded as in the data file, so that the values
+* are loaded back exactly as from the file engine, length is 0 until the
+* record is stored. The lock is the one taken by the callers, the mutex
+* guards the bytes.
+*/
+struct memory_record {
+	pthread_rwlock_t lock;
+	pthread_mutex_t mutex;
+	size_t length;
+	char bytes[RECORD_MAX_LEN];
+};
+
+typedef _Atomic(struct memory_record*) int_slot_t;
+
+/*
+* Records gathered by a backup, in the order of their keys.
+*/
+struct image {
+	char* bytes;
+	size_t size;
+	size_t capacity;
+};
+
+/*
+* State of a storage_foreach, error holds the errno of the record which
+* stopped it.
+*/
+struct iteration {
+	storage_foreach_function* function;
+	void* context;
+	int error;
+};
+
+/*
+* The records of the name key space are indexed by the index table, those of
+* the integer key space by a two level table addressed by the key, as in the
+* file engine. A store holds lock_memory as shared and the mutexes of its
+* records in the order of their addresses, an iteration or a backup holds it
+* as exclusive so that it never sees part of a batch. mutex_backup
+* serializes the backups.
+*/
+struct memory {
+	index_table_t index_table;
+	_Atomic(int_slot_t*) int_pages[INT_PAGES];
+	pthread_rwlock_t lock_memory;
+	pthread_mutex_t mutex_backup;
+	atomic_ulong backups;
+	atomic_ulong backup_stall_last;
+	atomic_ulong backup_stall_max;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static void* memory_init(const char* filename, const struct storage_options* options);
+static int memory_close(void* handle);
+static int memory_store_batch(void* handle, const size_t n, const char** keys, const char** values, char** result);
+static int memory_store_ints(void* handle, const size_t n, const unsigned long* keys, const long* values);
+static int memory_store_number(void* handle, const char* key, const long value);
+static int memory_checkpoint(void* handle);
+static int memory_backup(void* handle, const char* filename);
+static int memory_get_stats(void* handle, struct storage_stats* stats);
+static int memory_load(void* handle, const char* key, char** result);
+static int memory_load_int(void* handle, const unsigned long key, long* value);
+static int memory_load_number(void* handle, const char* key, long* value);
+static int memory_foreach(void* handle, storage_foreach_function* function, void* context);
+static int memory_lock_shared(void* handle, const char* key);
+static int memory_lock_exclusive(void* handle, const char* key);
+static int memory_lock_exclusive_timed(void* handle, const char* key, const struct timespec* deadline);
+static int memory_unlock(void* handle, const char* key);
+static int memory_lock_shared_int(void* handle, const unsigned long key);
+static int memory_lock_exclusive_int(void* handle, const unsigned long key);
+static int memory_lock_exclusive_timed_int(void* handle, const unsigned long key, const struct timespec* deadline);
+static int memory_unlock_int(void* handle, const unsigned long key);
+static int key_comparison(const void* key1, const void* key2);
+static index_record_t record_init();
+static int record_destroy(void* key, void* value);
+static int seed_records(struct memory* memory, const char* filename);
+static struct memory_record* int_record(struct memory* memory, const unsigned long key, const int create);
+static int destroy_int_records(struct memory* memory);
+static struct memory_record* find_record(struct memory* memory, const struct record* record, const int create);
+static int read_record(struct memory_record* memory_record, char* bytes);
+static int store_records(struct memory* memory, const struct record* records, const size_t n);
+static int record_address_comparison(const void* record1, const void* record2);
+static int lock_timed(struct memory_record* record, const struct timespec* deadline);
+static int append_record(void* key, void* value, void* context);
+static int visit_record(void* key, void* value, void* context);
+static size_t int_memory(struct memory* memory);
+
+static void* memory_init(const char* filename, const struct storage_options* options) {
+	struct memory* memory;
+	(void)options;
+	memory = calloc(1, sizeof * memory);
+	if (memory) {
+		try(memory->index_table = index_table_init(&record_init, &record_destroy, &key_comparison), NULL, error);
+		try_pthread_rwlock_init(&memory->lock_memory, cleanup1);
+		try_pthread_mutex_init(&memory->mutex_backup, cleanup2);
+		try(seed_records(memory, filename), !0, cleanup3);
+	}
+	return memory;
+
+cleanup3:
+	{
+		int error = errno;
+		destroy_int_records(memory);
+		errno = error;
+	}
+	pthread_mutex_destroy(&memory->mutex_backup);
+cleanup2:
+	pthread_rwlock_destroy(&memory->lock_memory);
+cleanup1:
+	{
+		int error = errno;
+		index_table_destroy(memory->index_table);
+		errno = error;
+	}
+error:
+	free(memory);
+	return NULL;
+}
+
+static int memory_close(void* handle) {
+	struct memory* memory = (struct memory*)handle;
+
+	try_pthread_mutex_destroy(&memory->mutex_backup, error);
+	try_pthread_rwlock_destroy(&memory->lock_memory, error);
+	index_table_destroy(memory->index_table);
+	try(destroy_int_records(memory), !0, error);
+	free(memory);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int memory_store_batch(void* handle, const size_t n, const char** keys, const char** values, char** result) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct record* records;
+
+	try(records = malloc(sizeof * records * (n + 1)), NULL, error);
+	for (size_t i = 0; i < n; i++) {
+		// a key or a value which can not be represented fails the whole batch
+		if (record_encode(keys[i], values[i], &records[i])) {
+			free(records);
+			*result = strdup(MSG_FAIL);
+			return 0;
+		}
+	}
+	try(store_records(memory, records, n), !0, cleanup);
+	free(records);
+	*result = strdup(MSG_SUCC);
+	return 0;
+
+cleanup:
+	free(records);
+error:
+	return 1;
+}
+
+static int memory_store_ints(void* handle, const size_t n, const unsigned long* keys, const long* values) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct record* records;
+
+	for (size_t i = 0; i < n; i++) {
+		if (keys[i] >= RECORD_INT_KEYS) {
+			errno = EINVAL;
+			return 1;
+		}
+	}
+	try(records = malloc(sizeof * records * (n + 1)), NULL, error);
+	for (size_t i = 0; i < n; i++) {
+		record_encode_int(keys[i], values[i], &records[i]);
+	}
+	try(store_records(memory, records, n), !0, cleanup);
+	free(records);
+	return 0;
+
+cleanup:
+	free(records);
+error:
+	return 1;
+}
+
+static int memory_store_number(void* handle, const char* key, const long value) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct record record;
+
+	try(record_encode_number(key, value, &record), !0, error);
+	try(store_records(memory, &record, 1), !0, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Nothing to compact, the records are never written.
+*/
+static int memory_checkpoint(void* handle) {
+	(void)handle;
+	return 0;
+}
+
+static int memory_backup(void* handle, const char* filename) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct image image = { NULL, RECORD_HEADER_LEN, 0 };
+	struct timespec start;
+	struct timespec end;
+	unsigned long stall;
+	int ret = 0;
+
+	try_pthread_mutex_lock(&memory->mutex_backup, error);
+	try_pthread_rwlock_wrlock(&memory->lock_memory, cleanup1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; !ret && i < INT_PAGES; i++) {
+		int_slot_t* page = atomic_load(&memory->int_pages[i]);
+		for (size_t j = 0; !ret && page && j < INT_PAGE_LEN; j++) {
+			struct memory_record* record = atomic_load(&page[j]);
+			if (record) {
+				ret = append_record(NULL, record, &image);
+			}
+		}
+	}
+	if (!ret) {
+		ret = index_table_foreach(memory->index_table, &append_record, &image);
+	}
+	pthread_rwlock_unlock(&memory->lock_memory);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stall = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+	if (ret) {
+		errno = ENOMEM;
+		goto cleanup2;
+	}
+	if (image.bytes == NULL) {
+		try(image.bytes = calloc(1, RECORD_HEADER_LEN), NULL, cleanup1);
+	}
+	record_write_header(image.bytes);
+	try(engine_write_file(filename, image.bytes, image.size), !0, cleanup2);
+	atomic_fetch_add(&memory->backups, 1);
+	atomic_store(&memory->backup_stall_last, stall);
+	if (stall > atomic_load(&memory->backup_stall_max)) {
+		atomic_store(&memory->backup_stall_max, stall);
+	}
+	free(image.bytes);
+	try_pthread_mutex_unlock(&memory->mutex_backup, error);
+	return 0;
+
+cleanup2:
+	free(image.bytes);
+cleanup1:
+	pthread_mutex_unlock(&memory->mutex_backup);
+error:
+	return 1;
+}
+
+static int memory_get_stats(void* handle, struct storage_stats* stats) {
+	struct memory* memory = (struct memory*)handle;
+
+	memset(stats, 0, sizeof * stats);
+	stats->backups = atomic_load(&memory->backups);
+	stats->backup_stall_last = atomic_load(&memory->backup_stall_last);
+	stats->backup_stall_max = atomic_load(&memory->backup_stall_max);
+	stats->memory_bytes = int_memory(memory);
+	return 0;
+}
+
+static int memory_load(void* handle, const char* key, char** result) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct record record;
+	struct memory_record* memory_record;
+	char bytes[RECORD_MAX_LEN];
+
+	if (record_encode_key(key, &record)) {
+		goto fail;
+	}
+	if ((memory_record = find_record(memory, &record, 0)) == NULL) {
+		if (errno == ENOENT) {
+			goto fail;
+		}
+		goto error;
+	}
+	if (read_record(memory_record, bytes)) {
+		if (errno == ENOENT) {
+			goto fail;
+		}
+		goto error;
+	}
+	try(record_value_string(bytes, result), !0, error);
+	return 0;
+
+fail:
+	*result = strdup(MSG_FAIL);
+	return 0;
+error:
+	return 1;
+}
+
+static int memory_load_int(void* handle, const unsigned long key, long* value) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct memory_record* record;
+	char bytes[RECORD_MAX_LEN];
+
+	try(record = int_record(memory, key, 0), NULL, error);
+	try(read_record(record, bytes), !0, error);
+	return record_value_number(bytes, value);
+
+error:
+	return 1;
+}
+
+static int memory_load_number(void* handle, const char* key, long* value) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct record record;
+	struct memory_record* memory_record;
+	char bytes[RECORD_MAX_LEN];
+
+	try(record_encode_key(key, &record), !0, error);
+	try(memory_record = find_record(memory, &record, 0), NULL, error);
+	try(read_record(memory_record, bytes), !0, error);
+	return record_value_number(bytes, value);
+
+error:
+	return 1;
+}
+
+static int memory_foreach(void* handle, storage_foreach_function* function, void* context) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct iteration iteration = { function, context, 0 };
+	int ret = 0;
+
+	try_pthread_rwlock_wrlock(&memory->lock_memory, error);
+	for (size_t i = 0; !ret && i < INT_PAGES; i++) {
+		int_slot_t* page = atomic_load(&memory->int_pages[i]);
+		for (size_t j = 0; !ret && page && j < INT_PAGE_LEN; j++) {
+			struct memory_record* record = atomic_load(&page[j]);
+			if (record) {
+				ret = visit_record(NULL, record, &iteration);
+			}
+		}
+	}
+	if (!ret) {
+		ret = index_table_foreach(memory->index_table, &visit_record, &iteration);
+	}
+	try_pthread_rwlock_unlock(&memory->lock_memory, error);
+	if (ret) {
+		errno = iteration.error ? iteration.error : errno;
+		return 1;
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+static int memory_lock_shared(void* handle, const char* key) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct record record;
+	struct memory_record* memory_record;
+	try(record_encode_key(key, &record), !0, on_success);
+	try(memory_record = find_record(memory, &record, 1), NULL, error);
+	try_pthread_rwlock_rdlock(&memory_record->lock, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int memory_lock_exclusive(void* handle, const char* key) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct record record;
+	struct memory_record* memory_record;
+	try(record_encode_key(key, &record), !0, on_success);
+	try(memory_record = find_record(memory, &record, 1), NULL, error);
+	try_pthread_rwlock_wrlock(&memory_record->lock, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int memory_lock_exclusive_timed(void* handle, const char* key, const struct timespec* deadline) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct record record;
+	struct memory_record* memory_record;
+	try(record_encode_key(key, &record), !0, on_success);
+	try(memory_record = find_record(memory, &record, 1), NULL, error);
+	try(lock_timed(memory_record, deadline), !0, error);
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int memory_unlock(void* handle, const char* key) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct record record;
+	struct memory_record* memory_record;
+	size_t length;
+	try(record_encode_key(key, &record), !0, on_success);
+	try(memory_record = find_record(memory, &record, 1), NULL, error);
+	try_pthread_rwlock_unlock(&memory_record->lock, error);
+	try_pthread_mutex_lock(&memory_record->mutex, error);
+	length = memory_record->length;
+	try_pthread_mutex_unlock(&memory_record->mutex, error);
+	// the records of the integer key space are never dropped
+	if (record.space == RECORD_SPACE_NAME && !length) {
+		index_table_delete(memory->index_table, record.name);
+	}
+
+on_success:
+	return 0;
+error:
+	return 1;
+}
+
+static int memory_lock_shared_int(void* handle, const unsigned long key) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct memory_record* record;
+	try(record = int_record(memory, key, 1), NULL, error);
+	try_pthread_rwlock_rdlock(&record->lock, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int memory_lock_exclusive_int(void* handle, const unsigned long key) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct memory_record* record;
+	try(record = int_record(memory, key, 1), NULL, error);
+	try_pthread_rwlock_wrlock(&record->lock, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int memory_lock_exclusive_timed_int(void* handle, const unsigned long key, const struct timespec* deadline) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct memory_record* record;
+	try(record = int_record(memory, key, 1), NULL, error);
+	try(lock_timed(record, deadline), !0, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int memory_unlock_int(void* handle, const unsigned long key) {
+	struct memory* memory = (struct memory*)handle;
+
+	struct memory_record* record;
+	try(record = int_record(memory, key, 0), NULL, error);
+	try_pthread_rwlock_unlock(&record->lock, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Compare two keys of the name key space, the index table needs exactly -1, 0
+* or 1.
+*/
+static int key_comparison(const void* key1, const void* key2) {
+	int result = strcmp((const char*)key1, (const char*)key2);
+	return (result > 0) - (result < 0);
+}
+
+static index_record_t record_init() {
+	struct memory_record* record;
+	record = calloc(1, sizeof * record);
+	if (record) {
+		try_pthread_rwlock_init(&record->lock, error);
+		try_pthread_mutex_init(&record->mutex, cleanup);
+	}
+	return record;
+
+cleanup:
+	pthread_rwlock_destroy(&record->lock);
+error:
+	free(record);
+	return NULL;
+}
+
+static int record_destroy(void* key, void* value) {
+	struct memory_record* record = (struct memory_record*)value;
+	try_pthread_rwlock_destroy(&record->lock, error);
+	try_pthread_mutex_destroy(&record->mutex, error);
+	free(key);
+	free(record);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Store the records of the data file, a missing file fails with ENOENT as
+* in the file engine while an empty one holds no record.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EILSEQ if a record is not valid and to ENOTSUP if the file
+*			belongs to another version of the format.
+*/
+static int seed_records(struct memory* memory, const char* filename) {
+	struct stat st;
+	struct record record;
+	char* bytes;
+	int fd;
+
+	try(fd = open(filename, O_RDONLY), -1, error);
+	try(fstat(fd, &st), -1, cleanup1);
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	try(bytes = malloc((size_t)st.st_size), NULL, cleanup1);
+	for (size_t done = 0; done < (size_t)st.st_size;) {
+		ssize_t n;
+		if ((n = read(fd, bytes + done, (size_t)st.st_size - done)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			errno = n ? errno : EILSEQ;
+			goto cleanup2;
+		}
+		done += (size_t)n;
+	}
+	if ((size_t)st.st_size < RECORD_HEADER_LEN) {
+		errno = EILSEQ;
+		goto cleanup2;
+	}
+	try(record_check_header(bytes), !0, cleanup2);
+	for (size_t offset = RECORD_HEADER_LEN; offset < (size_t)st.st_size && bytes[offset]; offset += record.length) {
+		try(record_decode(&bytes[offset], (size_t)st.st_size - offset, &record), !0, cleanup2);
+		try(store_records(memory, &record, 1), !0, cleanup2);
+	}
+	free(bytes);
+	try(close(fd), -1, error);
+	return 0;
+
+cleanup2:
+	free(bytes);
+cleanup1:
+	close(fd);
+error:
+	return 1;
+}
+
+/*
+* Find the record of the integer key space linked to the key, a missing
+* record is created only if create is set. A page or a record created by two
+* threads at once is published by the first one, the other is released.
+*
+* @return	the record on success or return NULL and set properly errno on
+*			error, errno is set to EINVAL if the key is out of the integer key
+*			space and to ENOENT if the record is missing.
+*/
+static struct memory_record* int_record(struct memory* memory, const unsigned long key, const int create) {
+	int_slot_t* page;
+	int_slot_t* expected_page = NULL;
+	struct memory_record* record = NULL;
+	struct memory_record* expected_record = NULL;
+
+	if (key >= RECORD_INT_KEYS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((page = atomic_load(&memory->int_pages[key >> INT_PAGE_BITS]))) {
+		record = atomic_load(&page[key & (INT_PAGE_LEN - 1)]);
+	}
+	if (record || !create) {
+		if (!record) {
+			errno = ENOENT;
+		}
+		return record;
+	}
+	if (page == NULL) {
+		try(page = calloc(INT_PAGE_LEN, sizeof * page), NULL, error);
+		if (!atomic_compare_exchange_strong(&memory->int_pages[key >> INT_PAGE_BITS], &expected_page, page)) {
+			free(page);
+			page = expected_page;
+		}
+	}
+	try(record = record_init(), NULL, error);
+	if (!atomic_compare_exchange_strong(&page[key & (INT_PAGE_LEN - 1)], &expected_record, record)) {
+		record_destroy(NULL, record);
+		record = expected_record;
+	}
+	return record;
+
+error:
+	return NULL;
+}
+
+static int destroy_int_records(struct memory* memory) {
+	for (size_t i = 0; i < INT_PAGES; i++) {
+		int_slot_t* page = atomic_load(&memory->int_pages[i]);
+		for (size_t j = 0; page && j < INT_PAGE_LEN; j++) {
+			struct memory_record* record = atomic_load(&page[j]);
+			if (record) {
+				try(record_destroy(NULL, record), !0, error);
+			}
+		}
+		free(page);
+		atomic_store(&memory->int_pages[i], NULL);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Find the record linked to the key of the received record in its key space.
+* A missing record of the name key space is always created, one of the
+* integer key space only if create is set.
+*
+* @return	the record on success or return NULL and set properly errno on
+*			error.
+*/
+static struct memory_record* find_record(struct memory* memory, const struct record* record, const int create) {
+	char* key;
+
+	if (record->space == RECORD_SPACE_INT) {
+		return int_record(memory, record->number, create);
+	}
+	try(key = strdup(record->name), NULL, error);
+	return index_table_search(memory->index_table, key);
+
+error:
+	return NULL;
+}
+
+/*
+* Copy the bytes of the record.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to ENOENT if the record is not stored.
+*/
+static int read_record(struct memory_record* memory_record, char* bytes) {
+	size_t length;
+
+	try_pthread_mutex_lock(&memory_record->mutex, error);
+	length = memory_record->length;
+	memcpy(bytes, memory_record->bytes, length);
+	try_pthread_mutex_unlock(&memory_record->mutex, error);
+	if (!length) {
+		errno = ENOENT;
+		return 1;
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Store the records as a whole: the mutexes of every record of the batch are
+* held while any of them is written.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int store_records(struct memory* memory, const struct record* records, const size_t n) {
+	struct memory_record** memory_records;
+	struct memory_record** locked;
+	size_t n_unique = 0;
+	size_t n_locked;
+
+	try(memory_records = malloc(sizeof * memory_records * (n + 1)), NULL, error);
+	try(locked = malloc(sizeof * locked * (n + 1)), NULL, cleanup1);
+	for (size_t i = 0; i < n; i++) {
+		try(memory_records[i] = find_record(memory, &records[i], 1), NULL, cleanup2);
+	}
+	memcpy(locked, memory_records, sizeof * locked * n);
+	qsort(locked, n, sizeof * locked, &record_address_comparison);
+	for (size_t i = 0; i < n; i++) {
+		if (!n_unique || locked[n_unique - 1] != locked[i]) {
+			locked[n_unique++] = locked[i];
+		}
+	}
+	try_pthread_rwlock_rdlock(&memory->lock_memory, cleanup2);
+	for (n_locked = 0; n_locked < n_unique; n_locked++) {
+		try_pthread_mutex_lock(&locked[n_locked]->mutex, unlock);
+	}
+	for (size_t i = 0; i < n; i++) {
+		memcpy(memory_records[i]->bytes, records[i].bytes, records[i].length);
+		memory_records[i]->length = records[i].length;
+	}
+	for (size_t i = n_locked; i > 0; i--) {
+		pthread_mutex_unlock(&locked[i - 1]->mutex);
+	}
+	pthread_rwlock_unlock(&memory->lock_memory);
+	free(locked);
+	free(memory_records);
+	return 0;
+
+unlock:
+	for (size_t i = n_locked; i > 0; i--) {
+		pthread_mutex_unlock(&locked[i - 1]->mutex);
+	}
+	pthread_rwlock_unlock(&memory->lock_memory);
+cleanup2:
+	free(locked);
+cleanup1:
+	free(memory_records);
+error:
+	return 1;
+}
+
+static int record_address_comparison(const void* record1, const void* record2) {
+	uintptr_t a = (uintptr_t)*(struct memory_record* const*)record1;
+	uintptr_t b = (uintptr_t)*(struct memory_record* const*)record2;
+	return (a > b) - (a < b);
+}
+
+/*
+* Lock as exclusive the lock of the record without waiting past the deadline,
+* a NULL deadline only tries the lock once.
+*/
+static int lock_timed(struct memory_record* record, const struct timespec* deadline) {
+	int ret;
+
+	while ((ret = deadline ? pthread_rwlock_timedwrlock(&record->lock, deadline) : pthread_rwlock_trywrlock(&record->lock)) == EINTR);
+	if (ret) {
+		errno = ret;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* Append the record to the image of the backup if it is stored.
+*
+* @return	0 on success or return 1 if the image can not grow.
+*/
+static int append_record(void* key, void* value, void* context) {
+	struct memory_record* record = (struct memory_record*)value;
+	struct image* image = (struct image*)context;
+	(void)key;
+
+	if (!record->length) {
+		return 0;
+	}
+	if (image->size + record->length > image->capacity) {
+		size_t capacity = image->capacity ? 2 * image->capacity : RECORD_HEADER_LEN + 64 * RECORD_MAX_LEN;
+		char* bytes;
+		if ((bytes = realloc(image->bytes, capacity)) == NULL) {
+			return 1;
+		}
+		image->bytes = bytes;
+		image->capacity = capacity;
+	}
+	memcpy(&image->bytes[image->size], record->bytes, record->length);
+	image->size += record->length;
+	return 0;
+}
+
+/*
+* Pass the key and the value of the record to the function of the iteration
+* if it is stored.
+*
+* @return	0 to go on or return 1 and set the error of the iteration to stop.
+*/
+static int visit_record(void* key, void* value, void* context) {
+	struct memory_record* memory_record = (struct memory_record*)value;
+	struct iteration* iteration = (struct iteration*)context;
+
+	struct record record;
+	char number[24];
+	char* result;
+	int ret;
+	(void)key;
+
+	if (!memory_record->length) {
+		return 0;
+	}
+	if (record_decode(memory_record->bytes, memory_record->length, &record) || record_value_string(memory_record->bytes, &result)) {
+		iteration->error = errno;
+		return 1;
+	}
+	if (record.space == RECORD_SPACE_INT) {
+		snprintf(number, sizeof number, "%lu", record.number);
+	}
+	ret = iteration->function((record.space == RECORD_SPACE_INT) ? number : record.name, result, iteration->context);
+	free(result);
+	if (ret) {
+		iteration->error = ECANCELED;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* Estimate the memory of the pages and the records of the integer key space,
+* those of the name key space are a handful and are not counted.
+*/
+static size_t int_memory(struct memory* memory) {
+	size_t bytes = 0;
+	for (size_t i = 0; i < INT_PAGES; i++) {
+		int_slot_t* page = atomic_load(&memory->int_pages[i]);
+		for (size_t j = 0; page && j < INT_PAGE_LEN; j++) {
+			if (atomic_load(&page[j])) {
+				bytes += sizeof(struct memory_record);
+			}
+		}
+		bytes += page ? INT_PAGE_LEN * sizeof * page : 0;
+	}
+	return bytes;
+}
+
+const struct engine memory_engine = {
+	&memory_init,
+	&memory_close,
+	&memory_store_batch,
+	&memory_store_ints,
+	&memory_store_number,
+	&memory_checkpoint,
+	&memory_backup,
+	&memory_get_stats,
+	&memory_load,
+	&memory_load_int,
+	&memory_load_number,
+	&memory_foreach,
+	&memory_lock_shared,
+	&memory_lock_exclusive,
+	&memory_lock_exclusive_timed,
+	&memory_unlock,
+	&memory_lock_shared_int,
+	&memory_lock_exclusive_int,
+	&memory_lock_exclusive_timed_int,
+	&memory_unlock_int
+};
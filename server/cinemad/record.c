@@ -0,0 +1,385 @@
+#include "record.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <resources.h>
+#include <try.h>
+
+#include "crc32c.h"
+
+#define MAGIC "CBSD"
+#define INT_RECORD_LEN RECORD_MIN_LEN
+#define NAME_RECORD_LEN RECORD_MAX_LEN
+#define INT_VALUE_OFFSET 8
+#define NAME_VALUE_OFFSET 16
+#define VALUE_LEN 16
+#define UNCHECKED_NAME_RECORD_LEN 32
+#define INT_CHECKSUM_OFFSET 1
+#define NAME_CHECKSUM_OFFSET 32
+#define INT_CHECKSUM_MASK 0xffffffu
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static int parse_number(const char* str, uint64_t* magnitude, int* negative);
+static uint32_t checksum(const char* bytes, const size_t length);
+static void seal(struct record* record);
+static void encode_value(char* bytes, const uint64_t magnitude, const int negative, enum record_type* type);
+static void put_u32(char* bytes, const uint32_t value);
+static void put_u64(char* bytes, const uint64_t value);
+static uint32_t get_u32(const char* bytes);
+static uint64_t get_u64(const char* bytes);
+
+extern int record_encode(const char* key, const char* value, struct record* record) {
+	uint64_t magnitude;
+	int negative;
+	enum record_type type;
+	char* field;
+
+	try(record_encode_key(key, record), !0, error);
+	field = &record->bytes[(record->space == RECORD_SPACE_INT) ? INT_VALUE_OFFSET : NAME_VALUE_OFFSET];
+	if (!parse_number(value, &magnitude, &negative)) {
+		encode_value(field, magnitude, negative, &type);
+	}
+	else if (record->space == RECORD_SPACE_NAME && strlen(value) < VALUE_LEN) {
+		strncpy(field, value, VALUE_LEN);
+		type = RECORD_STR;
+	}
+	else {
+		errno = EINVAL;
+		goto error;
+	}
+	record->bytes[0] = (char)(record->space << 4 | type);
+	seal(record);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int record_encode_key(const char* key, struct record* record) {
+	uint64_t magnitude;
+	int negative;
+
+	memset(record->bytes, 0, sizeof record->bytes);
+	if (!parse_number(key, &magnitude, &negative) && !negative && magnitude < RECORD_INT_KEYS) {
+		record->space = RECORD_SPACE_INT;
+		record->length = INT_RECORD_LEN;
+		record->number = (unsigned long)magnitude;
+		record->name[0] = '\0';
+		put_u32(&record->bytes[4], (uint32_t)magnitude);
+	}
+	else if (strlen(key) <= RECORD_NAME_LEN) {
+		record->space = RECORD_SPACE_NAME;
+		record->length = NAME_RECORD_LEN;
+		record->number = 0;
+		strcpy(record->name, key);
+		memcpy(&record->bytes[1], key, strlen(key));
+	}
+	else {
+		errno = EINVAL;
+		return 1;
+	}
+	// the tag is set by the value, a key alone can not be written
+	return 0;
+}
+
+extern void record_encode_int(const unsigned long key, const long value, struct record* record) {
+	enum record_type type;
+
+	memset(record->bytes, 0, sizeof record->bytes);
+	record->space = RECORD_SPACE_INT;
+	record->length = INT_RECORD_LEN;
+	record->number = key;
+	record->name[0] = '\0';
+	put_u32(&record->bytes[4], (uint32_t)key);
+	encode_value(&record->bytes[INT_VALUE_OFFSET], (value < 0) ? -(uint64_t)value : (uint64_t)value, value < 0, &type);
+	record->bytes[0] = (char)(RECORD_SPACE_INT << 4 | type);
+	seal(record);
+}
+
+extern int record_encode_number(const char* key, const long value, struct record* record) {
+	enum record_type type;
+	char* field;
+
+	try(record_encode_key(key, record), !0, error);
+	field = &record->bytes[(record->space == RECORD_SPACE_INT) ? INT_VALUE_OFFSET : NAME_VALUE_OFFSET];
+	encode_value(field, (value < 0) ? -(uint64_t)value : (uint64_t)value, value < 0, &type);
+	record->bytes[0] = (char)(record->space << 4 | type);
+	seal(record);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int record_decode(const char* bytes, const size_t available, struct record* record) {
+	if (record_decode_key(bytes, available, record) || record_verify(bytes)) {
+		errno = EILSEQ;
+		return 1;
+	}
+	return 0;
+}
+
+extern int record_decode_key(const char* bytes, const size_t available, struct record* record) {
+	size_t length = record_length(bytes);
+
+	if (!length || length > available) {
+		errno = EILSEQ;
+		return 1;
+	}
+	memcpy(record->bytes, bytes, length);
+	record->length = length;
+	record->space = (enum record_space)((unsigned char)bytes[0] >> 4);
+	if (record->space == RECORD_SPACE_INT) {
+		record->number = get_u32(&bytes[4]);
+		record->name[0] = '\0';
+		if (record->number >= RECORD_INT_KEYS) {
+			errno = EILSEQ;
+			return 1;
+		}
+	}
+	else {
+		record->number = 0;
+		memcpy(record->name, &bytes[1], RECORD_NAME_LEN);
+		record->name[RECORD_NAME_LEN] = '\0';
+	}
+	return 0;
+}
+
+extern int record_upgrade(const char* bytes, const size_t available, struct record* record, size_t* unchecked_length) {
+	struct record upgraded;
+	size_t length = record_length(bytes);
+
+	*unchecked_length = (length == NAME_RECORD_LEN) ? UNCHECKED_NAME_RECORD_LEN : length;
+	if (!length || *unchecked_length > available) {
+		errno = EILSEQ;
+		return 1;
+	}
+	// the checksum of an integer record takes the place of its padding
+	memset(upgraded.bytes, 0, sizeof upgraded.bytes);
+	memcpy(upgraded.bytes, bytes, *unchecked_length);
+	upgraded.length = length;
+	seal(&upgraded);
+	return record_decode(upgraded.bytes, length, record);
+}
+
+extern int record_verify(const char* bytes) {
+	size_t length = record_length(bytes);
+	uint32_t stored;
+
+	if (length == INT_RECORD_LEN) {
+		stored = get_u32(&bytes[0]) >> 8;
+		if ((checksum(bytes, length) & INT_CHECKSUM_MASK) == stored) {
+			return 0;
+		}
+	}
+	else if (length == NAME_RECORD_LEN) {
+		stored = get_u32(&bytes[NAME_CHECKSUM_OFFSET]);
+		if (checksum(bytes, length) == stored) {
+			return 0;
+		}
+	}
+	errno = EILSEQ;
+	return 1;
+}
+
+extern size_t record_length(const char* bytes) {
+	unsigned char tag = (unsigned char)bytes[0];
+	enum record_type type = (enum record_type)(tag & 0xf);
+
+	if (type < RECORD_U32 || type > RECORD_STR) {
+		return 0;
+	}
+	switch (tag >> 4) {
+	case RECORD_SPACE_INT:
+		return (type == RECORD_STR) ? 0 : INT_RECORD_LEN;
+	case RECORD_SPACE_NAME:
+		return NAME_RECORD_LEN;
+	default:
+		return 0;
+	}
+}
+
+extern int record_value_string(const char* bytes, char** result) {
+	unsigned char tag = (unsigned char)bytes[0];
+	const char* field = &bytes[((tag >> 4) == RECORD_SPACE_INT) ? INT_VALUE_OFFSET : NAME_VALUE_OFFSET];
+
+	switch ((enum record_type)(tag & 0xf)) {
+	case RECORD_U32:
+		try(asprintf(result, "%lu", (unsigned long)get_u32(field)), -1, error);
+		break;
+	case RECORD_U64:
+		try(asprintf(result, "%llu", (unsigned long long)get_u64(field)), -1, error);
+		break;
+	case RECORD_I64:
+		try(asprintf(result, "%lld", (long long)(int64_t)get_u64(field)), -1, error);
+		break;
+	default:
+		try(*result = strndup(field, VALUE_LEN), NULL, error);
+		break;
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int record_value_number(const char* bytes, long* value) {
+	unsigned char tag = (unsigned char)bytes[0];
+	const char* field = &bytes[((tag >> 4) == RECORD_SPACE_INT) ? INT_VALUE_OFFSET : NAME_VALUE_OFFSET];
+	uint64_t magnitude;
+
+	switch ((enum record_type)(tag & 0xf)) {
+	case RECORD_U32:
+		*value = (long)get_u32(field);
+		return 0;
+	case RECORD_U64:
+		if ((magnitude = get_u64(field)) > LONG_MAX) {
+			errno = ERANGE;
+			return 1;
+		}
+		*value = (long)magnitude;
+		return 0;
+	case RECORD_I64:
+		*value = (long)(int64_t)get_u64(field);
+		return 0;
+	default:
+		errno = EINVAL;
+		return 1;
+	}
+}
+
+extern void record_write_header(char* header) {
+	memset(header, 0, RECORD_HEADER_LEN);
+	memcpy(header, MAGIC, 4);
+	put_u32(&header[4], RECORD_VERSION);
+	put_u32(&header[8], RECORD_HEADER_LEN);
+}
+
+extern int record_check_header(const char* header) {
+	if (memcmp(header, MAGIC, 4)) {
+		errno = EILSEQ;
+		return 1;
+	}
+	if (get_u32(&header[4]) != RECORD_VERSION) {
+		errno = ENOTSUP;
+		return 1;
+	}
+	return 0;
+}
+
+extern unsigned long record_header_version(const char* header) {
+	if (memcmp(header, MAGIC, 4)) {
+		return 0;
+	}
+	return get_u32(&header[4]);
+}
+
+/*
+* Compute the CRC32C of the record with its checksum field set to zero.
+*/
+static uint32_t checksum(const char* bytes, const size_t length) {
+	char copy[RECORD_MAX_LEN];
+
+	memcpy(copy, bytes, length);
+	if (length == INT_RECORD_LEN) {
+		memset(&copy[INT_CHECKSUM_OFFSET], 0, 3);
+	}
+	else {
+		memset(&copy[NAME_CHECKSUM_OFFSET], 0, sizeof(uint32_t));
+	}
+	return crc32c(0, copy, length);
+}
+
+/*
+* Store the checksum of the encoded record.
+*/
+static void seal(struct record* record) {
+	uint32_t crc = checksum(record->bytes, record->length);
+
+	if (record->length == INT_RECORD_LEN) {
+		record->bytes[1] = (char)(crc & 0xff);
+		record->bytes[2] = (char)(crc >> 8 & 0xff);
+		record->bytes[3] = (char)(crc >> 16 & 0xff);
+	}
+	else {
+		put_u32(&record->bytes[NAME_CHECKSUM_OFFSET], crc);
+	}
+}
+
+/*
+* Parse the canonical decimal form of an integer: no sign but for a negative
+* integer, no leading zero and no other character.
+*
+* @return	0 on success or return 1 if the string is not canonical or the
+*			integer does not fit 64 bits.
+*/
+static int parse_number(const char* str, uint64_t* magnitude, int* negative) {
+	uint64_t limit;
+
+	*negative = (*str == '-');
+	str += *negative;
+	limit = *negative ? (uint64_t)INT64_MAX + 1 : UINT64_MAX;
+	if (*str < '0' || *str > '9' || (*str == '0' && (str[1] || *negative))) {
+		return 1;
+	}
+	*magnitude = 0;
+	for (; *str; str++) {
+		if (*str < '0' || *str > '9' || *magnitude > (limit - (uint64_t)(*str - '0')) / 10) {
+			return 1;
+		}
+		*magnitude = *magnitude * 10 + (uint64_t)(*str - '0');
+	}
+	return 0;
+}
+
+/*
+* Write the integer in the narrowest type which holds it.
+*/
+static void encode_value(char* bytes, const uint64_t magnitude, const int negative, enum record_type* type) {
+	if (negative) {
+		put_u64(bytes, (uint64_t)-magnitude);
+		*type = RECORD_I64;
+	}
+	else if (magnitude <= UINT32_MAX) {
+		put_u32(bytes, (uint32_t)magnitude);
+		*type = RECORD_U32;
+	}
+	else {
+		put_u64(bytes, magnitude);
+		*type = RECORD_U64;
+	}
+}
+
+static void put_u32(char* bytes, const uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = (char)(value >> (8 * i));
+	}
+}
+
+static void put_u64(char* bytes, const uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		bytes[i] = (char)(value >> (8 * i));
+	}
+}
+
+static uint32_t get_u32(const char* bytes) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value |= (uint32_t)(unsigned char)bytes[i] << (8 * i);
+	}
+	return value;
+}
+
+static uint64_t get_u64(const char* bytes) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t)(unsigned char)bytes[i] << (8 * i);
+	}
+	return value;
+}
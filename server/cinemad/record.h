@@ -0,0 +1,207 @@
+#pragma once
+
+#include <stddef.h>
+
+#define RECORD_NAME_LEN 15
+#define RECORD_MIN_LEN 16
+#define RECORD_MAX_LEN 48
+#define RECORD_HEADER_LEN 16
+#define RECORD_VERSION 3
+#define RECORD_VERSION_UNCHECKED 2	// the last version without checksums
+#define RECORD_INT_KEYS (1UL << 24)
+
+/*
+* The file starts with a header holding the magic "CBSD" and the version of
+* the format, the records follow it and end at the first zero byte. A record
+* starts with a tag holding its key space in the high nibble and the type of
+* its value in the low nibble, the key space fixes the length of the record.
+*
+* A record of the integer key space is 16 bytes long: the tag, the low 24
+* bits of the checksum, the key as u32 and the value as u64 or i64. A record
+* of the name key space is 48 bytes long: the tag, the key padded with zeros
+* to 15 bytes, 16 bytes of value, a u32, a u64, an i64 or a string padded
+* with zeros, the checksum as u32 and 12 bytes of padding. The checksum is
+* the CRC32C of the record with its checksum field set to zero. The integers
+* are little endian.
+*
+* Version 2 of the format had no checksum, a record of the name key space
+* ended after its value.
+*
+* A key which is the canonical decimal form of an integer below
+* RECORD_INT_KEYS belongs to the integer key space, its value must be an
+* integer. A value which is the canonical decimal form of an integer is
+* stored as an integer and loaded back in the same form.
+*/
+enum record_space {
+	RECORD_SPACE_NAME = 1,
+	RECORD_SPACE_INT = 2
+};
+
+enum record_type {
+	RECORD_U32 = 1,
+	RECORD_U64 = 2,
+	RECORD_I64 = 3,
+	RECORD_STR = 4
+};
+
+struct record {
+	char bytes[RECORD_MAX_LEN];
+	size_t length;
+	enum record_space space;
+	unsigned long number;	// the key in the integer key space
+	char name[RECORD_NAME_LEN + 1];	// the key in the name key space
+};
+
+/*
+* Encode the key and the value received as strings.
+*
+* @return	0 on success or return 1 and set errno to EINVAL if the key or the
+*			value can not be represented.
+*/
+extern int record_encode(
+	const char* key,
+	const char* value,
+	struct record* record
+);
+
+/*
+* Set the key space and the key of the record without encoding a value.
+*
+* @return	0 on success or return 1 and set errno to EINVAL if the key can
+*			not be represented.
+*/
+extern int record_encode_key(
+	const char* key,
+	struct record* record
+);
+
+/*
+* Encode a record of the integer key space, the key must be lower than
+* RECORD_INT_KEYS.
+*/
+extern void record_encode_int(
+	const unsigned long key,
+	const long value,
+	struct record* record
+);
+
+/*
+* Encode a record of the name key space holding an integer value.
+*
+* @return	0 on success or return 1 and set errno to EINVAL if the key can
+*			not be represented.
+*/
+extern int record_encode_number(
+	const char* key,
+	const long value,
+	struct record* record
+);
+
+/*
+* Decode the key of the record starting at the bytes and verify its
+* checksum, no more than available bytes are read.
+*
+* @return	0 on success or return 1 and set errno to EILSEQ if the bytes do
+*			not hold a valid record.
+*/
+extern int record_decode(
+	const char* bytes,
+	const size_t available,
+	struct record* record
+);
+
+/*
+* Decode the key of the record starting at the bytes without verifying its
+* checksum, to search a sequence of records; no more than available bytes
+* are read.
+*
+* @return	0 on success or return 1 and set errno to EILSEQ if the bytes do
+*			not hold a record.
+*/
+extern int record_decode_key(
+	const char* bytes,
+	const size_t available,
+	struct record* record
+);
+
+/*
+* Decode a record of version 2 of the format starting at the bytes, no more
+* than available bytes are read, and encode it in the current version. Set
+* unchecked_length to the length of the record in version 2.
+*
+* @return	0 on success or return 1 and set errno to EILSEQ if the bytes do
+*			not hold a valid record.
+*/
+extern int record_upgrade(
+	const char* bytes,
+	const size_t available,
+	struct record* record,
+	size_t* unchecked_length
+);
+
+/*
+* Verify the checksum of the record starting at the bytes, whose tag must be
+* valid.
+*
+* @return	0 on success or return 1 and set errno to EILSEQ if the checksum
+*			does not match.
+*/
+extern int record_verify(
+	const char* bytes
+);
+
+/*
+* Return the length of the record starting at the bytes, 0 if its tag is not
+* valid.
+*/
+extern size_t record_length(
+	const char* bytes
+);
+
+/*
+* Render the value of the record starting at the bytes as a string.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int record_value_string(
+	const char* bytes,
+	char** result
+);
+
+/*
+* Read the integer value of the record starting at the bytes.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EINVAL if the value is a string and to ERANGE if it does
+*			not fit.
+*/
+extern int record_value_number(
+	const char* bytes,
+	long* value
+);
+
+/*
+* Write the header of the current version of the format.
+*/
+extern void record_write_header(
+	char* header
+);
+
+/*
+* Check the header of a file.
+*
+* @return	0 if the header belongs to the current version or return 1 and
+*			set errno to EILSEQ if the file has no header and to ENOTSUP if
+*			it belongs to another version.
+*/
+extern int record_check_header(
+	const char* header
+);
+
+/*
+* Return the version of the format of the file starting with the header, 0
+* if the file has no header.
+*/
+extern unsigned long record_header_version(
+	const char* header
+);
@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "record.h"
+
+#include <try.h>
+
+/*
+* Pairs of key and value encoded as strings, every value is loaded back in
+* the same form.
+*/
+static const char* const pairs[][2] = {
+	{ "0", "0" },
+	{ "42", "7" },
+	{ "16777215", "4294967295" },
+	{ "1000", "4294967296" },
+	{ "12", "-1" },
+	{ "13", "-9223372036854775808" },
+	{ "14", "18446744073709551615" },
+	{ "ID_COUNTER", "123" },
+	{ "ROWS", "-40" },
+	{ "16777216", "18446744073709551615" },
+	{ "007", "x" },
+	{ "-1", "-1" },
+	{ "LONGEST_KEY_LEN", "longest value.." },
+	{ "NAME", "" },
+};
+
+/*
+* Pairs which can not be represented.
+*/
+static const char* const invalid_pairs[][2] = {
+	{ "KEY_OF_SIXTEEN_C", "1" },
+	{ "42", "string" },
+	{ "42", "18446744073709551616" },
+	{ "NAME", "value of 16 char" },
+};
+
+struct record_case {
+	const char* name;
+	int (*run)(void);
+};
+
+// Prototype declarations of functions included in this code module
+
+static int test_round_trip(void);
+static int test_invalid(void);
+static int test_numbers(void);
+static int test_corruption(void);
+static int test_truncated(void);
+static int test_upgrade(void);
+static int test_header(void);
+static int check_decoded(const struct record* record, const char* key, const char* value);
+static int check_flips(const struct record* record);
+
+/*
+* Usage: record_test
+*
+* Encode records of both key spaces and decode them back, then flip every
+* bit of a record, cut it and upgrade it from the format without checksums,
+* and check that the decoder rejects exactly the damaged records.
+*/
+int main(void) {
+	const struct record_case cases[] = {
+		{ "round trip", &test_round_trip },
+		{ "invalid", &test_invalid },
+		{ "numbers", &test_numbers },
+		{ "corruption", &test_corruption },
+		{ "truncated", &test_truncated },
+		{ "upgrade", &test_upgrade },
+		{ "header", &test_header },
+	};
+	int failures = 0;
+
+	for (size_t i = 0; i < sizeof cases / sizeof * cases; i++) {
+		errno = 0;
+		if (cases[i].run()) {
+			if (errno) {
+				perror("record_test");
+			}
+			fprintf(stderr, "record_test: %s: FAILED\n", cases[i].name);
+			failures++;
+		}
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+* Encode every pair and decode it from the encoded bytes.
+*/
+static int test_round_trip(void) {
+	for (size_t i = 0; i < sizeof pairs / sizeof * pairs; i++) {
+		struct record record;
+		struct record decoded;
+
+		try(record_encode(pairs[i][0], pairs[i][1], &record), !0, error);
+		if (record_length(record.bytes) != record.length) {
+			fprintf(stderr, "record_test: key %s encoded in %zu bytes, its tag says %zu\n", pairs[i][0], record.length, record_length(record.bytes));
+			return 1;
+		}
+		try(record_decode(record.bytes, record.length, &decoded), !0, error);
+		try(check_decoded(&decoded, pairs[i][0], pairs[i][1]), !0, error);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Reject the keys and the values which can not be represented.
+*/
+static int test_invalid(void) {
+	struct record record;
+
+	for (size_t i = 0; i < sizeof invalid_pairs / sizeof * invalid_pairs; i++) {
+		if (!record_encode(invalid_pairs[i][0], invalid_pairs[i][1], &record) || errno != EINVAL) {
+			fprintf(stderr, "record_test: key %s with value %s accepted\n", invalid_pairs[i][0], invalid_pairs[i][1]);
+			return 1;
+		}
+	}
+	if (!record_encode_number("KEY_OF_SIXTEEN_C", 1, &record) || errno != EINVAL) {
+		fprintf(stderr, "record_test: integer value of a key too long accepted\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* Encode integer values in both key spaces and read them back as integers,
+* a string value and an unsigned value past LONG_MAX can not be read.
+*/
+static int test_numbers(void) {
+	const long values[] = { 0, 1, -1, 4294967295L, 4294967296L, LONG_MAX, LONG_MIN };
+	struct record record;
+	struct record decoded;
+	long value;
+
+	for (size_t i = 0; i < sizeof values / sizeof * values; i++) {
+		record_encode_int(RECORD_INT_KEYS - 1 - i, values[i], &record);
+		try(record_decode(record.bytes, record.length, &decoded), !0, error);
+		try(record_value_number(decoded.bytes, &value), !0, error);
+		if (decoded.space != RECORD_SPACE_INT || decoded.number != RECORD_INT_KEYS - 1 - i || value != values[i]) {
+			fprintf(stderr, "record_test: integer key %lu with value %ld decoded as %lu with value %ld\n", RECORD_INT_KEYS - 1 - i, values[i], decoded.number, value);
+			return 1;
+		}
+		try(record_encode_number("COUNTER", values[i], &record), !0, error);
+		try(record_decode(record.bytes, record.length, &decoded), !0, error);
+		try(record_value_number(decoded.bytes, &value), !0, error);
+		if (decoded.space != RECORD_SPACE_NAME || strcmp(decoded.name, "COUNTER") || value != values[i]) {
+			fprintf(stderr, "record_test: key COUNTER with value %ld decoded as %s with value %ld\n", values[i], decoded.name, value);
+			return 1;
+		}
+	}
+	try(record_encode("NAME", "string", &record), !0, error);
+	if (!record_value_number(record.bytes, &value) || errno != EINVAL) {
+		fprintf(stderr, "record_test: string value read as an integer\n");
+		return 1;
+	}
+	try(record_encode("NAME", "18446744073709551615", &record), !0, error);
+	if (!record_value_number(record.bytes, &value) || errno != ERANGE) {
+		fprintf(stderr, "record_test: value past LONG_MAX read as an integer\n");
+		return 1;
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Flip every bit of a record of every type of value and of both key spaces.
+*/
+static int test_corruption(void) {
+	for (size_t i = 0; i < sizeof pairs / sizeof * pairs; i++) {
+		struct record record;
+
+		try(record_encode(pairs[i][0], pairs[i][1], &record), !0, error);
+		try(check_flips(&record), !0, error);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Decode a record from fewer bytes than its length.
+*/
+static int test_truncated(void) {
+	for (size_t i = 0; i < sizeof pairs / sizeof * pairs; i++) {
+		struct record record;
+		struct record decoded;
+
+		try(record_encode(pairs[i][0], pairs[i][1], &record), !0, error);
+		for (size_t available = 0; available < record.length; available++) {
+			if (!record_decode(record.bytes, available, &decoded) || errno != EILSEQ) {
+				fprintf(stderr, "record_test: key %s decoded from %zu bytes\n", pairs[i][0], available);
+				return 1;
+			}
+		}
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Strip the checksum of a record as version 2 of the format wrote it, the
+* upgrade encodes the same record again.
+*/
+static int test_upgrade(void) {
+	for (size_t i = 0; i < sizeof pairs / sizeof * pairs; i++) {
+		struct record record;
+		struct record upgraded;
+		char unchecked[RECORD_MAX_LEN];
+		size_t unchecked_length;
+		size_t expected_length;
+
+		try(record_encode(pairs[i][0], pairs[i][1], &record), !0, error);
+		memcpy(unchecked, record.bytes, record.length);
+		if (record.space == RECORD_SPACE_INT) {
+			memset(&unchecked[1], 0, 3);
+			expected_length = record.length;
+		}
+		else {
+			// a record of the name key space ended after its value
+			expected_length = RECORD_NAME_LEN + 17;
+			memset(&unchecked[expected_length], 0, record.length - expected_length);
+		}
+		try(record_upgrade(unchecked, expected_length, &upgraded, &unchecked_length), !0, error);
+		if (unchecked_length != expected_length || upgraded.length != record.length || memcmp(upgraded.bytes, record.bytes, record.length)) {
+			fprintf(stderr, "record_test: key %s upgraded to another record\n", pairs[i][0]);
+			return 1;
+		}
+		if (!record_upgrade(unchecked, expected_length - 1, &upgraded, &unchecked_length) || errno != EILSEQ) {
+			fprintf(stderr, "record_test: key %s upgraded from %zu bytes\n", pairs[i][0], expected_length - 1);
+			return 1;
+		}
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Check the header of the current version, of another version and of a file
+* without a header.
+*/
+static int test_header(void) {
+	char header[RECORD_HEADER_LEN];
+
+	record_write_header(header);
+	if (record_check_header(header) || record_header_version(header) != RECORD_VERSION) {
+		fprintf(stderr, "record_test: header of the current version rejected\n");
+		return 1;
+	}
+	header[4] = RECORD_VERSION_UNCHECKED;
+	if (!record_check_header(header) || errno != ENOTSUP || record_header_version(header) != RECORD_VERSION_UNCHECKED) {
+		fprintf(stderr, "record_test: header of version %d accepted\n", RECORD_VERSION_UNCHECKED);
+		return 1;
+	}
+	header[0] ^= 0x01;
+	if (!record_check_header(header) || errno != EILSEQ || record_header_version(header)) {
+		fprintf(stderr, "record_test: header without magic accepted\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* Check the key space, the key and the value of the decoded record.
+*
+* @return	0 if they match or return 1 otherwise.
+*/
+static int check_decoded(const struct record* record, const char* key, const char* value) {
+	char number[32];
+	char* loaded;
+	int ret;
+
+	if (record->space == RECORD_SPACE_INT) {
+		snprintf(number, sizeof number, "%lu", record->number);
+	}
+	if (strcmp((record->space == RECORD_SPACE_INT) ? number : record->name, key)) {
+		fprintf(stderr, "record_test: key %s decoded as %s\n", key, (record->space == RECORD_SPACE_INT) ? number : record->name);
+		return 1;
+	}
+	try(record_value_string(record->bytes, &loaded), !0, error);
+	if ((ret = strcmp(loaded, value))) {
+		fprintf(stderr, "record_test: value %s of key %s decoded as %s\n", value, key, loaded);
+	}
+	free(loaded);
+	return ret != 0;
+
+error:
+	return 1;
+}
+
+/*
+* Flip every bit of the record in turn, the decoder must reject every
+* flipped record.
+*
+* @return	0 if it did or return 1 otherwise.
+*/
+static int check_flips(const struct record* record) {
+	for (size_t i = 0; i < record->length * 8; i++) {
+		char bytes[RECORD_MAX_LEN];
+		struct record decoded;
+
+		memcpy(bytes, record->bytes, record->length);
+		bytes[i / 8] ^= (char)(1 << (i % 8));
+		if (!record_decode(bytes, record->length, &decoded)) {
+			fprintf(stderr, "record_test: record of %zu bytes decoded with bit %zu flipped\n", record->length, i);
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,563 @@
+#include "script.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <try.h>
+
+#define MAX_INSTRUCTIONS 512
+#define STACK_SIZE 32
+#define N_LOCALS 16
+#define NO_DEPTH -1
+
+/*
+* A script is assembled in fixed width instructions and verified once when it
+* is defined: every operand is in range, every jump lands on an instruction,
+* the stack depth of every instruction is the same along every path and the
+* execution can not run past the last instruction. The interpreter only checks
+* what depends on the data: the seats, the arguments, the divisions and the
+* instruction budget.
+*/
+
+enum opcode {
+	OP_PUSH, OP_ARG, OP_ARGC, OP_LOAD, OP_STORE,
+	OP_DUP, OP_POP, OP_SWAP,
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+	OP_EQ, OP_LT, OP_GT, OP_AND, OP_OR, OP_NOT,
+	OP_JMP, OP_JZ, OP_JNZ,
+	OP_SEATS, OP_ROWS, OP_ROW, OP_ROWLEN, OP_SEAT, OP_FREE,
+	OP_HOLD, OP_HELD, OP_UNHOLD,
+	OP_COMMIT, OP_RETURN, OP_FAIL
+};
+
+enum operand {
+	OPERAND_NONE,
+	OPERAND_NUMBER,
+	OPERAND_ARG,
+	OPERAND_LOCAL,
+	OPERAND_TARGET
+};
+
+enum flow {
+	FLOW_NEXT,
+	FLOW_JUMP,
+	FLOW_BRANCH,
+	FLOW_END
+};
+
+struct opcode_info {
+	const char* mnemonic;
+	enum operand operand;
+	int pops;
+	int pushes;
+	enum flow flow;
+};
+
+static const struct opcode_info opcodes[] = {
+	[OP_PUSH] = { "PUSH", OPERAND_NUMBER, 0, 1, FLOW_NEXT },
+	[OP_ARG] = { "ARG", OPERAND_ARG, 0, 1, FLOW_NEXT },
+	[OP_ARGC] = { "ARGC", OPERAND_NONE, 0, 1, FLOW_NEXT },
+	[OP_LOAD] = { "LOAD", OPERAND_LOCAL, 0, 1, FLOW_NEXT },
+	[OP_STORE] = { "STORE", OPERAND_LOCAL, 1, 0, FLOW_NEXT },
+	[OP_DUP] = { "DUP", OPERAND_NONE, 1, 2, FLOW_NEXT },
+	[OP_POP] = { "POP", OPERAND_NONE, 1, 0, FLOW_NEXT },
+	[OP_SWAP] = { "SWAP", OPERAND_NONE, 2, 2, FLOW_NEXT },
+	[OP_ADD] = { "ADD", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_SUB] = { "SUB", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_MUL] = { "MUL", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_DIV] = { "DIV", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_MOD] = { "MOD", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_EQ] = { "EQ", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_LT] = { "LT", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_GT] = { "GT", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_AND] = { "AND", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_OR] = { "OR", OPERAND_NONE, 2, 1, FLOW_NEXT },
+	[OP_NOT] = { "NOT", OPERAND_NONE, 1, 1, FLOW_NEXT },
+	[OP_JMP] = { "JMP", OPERAND_TARGET, 0, 0, FLOW_JUMP },
+	[OP_JZ] = { "JZ", OPERAND_TARGET, 1, 0, FLOW_BRANCH },
+	[OP_JNZ] = { "JNZ", OPERAND_TARGET, 1, 0, FLOW_BRANCH },
+	[OP_SEATS] = { "SEATS", OPERAND_NONE, 0, 1, FLOW_NEXT },
+	[OP_ROWS] = { "ROWS", OPERAND_NONE, 0, 1, FLOW_NEXT },
+	[OP_ROW] = { "ROW", OPERAND_NONE, 1, 1, FLOW_NEXT },
+	[OP_ROWLEN] = { "ROWLEN", OPERAND_NONE, 1, 1, FLOW_NEXT },
+	[OP_SEAT] = { "SEAT", OPERAND_NONE, 1, 1, FLOW_NEXT },
+	[OP_FREE] = { "FREE", OPERAND_NONE, 1, 1, FLOW_NEXT },
+	[OP_HOLD] = { "HOLD", OPERAND_NONE, 1, 0, FLOW_NEXT },
+	[OP_HELD] = { "HELD", OPERAND_NONE, 0, 1, FLOW_NEXT },
+	[OP_UNHOLD] = { "UNHOLD", OPERAND_NONE, 1, 0, FLOW_NEXT },
+	[OP_COMMIT] = { "COMMIT", OPERAND_NONE, 1, 0, FLOW_END },
+	[OP_RETURN] = { "RETURN", OPERAND_NONE, 1, 0, FLOW_END },
+	[OP_FAIL] = { "FAIL", OPERAND_NONE, 0, 0, FLOW_END }
+};
+
+#define N_OPCODES (sizeof opcodes / sizeof * opcodes)
+
+struct instruction {
+	enum opcode opcode;
+	long operand;
+};
+
+struct script {
+	char name[SCRIPT_NAME_LEN + 1];
+	struct instruction* code;
+	size_t n;
+};
+
+struct script_registry {
+	struct script* scripts;
+	size_t n_scripts;
+	long budget;
+	pthread_rwlock_t lock;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static int assemble(char** source, struct instruction** code, size_t* n);
+static long find_opcode(const char* mnemonic);
+static int parse_operand(const char* token, const enum operand operand, char** source, const size_t n_instructions, long* value);
+static int verify(const struct instruction* code, const size_t n);
+static void execute(const struct script* script, const long budget, const long* args, const size_t n_args, const struct script_env* env, struct script_result* result);
+static int is_held(const struct script_result* result, const long seat);
+
+extern script_registry_t script_registry_init(const long budget) {
+	struct script_registry* registry;
+	registry = calloc(1, sizeof * registry);
+	if (registry) {
+		registry->scripts = NULL;
+		registry->n_scripts = 0;
+		registry->budget = budget;
+		try_pthread_rwlock_init(&registry->lock, error);
+	}
+	return registry;
+
+error:
+	free(registry);
+	return NULL;
+}
+
+extern int script_registry_destroy(const script_registry_t handle) {
+	struct script_registry* registry = (struct script_registry*)handle;
+
+	try_pthread_rwlock_destroy(&registry->lock, error);
+	for (size_t i = 0; i < registry->n_scripts; i++) {
+		free(registry->scripts[i].code);
+	}
+	free(registry->scripts);
+	free(registry);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int script_define(const script_registry_t handle, const char* name, char** source) {
+	struct script_registry* registry = (struct script_registry*)handle;
+
+	struct instruction* code;
+	size_t n;
+	if (strlen(name) > SCRIPT_NAME_LEN) {
+		errno = EINVAL;
+		return 1;
+	}
+	try(assemble(source, &code, &n), !0, error);
+	try(verify(code, n), !0, cleanup);
+	try_pthread_rwlock_wrlock(&registry->lock, cleanup);
+	size_t i = 0;
+	while (i < registry->n_scripts && strcmp(registry->scripts[i].name, name)) {
+		i++;
+	}
+	if (i == registry->n_scripts) {
+		struct script* scripts;
+		try(scripts = realloc(registry->scripts, sizeof * scripts * (registry->n_scripts + 1)), NULL, unlock);
+		registry->scripts = scripts;
+		registry->n_scripts++;
+		strcpy(registry->scripts[i].name, name);
+		registry->scripts[i].code = NULL;
+	}
+	free(registry->scripts[i].code);
+	registry->scripts[i].code = code;
+	registry->scripts[i].n = n;
+	try_pthread_rwlock_unlock(&registry->lock, error);
+	return 0;
+
+unlock:
+	pthread_rwlock_unlock(&registry->lock);
+cleanup:
+	free(code);
+error:
+	return 1;
+}
+
+extern int script_run(const script_registry_t handle, const char* name, const long* args, const size_t n_args, const struct script_env* env, struct script_result* result) {
+	struct script_registry* registry = (struct script_registry*)handle;
+
+	try_pthread_rwlock_rdlock(&registry->lock, error);
+	size_t i = 0;
+	while (i < registry->n_scripts && strcmp(registry->scripts[i].name, name)) {
+		i++;
+	}
+	if (i == registry->n_scripts) {
+		pthread_rwlock_unlock(&registry->lock);
+		errno = ENOENT;
+		return 1;
+	}
+	execute(&registry->scripts[i], registry->budget, args, n_args, env, result);
+	try_pthread_rwlock_unlock(&registry->lock, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Translate the tokens in instructions, the first pass collects the position
+* of the labels and the second one resolves the operands.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int assemble(char** source, struct instruction** code, size_t* n) {
+	size_t n_instructions = 0;
+	long opcode;
+
+	for (size_t i = 0; source[i]; i++) {
+		if (source[i][strlen(source[i]) - 1] == ':') {
+			// a label can be defined only once
+			for (size_t j = 0; j < i; j++) {
+				if (!strcmp(source[j], source[i])) {
+					goto invalid;
+				}
+			}
+			continue;
+		}
+		if ((opcode = find_opcode(source[i])) == -1) {
+			goto invalid;
+		}
+		if (opcodes[opcode].operand != OPERAND_NONE && !source[++i]) {
+			goto invalid;
+		}
+		n_instructions++;
+	}
+	if (!n_instructions || n_instructions > MAX_INSTRUCTIONS) {
+		goto invalid;
+	}
+	try(*code = malloc(sizeof * *code * n_instructions), NULL, error);
+	*n = 0;
+	for (size_t i = 0; source[i]; i++) {
+		if (source[i][strlen(source[i]) - 1] == ':') {
+			continue;
+		}
+		struct instruction* instruction = &(*code)[(*n)++];
+		instruction->opcode = (enum opcode)find_opcode(source[i]);
+		instruction->operand = 0;
+		if (opcodes[instruction->opcode].operand != OPERAND_NONE) {
+			i++;
+			try(parse_operand(source[i], opcodes[instruction->opcode].operand, source, n_instructions, &instruction->operand), !0, cleanup);
+		}
+	}
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return 1;
+cleanup:
+	free(*code);
+error:
+	return 1;
+}
+
+static long find_opcode(const char* mnemonic) {
+	for (size_t i = 0; i < N_OPCODES; i++) {
+		if (!strcmp(opcodes[i].mnemonic, mnemonic)) {
+			return (long)i;
+		}
+	}
+	return -1;
+}
+
+/*
+* Parse the operand of an instruction, a jump target is either an instruction
+* index or a label.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int parse_operand(const char* token, const enum operand operand, char** source, const size_t n_instructions, long* value) {
+	char* endptr;
+
+	if (operand == OPERAND_TARGET && (*token < '0' || *token > '9')) {
+		size_t length = strlen(token);
+		long index = 0;
+		for (size_t i = 0; source[i]; i++) {
+			size_t token_length = strlen(source[i]);
+			if (source[i][token_length - 1] != ':') {
+				i += (opcodes[find_opcode(source[i])].operand != OPERAND_NONE);
+				index++;
+			}
+			else if (token_length == length + 1 && !strncmp(source[i], token, length)) {
+				*value = index;
+				return 0;
+			}
+		}
+		goto invalid;
+	}
+	errno = 0;
+	*value = strtol(token, &endptr, 10);
+	if (*endptr || endptr == token || errno == ERANGE) {
+		goto invalid;
+	}
+	switch (operand) {
+	case OPERAND_ARG:
+		if (*value < 0 || *value >= SCRIPT_MAX_ARGS) {
+			goto invalid;
+		}
+		break;
+	case OPERAND_LOCAL:
+		if (*value < 0 || *value >= N_LOCALS) {
+			goto invalid;
+		}
+		break;
+	case OPERAND_TARGET:
+		if (*value < 0 || *value >= (long)n_instructions) {
+			goto invalid;
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return 1;
+}
+
+/*
+* Compute the stack depth of every reachable instruction following every
+* path of the script.
+*
+* @return	0 if the script is valid or return 1 and set errno to EINVAL.
+*/
+static int verify(const struct instruction* code, const size_t n) {
+	int* depth;
+	size_t* pending;
+	size_t n_pending = 0;
+
+	try(depth = malloc(sizeof * depth * n), NULL, error);
+	try(pending = malloc(sizeof * pending * n), NULL, cleanup);
+	for (size_t i = 0; i < n; i++) {
+		depth[i] = NO_DEPTH;
+	}
+	depth[0] = 0;
+	pending[n_pending++] = 0;
+	while (n_pending) {
+		size_t pc = pending[--n_pending];
+		const struct opcode_info* info = &opcodes[code[pc].opcode];
+		size_t successors[2];
+		size_t n_successors = 0;
+		if (depth[pc] < info->pops) {
+			goto invalid;
+		}
+		int next_depth = depth[pc] - info->pops + info->pushes;
+		if (next_depth > STACK_SIZE) {
+			goto invalid;
+		}
+		if (info->flow == FLOW_NEXT || info->flow == FLOW_BRANCH) {
+			successors[n_successors++] = pc + 1;
+		}
+		if (info->flow == FLOW_JUMP || info->flow == FLOW_BRANCH) {
+			successors[n_successors++] = (size_t)code[pc].operand;
+		}
+		for (size_t i = 0; i < n_successors; i++) {
+			size_t successor = successors[i];
+			if (successor == n) {
+				goto invalid;
+			}
+			if (depth[successor] == NO_DEPTH) {
+				depth[successor] = next_depth;
+				pending[n_pending++] = successor;
+			}
+			else if (depth[successor] != next_depth) {
+				goto invalid;
+			}
+		}
+	}
+	free(pending);
+	free(depth);
+	return 0;
+
+invalid:
+	free(pending);
+	errno = EINVAL;
+cleanup:
+	free(depth);
+error:
+	return 1;
+}
+
+/*
+* Interpret the verified script, the script fails if it runs out of budget
+* or if an instruction has an invalid argument.
+*/
+static void execute(const struct script* script, const long budget, const long* args, const size_t n_args, const struct script_env* env, struct script_result* result) {
+	long stack[STACK_SIZE];
+	long locals[N_LOCALS] = { 0 };
+	size_t top = 0;
+	size_t pc = 0;
+
+	result->n_holds = 0;
+	result->value = 0;
+	for (long step = 0; step < budget; step++) {
+		const struct instruction* instruction = &script->code[pc++];
+		long a;
+		long b;
+		int id;
+		switch (instruction->opcode) {
+		case OP_PUSH:
+			stack[top++] = instruction->operand;
+			break;
+		case OP_ARG:
+			if ((size_t)instruction->operand >= n_args) {
+				goto fail;
+			}
+			stack[top++] = args[instruction->operand];
+			break;
+		case OP_ARGC:
+			stack[top++] = (long)n_args;
+			break;
+		case OP_LOAD:
+			stack[top++] = locals[instruction->operand];
+			break;
+		case OP_STORE:
+			locals[instruction->operand] = stack[--top];
+			break;
+		case OP_DUP:
+			stack[top] = stack[top - 1];
+			top++;
+			break;
+		case OP_POP:
+			top--;
+			break;
+		case OP_SWAP:
+			a = stack[top - 1];
+			stack[top - 1] = stack[top - 2];
+			stack[top - 2] = a;
+			break;
+		case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+		case OP_EQ: case OP_LT: case OP_GT: case OP_AND: case OP_OR:
+			b = stack[--top];
+			a = stack[--top];
+			switch (instruction->opcode) {
+			case OP_ADD: a = (long)((unsigned long)a + (unsigned long)b); break;
+			case OP_SUB: a = (long)((unsigned long)a - (unsigned long)b); break;
+			case OP_MUL: a = (long)((unsigned long)a * (unsigned long)b); break;
+			case OP_DIV: case OP_MOD:
+				if (!b || (a == LONG_MIN && b == -1)) {
+					goto fail;
+				}
+				a = (instruction->opcode == OP_DIV) ? a / b : a % b;
+				break;
+			case OP_EQ: a = (a == b); break;
+			case OP_LT: a = (a < b); break;
+			case OP_GT: a = (a > b); break;
+			case OP_AND: a = (a && b); break;
+			default: a = (a || b); break;
+			}
+			stack[top++] = a;
+			break;
+		case OP_NOT:
+			stack[top - 1] = !stack[top - 1];
+			break;
+		case OP_JMP:
+			pc = (size_t)instruction->operand;
+			break;
+		case OP_JZ:
+			if (!stack[--top]) {
+				pc = (size_t)instruction->operand;
+			}
+			break;
+		case OP_JNZ:
+			if (stack[--top]) {
+				pc = (size_t)instruction->operand;
+			}
+			break;
+		case OP_SEATS:
+			stack[top++] = env->n_seats;
+			break;
+		case OP_ROWS:
+			stack[top++] = env->n_rows;
+			break;
+		case OP_ROW: case OP_ROWLEN:
+			a = stack[top - 1];
+			if (a < 0 || a >= env->n_rows || env->row_range(env->context, a, &a, &b)) {
+				goto fail;
+			}
+			stack[top - 1] = (instruction->opcode == OP_ROW) ? a : b;
+			break;
+		case OP_SEAT:
+			a = stack[top - 1];
+			if (a < 0 || a >= env->n_seats || env->seat_get(env->context, a, &id)) {
+				goto fail;
+			}
+			stack[top - 1] = id;
+			break;
+		case OP_FREE:
+			// a seat out of the venue is never free, so that a scan can run past its edges
+			a = stack[top - 1];
+			if (a < 0 || a >= env->n_seats) {
+				stack[top - 1] = 0;
+				break;
+			}
+			if (env->seat_get(env->context, a, &id)) {
+				goto fail;
+			}
+			stack[top - 1] = (id == 0 && !is_held(result, a));
+			break;
+		case OP_HOLD:
+			a = stack[--top];
+			if (a < 0 || a >= env->n_seats || result->n_holds == SCRIPT_MAX_HOLDS || is_held(result, a)) {
+				goto fail;
+			}
+			result->holds[result->n_holds++] = (int)a;
+			break;
+		case OP_HELD:
+			stack[top++] = (long)result->n_holds;
+			break;
+		case OP_UNHOLD:
+			a = stack[--top];
+			if (a < 0 || a > (long)result->n_holds) {
+				goto fail;
+			}
+			result->n_holds = (size_t)a;
+			break;
+		case OP_COMMIT:
+			result->outcome = SCRIPT_COMMIT;
+			result->value = stack[--top];
+			if (!result->n_holds) {
+				goto fail;
+			}
+			return;
+		case OP_RETURN:
+			result->outcome = SCRIPT_RETURN;
+			result->value = stack[--top];
+			result->n_holds = 0;
+			return;
+		case OP_FAIL:
+			goto fail;
+		}
+	}
+
+fail:
+	result->outcome = SCRIPT_FAIL;
+	result->n_holds = 0;
+}
+
+static int is_held(const struct script_result* result, const long seat) {
+	for (size_t i = 0; i < result->n_holds; i++) {
+		if (result->holds[i] == seat) {
+			return 1;
+		}
+	}
+	return 0;
+}
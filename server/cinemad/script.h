@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+
+#define SCRIPT_NAME_LEN 15
+#define SCRIPT_MAX_ARGS 8
+#define SCRIPT_MAX_HOLDS 64
+
+typedef void* script_registry_t;
+
+/*
+* Read only view of the venue a script runs against, every function returns 0
+* on success or returns 1 and sets properly errno on error.
+*/
+struct script_env {
+	void* context;
+	int (*seat_get)(void* context, const long seat, int* id);
+	long n_seats;
+	long n_rows;
+	int (*row_range)(void* context, const long row, long* first_seat, long* n_seats);
+};
+
+/*
+* Outcome of a script run. A script ends by committing its held seats for a
+* booking ID, by returning a value or by failing.
+*/
+enum script_outcome {
+	SCRIPT_COMMIT,
+	SCRIPT_RETURN,
+	SCRIPT_FAIL
+};
+
+struct script_result {
+	enum script_outcome outcome;
+	long value;	// the ID to commit for or the returned value
+	int holds[SCRIPT_MAX_HOLDS];
+	size_t n_holds;
+};
+
+/*
+* Create an empty registry of scripts, a script runs with a budget of at most
+* budget executed instructions.
+*
+* @return	registry handle on success or return NULL and set properly errno
+*			on error.
+*/
+extern script_registry_t script_registry_init(
+	const long budget
+);
+
+/*
+* Destroy the registry, no script must be running.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int script_registry_destroy(
+	const script_registry_t handle
+);
+
+/*
+* Assemble and verify the script, then register it under the name replacing
+* a previous script with the same name. The source is a list of tokens, a
+* token ending with ':' defines a label which a jump can name instead of an
+* instruction index.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EINVAL if the script is not valid.
+*/
+extern int script_define(
+	const script_registry_t handle,
+	const char* name,
+	char** source
+);
+
+/*
+* Run the script registered under the name with the received arguments.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to ENOENT if no script is registered under the name.
+*/
+extern int script_run(
+	const script_registry_t handle,
+	const char* name,
+	const long* args,
+	const size_t n_args,
+	const struct script_env* env,
+	struct script_result* result
+);
@@ -0,0 +1,458 @@
+#include "segment.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include <try.h>
+
+#include "crc32c.h"
+#include "engine.h"
+
+#define SEGMENT_MAGIC "CSEG"
+#define SEGMENT_VERSION 1
+#define HEADER_LEN 32
+#define CHECKED_HEADER_LEN 24	// bytes of the header covered by the checksum
+#define VARINT_MAX_LEN 5
+#define INDEX_STRIDE 64	// runs between two entries of the run index
+
+/*
+* The file starts with a header holding the magic, the version of the
+* format, the number of seats, the lengths of the layout and of the runs
+* and the checksum of the rest of the header, of the layout and of the
+* runs. The layout is the text of a layout file, the runs are pairs of
+* varints holding the number of seats of the run and the ID linked to all
+* of them, in the order of the seats.
+*
+* The file is validated once when it is mapped, so the runs are decoded
+* afterwards without any bound check. The validation also fills the run
+* index, which holds the first seat and the offset of every INDEX_STRIDE-th
+* run, so a range of seats is decoded starting from the nearest entry instead
+* of from the first run.
+*/
+struct index_entry {
+	size_t seat;
+	size_t offset;
+};
+
+struct segment {
+	const char* bytes;
+	size_t size;
+	size_t n_seats;
+	const char* layout;
+	size_t layout_len;
+	const char* runs;
+	size_t runs_len;
+	struct index_entry* index;
+	size_t n_index;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static int validate(struct segment* segment);
+static size_t seek(const struct segment* segment, const size_t seat, size_t* offset);
+static size_t get_run(const struct segment* segment, const size_t offset, uint32_t* run, uint32_t* id);
+static size_t put_varint(char* bytes, uint32_t value);
+static int get_varint(const char* bytes, const size_t available, uint32_t* value);
+static void put_u32(char* bytes, const uint32_t value);
+static void put_u64(char* bytes, const uint64_t value);
+static uint32_t get_u32(const char* bytes);
+static uint64_t get_u64(const char* bytes);
+
+extern int segment_write(const char* filename, const struct venue_layout* layout, const int* ids) {
+	char* text;
+	char* image;
+	size_t text_len;
+	size_t length = 0;
+
+	try(text = layout_format(layout), NULL, error);
+	text_len = strlen(text);
+	// every run takes two varints at most, there is a run per seat at most
+	try(image = malloc(HEADER_LEN + text_len + layout->n_seats * 2 * VARINT_MAX_LEN), NULL, cleanup);
+	memcpy(image + HEADER_LEN, text, text_len);
+	char* runs = image + HEADER_LEN + text_len;
+	for (size_t i = 0; i < layout->n_seats;) {
+		size_t run = 1;
+		if (ids[i] < 0) {
+			errno = EINVAL;
+			goto cleanup2;
+		}
+		while (i + run < layout->n_seats && ids[i + run] == ids[i]) {
+			run++;
+		}
+		length += put_varint(runs + length, (uint32_t)run);
+		length += put_varint(runs + length, (uint32_t)ids[i]);
+		i += run;
+	}
+	memcpy(image, SEGMENT_MAGIC, 4);
+	put_u32(image + 4, SEGMENT_VERSION);
+	put_u64(image + 8, layout->n_seats);
+	put_u32(image + 16, (uint32_t)text_len);
+	put_u32(image + 20, (uint32_t)length);
+	put_u32(image + 24, crc32c(crc32c(0, image, CHECKED_HEADER_LEN), image + HEADER_LEN, text_len + length));
+	put_u32(image + 28, 0);
+	try(engine_write_file(filename, image, HEADER_LEN + text_len + length), !0, cleanup2);
+	free(image);
+	free(text);
+	return 0;
+
+cleanup2:
+	{
+		int error = errno;
+		free(image);
+		errno = error;
+	}
+cleanup:
+	{
+		int error = errno;
+		free(text);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+extern segment_t segment_open(const char* filename) {
+	struct segment* segment;
+	struct stat st;
+	void* bytes;
+	int fd;
+
+	try(segment = calloc(1, sizeof * segment), NULL, error);
+	try(fd = open(filename, O_RDONLY), -1, cleanup1);
+	try(fstat(fd, &st), -1, cleanup2);
+	if ((size_t)st.st_size < HEADER_LEN) {
+		errno = EILSEQ;
+		goto cleanup2;
+	}
+	try(bytes = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0), MAP_FAILED, cleanup2);
+	segment->bytes = bytes;
+	segment->size = (size_t)st.st_size;
+	try(close(fd), -1, cleanup3);
+	try(validate(segment), !0, cleanup3);
+	return segment;
+
+cleanup3:
+	{
+		int error = errno;
+		munmap((void*)segment->bytes, segment->size);
+		free(segment->index);
+		free(segment);
+		errno = error;
+		return NULL;
+	}
+cleanup2:
+	{
+		int error = errno;
+		close(fd);
+		errno = error;
+	}
+cleanup1:
+	free(segment);
+error:
+	return NULL;
+}
+
+extern int segment_close(const segment_t handle) {
+	struct segment* segment = (struct segment*)handle;
+
+	try(munmap((void*)segment->bytes, segment->size), -1, error);
+	free(segment->index);
+	free(segment);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern struct venue_layout* segment_layout(const segment_t handle) {
+	struct segment* segment = (struct segment*)handle;
+	struct venue_layout* layout;
+	char* text;
+
+	try(text = malloc(segment->layout_len + 1), NULL, error);
+	memcpy(text, segment->layout, segment->layout_len);
+	text[segment->layout_len] = 0;
+	layout = layout_parse(text);
+	{
+		int error = errno;
+		free(text);
+		errno = error;
+	}
+	if (layout && layout->n_seats != segment->n_seats) {
+		layout_destroy(layout);
+		errno = EILSEQ;
+		return NULL;
+	}
+	return layout;
+
+error:
+	return NULL;
+}
+
+extern size_t segment_size(const segment_t handle) {
+	struct segment* segment = (struct segment*)handle;
+	return segment->size + segment->n_index * sizeof * segment->index;
+}
+
+extern void segment_read(const segment_t handle, const size_t first_seat, const size_t n_seats, int* ids) {
+	struct segment* segment = (struct segment*)handle;
+	size_t offset;
+	size_t seat;
+
+	if (!n_seats) {
+		return;
+	}
+	seat = seek(segment, first_seat, &offset);
+	while (seat < first_seat + n_seats) {
+		uint32_t run;
+		uint32_t id;
+		offset += get_run(segment, offset, &run, &id);
+		size_t from = (seat > first_seat) ? seat : first_seat;
+		size_t to = (seat + run < first_seat + n_seats) ? seat + run : first_seat + n_seats;
+		for (size_t i = from; i < to; i++) {
+			ids[i - first_seat] = (int)id;
+		}
+		seat += run;
+	}
+}
+
+extern size_t segment_booked(const segment_t handle, const size_t first_seat, const size_t n_seats) {
+	struct segment* segment = (struct segment*)handle;
+	size_t offset;
+	size_t seat;
+	size_t n_booked = 0;
+
+	if (!n_seats) {
+		return 0;
+	}
+	seat = seek(segment, first_seat, &offset);
+	while (seat < first_seat + n_seats) {
+		uint32_t run;
+		uint32_t id;
+		offset += get_run(segment, offset, &run, &id);
+		size_t from = (seat > first_seat) ? seat : first_seat;
+		size_t to = (seat + run < first_seat + n_seats) ? seat + run : first_seat + n_seats;
+		if (id) {
+			n_booked += to - from;
+		}
+		seat += run;
+	}
+	return n_booked;
+}
+
+extern int segment_lookup(const segment_t handle, const int id, int** seats, size_t* n) {
+	struct segment* segment = (struct segment*)handle;
+
+	size_t seat = 0;
+	size_t n_seats = 0;
+	int* found = NULL;
+	*seats = NULL;
+	*n = 0;
+	if (id <= 0) {
+		return 0;
+	}
+	// the first pass counts the seats of the booking, the second copies them
+	for (int pass = 0; pass < 2; pass++) {
+		seat = 0;
+		n_seats = 0;
+		for (size_t offset = 0; offset < segment->runs_len;) {
+			uint32_t run;
+			uint32_t run_id;
+			offset += get_run(segment, offset, &run, &run_id);
+			if ((int)run_id == id) {
+				for (uint32_t i = 0; found && i < run; i++) {
+					found[n_seats + i] = (int)(seat + i);
+				}
+				n_seats += run;
+			}
+			seat += run;
+		}
+		if (!n_seats) {
+			return 0;
+		}
+		if (!found) {
+			try(found = malloc(sizeof * found * n_seats), NULL, error);
+		}
+	}
+	*seats = found;
+	*n = n_seats;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Check the header, the checksum and the runs of the mapped file, set the
+* fields of the segment.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno
+*			is set to EILSEQ if the file is not valid.
+*/
+static int validate(struct segment* segment) {
+	const char* bytes = segment->bytes;
+	size_t n_seats = 0;
+
+	if (memcmp(bytes, SEGMENT_MAGIC, 4) || get_u32(bytes + 4) != SEGMENT_VERSION) {
+		goto invalid;
+	}
+	segment->n_seats = (size_t)get_u64(bytes + 8);
+	segment->layout_len = get_u32(bytes + 16);
+	segment->runs_len = get_u32(bytes + 20);
+	if (segment->layout_len + segment->runs_len != segment->size - HEADER_LEN || segment->n_seats > INT_MAX) {
+		goto invalid;
+	}
+	segment->layout = bytes + HEADER_LEN;
+	segment->runs = segment->layout + segment->layout_len;
+	if (crc32c(crc32c(0, bytes, CHECKED_HEADER_LEN), segment->layout, segment->layout_len + segment->runs_len) != get_u32(bytes + 24)) {
+		goto invalid;
+	}
+	// a run takes two bytes at least
+	try(segment->index = malloc(sizeof * segment->index * (segment->runs_len / 2 / INDEX_STRIDE + 1)), NULL, error);
+	for (size_t offset = 0, n_runs = 0; offset < segment->runs_len; n_runs++) {
+		uint32_t run;
+		uint32_t id;
+		int length;
+		if (!(n_runs % INDEX_STRIDE)) {
+			segment->index[segment->n_index].seat = n_seats;
+			segment->index[segment->n_index].offset = offset;
+			segment->n_index++;
+		}
+		if ((length = get_varint(segment->runs + offset, segment->runs_len - offset, &run)) == 0) {
+			goto invalid;
+		}
+		offset += (size_t)length;
+		if ((length = get_varint(segment->runs + offset, segment->runs_len - offset, &id)) == 0) {
+			goto invalid;
+		}
+		offset += (size_t)length;
+		if (!run || run > segment->n_seats - n_seats || id > INT_MAX) {
+			goto invalid;
+		}
+		n_seats += run;
+	}
+	if (n_seats != segment->n_seats) {
+		goto invalid;
+	}
+	return 0;
+
+invalid:
+	errno = EILSEQ;
+error:
+	return 1;
+}
+
+/*
+* Find the run holding the seat starting from the nearest entry of the run
+* index, the seat must be lower than the seats of the segment.
+*
+* @return	the first seat of the run, whose offset is set in the offset
+*			parameter.
+*/
+static size_t seek(const struct segment* segment, const size_t seat, size_t* offset) {
+	size_t low = 0;
+	size_t high = segment->n_index;
+
+	while (high - low > 1) {
+		size_t middle = low + (high - low) / 2;
+		if (segment->index[middle].seat <= seat) {
+			low = middle;
+		}
+		else {
+			high = middle;
+		}
+	}
+	size_t first = segment->index[low].seat;
+	*offset = segment->index[low].offset;
+	for (;;) {
+		uint32_t run;
+		uint32_t id;
+		size_t length = get_run(segment, *offset, &run, &id);
+		if (first + run > seat) {
+			return first;
+		}
+		first += run;
+		*offset += length;
+	}
+}
+
+/*
+* Decode the run starting at the offset of a validated segment.
+*
+* @return	the number of bytes of the run.
+*/
+static size_t get_run(const struct segment* segment, const size_t offset, uint32_t* run, uint32_t* id) {
+	size_t length = (size_t)get_varint(segment->runs + offset, segment->runs_len - offset, run);
+	return length + (size_t)get_varint(segment->runs + offset + length, segment->runs_len - offset - length, id);
+}
+
+/*
+* Write the value as a little endian base 128 varint.
+*
+* @return	the number of bytes written.
+*/
+static size_t put_varint(char* bytes, uint32_t value) {
+	size_t length = 0;
+	while (value >= 0x80) {
+		bytes[length++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+	bytes[length++] = (char)value;
+	return length;
+}
+
+/*
+* Read a little endian base 128 varint from the available bytes.
+*
+* @return	the number of bytes read or 0 if the varint is truncated or
+*			longer than VARINT_MAX_LEN bytes.
+*/
+static int get_varint(const char* bytes, const size_t available, uint32_t* value) {
+	uint64_t result = 0;
+	for (size_t i = 0; i < available && i < VARINT_MAX_LEN; i++) {
+		result |= (uint64_t)((unsigned char)bytes[i] & 0x7f) << (7 * i);
+		if (!((unsigned char)bytes[i] & 0x80)) {
+			if (result > UINT32_MAX) {
+				return 0;
+			}
+			*value = (uint32_t)result;
+			return (int)i + 1;
+		}
+	}
+	return 0;
+}
+
+static void put_u32(char* bytes, const uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = (char)(value >> (8 * i));
+	}
+}
+
+static void put_u64(char* bytes, const uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		bytes[i] = (char)(value >> (8 * i));
+	}
+}
+
+static uint32_t get_u32(const char* bytes) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value |= (uint32_t)(unsigned char)bytes[i] << (8 * i);
+	}
+	return value;
+}
+
+static uint64_t get_u64(const char* bytes) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t)(unsigned char)bytes[i] << (8 * i);
+	}
+	return value;
+}
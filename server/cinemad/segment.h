@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "layout.h"
+
+typedef void* segment_t;
+
+/*
+* Write the sealed state of a show to the file: the layout of the venue and
+* the booking ID linked to every seat, 0 for a free seat. The IDs are stored
+* as runs of equal IDs and the whole file is covered by a checksum, it
+* replaces the file once it is durable.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int segment_write(
+	const char* filename,
+	const struct venue_layout* layout,
+	const int* ids
+);
+
+/*
+* Map the segment file read-only and verify its checksum.
+*
+* @return	segment handle on success or return NULL and set properly errno
+*			on error, errno is set to EILSEQ if the file is not valid.
+*/
+extern segment_t segment_open(
+	const char* filename
+);
+
+/*
+* Unmap the segment.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int segment_close(
+	const segment_t handle
+);
+
+/*
+* Parse the layout stored in the segment, the caller destroys it.
+*
+* @return	the layout on success or return NULL and set properly errno on
+*			error, errno is set to EILSEQ if the layout does not match the
+*			seats of the segment.
+*/
+extern struct venue_layout* segment_layout(
+	const segment_t handle
+);
+
+/*
+* Get the bytes the segment holds in memory, the mapped file and its run
+* index.
+*/
+extern size_t segment_size(
+	const segment_t handle
+);
+
+/*
+* Decode the ID linked to every seat of the range starting from first_seat in
+* the ids vector, which holds n_seats elements. Only the runs overlapping the
+* range are decoded, the range must lie within the seats of the layout.
+*/
+extern void segment_read(
+	const segment_t handle,
+	const size_t first_seat,
+	const size_t n_seats,
+	int* ids
+);
+
+/*
+* Count the booked seats of the range starting from first_seat, decoding only
+* the runs overlapping it.
+*
+* @return	the number of seats of the range linked to a booking.
+*/
+extern size_t segment_booked(
+	const segment_t handle,
+	const size_t first_seat,
+	const size_t n_seats
+);
+
+/*
+* Copy the seats linked to the booking ID in a malloc'd vector sorted in
+* ascending order, seats is set to NULL and n to 0 if the ID is unknown.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int segment_lookup(
+	const segment_t handle,
+	const int id,
+	int** seats,
+	size_t* n
+);
@@ -0,0 +1,367 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "layout.h"
+#include "segment.h"
+
+#include <try.h>
+
+#define MAX_FILE_LEN 65536
+#define N_RANGES 200
+#define N_LOOKUPS 20
+#define TEST_DIR_TEMPLATE "/tmp/segment_test.XXXXXX"
+
+/*
+* Layouts written as the content of a layout file, with sections, rows of
+* different lengths and gaps.
+*/
+static const char* const layouts[] = {
+	"A 1\n",
+	"A 300 700 1000 3\nB 5:2:5 10 4:1:4:1:4 600:3:400\nC 1\n",
+	"STALLS 40 40 40 40 40 40 40 40\nBALCONY 10:4:10 10:4:10\n",
+};
+
+enum pattern {
+	PATTERN_FREE,	// every seat is free
+	PATTERN_FULL,	// a single booking holds every seat
+	PATTERN_SINGLES,	// every seat is a booking of its own, a run per seat
+	PATTERN_RANDOM,	// bookings of random lengths with free gaps between them
+	PATTERN_LARGE_IDS,	// IDs which take every length of a varint
+	N_PATTERNS
+};
+
+struct segment_case {
+	const char* name;
+	int (*run)(const char* filename, const struct venue_layout* layout, const int* ids);
+};
+
+// Prototype declarations of functions included in this code module
+
+static int test_round_trip(const char* filename, const struct venue_layout* layout, const int* ids);
+static int test_corruption(const char* filename, const struct venue_layout* layout, const int* ids);
+static int test_truncation(const char* filename, const struct venue_layout* layout, const int* ids);
+static int test_invalid_id(const char* filename, const struct venue_layout* layout, const int* ids);
+static void fill_ids(const enum pattern pattern, const size_t n_seats, int* ids);
+static int check_segment(const segment_t segment, const struct venue_layout* layout, const int* ids);
+static int check_lookup(const segment_t segment, const size_t n_seats, const int* ids, const int id);
+static int read_file(const char* filename, char* bytes, size_t* size);
+static int write_file(const char* filename, const char* bytes, const size_t size);
+
+/*
+* Usage: segment_test
+*
+* Write segments of several layouts and booking patterns and read them back
+* whole, by range and by booking, then flip a bit of every byte of the file
+* and cut it at every length and check that no damaged segment is opened unless it
+* reads the same seats.
+*/
+int main(void) {
+	const struct segment_case cases[] = {
+		{ "round trip", &test_round_trip },
+		{ "corruption", &test_corruption },
+		{ "truncation", &test_truncation },
+		{ "invalid id", &test_invalid_id },
+	};
+	int failures = 0;
+
+	srand(1);
+	for (size_t i = 0; i < sizeof layouts / sizeof * layouts; i++) {
+		struct venue_layout* layout;
+		int* ids;
+
+		try(layout = layout_parse(layouts[i]), NULL, error);
+		try(ids = malloc(sizeof * ids * layout->n_seats), NULL, error);
+		for (int pattern = 0; pattern < N_PATTERNS; pattern++) {
+			fill_ids((enum pattern)pattern, layout->n_seats, ids);
+			for (size_t j = 0; j < sizeof cases / sizeof * cases; j++) {
+				char path[] = TEST_DIR_TEMPLATE;
+				char filename[sizeof path + sizeof "/show.seg"];
+
+				try(mkdtemp(path), NULL, error);
+				sprintf(filename, "%s/show.seg", path);
+				errno = 0;
+				if (cases[j].run(filename, layout, ids)) {
+					if (errno) {
+						perror("segment_test");
+					}
+					fprintf(stderr, "segment_test: %s, layout %zu, pattern %d: FAILED\n", cases[j].name, i, pattern);
+					failures++;
+				}
+				unlink(filename);
+				try(rmdir(path), -1, error);
+			}
+		}
+		free(ids);
+		layout_destroy(layout);
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+
+error:
+	perror("segment_test");
+	return EXIT_FAILURE;
+}
+
+/*
+* Write the segment and read it back.
+*/
+static int test_round_trip(const char* filename, const struct venue_layout* layout, const int* ids) {
+	segment_t segment;
+	int ret;
+
+	try(segment_write(filename, layout, ids), !0, error);
+	try(segment = segment_open(filename), NULL, error);
+	ret = check_segment(segment, layout, ids);
+	try(segment_close(segment), !0, error);
+	return ret;
+
+error:
+	return 1;
+}
+
+/*
+* Flip a bit of every byte of the file in turn, the bit moving along with the
+* byte, a flipped segment is either rejected with EILSEQ or reads the same
+* seats, as a flip of a byte no field uses.
+*/
+static int test_corruption(const char* filename, const struct venue_layout* layout, const int* ids) {
+	char bytes[MAX_FILE_LEN];
+	size_t size;
+
+	try(segment_write(filename, layout, ids), !0, error);
+	try(read_file(filename, bytes, &size), !0, error);
+	for (size_t i = 0; i < size; i++) {
+		segment_t segment;
+		int ret;
+
+		bytes[i] ^= (char)(1 << (i % 8));
+		try(write_file(filename, bytes, size), !0, error);
+		bytes[i] ^= (char)(1 << (i % 8));
+		if (!(segment = segment_open(filename))) {
+			if (errno != EILSEQ) {
+				goto error;
+			}
+			continue;
+		}
+		ret = check_segment(segment, layout, ids);
+		try(segment_close(segment), !0, error);
+		if (ret) {
+			fprintf(stderr, "segment_test: segment opened with byte %zu flipped\n", i);
+			return 1;
+		}
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Cut the file at every length and extend it by a byte, every such file is
+* rejected with EILSEQ.
+*/
+static int test_truncation(const char* filename, const struct venue_layout* layout, const int* ids) {
+	char bytes[MAX_FILE_LEN];
+	size_t size;
+
+	try(segment_write(filename, layout, ids), !0, error);
+	try(read_file(filename, bytes, &size), !0, error);
+	bytes[size] = 0;
+	for (size_t length = 0; length <= size + 1; length++) {
+		segment_t segment;
+
+		if (length == size) {
+			continue;
+		}
+		try(write_file(filename, bytes, length), !0, error);
+		if ((segment = segment_open(filename)) || errno != EILSEQ) {
+			fprintf(stderr, "segment_test: segment of %zu bytes out of %zu not rejected\n", length, size);
+			if (segment) {
+				segment_close(segment);
+			}
+			return 1;
+		}
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* A negative ID can not be written and leaves no file behind.
+*/
+static int test_invalid_id(const char* filename, const struct venue_layout* layout, const int* ids) {
+	int* invalid;
+	int ret;
+
+	try(invalid = malloc(sizeof * invalid * layout->n_seats), NULL, error);
+	memcpy(invalid, ids, sizeof * invalid * layout->n_seats);
+	invalid[layout->n_seats - 1] = -1;
+	ret = !segment_write(filename, layout, invalid) || errno != EINVAL || !access(filename, F_OK);
+	free(invalid);
+	if (ret) {
+		fprintf(stderr, "segment_test: segment with a negative ID written\n");
+	}
+	return ret;
+
+error:
+	return 1;
+}
+
+/*
+* Fill the IDs of the seats with the pattern.
+*/
+static void fill_ids(const enum pattern pattern, const size_t n_seats, int* ids) {
+	for (size_t i = 0; i < n_seats;) {
+		size_t run;
+		int id;
+
+		switch (pattern) {
+		case PATTERN_FREE:
+			run = n_seats;
+			id = 0;
+			break;
+		case PATTERN_FULL:
+			run = n_seats;
+			id = 1;
+			break;
+		case PATTERN_SINGLES:
+			run = 1;
+			id = (int)i + 1;
+			break;
+		case PATTERN_RANDOM:
+			run = 1 + (size_t)rand() % 20;
+			id = (rand() % 3) ? 1 + rand() % 50 : 0;
+			break;
+		default:
+			run = 1 + (size_t)rand() % 3;
+			id = (int)((unsigned int)INT_MAX >> (rand() % 31));
+			break;
+		}
+		for (size_t j = 0; j < run && i < n_seats; j++) {
+			ids[i++] = id;
+		}
+	}
+}
+
+/*
+* Check the layout, the IDs of the whole venue and of random ranges, the
+* booked seats of the ranges, the seats of random bookings and those of an
+* unknown one.
+*
+* @return	0 if the segment holds the layout and the IDs or return 1
+*			otherwise.
+*/
+static int check_segment(const segment_t segment, const struct venue_layout* layout, const int* ids) {
+	struct venue_layout* stored;
+	char* text = NULL;
+	char* expected;
+	int* read;
+	int ret = 1;
+
+	if (!(stored = segment_layout(segment))) {
+		return 1;
+	}
+	try(text = layout_format(stored), NULL, cleanup1);
+	try(expected = layout_format(layout), NULL, cleanup1);
+	ret = strcmp(text, expected) != 0;
+	free(expected);
+	try(read = malloc(sizeof * read * layout->n_seats), NULL, cleanup1);
+	segment_read(segment, 0, layout->n_seats, read);
+	ret |= memcmp(read, ids, sizeof * read * layout->n_seats) != 0;
+	for (size_t i = 0; !ret && i < N_RANGES; i++) {
+		size_t first = (size_t)rand() % layout->n_seats;
+		size_t n = (size_t)rand() % (layout->n_seats - first + 1);
+		size_t n_booked = 0;
+		segment_read(segment, first, n, read);
+		for (size_t j = 0; j < n; j++) {
+			n_booked += (ids[first + j] != 0);
+		}
+		ret |= memcmp(read, &ids[first], sizeof * read * n) != 0;
+		ret |= segment_booked(segment, first, n) != n_booked;
+	}
+	for (size_t i = 0; !ret && i < N_LOOKUPS; i++) {
+		ret |= check_lookup(segment, layout->n_seats, ids, ids[(size_t)rand() % layout->n_seats]);
+	}
+	ret |= check_lookup(segment, layout->n_seats, ids, INT_MAX - 1);
+	free(read);
+cleanup1:
+	free(text);
+	layout_destroy(stored);
+	return ret;
+}
+
+/*
+* Check the seats the segment links to the booking ID.
+*
+* @return	0 if they are the seats holding the ID or return 1 otherwise.
+*/
+static int check_lookup(const segment_t segment, const size_t n_seats, const int* ids, const int id) {
+	int* seats;
+	size_t n;
+	size_t found = 0;
+	int ret = 0;
+
+	if (segment_lookup(segment, id, &seats, &n)) {
+		return 1;
+	}
+	// the free seats belong to no booking
+	for (size_t i = 0; id > 0 && i < n_seats; i++) {
+		if (ids[i] == id) {
+			ret |= (found >= n || seats[found] != (int)i);
+			found++;
+		}
+	}
+	ret |= (found != n);
+	free(seats);
+	return ret;
+}
+
+/*
+* Read the whole file, which must hold less than MAX_FILE_LEN bytes.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int read_file(const char* filename, char* bytes, size_t* size) {
+	FILE* stream;
+
+	try(stream = fopen(filename, "r"), NULL, error);
+	*size = fread(bytes, 1, MAX_FILE_LEN, stream);
+	if (ferror(stream) || *size == MAX_FILE_LEN) {
+		errno = EFBIG;
+		goto cleanup;
+	}
+	try(fclose(stream), EOF, error);
+	return 0;
+
+cleanup:
+	fclose(stream);
+error:
+	return 1;
+}
+
+/*
+* Replace the content of the file with the bytes.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int write_file(const char* filename, const char* bytes, const size_t size) {
+	FILE* stream;
+
+	try(stream = fopen(filename, "w"), NULL, error);
+	if (fwrite(bytes, 1, size, stream) != size) {
+		goto cleanup;
+	}
+	try(fclose(stream), EOF, error);
+	return 0;
+
+cleanup:
+	fclose(stream);
+error:
+	return 1;
+}
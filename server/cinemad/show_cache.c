@@ -0,0 +1,851 @@
+#include "show_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+
+#include <try.h>
+
+#include "database.h"
+#include "storage.h"
+
+#define DATA_FILENAME "data.dat"
+#define SEGMENT_FILENAME "sealed.seg"
+#define INITIAL_CAPACITY 64
+#define EVICT_INTERVAL 1000	// milliseconds between two passes of the evictor
+
+/*
+* A show accessed since the cache was created. Its database is NULL while
+* the show is not resident, loading is set while the database is opened or
+* closed and sealing while it is sealed, the requests for the show wait for
+* both. refs counts the requests executing against the database, which is
+* never evicted meanwhile, and referenced is the bit of the CLOCK set by
+* every access. The load latencies are in microseconds.
+*/
+struct show {
+	char name[SHOW_NAME_LEN + 1];
+	database_t database;
+	int sealed;
+	int loading;
+	int sealing;
+	size_t refs;
+	int referenced;
+	time_t last_access;
+	size_t memory;
+	unsigned long loads;
+	unsigned long hits;
+	unsigned long evictions;
+	unsigned long load_latency_last;
+	unsigned long load_latency_total;
+	unsigned long load_latency_max;
+	struct show* next;
+};
+
+/*
+* The shows are found by name through a hash table of chained shows and kept
+* in the order of their first access, which is the order the hand of the
+* CLOCK visits them. The entry of a show is kept once it is evicted, so that
+* its counters survive, but it holds no database.
+*
+* The mutex guards every show and the totals. A show is loaded, sealed and
+* closed without holding it, the evictor takes a reference to a resident
+* show to read its memory without holding it too.
+*
+* n_open counts the resident shows whose bookings are open, each running the
+* background threads of its storage, and the loads in progress, which take
+* their slot before the database is opened and give it back if the show
+* turns out sealed. A load beyond max_open evicts the coldest open show or,
+* if every one has a request in flight, waits on changed for an unpin.
+*/
+struct show_cache {
+	char* directory;
+	struct storage_options* options;	// NULL for the stream mode
+	size_t memory_cap;
+	size_t max_open;
+	time_t idle_timeout;
+	struct show** buckets;
+	size_t n_buckets;
+	struct show** shows;
+	size_t n_shows;
+	size_t capacity;
+	size_t hand;
+	size_t n_resident;
+	size_t n_open;
+	size_t waiting;	// loads waiting for a slot of an open show
+	size_t memory;
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+	pthread_cond_t evict;
+	int stopping;
+	pthread_t evictor;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static int is_valid_name(const char* name);
+static size_t hash(const char* name, const size_t n_buckets);
+static struct show* find_show(struct show_cache* cache, const char* name, const int create);
+static int grow(struct show_cache* cache);
+static struct show* pin_show(struct show_cache* cache, const char* name, const int create);
+static int unpin_show(struct show_cache* cache, struct show* show);
+static int seal_show(struct show_cache* cache, struct show* show, const char* filename);
+static char* show_filename(struct show_cache* cache, const char* name, const char* basename);
+static int show_exists(struct show_cache* cache, const char* name);
+static database_t load_database(struct show_cache* cache, const char* name, const int create, int* sealed);
+static int reserve_open(struct show_cache* cache);
+static int release_open(struct show_cache* cache);
+static int evict_shows(struct show_cache* cache);
+static int evict_coldest(struct show_cache* cache, const int open, int* evicted);
+static int evict_show(struct show_cache* cache, struct show* show);
+static void* evictor_routine(void* arg);
+static time_t now(void);
+
+extern show_cache_t show_cache_init(const char* directory, const struct storage_options* options, const size_t memory_cap, const size_t max_open, const time_t idle_timeout) {
+	struct show_cache* cache;
+	// an evicted show must be loaded back with its bookings
+	if ((options && options->engine == STORAGE_ENGINE_MEMORY) || !max_open) {
+		errno = EINVAL;
+		return NULL;
+	}
+	cache = calloc(1, sizeof * cache);
+	if (cache) {
+		cache->memory_cap = memory_cap;
+		cache->max_open = max_open;
+		cache->idle_timeout = idle_timeout;
+		try(cache->directory = strdup(directory), NULL, error);
+		if (options) {
+			try(cache->options = malloc(sizeof * cache->options), NULL, cleanup0);
+			*cache->options = *options;
+		}
+		try(cache->buckets = calloc(INITIAL_CAPACITY, sizeof * cache->buckets), NULL, cleanup1);
+		cache->n_buckets = INITIAL_CAPACITY;
+		try(cache->shows = malloc(sizeof * cache->shows * INITIAL_CAPACITY), NULL, cleanup2);
+		cache->capacity = INITIAL_CAPACITY;
+		try_pthread_mutex_init(&cache->mutex, cleanup3);
+		try_pthread(pthread_cond_init(&cache->changed, NULL), cleanup4);
+		try_pthread(pthread_cond_init(&cache->evict, NULL), cleanup5);
+		try_pthread(pthread_create(&cache->evictor, NULL, &evictor_routine, cache), cleanup6);
+	}
+	return cache;
+
+cleanup6:
+	pthread_cond_destroy(&cache->evict);
+cleanup5:
+	pthread_cond_destroy(&cache->changed);
+cleanup4:
+	pthread_mutex_destroy(&cache->mutex);
+cleanup3:
+	free(cache->shows);
+cleanup2:
+	free(cache->buckets);
+cleanup1:
+	free(cache->options);
+cleanup0:
+	free(cache->directory);
+error:
+	free(cache);
+	return NULL;
+}
+
+extern int show_cache_destroy(const show_cache_t handle) {
+	struct show_cache* cache = (struct show_cache*)handle;
+
+	try_pthread_mutex_lock(&cache->mutex, error);
+	cache->stopping = 1;
+	try_pthread(pthread_cond_signal(&cache->evict), unlock);
+	try_pthread_mutex_unlock(&cache->mutex, error);
+	try_pthread(pthread_join(cache->evictor, NULL), error);
+	for (size_t i = 0; i < cache->n_shows; i++) {
+		if (cache->shows[i]->database) {
+			try(database_close(cache->shows[i]->database), !0, error);
+		}
+		free(cache->shows[i]);
+	}
+	try_pthread(pthread_cond_destroy(&cache->evict), error);
+	try_pthread(pthread_cond_destroy(&cache->changed), error);
+	try_pthread_mutex_destroy(&cache->mutex, error);
+	free(cache->shows);
+	free(cache->buckets);
+	free(cache->options);
+	free(cache->directory);
+	free(cache);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&cache->mutex);
+error:
+	return 1;
+}
+
+extern int show_cache_execute(const show_cache_t handle, const char* name, const char* query, const int create, char** result) {
+	struct show_cache* cache = (struct show_cache*)handle;
+	struct show* show;
+
+	if (!is_valid_name(name)) {
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	if ((show = pin_show(cache, name, create)) == NULL) {
+		// a missing show is no fault of the daemon
+		if (errno != ENOENT) {
+			syslog(LOG_WARNING, "Show:	%s can not be loaded: %m", name);
+		}
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	if (database_execute(show->database, query, result)) {
+		int error = errno;
+		unpin_show(cache, show);
+		errno = error;
+		return 1;
+	}
+	return unpin_show(cache, show);
+}
+
+/*
+* Seal the show once no request runs against it: write its map and its
+* bookings to a segment which replaces its database in memory and at every
+* later load. The files of the database are left in place, removing the
+* segment opens the bookings again.
+*/
+extern int show_cache_seal(const show_cache_t handle, const char* name, char** result) {
+	struct show_cache* cache = (struct show_cache*)handle;
+	struct show* show;
+	char* filename;
+
+	if (!is_valid_name(name)) {
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	if ((show = pin_show(cache, name, 0)) == NULL) {
+		syslog(LOG_WARNING, "Show:	%s can not be loaded: %m", name);
+		*result = strdup(MSG_FAIL);
+		return 0;
+	}
+	try(filename = show_filename(cache, name, SEGMENT_FILENAME), NULL, cleanup);
+	if (seal_show(cache, show, filename)) {
+		syslog(LOG_WARNING, "Show:	%s can not be sealed: %m", name);
+		*result = strdup(MSG_FAIL);
+	}
+	else {
+		*result = strdup(MSG_SUCC);
+	}
+	free(filename);
+	try(unpin_show(cache, show), !0, error);
+	return 0;
+
+cleanup:
+	{
+		int error = errno;
+		unpin_show(cache, show);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Return RESIDENT <shows> OPEN <shows> <max> MEMORY <bytes> CAP <bytes> followed by
+* <name>:<resident>:<sealed>:<memory>:<loads>:<hits>:<evictions>:<last>:<avg>:<max>
+* for every show, the memory is the estimate of the last pass of the evictor
+* and the load latencies are in microseconds
+*/
+extern int show_cache_report(const show_cache_t handle, char** result) {
+	struct show_cache* cache = (struct show_cache*)handle;
+	char* report;
+
+	try_pthread_mutex_lock(&cache->mutex, error);
+	// every counter takes at most 20 characters plus its separator
+	try(report = malloc(sizeof * report * (5 * 30 + cache->n_shows * (SHOW_NAME_LEN + 10 * 21 + 1) + 1)), NULL, unlock);
+	char* cursor = report;
+	cursor += sprintf(cursor, "RESIDENT %zu OPEN %zu %zu MEMORY %zu CAP %zu", cache->n_resident, cache->n_open, cache->max_open, cache->memory, cache->memory_cap);
+	for (size_t i = 0; i < cache->n_shows; i++) {
+		const struct show* show = cache->shows[i];
+		cursor += sprintf(cursor, " %s:%d:%d:%zu:%lu:%lu:%lu:%lu:%lu:%lu", show->name, show->database != NULL, show->sealed, show->memory,
+			show->loads, show->hits, show->evictions, show->load_latency_last,
+			show->loads ? show->load_latency_total / show->loads : 0, show->load_latency_max);
+	}
+	try_pthread_mutex_unlock(&cache->mutex, cleanup);
+	*result = report;
+	return 0;
+
+cleanup:
+	free(report);
+	return 1;
+unlock:
+	pthread_mutex_unlock(&cache->mutex);
+error:
+	return 1;
+}
+
+/*
+* Check the name of a show, which names its directory too.
+*
+* @return	1 if the name is made of letters, digits, '-' and '_' and is not
+*			longer than SHOW_NAME_LEN, 0 otherwise.
+*/
+static int is_valid_name(const char* name) {
+	size_t length = strlen(name);
+	return length > 0 && length <= SHOW_NAME_LEN
+		&& strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_") == length;
+}
+
+static size_t hash(const char* name, const size_t n_buckets) {
+	size_t h = 5381;
+	for (const char* c = name; *c; c++) {
+		h = h * 33 + (unsigned char)*c;
+	}
+	return h & (n_buckets - 1);
+}
+
+/*
+* Find the show, create its entry if it was never accessed. Unless create is
+* set the entry is created only for a show with files in the directory, so
+* the entries stay bounded by the shows created. Must be called holding the
+* mutex.
+*
+* @return	the show on success or return NULL and set properly errno on
+*			error, errno is set to ENOENT if the show does not exist.
+*/
+static struct show* find_show(struct show_cache* cache, const char* name, const int create) {
+	struct show* show;
+	for (show = cache->buckets[hash(name, cache->n_buckets)]; show; show = show->next) {
+		if (!strcmp(show->name, name)) {
+			return show;
+		}
+	}
+	if (!create && !show_exists(cache, name)) {
+		errno = ENOENT;
+		return NULL;
+	}
+	if (cache->n_shows == cache->capacity) {
+		try(grow(cache), !0, error);
+	}
+	try(show = calloc(1, sizeof * show), NULL, error);
+	strcpy(show->name, name);
+	size_t bucket = hash(name, cache->n_buckets);
+	show->next = cache->buckets[bucket];
+	cache->buckets[bucket] = show;
+	cache->shows[cache->n_shows++] = show;
+	return show;
+
+error:
+	return NULL;
+}
+
+/*
+* Double the shows vector and the hash table, rehashing every show. Must be
+* called holding the mutex.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int grow(struct show_cache* cache) {
+	struct show** shows;
+	struct show** buckets;
+	try(shows = realloc(cache->shows, sizeof * shows * cache->capacity * 2), NULL, error);
+	cache->shows = shows;
+	cache->capacity *= 2;
+	try(buckets = calloc(cache->n_buckets * 2, sizeof * buckets), NULL, error);
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->n_buckets *= 2;
+	for (size_t i = 0; i < cache->n_shows; i++) {
+		size_t bucket = hash(cache->shows[i]->name, cache->n_buckets);
+		cache->shows[i]->next = buckets[bucket];
+		buckets[bucket] = cache->shows[i];
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Take a reference to the show for a request, loading its database if it is
+* not resident and creating it if it does not exist and create is set. A
+* request for a show being loaded, evicted or sealed waits for it.
+*
+* @return	the show on success or return NULL and set properly errno on
+*			error.
+*/
+static struct show* pin_show(struct show_cache* cache, const char* name, const int create) {
+	struct show* show;
+	database_t database;
+	struct timespec start;
+	struct timespec end;
+	size_t memory;
+	int sealed;
+
+	try_pthread_mutex_lock(&cache->mutex, error);
+	try(show = find_show(cache, name, create), NULL, unlock);
+	while (show->loading || show->sealing) {
+		try_pthread(pthread_cond_wait(&cache->changed, &cache->mutex), unlock);
+	}
+	if (show->database) {
+		show->refs++;
+		show->referenced = 1;
+		show->hits++;
+		show->last_access = now();
+		try_pthread_mutex_unlock(&cache->mutex, error);
+		return show;
+	}
+	show->loading = 1;
+	if (reserve_open(cache)) {
+		int error = errno;
+		show->loading = 0;
+		pthread_cond_broadcast(&cache->changed);
+		pthread_mutex_unlock(&cache->mutex);
+		errno = error;
+		return NULL;
+	}
+	try_pthread_mutex_unlock(&cache->mutex, error);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	database = load_database(cache, name, create, &sealed);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (database && database_memory(database, &memory)) {
+		int error = errno;
+		database_close(database);
+		database = NULL;
+		errno = error;
+	}
+	int load_error = errno;
+	try_pthread_mutex_lock(&cache->mutex, error);
+	show->loading = 0;
+	pthread_cond_broadcast(&cache->changed);
+	if (!database || sealed) {
+		release_open(cache);
+	}
+	if (!database) {
+		pthread_mutex_unlock(&cache->mutex);
+		errno = load_error;
+		return NULL;
+	}
+	unsigned long latency = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000);
+	show->database = database;
+	show->sealed = sealed;
+	show->refs++;
+	show->referenced = 1;
+	show->last_access = now();
+	show->memory = memory;
+	show->loads++;
+	show->load_latency_last = latency;
+	show->load_latency_total += latency;
+	show->load_latency_max = (latency > show->load_latency_max) ? latency : show->load_latency_max;
+	cache->n_resident++;
+	cache->memory += memory;
+	if (cache->memory > cache->memory_cap) {
+		pthread_cond_signal(&cache->evict);
+	}
+	try_pthread_mutex_unlock(&cache->mutex, error);
+	return show;
+
+unlock:
+	pthread_mutex_unlock(&cache->mutex);
+error:
+	return NULL;
+}
+
+/*
+* Release the reference taken by a request, the show becomes idle from now.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int unpin_show(struct show_cache* cache, struct show* show) {
+	try_pthread_mutex_lock(&cache->mutex, error);
+	show->refs--;
+	show->last_access = now();
+	// a load waiting for a slot can evict the show from now
+	if (show->sealing || (cache->waiting && !show->refs)) {
+		try_pthread(pthread_cond_broadcast(&cache->changed), unlock);
+	}
+	try_pthread_mutex_unlock(&cache->mutex, error);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&cache->mutex);
+error:
+	return 1;
+}
+
+/*
+* Wait for the other requests for the show to complete, write its segment
+* and replace its database with the sealed one. The caller holds a reference
+* to the show, a show already sealed fails with EINVAL.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int seal_show(struct show_cache* cache, struct show* show, const char* filename) {
+	database_t database;
+	database_t sealed;
+	size_t memory;
+
+	try_pthread_mutex_lock(&cache->mutex, error);
+	if (show->sealed || show->sealing) {
+		pthread_mutex_unlock(&cache->mutex);
+		errno = EINVAL;
+		return 1;
+	}
+	show->sealing = 1;
+	while (show->refs > 1) {
+		try_pthread(pthread_cond_wait(&cache->changed, &cache->mutex), unlock);
+	}
+	try_pthread_mutex_unlock(&cache->mutex, cleanup1);
+	// no request runs against the show, its map is final
+	try(database_seal(show->database, filename), !0, cleanup1);
+	try(sealed = database_open_sealed(filename), NULL, cleanup2);
+	try(database_memory(sealed, &memory), !0, cleanup3);
+	try_pthread_mutex_lock(&cache->mutex, cleanup3);
+	database = show->database;
+	show->database = sealed;
+	show->sealed = 1;
+	show->sealing = 0;
+	cache->n_open--;
+	cache->memory += memory - show->memory;
+	show->memory = memory;
+	pthread_cond_broadcast(&cache->changed);
+	try_pthread_mutex_unlock(&cache->mutex, error);
+	if (database_close(database)) {
+		syslog(LOG_ERR, "Show:	%s can not be closed: %m", show->name);
+	}
+	return 0;
+
+unlock:
+	{
+		int error = errno;
+		show->sealing = 0;
+		pthread_cond_broadcast(&cache->changed);
+		pthread_mutex_unlock(&cache->mutex);
+		errno = error;
+		return 1;
+	}
+cleanup3:
+	{
+		int error = errno;
+		database_close(sealed);
+		errno = error;
+	}
+cleanup2:
+	{
+		int error = errno;
+		remove(filename);
+		errno = error;
+	}
+cleanup1:
+	{
+		int error = errno;
+		pthread_mutex_lock(&cache->mutex);
+		show->sealing = 0;
+		pthread_cond_broadcast(&cache->changed);
+		pthread_mutex_unlock(&cache->mutex);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Build the path of a file in the directory of the show.
+*
+* @return	the malloc'd path on success or return NULL and set properly
+*			errno on error.
+*/
+static char* show_filename(struct show_cache* cache, const char* name, const char* basename) {
+	char* filename;
+
+	try(filename = malloc(strlen(cache->directory) + SHOW_NAME_LEN + strlen(basename) + 3), NULL, error);
+	sprintf(filename, "%s/%s/%s", cache->directory, name, basename);
+	return filename;
+
+error:
+	return NULL;
+}
+
+/*
+* Check whether the show has a segment or a data file in the directory.
+*
+* @return	1 if it has one, 0 otherwise.
+*/
+static int show_exists(struct show_cache* cache, const char* name) {
+	const char* const basenames[] = { SEGMENT_FILENAME, DATA_FILENAME };
+	char* filename;
+	int exists = 0;
+
+	for (size_t i = 0; !exists && i < sizeof basenames / sizeof * basenames; i++) {
+		if ((filename = show_filename(cache, name, basenames[i])) == NULL) {
+			break;
+		}
+		exists = !access(filename, F_OK);
+		free(filename);
+	}
+	return exists;
+}
+
+/*
+* Open the database of the show, the segment of a sealed show or else its
+* bookings, creating and populating them on its first load if create is set,
+* and set it up. sealed tells which one has been opened.
+*
+* @return	the database on success or return NULL and set properly errno on
+*			error, errno is set to ENOENT if the show does not exist and
+*			create is not set.
+*/
+static database_t load_database(struct show_cache* cache, const char* name, const int create, int* sealed) {
+	database_t database;
+	char* dirname;
+	char* filename;
+	char* result;
+	int fd;
+
+	try(dirname = show_filename(cache, name, ""), NULL, error);
+	try(filename = show_filename(cache, name, SEGMENT_FILENAME), NULL, cleanup1);
+	if (access(filename, F_OK) == 0) {
+		*sealed = 1;
+		database = database_open_sealed(filename);
+		{
+			int error = errno;
+			free(filename);
+			free(dirname);
+			errno = error;
+		}
+		return database;
+	}
+	*sealed = 0;
+	free(filename);
+	try(filename = show_filename(cache, name, DATA_FILENAME), NULL, cleanup1);
+	if (create) {
+		try(mkdir(dirname, 0775), -1 * (errno != EEXIST), cleanup2);
+	}
+	if ((database = database_init(filename, cache->options)) == NULL) {
+		if (errno != ENOENT || !create) {
+			goto cleanup2;
+		}
+		try(fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0660), -1, cleanup2);
+		try(close(fd), -1, cleanup2);
+		try(database = database_init(filename, cache->options), NULL, cleanup2);
+		try(database_execute(database, "POPULATE", &result), 1, cleanup3);
+		free(result);
+	}
+	try(database_execute(database, "SETUP", &result), 1, cleanup3);
+	free(result);
+	free(filename);
+	free(dirname);
+	return database;
+
+cleanup3:
+	{
+		int error = errno;
+		database_close(database);
+		errno = error;
+	}
+cleanup2:
+	free(filename);
+cleanup1:
+	free(dirname);
+error:
+	return NULL;
+}
+
+/*
+* Refresh the memory of the resident shows, evict those idle for longer
+* than the timeout, then the coldest ones in CLOCK order while the resident
+* shows take more memory than the cap. A show with a request in flight is
+* never evicted and a show being sealed is skipped, since the seal closes
+* its database once it holds the only reference. Must be called holding
+* the mutex.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int evict_shows(struct show_cache* cache) {
+	time_t current = now();
+	for (size_t i = 0; i < cache->n_shows; i++) {
+		struct show* show = cache->shows[i];
+		database_t database = show->database;
+		size_t memory;
+		if (!database || show->loading || show->sealing) {
+			continue;
+		}
+		// a seal starting meanwhile waits for this reference
+		show->refs++;
+		try_pthread_mutex_unlock(&cache->mutex, error);
+		int ret = database_memory(database, &memory);
+		try_pthread_mutex_lock(&cache->mutex, error);
+		show->refs--;
+		if (show->sealing) {
+			try_pthread(pthread_cond_broadcast(&cache->changed), error);
+		}
+		if (!ret && show->database == database) {
+			cache->memory += memory - show->memory;
+			show->memory = memory;
+		}
+		if (!show->refs && current - show->last_access >= cache->idle_timeout) {
+			try(evict_show(cache, show), !0, error);
+		}
+	}
+	while (cache->memory > cache->memory_cap) {
+		int evicted;
+		try(evict_coldest(cache, 0, &evicted), !0, error);
+		if (!evicted) {
+			break;
+		}
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Take the slot of an open show for a load, evicting the coldest open show
+* or waiting for one to become idle while max_open are taken. Must be called
+* holding the mutex.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int reserve_open(struct show_cache* cache) {
+	while (cache->n_open >= cache->max_open) {
+		int evicted;
+		try(evict_coldest(cache, 1, &evicted), !0, error);
+		if (!evicted && cache->n_open >= cache->max_open) {
+			cache->waiting++;
+			int ret = pthread_cond_wait(&cache->changed, &cache->mutex);
+			cache->waiting--;
+			if (ret) {
+				errno = ret;
+				goto error;
+			}
+		}
+	}
+	cache->n_open++;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Give back the slot taken by a load which opened a sealed show or failed.
+* Must be called holding the mutex.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int release_open(struct show_cache* cache) {
+	cache->n_open--;
+	if (cache->waiting) {
+		try_pthread(pthread_cond_broadcast(&cache->changed), error);
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Evict the first show the hand of the CLOCK finds without its bit and
+* without requests in flight, only among the open shows if requested. Must
+* be called holding the mutex.
+*
+* @return	0 on success or return 1 and set properly errno on error, evicted
+*			tells whether a show has been evicted.
+*/
+static int evict_coldest(struct show_cache* cache, const int open, int* evicted) {
+	*evicted = 0;
+	// every resident show loses its bit on the first round at most
+	for (size_t n = 2 * cache->n_shows; n; n--) {
+		struct show* show = cache->shows[cache->hand];
+		cache->hand = (cache->hand + 1) % cache->n_shows;
+		if (!show->database || show->loading || show->sealing || show->refs || (open && show->sealed)) {
+			continue;
+		}
+		if (show->referenced) {
+			show->referenced = 0;
+			continue;
+		}
+		try(evict_show(cache, show), !0, error);
+		*evicted = 1;
+		return 0;
+	}
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Close the database of the show, whose durable state stays on disk. The
+* mutex is released while the database is closed, the requests for the show
+* wait meanwhile. Must be called holding the mutex.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int evict_show(struct show_cache* cache, struct show* show) {
+	database_t database = show->database;
+	show->database = NULL;
+	show->loading = 1;
+	show->evictions++;
+	cache->n_resident--;
+	if (!show->sealed) {
+		cache->n_open--;
+	}
+	cache->memory -= show->memory;
+	show->memory = 0;
+	try_pthread_mutex_unlock(&cache->mutex, error);
+	if (database_close(database)) {
+		syslog(LOG_ERR, "Show:	%s can not be closed: %m", show->name);
+	}
+	try_pthread_mutex_lock(&cache->mutex, error);
+	show->loading = 0;
+	try_pthread(pthread_cond_broadcast(&cache->changed), error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Evict the shows every EVICT_INTERVAL milliseconds or as soon as a load
+* exceeds the memory cap, until the cache is destroyed.
+*/
+static void* evictor_routine(void* arg) {
+	struct show_cache* cache = (struct show_cache*)arg;
+
+	try_pthread_mutex_lock(&cache->mutex, error);
+	while (!cache->stopping) {
+		struct timespec deadline;
+		int ret;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += EVICT_INTERVAL / 1000;
+		deadline.tv_nsec += (EVICT_INTERVAL % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		ret = pthread_cond_timedwait(&cache->evict, &cache->mutex, &deadline);
+		if (ret && ret != ETIMEDOUT) {
+			goto unlock;
+		}
+		if (!cache->stopping && evict_shows(cache)) {
+			syslog(LOG_ERR, "Show:	eviction failed: %m");
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return NULL;
+
+unlock:
+	pthread_mutex_unlock(&cache->mutex);
+error:
+	return NULL;
+}
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
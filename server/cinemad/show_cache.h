@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <time.h>
+
+#define SHOW_NAME_LEN 64
+
+typedef void* show_cache_t;
+
+struct storage_options;
+
+/*
+* Create the cache of the shows kept in the directory, every show is a
+* database in the subdirectory of its name opened with the options, NULL
+* options select the stream mode. A show is loaded on its first access and
+* evicted once it has been idle for idle_timeout seconds or, while the
+* resident shows take more than memory_cap bytes, in CLOCK order. The
+* memory engine does not persist the shows and is rejected.
+*
+* Every resident show whose bookings are open runs the background threads
+* of its storage, the log flusher, the checkpointer, the scrubber and the
+* write-back flusher or those of the LSM engine, at most four, while a sealed
+* show runs none. At most max_open such shows are resident: a load beyond
+* them evicts the coldest one first, or waits for one without requests in
+* flight, so the threads of the shows stay within four times max_open, plus
+* those parsing the file of a show being loaded, joined before it is used.
+*
+* @return	cache handle on success or return NULL and set properly errno
+*			on error, errno is set to EINVAL if max_open is 0.
+*/
+extern show_cache_t show_cache_init(
+	const char* directory,
+	const struct storage_options* options,
+	const size_t memory_cap,
+	const size_t max_open,
+	const time_t idle_timeout
+);
+
+/*
+* Close every resident show and destroy the cache, no request must be in
+* flight.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int show_cache_destroy(
+	const show_cache_t handle
+);
+
+/*
+* Execute the query against the show, set the result parameter. A show which
+* is not resident is loaded first, one which does not exist yet is created
+* empty if create is set. An invalid name, a show which does not exist and
+* is not created or a show which can not be loaded gets a failure result.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int show_cache_execute(
+	const show_cache_t handle,
+	const char* name,
+	const char* query,
+	const int create,
+	char** result
+);
+
+/*
+* Seal the show: once the requests in flight complete, its map and bookings
+* are written to a read-only segment which serves every later MAP, SEATS,
+* COUNT, ROWSTATS and SECTIONS query and fails the others. An invalid name
+* or a show which is already sealed gets a failure result.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int show_cache_seal(
+	const show_cache_t handle,
+	const char* name,
+	char** result
+);
+
+/*
+* Report the shows accessed since the cache was created, set the result
+* parameter.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int show_cache_report(
+	const show_cache_t handle,
+	char** result
+);
@@ -0,0 +1,431 @@
+#include "snapshot.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+
+#include <try.h>
+
+#define N_READERS 256
+
+/*
+* Epoch based reclamation: a reader announces the current epoch in a free
+* slot before loading the snapshot pointer, a replaced block is retired with
+* the epoch of its replacement and it is freed once every active reader
+* announced a later epoch. A publication retires the previous root, the
+* sections it replaced and their chunks it replaced.
+*/
+
+struct retired_block {
+	void* block;
+	unsigned long epoch;
+	struct retired_block* next;
+};
+
+struct snapshot {
+	_Atomic(struct seat_snapshot*) current;
+	atomic_ulong epoch;
+	atomic_ulong readers[N_READERS];
+	pthread_mutex_t writer;
+	struct retired_block* retired;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static struct seat_snapshot* allocate_root(const size_t n_sections);
+static struct section_snapshot* allocate_section(const size_t n_seats, const size_t n_rows);
+static struct section_snapshot* copy_section(const struct section_snapshot* section);
+static struct seat_state* copy_chunk(const struct seat_state* chunk);
+static size_t row_of(const struct section_snapshot* section, const size_t seat);
+static int publish(struct snapshot* snapshot, struct seat_snapshot* published);
+static int retire(struct snapshot* snapshot, void* block, const unsigned long epoch);
+static void reclaim(struct snapshot* snapshot);
+static void free_root(struct seat_snapshot* root, const struct seat_snapshot* shared);
+static void free_section(struct section_snapshot* section, const struct section_snapshot* shared);
+
+extern snapshot_t snapshot_init(void) {
+	struct snapshot* snapshot;
+	struct seat_snapshot* empty;
+	snapshot = calloc(1, sizeof * snapshot);
+	if (snapshot) {
+		try(empty = allocate_root(0), NULL, error);
+		atomic_init(&snapshot->current, empty);
+		atomic_init(&snapshot->epoch, 1);
+		for (int i = 0; i < N_READERS; i++) {
+			atomic_init(&snapshot->readers[i], 0);
+		}
+		try_pthread_mutex_init(&snapshot->writer, cleanup);
+		snapshot->retired = NULL;
+	}
+	return snapshot;
+
+cleanup:
+	free(empty);
+error:
+	free(snapshot);
+	return NULL;
+}
+
+extern int snapshot_destroy(const snapshot_t handle) {
+	struct snapshot* snapshot = (struct snapshot*)handle;
+
+	try_pthread_mutex_destroy(&snapshot->writer, error);
+	while (snapshot->retired) {
+		struct retired_block* retired = snapshot->retired;
+		snapshot->retired = retired->next;
+		free(retired->block);
+		free(retired);
+	}
+	free_root(atomic_load(&snapshot->current), NULL);
+	free(snapshot);
+	return 0;
+
+error:
+	return 1;
+}
+
+extern int snapshot_reset(const snapshot_t handle, const int* ids, const struct venue_layout* layout) {
+	struct snapshot* snapshot = (struct snapshot*)handle;
+
+	struct seat_snapshot* published;
+	try(published = allocate_root(layout->n_sections), NULL, error);
+	for (size_t k = 0; k < layout->n_sections; k++) {
+		const struct venue_section* venue_section = &layout->sections[k];
+		struct section_snapshot* section;
+		try(section = allocate_section(venue_section->n_seats, venue_section->n_rows), NULL, cleanup);
+		published->sections[k] = section;
+		published->n_sections = k + 1;
+		for (size_t c = 0; c < section->n_chunks; c++) {
+			try(section->chunks[c] = malloc(sizeof * section->chunks[c] * SNAPSHOT_CHUNK_SEATS), NULL, cleanup);
+		}
+		section->first_seat = venue_section->first_seat;
+		memcpy(section->row_start, venue_section->row_start, sizeof * section->row_start * (section->n_rows + 1));
+		published->n_seats += section->n_seats;
+	}
+	try_pthread_mutex_lock(&snapshot->writer, cleanup);
+	published->version = atomic_load(&snapshot->current)->version + 1;
+	for (size_t k = 0; k < published->n_sections; k++) {
+		struct section_snapshot* section = published->sections[k];
+		for (size_t r = 0; r < section->n_rows; r++) {
+			for (size_t i = section->row_start[r]; i < section->row_start[r + 1]; i++) {
+				int id = ids[section->first_seat + i];
+				struct seat_state* seat = &section->chunks[i / SNAPSHOT_CHUNK_SEATS][i % SNAPSHOT_CHUNK_SEATS];
+				seat->id = id;
+				seat->version = published->version;
+				if (id > 0) {
+					section->row_booked[r]++;
+					section->n_booked++;
+				}
+			}
+		}
+		published->n_booked += section->n_booked;
+	}
+	try(publish(snapshot, published), !0, unlock);
+	try_pthread_mutex_unlock(&snapshot->writer, error);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&snapshot->writer);
+cleanup:
+	free_root(published, NULL);
+error:
+	return 1;
+}
+
+extern int snapshot_publish(const snapshot_t handle, const int* seats, const int* ids, const size_t n) {
+	struct snapshot* snapshot = (struct snapshot*)handle;
+
+	struct seat_snapshot* current;
+	struct seat_snapshot* published = NULL;
+	try_pthread_mutex_lock(&snapshot->writer, error);
+	current = atomic_load(&snapshot->current);
+	try(published = allocate_root(current->n_sections), NULL, unlock);
+	published->version = current->version + 1;
+	published->n_seats = current->n_seats;
+	published->n_booked = current->n_booked;
+	published->n_sections = current->n_sections;
+	memcpy(published->sections, current->sections, sizeof * published->sections * current->n_sections);
+	for (size_t i = 0; i < n; i++) {
+		long k;
+		if (seats[i] < 0 || (k = snapshot_section_of(published, (size_t)seats[i])) == -1) {
+			continue;
+		}
+		size_t offset = (size_t)seats[i] - published->sections[k]->first_seat;
+		size_t c = offset / SNAPSHOT_CHUNK_SEATS;
+		if (snapshot_section_seat(published->sections[k], offset)->id == ids[i]) {
+			continue;
+		}
+		// a section or a chunk shared with the current snapshot is copied before its first change
+		if (published->sections[k] == current->sections[k]) {
+			try(published->sections[k] = copy_section(current->sections[k]), NULL, cleanup);
+		}
+		struct section_snapshot* section = published->sections[k];
+		if (section->chunks[c] == current->sections[k]->chunks[c]) {
+			try(section->chunks[c] = copy_chunk(current->sections[k]->chunks[c]), NULL, cleanup);
+		}
+		struct seat_state* seat = &section->chunks[c][offset % SNAPSHOT_CHUNK_SEATS];
+		// keep the occupancy counters of the venue, the section and the row in step
+		if ((seat->id > 0) != (ids[i] > 0)) {
+			size_t* row = &section->row_booked[row_of(section, offset)];
+			if (ids[i] > 0) {
+				published->n_booked++;
+				section->n_booked++;
+				(*row)++;
+			}
+			else {
+				published->n_booked--;
+				section->n_booked--;
+				(*row)--;
+			}
+		}
+		seat->id = ids[i];
+		seat->version = published->version;
+	}
+	try(publish(snapshot, published), !0, cleanup);
+	try_pthread_mutex_unlock(&snapshot->writer, error);
+	return 0;
+
+cleanup:
+	free_root(published, current);
+unlock:
+	pthread_mutex_unlock(&snapshot->writer);
+error:
+	return 1;
+}
+
+extern const struct seat_snapshot* snapshot_acquire(const snapshot_t handle, int* guard) {
+	struct snapshot* snapshot = (struct snapshot*)handle;
+
+	size_t start = (size_t)((uintptr_t)pthread_self() >> 4);
+	for (;;) {
+		unsigned long epoch = atomic_load(&snapshot->epoch);
+		for (size_t i = 0; i < N_READERS; i++) {
+			size_t slot = (start + i) % N_READERS;
+			unsigned long expected = 0;
+			if (atomic_compare_exchange_strong(&snapshot->readers[slot], &expected, epoch)) {
+				*guard = (int)slot;
+				return atomic_load(&snapshot->current);
+			}
+		}
+		sched_yield();
+	}
+}
+
+extern void snapshot_release(const snapshot_t handle, const int guard) {
+	struct snapshot* snapshot = (struct snapshot*)handle;
+	atomic_store(&snapshot->readers[guard], 0);
+}
+
+extern const struct seat_state* snapshot_seat(const struct seat_snapshot* snapshot, const size_t seat) {
+	long k;
+	if ((k = snapshot_section_of(snapshot, seat)) == -1) {
+		return NULL;
+	}
+	return snapshot_section_seat(snapshot->sections[k], seat - snapshot->sections[k]->first_seat);
+}
+
+extern const struct seat_state* snapshot_section_seat(const struct section_snapshot* section, const size_t offset) {
+	return &section->chunks[offset / SNAPSHOT_CHUNK_SEATS][offset % SNAPSHOT_CHUNK_SEATS];
+}
+
+extern long snapshot_section_of(const struct seat_snapshot* snapshot, const size_t seat) {
+	size_t low = 0;
+	size_t high = snapshot->n_sections;
+	if (seat >= snapshot->n_seats) {
+		return -1;
+	}
+	// the sections are sorted by their first seat
+	while (high - low > 1) {
+		size_t middle = low + (high - low) / 2;
+		if (snapshot->sections[middle]->first_seat <= seat) {
+			low = middle;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return (long)low;
+}
+
+static struct seat_snapshot* allocate_root(const size_t n_sections) {
+	struct seat_snapshot* root;
+	try(root = malloc(sizeof * root + sizeof * root->sections * n_sections), NULL, error);
+	root->version = 0;
+	root->n_seats = 0;
+	root->n_booked = 0;
+	root->n_sections = 0;
+	return root;
+
+error:
+	return NULL;
+}
+
+/*
+* Allocate a section with zeroed counters and no chunk, the row vectors follow
+* the chunk vector in the same block.
+*/
+static struct section_snapshot* allocate_section(const size_t n_seats, const size_t n_rows) {
+	struct section_snapshot* section;
+	size_t n_chunks = (n_seats + SNAPSHOT_CHUNK_SEATS - 1) / SNAPSHOT_CHUNK_SEATS;
+	try(section = malloc(sizeof * section + sizeof * section->chunks * n_chunks + sizeof * section->row_start * (2 * n_rows + 1)), NULL, error);
+	section->first_seat = 0;
+	section->n_seats = n_seats;
+	section->n_booked = 0;
+	section->n_rows = n_rows;
+	section->n_chunks = n_chunks;
+	section->row_start = (size_t*)&section->chunks[n_chunks];
+	section->row_booked = &section->row_start[n_rows + 1];
+	memset(section->chunks, 0, sizeof * section->chunks * n_chunks);
+	memset(section->row_booked, 0, sizeof * section->row_booked * n_rows);
+	return section;
+
+error:
+	return NULL;
+}
+
+/*
+* Copy the counters of the section, the copy shares every chunk with it.
+*/
+static struct section_snapshot* copy_section(const struct section_snapshot* section) {
+	struct section_snapshot* copy;
+	try(copy = allocate_section(section->n_seats, section->n_rows), NULL, error);
+	copy->first_seat = section->first_seat;
+	copy->n_booked = section->n_booked;
+	memcpy(copy->chunks, section->chunks, sizeof * copy->chunks * section->n_chunks);
+	memcpy(copy->row_start, section->row_start, sizeof * copy->row_start * (section->n_rows + 1));
+	memcpy(copy->row_booked, section->row_booked, sizeof * copy->row_booked * section->n_rows);
+	return copy;
+
+error:
+	return NULL;
+}
+
+static struct seat_state* copy_chunk(const struct seat_state* chunk) {
+	struct seat_state* copy;
+	try(copy = malloc(sizeof * copy * SNAPSHOT_CHUNK_SEATS), NULL, error);
+	memcpy(copy, chunk, sizeof * copy * SNAPSHOT_CHUNK_SEATS);
+	return copy;
+
+error:
+	return NULL;
+}
+
+/*
+* Find the row of the seat, the offset of the seat is relative to the section.
+*/
+static size_t row_of(const struct section_snapshot* section, const size_t seat) {
+	size_t low = 0;
+	size_t high = section->n_rows;
+	while (high - low > 1) {
+		size_t middle = low + (high - low) / 2;
+		if (section->row_start[middle] <= seat) {
+			low = middle;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+/*
+* Replace the current snapshot retiring the previous root and every section
+* and chunk which is not shared with the new one, must be called holding the
+* writer mutex.
+*/
+static int publish(struct snapshot* snapshot, struct seat_snapshot* published) {
+	struct seat_snapshot* previous;
+	unsigned long epoch;
+
+	previous = atomic_exchange(&snapshot->current, published);
+	epoch = atomic_fetch_add(&snapshot->epoch, 1);
+	for (size_t k = 0; k < previous->n_sections; k++) {
+		const struct section_snapshot* section = (k < published->n_sections) ? published->sections[k] : NULL;
+		if (section == previous->sections[k]) {
+			continue;
+		}
+		for (size_t c = 0; c < previous->sections[k]->n_chunks; c++) {
+			if (!section || c >= section->n_chunks || section->chunks[c] != previous->sections[k]->chunks[c]) {
+				try(retire(snapshot, previous->sections[k]->chunks[c], epoch), !0, error);
+			}
+		}
+		try(retire(snapshot, previous->sections[k], epoch), !0, error);
+	}
+	try(retire(snapshot, previous, epoch), !0, error);
+	reclaim(snapshot);
+	return 0;
+
+error:
+	return 1;
+}
+
+static int retire(struct snapshot* snapshot, void* block, const unsigned long epoch) {
+	struct retired_block* retired;
+	try(retired = malloc(sizeof * retired), NULL, error);
+	retired->block = block;
+	retired->epoch = epoch;
+	retired->next = snapshot->retired;
+	snapshot->retired = retired;
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Free every retired block which can not be reached by an active reader,
+* must be called holding the writer mutex.
+*/
+static void reclaim(struct snapshot* snapshot) {
+	unsigned long oldest = ULONG_MAX;
+	for (int i = 0; i < N_READERS; i++) {
+		unsigned long epoch = atomic_load(&snapshot->readers[i]);
+		if (epoch && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+	struct retired_block** link = &snapshot->retired;
+	while (*link) {
+		struct retired_block* retired = *link;
+		if (retired->epoch < oldest) {
+			*link = retired->next;
+			free(retired->block);
+			free(retired);
+		}
+		else {
+			link = &retired->next;
+		}
+	}
+}
+
+/*
+* Free a root which has never been published together with its sections
+* which are not shared with the received root.
+*/
+static void free_root(struct seat_snapshot* root, const struct seat_snapshot* shared) {
+	for (size_t k = 0; k < root->n_sections; k++) {
+		free_section(root->sections[k], shared ? shared->sections[k] : NULL);
+	}
+	free(root);
+}
+
+/*
+* Free a section which has never been published together with its chunks
+* which are not shared with the received section.
+*/
+static void free_section(struct section_snapshot* section, const struct section_snapshot* shared) {
+	if (!section || section == shared) {
+		return;
+	}
+	for (size_t c = 0; c < section->n_chunks; c++) {
+		if (!shared || section->chunks[c] != shared->chunks[c]) {
+			free(section->chunks[c]);
+		}
+	}
+	free(section);
+}
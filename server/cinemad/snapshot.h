@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "layout.h"
+
+#define SNAPSHOT_CHUNK_SEATS 256	// seats of a chunk, the unit a publication copies
+
+typedef void* snapshot_t;
+
+/*
+* State of a seat, id is the booking ID linked to the seat or 0 if the seat is
+* free, version is the version of the snapshot which last changed it.
+*/
+struct seat_state {
+	int id;
+	unsigned long version;
+};
+
+/*
+* Immutable state of a section of the venue, the seats are split in chunks of
+* SNAPSHOT_CHUNK_SEATS seats and snapshot_section_seat() finds the state of
+* the seat first_seat + i. row_start[r] is the first seat of the r-th row
+* relative to the section and row_booked[r] is the number of its booked
+* seats.
+*/
+struct section_snapshot {
+	size_t first_seat;
+	size_t n_seats;
+	size_t n_booked;
+	size_t n_rows;
+	size_t n_chunks;
+	size_t* row_start;
+	size_t* row_booked;
+	struct seat_state* chunks[];
+};
+
+/*
+* Immutable state of the venue. A publication copies only the sections it
+* changes and, within them, only the chunks of the changed seats, the others
+* are shared with the previous snapshot. Every publication increments the
+* version.
+*/
+struct seat_snapshot {
+	unsigned long version;
+	size_t n_seats;
+	size_t n_booked;
+	size_t n_sections;
+	struct section_snapshot* sections[];
+};
+
+/*
+* Create the snapshot publisher, the current snapshot is an empty hall.
+*
+* @return	snapshot handle on success or return NULL and set properly errno
+*			on error.
+*/
+extern snapshot_t snapshot_init(void);
+
+/*
+* Destroy the snapshot publisher and every snapshot still alive, no reader
+* must be active.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int snapshot_destroy(
+	const snapshot_t handle
+);
+
+/*
+* Publish a snapshot of the whole venue split in the sections of the layout.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int snapshot_reset(
+	const snapshot_t handle,
+	const int* ids,
+	const struct venue_layout* layout
+);
+
+/*
+* Publish a copy of the current snapshot where the seats are linked to the
+* received IDs, the writer must hold the seats exclusive locks.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int snapshot_publish(
+	const snapshot_t handle,
+	const int* seats,
+	const int* ids,
+	const size_t n
+);
+
+/*
+* Get the current snapshot without taking any lock, the snapshot is valid
+* until it is released with the returned guard.
+*/
+extern const struct seat_snapshot* snapshot_acquire(
+	const snapshot_t handle,
+	int* guard
+);
+
+/*
+* Release the snapshot acquired with the guard.
+*/
+extern void snapshot_release(
+	const snapshot_t handle,
+	const int guard
+);
+
+/*
+* Find the state of the seat in the snapshot.
+*
+* @return	the state of the seat or NULL if the snapshot has no such seat.
+*/
+extern const struct seat_state* snapshot_seat(
+	const struct seat_snapshot* snapshot,
+	const size_t seat
+);
+
+/*
+* Find the state of the seat of the section, the offset of the seat is
+* relative to the section and must be lower than its number of seats.
+*/
+extern const struct seat_state* snapshot_section_seat(
+	const struct section_snapshot* section,
+	const size_t offset
+);
+
+/*
+* Find the section of the snapshot containing the seat.
+*
+* @return	the index of the section or -1 if the snapshot has no such seat.
+*/
+extern long snapshot_section_of(
+	const struct seat_snapshot* snapshot,
+	const size_t seat
+);
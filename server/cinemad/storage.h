@@ -1,18 +1,133 @@
 #pragma once
 
+#include <stddef.h>
+#include <time.h>
+
+#include "record.h"
+#include "wal.h"
+
 #define MSG_SUCC "OPERATION SUCCEDED"
 #define MSG_FAIL "OPERATION FAILED"
 
 typedef void* storage_t;
 
 /*
-* Create storage.
+* A key which is the canonical decimal form of an integer lower than
+* RECORD_INT_KEYS belongs to the integer key space and holds an integer
+* value, the functions with the _int suffix address it directly by the
+* integer. Every other key of at most RECORD_NAME_LEN characters belongs to
+* the name key space.
+*/
+
+/*
+* STORAGE_STREAM reads the file in a buffer cache and writes the records in
+* place with positional writes on the file descriptor, STORAGE_MMAP maps a
+* preallocated file and reads and writes the values in place. In both modes
+* the stores of different keys proceed in parallel.
+*
+* With a flush interval the stream mode writes back: a store only marks the
+* pages it touched as dirty and a flusher thread writes every run of dirty
+* pages with a single write, once per interval or as soon as the dirty bytes
+* reach the threshold. The stores of the last interval are lost by a crash
+* unless they are logged.
+*
+* A logged store is applied once its log record is durable. A log synced
+* every interval or never does not make it durable on commit, so the stream
+* mode writes back with it, the flush interval defaulting to the log
+* interval, and every flush syncs the log first; the mmap mode can not keep
+* a store out of the file and rejects such a log with EINVAL.
+*
+* Every record carries a checksum, verified when the file is loaded and, if
+* requested, on every read. A scrubber thread can validate the whole file in
+* the background at a limited rate.
+*/
+enum storage_mode {
+	STORAGE_STREAM,
+	STORAGE_MMAP
+};
+
+/*
+* STORAGE_ENGINE_FILE keeps the records in the data file, STORAGE_ENGINE_MEMORY
+* keeps them in memory only: the data file seeds them at startup and is never
+* written, the mode, the log and the checkpoints do not apply to it.
+* STORAGE_ENGINE_LSM logs the stores and buffers them in memory, then writes
+* them to sorted runs next to the data file which a background thread merges;
+* the data file lists the runs, the mode does not apply to it.
+*/
+enum storage_engine {
+	STORAGE_ENGINE_FILE,
+	STORAGE_ENGINE_MEMORY,
+	STORAGE_ENGINE_LSM
+};
+
+/*
+* Durability of a mapped store: STORAGE_SYNC_NONE leaves the pages to the
+* kernel writeback, STORAGE_SYNC_ASYNC schedules their writeback and
+* STORAGE_SYNC_FULL waits for it before the store returns.
+*/
+enum storage_sync {
+	STORAGE_SYNC_NONE,
+	STORAGE_SYNC_ASYNC,
+	STORAGE_SYNC_FULL
+};
+
+struct storage_options {
+	enum storage_mode mode;
+	enum storage_sync sync;
+	size_t grow_step;	// bytes the mapped file grows by, 0 for the default
+	int wal;	// nonzero to log every store in a write-ahead log
+	enum wal_sync wal_sync;
+	long wal_interval;	// milliseconds between syncs of the log, 0 for the default
+	long checkpoint_interval;	// milliseconds between checkpoints, 0 for none
+	long flush_interval;	// milliseconds between flushes of the dirty pages in stream mode, 0 to write through
+	size_t flush_threshold;	// dirty bytes which start a flush early, 0 for the default
+	int verify_reads;	// nonzero to verify the checksum of every record read
+	long scrub_rate;	// bytes of the file validated per second by the scrubber, 0 for none
+	enum storage_engine engine;
+	size_t memtable_size;	// bytes of stores the LSM engine buffers in memory before writing a run, 0 for the default
+};
+
+/*
+* Function called by storage_foreach on every stored key, the value is
+* rendered as by storage_load. A nonzero return stops the iteration.
+*/
+typedef int storage_foreach_function(const char* key, const char* value, void* context);
+
+/*
+* Counters of the write-back cache of the stream mode, the latencies are in
+* microseconds, and of the checksums. The corrupt records are those found by
+* the scrubber or by a verified read, in stream mode the scrubber repairs
+* the file from the buffer cache. The backup stalls are the microseconds the
+* writers waited for a backup. The memory bytes estimate the memory the
+* engine holds for the records.
+*/
+struct storage_stats {
+	size_t dirty_bytes;
+	unsigned long flushes;
+	size_t flushed_bytes;
+	unsigned long flush_latency_last;
+	unsigned long flush_latency_avg;
+	unsigned long flush_latency_max;
+	unsigned long scrub_passes;
+	size_t scrubbed_bytes;
+	unsigned long corrupt_records;
+	unsigned long repaired_records;
+	unsigned long backups;
+	unsigned long backup_stall_last;
+	unsigned long backup_stall_max;
+	size_t memory_bytes;
+};
+
+/*
+* Create storage, a NULL options parameter selects the stream mode of the
+* file engine.
 * 
 * @return	database handle on success or return NULL and properly errno 
 *			on error.
 */
 extern storage_t storage_init(
-	const char* filename
+	const char* filename,
+	const struct storage_options* options
 );
 
 /*
@@ -25,7 +140,9 @@ extern int storage_close(
 );
 
 /*
-* Store the value linked to the key in the storage.
+* Store the value linked to the key in the storage. When the stores are
+* logged the call returns once the store is as durable as the sync mode of
+* the log requires.
 */
 extern int storage_store(
 	const storage_t handle, 
@@ -35,7 +152,82 @@ extern int storage_store(
 );
 
 /*
-* Load the value linked to the key from the storage.
+* Store every value linked to its key in the storage, the new keys are
+* appended with a single write in the received order. When the stores
+* are logged the whole batch is a single record of the log. A key or a value
+* which can not be represented fails the whole batch and nothing is stored.
+*/
+extern int storage_store_batch(
+	const storage_t handle, 
+	const size_t n, 
+	const char** keys, 
+	const char** values, 
+	char** result
+);
+
+/*
+* Store every integer value linked to its integer key in the storage, as a
+* single batch.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EINVAL if a key is out of the integer key space.
+*/
+extern int storage_store_ints(
+	const storage_t handle,
+	const size_t n,
+	const unsigned long* keys,
+	const long* values
+);
+
+/*
+* Store the integer value linked to the key in the storage.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EINVAL if the key can not be represented.
+*/
+extern int storage_store_number(
+	const storage_t handle,
+	const char* key,
+	const long value
+);
+
+/*
+* Rewrite the live records of the storage in a compacted file sorted by key
+* which replaces the current one, then empty the write-ahead log. Every
+* reader and writer waits for the checkpoint.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int storage_checkpoint(
+	const storage_t handle
+);
+
+/*
+* Write a point in time copy of the storage to the file, replacing it
+* atomically. The writers wait only while the records are copied in memory,
+* the copy is written and made durable after they resume.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EINVAL if the file is the one of the storage.
+*/
+extern int storage_backup(
+	const storage_t handle,
+	const char* filename
+);
+
+/*
+* Read the counters of the write-back cache.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int storage_get_stats(
+	const storage_t handle,
+	struct storage_stats* stats
+);
+
+/*
+* Load the value linked to the key from the storage, a record whose checksum
+* does not match fails the call with errno set to EILSEQ.
 */
 extern int storage_load(
 	const storage_t handle, 
@@ -43,6 +235,48 @@ extern int storage_load(
 	char** result
 );
 
+/*
+* Load the integer value linked to the integer key from the storage.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to ENOENT if the key is missing, to EINVAL if it is out of the
+*			integer key space and to ERANGE if the value does not fit.
+*/
+extern int storage_load_int(
+	const storage_t handle,
+	const unsigned long key,
+	long* value
+);
+
+/*
+* Load the integer value linked to the key from the storage.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to ENOENT if the key is missing, to EINVAL if the value is a
+*			string and to ERANGE if it does not fit.
+*/
+extern int storage_load_number(
+	const storage_t handle,
+	const char* key,
+	long* value
+);
+
+/*
+* Call the function on every stored key, first the keys of the integer key
+* space then those of the name key space, both in the order of their keys.
+* The stores wait for the whole iteration, so the function sees a point in
+* time view of the storage and must not call the storage itself.
+*
+* @return	0 on success or return 1 and set properly errno on error, a
+*			nonzero return of the function stops the iteration and fails with
+*			errno set to ECANCELED.
+*/
+extern int storage_foreach(
+	const storage_t handle,
+	storage_foreach_function* function,
+	void* context
+);
+
 /*
 * Lock as shared the lock linked to the key.
 */
@@ -59,6 +293,20 @@ extern int storage_lock_exclusive(
 	const char* key
 );
 
+/*
+* Lock as exclusive the lock linked to the key without waiting past the
+* deadline, measured against CLOCK_REALTIME. A NULL deadline only tries the
+* lock once.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EBUSY or ETIMEDOUT if the lock is held by someone else.
+*/
+extern int storage_lock_exclusive_timed(
+	const storage_t handle, 
+	const char* key,
+	const struct timespec* deadline
+);
+
 /*
 * Unlock the lock linked to the key.
 */
@@ -66,3 +314,47 @@ extern int storage_unlock(
 	const storage_t handle, 
 	const char* key
 );
+
+/*
+* Lock as shared the lock linked to the integer key, the lock lives as long
+* as the storage.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int storage_lock_shared_int(
+	const storage_t handle,
+	const unsigned long key
+);
+
+/*
+* Lock as exclusive the lock linked to the integer key.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int storage_lock_exclusive_int(
+	const storage_t handle,
+	const unsigned long key
+);
+
+/*
+* Lock as exclusive the lock linked to the integer key without waiting past
+* the deadline, as storage_lock_exclusive_timed does.
+*
+* @return	0 on success or return 1 and set properly errno on error, errno is
+*			set to EBUSY or ETIMEDOUT if the lock is held by someone else.
+*/
+extern int storage_lock_exclusive_timed_int(
+	const storage_t handle,
+	const unsigned long key,
+	const struct timespec* deadline
+);
+
+/*
+* Unlock the lock linked to the integer key.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int storage_unlock_int(
+	const storage_t handle,
+	const unsigned long key
+);
@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "storage.h"
+#include "record.h"
+
+#include <try.h>
+
+#define N_RECORDS 10000000UL
+#define NAME_RATIO 8	// one record out of NAME_RATIO belongs to the name key space
+#define BENCH_FILE "storage_bench.dat"
+#define PRIME 1000003UL
+#define BATCH_LEN 64	// keys stored by each call of the workload
+
+// Prototype declarations of functions included in this code module
+
+static int generate_file(const char* filename, const unsigned long n);
+static unsigned long permute(const unsigned long i, const unsigned long n);
+static int bench_load(const char* filename, const unsigned long n, const enum storage_mode mode);
+static int bench_engine(const char* filename, const unsigned long n, const enum storage_engine engine);
+static double elapsed(const struct timespec* start);
+
+/*
+* Usage: storage_bench [records] [file]
+*
+* Generate a data file holding the received number of records, in no order
+* of their keys, and report the records loaded per second by the startup of
+* the storage in each mode. Then run the same workload of stores and loads
+* on an empty file with each engine.
+*/
+int main(int argc, char** argv) {
+	unsigned long n = (argc > 1) ? strtoul(argv[1], NULL, 10) : N_RECORDS;
+	const char* filename = (argc > 2) ? argv[2] : BENCH_FILE;
+
+	if (n - n / NAME_RATIO > RECORD_INT_KEYS) {
+		fprintf(stderr, "storage_bench: at most %lu records of the integer key space\n", RECORD_INT_KEYS);
+		return EXIT_FAILURE;
+	}
+	try(generate_file(filename, n), !0, error);
+	try(bench_load(filename, n, STORAGE_STREAM), !0, error);
+	try(bench_load(filename, n, STORAGE_MMAP), !0, error);
+	try(bench_engine(filename, n - n / NAME_RATIO, STORAGE_ENGINE_FILE), !0, error);
+	try(bench_engine(filename, n - n / NAME_RATIO, STORAGE_ENGINE_MEMORY), !0, error);
+	try(bench_engine(filename, n - n / NAME_RATIO, STORAGE_ENGINE_LSM), !0, error);
+	remove(filename);
+	return EXIT_SUCCESS;
+
+error:
+	perror("storage_bench");
+	remove(filename);
+	return EXIT_FAILURE;
+}
+
+/*
+* Write a file of n records, the integer keys and the name keys are
+* permutations of their ranges so that the loader has to sort the runs.
+*/
+static int generate_file(const char* filename, const unsigned long n) {
+	FILE* stream;
+	char header[RECORD_HEADER_LEN];
+	char key[RECORD_NAME_LEN + 1];
+	struct record record;
+	unsigned long n_names = n / NAME_RATIO;
+	unsigned long n_ints = n - n_names;
+
+	try(stream = fopen(filename, "w"), NULL, error);
+	record_write_header(header);
+	try(fwrite(header, sizeof header, 1, stream), 0, cleanup);
+	for (unsigned long i = 0, name = 0, number = 0; i < n; i++) {
+		if (i % NAME_RATIO == NAME_RATIO - 1) {
+			snprintf(key, sizeof key, "K%lu", permute(name++, n_names));
+			try(record_encode_number(key, (long)i, &record), !0, cleanup);
+		}
+		else {
+			record_encode_int(permute(number++, n_ints), (long)i, &record);
+		}
+		try(fwrite(record.bytes, record.length, 1, stream), 0, cleanup);
+	}
+	try(fclose(stream), EOF, error);
+	return 0;
+
+cleanup:
+	fclose(stream);
+error:
+	return 1;
+}
+
+/*
+* Map i to a distinct value lower than n, multiplying by a prime which is
+* coprime with n.
+*/
+static unsigned long permute(const unsigned long i, const unsigned long n) {
+	return (n % PRIME) ? (i * PRIME) % n : i;
+}
+
+static int bench_load(const char* filename, const unsigned long n, const enum storage_mode mode) {
+	struct storage_options options = { .mode = mode };
+	struct timespec start;
+	storage_t storage;
+	double seconds;
+
+	try(clock_gettime(CLOCK_MONOTONIC, &start), -1, error);
+	try(storage = storage_init(filename, &options), NULL, error);
+	seconds = elapsed(&start);
+	printf("%s: %lu records loaded in %.3f s, %.0f records/s\n", (mode == STORAGE_MMAP) ? "mmap" : "stream", n, seconds, (double)n / seconds);
+	try(storage_close(storage), !0, error);
+	return 0;
+
+error:
+	return 1;
+}
+
+/*
+* Store n records of the integer key space in batches, in no order of their
+* keys, then load them back, and report the operations per second.
+*/
+static int bench_engine(const char* filename, const unsigned long n, const enum storage_engine engine) {
+	struct storage_options options = { .mode = STORAGE_STREAM, .engine = engine };
+	const char* names[] = { "file", "memory", "lsm" };
+	const char* name = names[engine];
+	unsigned long keys[BATCH_LEN];
+	long values[BATCH_LEN];
+	struct timespec start;
+	storage_t storage;
+	double seconds;
+	FILE* stream;
+
+	try(stream = fopen(filename, "w"), NULL, error);
+	try(fclose(stream), EOF, error);
+	try(storage = storage_init(filename, &options), NULL, error);
+	try(clock_gettime(CLOCK_MONOTONIC, &start), -1, cleanup);
+	for (unsigned long i = 0; i < n; i += BATCH_LEN) {
+		size_t len = (n - i < BATCH_LEN) ? n - i : BATCH_LEN;
+		for (size_t j = 0; j < len; j++) {
+			keys[j] = permute(i + j, n);
+			values[j] = (long)(i + j);
+		}
+		try(storage_store_ints(storage, len, keys, values), !0, cleanup);
+	}
+	seconds = elapsed(&start);
+	printf("%s engine: %lu records stored in %.3f s, %.0f records/s\n", name, n, seconds, (double)n / seconds);
+	try(clock_gettime(CLOCK_MONOTONIC, &start), -1, cleanup);
+	for (unsigned long i = 0; i < n; i++) {
+		long value;
+		try(storage_load_int(storage, permute(i, n), &value), !0, cleanup);
+		if (value != (long)i) {
+			errno = EILSEQ;
+			goto cleanup;
+		}
+	}
+	seconds = elapsed(&start);
+	printf("%s engine: %lu records loaded in %.3f s, %.0f records/s\n", name, n, seconds, (double)n / seconds);
+	try(storage_close(storage), !0, error);
+	return 0;
+
+cleanup:
+	storage_close(storage);
+error:
+	return 1;
+}
+
+/*
+* Return the seconds elapsed since start.
+*/
+static double elapsed(const struct timespec* start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)(end.tv_sec - start->tv_sec) + (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
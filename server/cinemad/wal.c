@@ -0,0 +1,381 @@
+#include "wal.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <try.h>
+
+#include "crc32c.h"
+
+#define WAL_MAGIC 0x57414c32u
+
+/*
+* Every record is a header followed by its payload, the checksum covers the
+* log sequence number and the payload. The records of the log have
+* consecutive sequence numbers, so a replay stops at the first record which
+* is torn, corrupted or left by a previous incarnation of the log.
+*/
+
+struct wal_header {
+	uint32_t magic;
+	uint32_t length;
+	uint64_t lsn;
+	uint32_t checksum;
+	uint32_t reserved;
+};
+
+struct wal {
+	int fd;
+	enum wal_sync sync;
+	long interval;
+	unsigned long appended;	// sequence number of the last appended record
+	unsigned long durable;	// sequence number of the last durable record
+	int syncing;
+	int stopping;
+	int failure;	// errno of a failed sync or of a torn append, the log can not be trusted after it
+	pthread_mutex_t mutex;
+	pthread_cond_t flush;
+	pthread_cond_t flushed;
+	pthread_t flusher;
+};
+
+/*	Prototype declarations of functions included in this code module	*/
+
+static void* flusher_routine(void* arg);
+static int sync_log(struct wal* wal);
+static uint32_t checksum(const uint64_t lsn, const char* payload, const size_t length);
+
+extern wal_t wal_open(const char* filename, const enum wal_sync sync, const long interval) {
+	struct wal* wal;
+	wal = calloc(1, sizeof * wal);
+	if (wal) {
+		wal->sync = sync;
+		wal->interval = interval;
+		wal->appended = 0;
+		wal->durable = 0;
+		wal->syncing = 0;
+		wal->stopping = 0;
+		wal->failure = 0;
+		try(wal->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0660), -1, error);
+		try_pthread_mutex_init(&wal->mutex, cleanup1);
+		try_pthread(pthread_cond_init(&wal->flush, NULL), cleanup2);
+		try_pthread(pthread_cond_init(&wal->flushed, NULL), cleanup3);
+		if (sync == WAL_SYNC_GROUP || sync == WAL_SYNC_INTERVAL) {
+			try_pthread(pthread_create(&wal->flusher, NULL, &flusher_routine, wal), cleanup4);
+		}
+	}
+	return wal;
+
+cleanup4:
+	pthread_cond_destroy(&wal->flushed);
+cleanup3:
+	pthread_cond_destroy(&wal->flush);
+cleanup2:
+	pthread_mutex_destroy(&wal->mutex);
+cleanup1:
+	close(wal->fd);
+error:
+	free(wal);
+	return NULL;
+}
+
+extern int wal_close(const wal_t handle) {
+	struct wal* wal = (struct wal*)handle;
+
+	if (wal->sync == WAL_SYNC_GROUP || wal->sync == WAL_SYNC_INTERVAL) {
+		try_pthread_mutex_lock(&wal->mutex, error);
+		wal->stopping = 1;
+		try_pthread(pthread_cond_signal(&wal->flush), unlock);
+		try_pthread_mutex_unlock(&wal->mutex, error);
+		try_pthread(pthread_join(wal->flusher, NULL), error);
+	}
+	try(fdatasync(wal->fd), -1, error);
+	try_pthread(pthread_cond_destroy(&wal->flushed), error);
+	try_pthread(pthread_cond_destroy(&wal->flush), error);
+	try_pthread_mutex_destroy(&wal->mutex, error);
+	try(close(wal->fd), -1, error);
+	free(wal);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&wal->mutex);
+error:
+	return 1;
+}
+
+extern int wal_replay(const wal_t handle, wal_apply_function* apply, void* context) {
+	struct wal* wal = (struct wal*)handle;
+
+	struct stat st;
+	char* log;
+	size_t offset = 0;
+	unsigned long last = 0;
+
+	try(fstat(wal->fd, &st), -1, error);
+	try(log = malloc((size_t)st.st_size + 1), NULL, error);
+	for (size_t done = 0; done < (size_t)st.st_size;) {
+		ssize_t n;
+		try(n = pread(wal->fd, log + done, (size_t)st.st_size - done, (off_t)done), -1, cleanup);
+		if (!n) {
+			break;
+		}
+		done += (size_t)n;
+	}
+	while (offset + sizeof(struct wal_header) <= (size_t)st.st_size) {
+		struct wal_header header;
+		memcpy(&header, log + offset, sizeof header);
+		if (header.magic != WAL_MAGIC
+			|| header.length > (size_t)st.st_size - offset - sizeof header
+			|| (last && header.lsn != last + 1)
+			|| header.checksum != checksum(header.lsn, log + offset + sizeof header, header.length)) {
+			break;
+		}
+		try(apply(context, log + offset + sizeof header, header.length), !0, cleanup);
+		last = header.lsn;
+		offset += sizeof header + header.length;
+	}
+	free(log);
+	// the torn tail is dropped, the next records follow the last intact one
+	if (offset < (size_t)st.st_size) {
+		try(ftruncate(wal->fd, (off_t)offset), -1, error);
+		try(fdatasync(wal->fd), -1, error);
+	}
+	try_pthread_mutex_lock(&wal->mutex, error);
+	wal->appended = last;
+	wal->durable = last;
+	try_pthread_mutex_unlock(&wal->mutex, error);
+	return 0;
+
+cleanup:
+	free(log);
+error:
+	return 1;
+}
+
+extern int wal_append(const wal_t handle, const char* payload, const size_t length, unsigned long* lsn) {
+	struct wal* wal = (struct wal*)handle;
+
+	struct wal_header header;
+	char* record;
+	size_t size = sizeof header + length;
+
+	if (length > UINT32_MAX) {
+		errno = EINVAL;
+		return 1;
+	}
+	try(record = malloc(size), NULL, error);
+	memcpy(record + sizeof header, payload, length);
+	try_pthread_mutex_lock(&wal->mutex, cleanup);
+	if (wal->failure) {
+		errno = wal->failure;
+		goto unlock;
+	}
+	header.magic = WAL_MAGIC;
+	header.length = (uint32_t)length;
+	header.lsn = wal->appended + 1;
+	header.checksum = checksum(header.lsn, payload, length);
+	header.reserved = 0;
+	memcpy(record, &header, sizeof header);
+	// the records are written in the order of their sequence numbers
+	for (size_t done = 0; done < size;) {
+		ssize_t n;
+		if ((n = write(wal->fd, record + done, size - done)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// a torn record ends the replay, the records after it would be lost
+			if (done) {
+				wal->failure = errno;
+			}
+			goto unlock;
+		}
+		done += (size_t)n;
+	}
+	wal->appended = header.lsn;
+	*lsn = header.lsn;
+	try_pthread_mutex_unlock(&wal->mutex, cleanup);
+	free(record);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&wal->mutex);
+cleanup:
+	free(record);
+error:
+	return 1;
+}
+
+extern int wal_commit(const wal_t handle, const unsigned long lsn) {
+	struct wal* wal = (struct wal*)handle;
+
+	try_pthread_mutex_lock(&wal->mutex, error);
+	switch (wal->sync) {
+	case WAL_SYNC_ALWAYS:
+		// a sync started after the record was appended covers it too
+		while (wal->durable < lsn && !wal->failure) {
+			if (wal->syncing) {
+				try_pthread(pthread_cond_wait(&wal->flushed, &wal->mutex), unlock);
+			}
+			else {
+				try(sync_log(wal), !0, unlock);
+			}
+		}
+		break;
+	case WAL_SYNC_GROUP:
+		if (wal->durable < lsn) {
+			try_pthread(pthread_cond_signal(&wal->flush), unlock);
+		}
+		while (wal->durable < lsn && !wal->failure) {
+			try_pthread(pthread_cond_wait(&wal->flushed, &wal->mutex), unlock);
+		}
+		break;
+	default:
+		break;
+	}
+	if (wal->failure) {
+		errno = wal->failure;
+		goto unlock;
+	}
+	try_pthread_mutex_unlock(&wal->mutex, error);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&wal->mutex);
+error:
+	return 1;
+}
+
+extern int wal_sync(const wal_t handle) {
+	struct wal* wal = (struct wal*)handle;
+
+	try_pthread_mutex_lock(&wal->mutex, error);
+	unsigned long target = wal->appended;
+	// a sync started after the last record was appended covers it too
+	while (wal->durable < target && !wal->failure) {
+		if (wal->syncing) {
+			try_pthread(pthread_cond_wait(&wal->flushed, &wal->mutex), unlock);
+		}
+		else {
+			try(sync_log(wal), !0, unlock);
+		}
+	}
+	if (wal->failure) {
+		errno = wal->failure;
+		goto unlock;
+	}
+	try_pthread_mutex_unlock(&wal->mutex, error);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&wal->mutex);
+error:
+	return 1;
+}
+
+extern int wal_reset(const wal_t handle) {
+	struct wal* wal = (struct wal*)handle;
+
+	try_pthread_mutex_lock(&wal->mutex, error);
+	try(ftruncate(wal->fd, 0), -1, unlock);
+	try(fdatasync(wal->fd), -1, unlock);
+	wal->durable = wal->appended;
+	// the commits waiting for a sync are covered by the reset
+	try_pthread(pthread_cond_broadcast(&wal->flushed), unlock);
+	try_pthread_mutex_unlock(&wal->mutex, error);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&wal->mutex);
+error:
+	return 1;
+}
+
+/*
+* Sync the log whenever a record is waiting for it in WAL_SYNC_GROUP mode or
+* every interval in WAL_SYNC_INTERVAL mode, until the log is closed.
+*/
+static void* flusher_routine(void* arg) {
+	struct wal* wal = (struct wal*)arg;
+
+	try_pthread_mutex_lock(&wal->mutex, error);
+	while (!wal->stopping && !wal->failure) {
+		if (wal->sync == WAL_SYNC_GROUP) {
+			while (!wal->stopping && wal->durable >= wal->appended) {
+				try_pthread(pthread_cond_wait(&wal->flush, &wal->mutex), unlock);
+			}
+		}
+		else {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += wal->interval / 1000;
+			deadline.tv_nsec += (wal->interval % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			int ret = pthread_cond_timedwait(&wal->flush, &wal->mutex, &deadline);
+			if (ret && ret != ETIMEDOUT) {
+				goto unlock;
+			}
+		}
+		if (wal->durable < wal->appended) {
+			sync_log(wal);
+		}
+	}
+	pthread_mutex_unlock(&wal->mutex);
+	return NULL;
+
+unlock:
+	pthread_mutex_unlock(&wal->mutex);
+error:
+	return NULL;
+}
+
+/*
+* Sync the records appended so far, the mutex is released during the sync so
+* that the following records can be appended. Must be called holding the
+* mutex.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int sync_log(struct wal* wal) {
+	unsigned long target = wal->appended;
+	int ret;
+
+	wal->syncing = 1;
+	pthread_mutex_unlock(&wal->mutex);
+	ret = fdatasync(wal->fd);
+	int error = errno;
+	pthread_mutex_lock(&wal->mutex);
+	wal->syncing = 0;
+	if (ret == -1) {
+		wal->failure = error;
+	}
+	else if (target > wal->durable) {
+		wal->durable = target;
+	}
+	pthread_cond_broadcast(&wal->flushed);
+	if (ret == -1) {
+		errno = error;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+* CRC32C of the sequence number, little endian, and of the payload.
+*/
+static uint32_t checksum(const uint64_t lsn, const char* payload, const size_t length) {
+	uint8_t bytes[8];
+	for (int i = 0; i < 8; i++) {
+		bytes[i] = (uint8_t)(lsn >> (8 * i));
+	}
+	return crc32c(crc32c(0, bytes, sizeof bytes), payload, length);
+}
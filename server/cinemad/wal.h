@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef void* wal_t;
+
+/*
+* Durability of a committed record: WAL_SYNC_ALWAYS syncs the log on the
+* committing thread, WAL_SYNC_GROUP waits for a flusher thread which syncs
+* the records of every concurrent commit at once, WAL_SYNC_INTERVAL returns
+* at once and the flusher syncs the log periodically, WAL_SYNC_NONE leaves
+* the log to the kernel writeback until it is closed.
+*/
+enum wal_sync {
+	WAL_SYNC_ALWAYS,
+	WAL_SYNC_GROUP,
+	WAL_SYNC_INTERVAL,
+	WAL_SYNC_NONE
+};
+
+/*
+* Function applying the payload of a logged record during the replay.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+typedef int wal_apply_function(void* context, const char* payload, const size_t length);
+
+/*
+* Open the log, creating it if it does not exist. The interval is the period
+* in milliseconds of the flusher in WAL_SYNC_INTERVAL mode.
+*
+* @return	log handle on success or return NULL and set properly errno on
+*			error.
+*/
+extern wal_t wal_open(
+	const char* filename,
+	const enum wal_sync sync,
+	const long interval
+);
+
+/*
+* Sync and close the log, no commit must be in flight.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int wal_close(
+	const wal_t handle
+);
+
+/*
+* Apply every intact record of the log in order, the log is cut after the
+* last intact record so that a record torn by a crash is dropped.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int wal_replay(
+	const wal_t handle,
+	wal_apply_function* apply,
+	void* context
+);
+
+/*
+* Append a record holding the payload, set the lsn parameter to its log
+* sequence number. The record is not durable until it is committed. A write
+* which fails after part of the record is written fails every following
+* append and commit, as a failed sync does.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int wal_append(
+	const wal_t handle,
+	const char* payload,
+	const size_t length,
+	unsigned long* lsn
+);
+
+/*
+* Wait until the record with the log sequence number is as durable as the
+* sync mode of the log requires.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int wal_commit(
+	const wal_t handle,
+	const unsigned long lsn
+);
+
+/*
+* Make every record appended so far durable, whatever the sync mode of the
+* log.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int wal_sync(
+	const wal_t handle
+);
+
+/*
+* Empty the log, the records must have been made durable elsewhere.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+extern int wal_reset(
+	const wal_t handle
+);
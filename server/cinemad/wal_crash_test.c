@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "storage.h"
+
+#include <try.h>
+
+#define N_KEYS 8	// keys written by every batch, all with the number of the batch
+#define MAX_BATCHES 1000000L
+#define MAX_LOGS 64
+#define LOG_NAME_LEN 63
+#define TEST_DIR_TEMPLATE "/tmp/wal_crash_test.XXXXXX"
+
+/*
+* The test links with -Wl,--wrap=fdatasync: once armed, the countdown-th sync
+* of a log kills the process in the middle of it. Then every byte of the logs
+* which no sync covered is dropped, as a power loss would, while the data
+* file keeps every write it received, the worst case for a store applied
+* before its log record is durable.
+*/
+
+struct synced_log {
+	char name[LOG_NAME_LEN + 1];
+	off_t size;	// bytes covered by a completed sync
+};
+
+struct progress {
+	long started;	// batches whose store has started
+	long acked;	// batches whose store has returned
+	long bound;	// batches started when the last completed sync of a log started
+	size_t n_logs;
+	struct synced_log logs[MAX_LOGS];
+};
+
+struct crash_case {
+	const char* name;
+	struct storage_options options;
+	int exact;	// nonzero if every acknowledged batch must survive the crash
+};
+
+// Prototype declarations of functions included in this code module
+
+int __real_fdatasync(int fd);
+int __wrap_fdatasync(int fd);
+static const char* log_name(const int fd, char* path, const size_t size);
+static int drop_unsynced(const char* path);
+static void run_child(const char* filename, const struct storage_options* options, const long countdown_syncs);
+static int run_case(const struct crash_case* test, const long countdown_syncs);
+static int check_storage(const char* filename, const struct storage_options* options, const int exact);
+static int clear_dir(const char* path);
+
+static struct progress* progress;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static long countdown;	// syncs of a log left before the crash, 0 when not armed
+
+/*
+* Usage: wal_crash_test
+*
+* Crash a process storing batches at several syncs of the log, for each
+* engine, mode and sync mode of the log, then check that the restarted
+* storage holds no store whose log record was not durable and that no batch
+* is partially applied.
+*/
+int main(void) {
+	const struct crash_case cases[] = {
+		{ "file stream always", { .mode = STORAGE_STREAM, .wal = 1, .wal_sync = WAL_SYNC_ALWAYS }, 1 },
+		{ "file stream group", { .mode = STORAGE_STREAM, .wal = 1, .wal_sync = WAL_SYNC_GROUP }, 1 },
+		{ "file stream interval", { .mode = STORAGE_STREAM, .wal = 1, .wal_sync = WAL_SYNC_INTERVAL, .wal_interval = 1 }, 0 },
+		{ "file mmap always", { .mode = STORAGE_MMAP, .sync = STORAGE_SYNC_NONE, .wal = 1, .wal_sync = WAL_SYNC_ALWAYS }, 1 },
+		{ "lsm always", { .engine = STORAGE_ENGINE_LSM, .wal = 1, .wal_sync = WAL_SYNC_ALWAYS }, 1 },
+		{ "lsm group", { .engine = STORAGE_ENGINE_LSM, .wal = 1, .wal_sync = WAL_SYNC_GROUP }, 1 },
+	};
+	const long countdowns[] = { 1, 2, 5, 17 };
+	int failures = 0;
+
+	try(progress = mmap(NULL, sizeof * progress, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0), MAP_FAILED, error);
+	for (size_t i = 0; i < sizeof cases / sizeof * cases; i++) {
+		for (size_t j = 0; j < sizeof countdowns / sizeof * countdowns; j++) {
+			if (run_case(&cases[i], countdowns[j])) {
+				fprintf(stderr, "wal_crash_test: %s, crash at sync %ld: FAILED\n", cases[i].name, countdowns[j]);
+				failures++;
+			}
+		}
+	}
+	// the mapped file can not keep a store out of it until the log is synced
+	{
+		struct storage_options options = { .mode = STORAGE_MMAP, .wal = 1, .wal_sync = WAL_SYNC_INTERVAL };
+		char path[] = TEST_DIR_TEMPLATE;
+		char filename[sizeof path + sizeof "/data"];
+		FILE* stream;
+
+		try(mkdtemp(path), NULL, error);
+		sprintf(filename, "%s/data", path);
+		try(stream = fopen(filename, "w"), NULL, error);
+		try(fclose(stream), EOF, error);
+		if (storage_init(filename, &options) || errno != EINVAL) {
+			fprintf(stderr, "wal_crash_test: mmap with a log synced every interval: FAILED\n");
+			failures++;
+		}
+		try(clear_dir(path), !0, error);
+	}
+	munmap(progress, sizeof * progress);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+
+error:
+	perror("wal_crash_test");
+	return EXIT_FAILURE;
+}
+
+int __wrap_fdatasync(int fd) {
+	char path[4096];
+	const char* name;
+	struct stat st;
+	long started;
+	size_t i;
+	int ret;
+
+	pthread_mutex_lock(&mutex);
+	if (!countdown || !(name = log_name(fd, path, sizeof path))) {
+		pthread_mutex_unlock(&mutex);
+		return __real_fdatasync(fd);
+	}
+	if (!--countdown) {
+		raise(SIGKILL);
+	}
+	pthread_mutex_unlock(&mutex);
+	// a record within the synced size belongs to a batch started before
+	if (fstat(fd, &st) == -1) {
+		return -1;
+	}
+	started = __atomic_load_n(&progress->started, __ATOMIC_SEQ_CST);
+	if ((ret = __real_fdatasync(fd))) {
+		return ret;
+	}
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < progress->n_logs && strcmp(progress->logs[i].name, name); i++);
+	if (i == progress->n_logs && i < MAX_LOGS && strlen(name) <= LOG_NAME_LEN) {
+		strcpy(progress->logs[progress->n_logs++].name, name);
+	}
+	if (i < progress->n_logs) {
+		progress->logs[i].size = st.st_size;
+	}
+	if (started > progress->bound) {
+		progress->bound = started;
+	}
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+/*
+* Return the name of the write-ahead log the descriptor is open on, read in
+* the path, or NULL if it is not open on a log.
+*/
+static const char* log_name(const int fd, char* path, const size_t size) {
+	char link[32];
+	char* name;
+	ssize_t n;
+
+	snprintf(link, sizeof link, "/proc/self/fd/%d", fd);
+	if ((n = readlink(link, path, size - 1)) < (ssize_t)sizeof ".wal") {
+		return NULL;
+	}
+	path[n] = '\0';
+	if (strcmp(path + n - (sizeof ".wal" - 1), ".wal")) {
+		return NULL;
+	}
+	name = strrchr(path, '/');
+	return name ? name + 1 : path;
+}
+
+/*
+* Drop the bytes of the logs in the directory which no sync covered, a log
+* never synced is dropped whole.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int drop_unsynced(const char* path) {
+	char filename[4096];
+	struct dirent* entry;
+	struct stat st;
+	DIR* dir;
+
+	try(dir = opendir(path), NULL, error);
+	while ((entry = readdir(dir))) {
+		size_t length = strlen(entry->d_name);
+		off_t size = 0;
+		if (length < sizeof ".wal" || strcmp(entry->d_name + length - (sizeof ".wal" - 1), ".wal")) {
+			continue;
+		}
+		for (size_t i = 0; i < progress->n_logs; i++) {
+			if (!strcmp(progress->logs[i].name, entry->d_name)) {
+				size = progress->logs[i].size;
+			}
+		}
+		snprintf(filename, sizeof filename, "%s/%s", path, entry->d_name);
+		try(stat(filename, &st), -1, cleanup);
+		if (st.st_size > size) {
+			try(truncate(filename, size), -1, cleanup);
+		}
+	}
+	try(closedir(dir), -1, error);
+	return 0;
+
+cleanup:
+	closedir(dir);
+error:
+	return 1;
+}
+
+/*
+* Store batches until the countdown-th sync of a log crashes the process.
+*/
+static void run_child(const char* filename, const struct storage_options* options, const long countdown_syncs) {
+	unsigned long keys[N_KEYS];
+	long values[N_KEYS];
+	storage_t storage;
+
+	if (!(storage = storage_init(filename, options))) {
+		_exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < N_KEYS; i++) {
+		keys[i] = i;
+	}
+	pthread_mutex_lock(&mutex);
+	countdown = countdown_syncs;
+	pthread_mutex_unlock(&mutex);
+	for (long batch = 1; batch <= MAX_BATCHES; batch++) {
+		for (size_t i = 0; i < N_KEYS; i++) {
+			values[i] = batch;
+		}
+		__atomic_store_n(&progress->started, batch, __ATOMIC_SEQ_CST);
+		if (storage_store_ints(storage, N_KEYS, keys, values)) {
+			_exit(EXIT_FAILURE);
+		}
+		__atomic_store_n(&progress->acked, batch, __ATOMIC_SEQ_CST);
+	}
+	// the crash never came
+	_exit(EXIT_FAILURE);
+}
+
+/*
+* Crash a child storing batches at the countdown-th sync of a log, then
+* restart the storage and check it.
+*
+* @return	0 if the restarted storage is consistent or return 1 otherwise.
+*/
+static int run_case(const struct crash_case* test, const long countdown_syncs) {
+	char path[] = TEST_DIR_TEMPLATE;
+	char filename[sizeof path + sizeof "/data"];
+	FILE* stream;
+	pid_t pid;
+	int status;
+	int ret;
+
+	try(mkdtemp(path), NULL, error);
+	sprintf(filename, "%s/data", path);
+	try(stream = fopen(filename, "w"), NULL, cleanup);
+	try(fclose(stream), EOF, cleanup);
+	memset(progress, 0, sizeof * progress);
+	try(pid = fork(), -1, cleanup);
+	if (!pid) {
+		run_child(filename, &test->options, countdown_syncs);
+	}
+	try(waitpid(pid, &status, 0), -1, cleanup);
+	if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL) {
+		fprintf(stderr, "wal_crash_test: %s: the child did not crash\n", test->name);
+		goto cleanup;
+	}
+	try(drop_unsynced(path), !0, cleanup);
+	ret = check_storage(filename, &test->options, test->exact);
+	try(clear_dir(path), !0, error);
+	return ret;
+
+cleanup:
+	{ int error = errno; clear_dir(path); errno = error; }
+error:
+	if (errno) {
+		perror("wal_crash_test");
+	}
+	return 1;
+}
+
+/*
+* Restart the storage and check that every key holds the same batch, no
+* later than the last batch the durable log can hold and, if exact, no
+* earlier than the last acknowledged one.
+*
+* @return	0 if the storage is consistent or return 1 otherwise.
+*/
+static int check_storage(const char* filename, const struct storage_options* options, const int exact) {
+	storage_t storage;
+	long first = 0;
+	int ret = 0;
+
+	try(storage = storage_init(filename, options), NULL, error);
+	for (size_t i = 0; i < N_KEYS; i++) {
+		long value = 0;
+		if (storage_load_int(storage, i, &value) && errno != ENOENT) {
+			goto cleanup;
+		}
+		if (!i) {
+			first = value;
+		}
+		else if (value != first) {
+			fprintf(stderr, "wal_crash_test: key %zu holds batch %ld, key 0 holds batch %ld\n", i, value, first);
+			ret = 1;
+		}
+	}
+	if (first > progress->bound) {
+		fprintf(stderr, "wal_crash_test: batch %ld survived, the durable log holds at most batch %ld\n", first, progress->bound);
+		ret = 1;
+	}
+	if (exact && first < progress->acked) {
+		fprintf(stderr, "wal_crash_test: batch %ld survived, batch %ld was acknowledged\n", first, progress->acked);
+		ret = 1;
+	}
+	try(storage_close(storage), !0, error);
+	return ret;
+
+cleanup:
+	storage_close(storage);
+error:
+	perror("wal_crash_test");
+	return 1;
+}
+
+/*
+* Remove the directory and the files in it.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int clear_dir(const char* path) {
+	char filename[4096];
+	struct dirent* entry;
+	DIR* dir;
+
+	try(dir = opendir(path), NULL, error);
+	while ((entry = readdir(dir))) {
+		if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+			snprintf(filename, sizeof filename, "%s/%s", path, entry->d_name);
+			unlink(filename);
+		}
+	}
+	try(closedir(dir), -1, error);
+	try(rmdir(path), -1, error);
+	return 0;
+
+error:
+	return 1;
+}
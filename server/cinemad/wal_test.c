@@ -0,0 +1,488 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "wal.h"
+
+#include <try.h>
+
+#define N_RECORDS 100
+#define N_WRITERS 4
+#define PAYLOAD_LEN 63
+#define TORN_LEN 10	// bytes of the torn record, fewer than its header
+#define TEST_DIR_TEMPLATE "/tmp/wal_test.XXXXXX"
+
+/*
+* Every record of a test holds the payload of its index, so a replay is
+* checked against the indexes it must yield in order.
+*/
+
+struct replayed {
+	size_t n;
+	size_t fail_at;	// records applied before the apply function fails, N_RECORDS for never
+	int indexes[N_RECORDS];
+};
+
+struct writer {
+	wal_t wal;
+	int first;
+};
+
+struct wal_case {
+	const char* name;
+	int (*run)(const char* filename, const enum wal_sync sync);
+	enum wal_sync sync;
+};
+
+// Prototype declarations of functions included in this code module
+
+static int test_round_trip(const char* filename, const enum wal_sync sync);
+static int test_torn_tail(const char* filename, const enum wal_sync sync);
+static int test_torn_append(const char* filename, const enum wal_sync sync);
+static int test_corrupt_record(const char* filename, const enum wal_sync sync);
+static int test_reset(const char* filename, const enum wal_sync sync);
+static int test_apply_failure(const char* filename, const enum wal_sync sync);
+static int test_group_commit(const char* filename, const enum wal_sync sync);
+static void* writer_routine(void* arg);
+static size_t payload(const int index, char* bytes);
+static int apply(void* context, const char* bytes, const size_t length);
+static int write_log(const char* filename, const enum wal_sync sync, const int first, const int n);
+static int replay_log(const char* filename, struct replayed* replayed);
+static int check_replayed(const struct replayed* replayed, const int n);
+static int patch_file(const char* filename, const int index);
+
+/*
+* Usage: wal_test
+*
+* Append records in every sync mode and replay them, then tear, corrupt and
+* reset the log and check that the replay keeps only the intact records
+* before the damage and that the records appended afterwards follow them.
+*/
+int main(void) {
+	const struct wal_case cases[] = {
+		{ "round trip always", &test_round_trip, WAL_SYNC_ALWAYS },
+		{ "round trip group", &test_round_trip, WAL_SYNC_GROUP },
+		{ "round trip interval", &test_round_trip, WAL_SYNC_INTERVAL },
+		{ "round trip none", &test_round_trip, WAL_SYNC_NONE },
+		{ "torn tail", &test_torn_tail, WAL_SYNC_ALWAYS },
+		{ "torn append", &test_torn_append, WAL_SYNC_ALWAYS },
+		{ "corrupt record", &test_corrupt_record, WAL_SYNC_ALWAYS },
+		{ "reset", &test_reset, WAL_SYNC_ALWAYS },
+		{ "apply failure", &test_apply_failure, WAL_SYNC_ALWAYS },
+		{ "group commit", &test_group_commit, WAL_SYNC_GROUP },
+	};
+	int failures = 0;
+
+	for (size_t i = 0; i < sizeof cases / sizeof * cases; i++) {
+		char path[] = TEST_DIR_TEMPLATE;
+		char filename[sizeof path + sizeof "/log.wal"];
+
+		try(mkdtemp(path), NULL, error);
+		sprintf(filename, "%s/log.wal", path);
+		errno = 0;
+		if (cases[i].run(filename, cases[i].sync)) {
+			if (errno) {
+				perror("wal_test");
+			}
+			fprintf(stderr, "wal_test: %s: FAILED\n", cases[i].name);
+			failures++;
+		}
+		unlink(filename);
+		try(rmdir(path), -1, error);
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+
+error:
+	perror("wal_test");
+	return EXIT_FAILURE;
+}
+
+/*
+* Append and commit the records, then replay them from a new handle.
+*/
+static int test_round_trip(const char* filename, const enum wal_sync sync) {
+	struct replayed replayed;
+
+	try(write_log(filename, sync, 0, N_RECORDS), !0, error);
+	try(replay_log(filename, &replayed), !0, error);
+	return check_replayed(&replayed, N_RECORDS);
+
+error:
+	return 1;
+}
+
+/*
+* Cut the last byte of the log as a crash in the middle of a write would, the
+* torn record is dropped and the next one takes its place.
+*/
+static int test_torn_tail(const char* filename, const enum wal_sync sync) {
+	struct replayed replayed;
+	struct stat st;
+
+	try(write_log(filename, sync, 0, N_RECORDS), !0, error);
+	try(stat(filename, &st), -1, error);
+	try(truncate(filename, st.st_size - 1), -1, error);
+	try(replay_log(filename, &replayed), !0, error);
+	try(check_replayed(&replayed, N_RECORDS - 1), !0, error);
+	try(write_log(filename, sync, N_RECORDS - 1, 1), !0, error);
+	try(replay_log(filename, &replayed), !0, error);
+	return check_replayed(&replayed, N_RECORDS);
+
+error:
+	return 1;
+}
+
+/*
+* Fail an append after part of its record is written, past the file size
+* limit, every later append fails too so that no committed record follows the
+* torn one, which the replay would drop along with it.
+*/
+static int test_torn_append(const char* filename, const enum wal_sync sync) {
+	struct replayed replayed = { .fail_at = N_RECORDS };
+	char bytes[PAYLOAD_LEN + 1];
+	struct rlimit limit;
+	struct rlimit torn;
+	unsigned long lsn;
+	struct stat st;
+	wal_t wal;
+	int ret;
+
+	try(write_log(filename, sync, 0, N_RECORDS / 2), !0, error);
+	try(wal = wal_open(filename, sync, 1), NULL, error);
+	try(wal_replay(wal, &apply, &replayed), !0, cleanup);
+	try(stat(filename, &st), -1, cleanup);
+	try(getrlimit(RLIMIT_FSIZE, &limit), -1, cleanup);
+	torn = limit;
+	torn.rlim_cur = (rlim_t)st.st_size + TORN_LEN;
+	try(signal(SIGXFSZ, SIG_IGN), SIG_ERR, cleanup);
+	try(setrlimit(RLIMIT_FSIZE, &torn), -1, cleanup);
+	ret = !wal_append(wal, bytes, payload(N_RECORDS / 2, bytes), &lsn);
+	try(setrlimit(RLIMIT_FSIZE, &limit), -1, cleanup);
+	signal(SIGXFSZ, SIG_DFL);
+	ret |= !wal_append(wal, bytes, payload(N_RECORDS / 2, bytes), &lsn);
+	try(wal_close(wal), !0, error);
+	if (ret) {
+		fprintf(stderr, "wal_test: record appended after a torn one\n");
+		return 1;
+	}
+	try(replay_log(filename, &replayed), !0, error);
+	return check_replayed(&replayed, N_RECORDS / 2);
+
+cleanup:
+	{
+		int error = errno;
+		wal_close(wal);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Flip a byte of a record in the middle of the log, the replay stops before
+* it and the records appended afterwards follow the last intact one.
+*/
+static int test_corrupt_record(const char* filename, const enum wal_sync sync) {
+	struct replayed replayed;
+
+	try(write_log(filename, sync, 0, N_RECORDS), !0, error);
+	try(patch_file(filename, N_RECORDS / 2), !0, error);
+	try(replay_log(filename, &replayed), !0, error);
+	try(check_replayed(&replayed, N_RECORDS / 2), !0, error);
+	try(write_log(filename, sync, N_RECORDS / 2, N_RECORDS - N_RECORDS / 2), !0, error);
+	try(replay_log(filename, &replayed), !0, error);
+	return check_replayed(&replayed, N_RECORDS);
+
+error:
+	return 1;
+}
+
+/*
+* Reset the log, no record survives and the log starts again.
+*/
+static int test_reset(const char* filename, const enum wal_sync sync) {
+	struct replayed replayed = { .fail_at = N_RECORDS };
+	wal_t wal;
+
+	try(write_log(filename, sync, 0, N_RECORDS), !0, error);
+	try(wal = wal_open(filename, sync, 0), NULL, error);
+	try(wal_replay(wal, &apply, &replayed), !0, cleanup);
+	try(wal_reset(wal), !0, cleanup);
+	try(wal_close(wal), !0, error);
+	try(replay_log(filename, &replayed), !0, error);
+	try(check_replayed(&replayed, 0), !0, error);
+	try(write_log(filename, sync, 0, N_RECORDS / 2), !0, error);
+	try(replay_log(filename, &replayed), !0, error);
+	return check_replayed(&replayed, N_RECORDS / 2);
+
+cleanup:
+	wal_close(wal);
+error:
+	return 1;
+}
+
+/*
+* Fail the apply function in the middle of the replay, the replay fails with
+* its errno and the log is left whole.
+*/
+static int test_apply_failure(const char* filename, const enum wal_sync sync) {
+	struct replayed replayed = { .fail_at = N_RECORDS / 2 };
+	wal_t wal;
+	int ret;
+
+	try(write_log(filename, sync, 0, N_RECORDS), !0, error);
+	try(wal = wal_open(filename, sync, 0), NULL, error);
+	ret = wal_replay(wal, &apply, &replayed);
+	if (!ret || errno != EIO) {
+		fprintf(stderr, "wal_test: the replay did not fail with the apply function\n");
+		wal_close(wal);
+		return 1;
+	}
+	try(wal_close(wal), !0, error);
+	try(replay_log(filename, &replayed), !0, error);
+	return check_replayed(&replayed, N_RECORDS);
+
+error:
+	return 1;
+}
+
+/*
+* Commit the records from several threads sharing a log, every record is
+* replayed once and the records of every thread keep their order.
+*/
+static int test_group_commit(const char* filename, const enum wal_sync sync) {
+	struct writer writers[N_WRITERS];
+	pthread_t threads[N_WRITERS];
+	struct replayed replayed;
+	int last[N_WRITERS];
+	size_t n_started = 0;
+	wal_t wal;
+	int ret = 0;
+
+	try(wal = wal_open(filename, sync, 0), NULL, error);
+	for (; n_started < N_WRITERS; n_started++) {
+		writers[n_started].wal = wal;
+		writers[n_started].first = (int)n_started;
+		try_pthread(pthread_create(&threads[n_started], NULL, &writer_routine, &writers[n_started]), cleanup);
+	}
+	for (size_t i = 0; i < N_WRITERS; i++) {
+		void* failed;
+		try_pthread(pthread_join(threads[i], &failed), error);
+		ret |= (failed != NULL);
+	}
+	try(wal_close(wal), !0, error);
+	try(replay_log(filename, &replayed), !0, error);
+	if (ret || replayed.n != N_RECORDS) {
+		fprintf(stderr, "wal_test: %zu records replayed, %d expected\n", replayed.n, N_RECORDS);
+		return 1;
+	}
+	for (size_t i = 0; i < N_WRITERS; i++) {
+		last[i] = -1;
+	}
+	for (size_t i = 0; i < replayed.n; i++) {
+		int index = replayed.indexes[i];
+		if (index < 0 || index <= last[index % N_WRITERS]) {
+			fprintf(stderr, "wal_test: record %d replayed out of order\n", index);
+			return 1;
+		}
+		last[index % N_WRITERS] = index;
+	}
+	return 0;
+
+cleanup:
+	for (size_t i = 0; i < n_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	wal_close(wal);
+error:
+	return 1;
+}
+
+/*
+* Append and commit every N_WRITERS-th record starting from the first one of
+* the writer.
+*
+* @return	NULL on success or the writer on error.
+*/
+static void* writer_routine(void* arg) {
+	struct writer* writer = (struct writer*)arg;
+	char bytes[PAYLOAD_LEN + 1];
+
+	for (int index = writer->first; index < N_RECORDS; index += N_WRITERS) {
+		unsigned long lsn;
+		try(wal_append(writer->wal, bytes, payload(index, bytes), &lsn), !0, error);
+		try(wal_commit(writer->wal, lsn), !0, error);
+	}
+	return NULL;
+
+error:
+	return writer;
+}
+
+/*
+* Write the payload of the record with the index, its length grows with the
+* index so that the records are not aligned.
+*
+* @return	the length of the payload.
+*/
+static size_t payload(const int index, char* bytes) {
+	int length = sprintf(bytes, "record %03d ", index);
+	for (int i = 0; i < index % (PAYLOAD_LEN - length); i++) {
+		bytes[length++] = (char)('a' + i % 26);
+	}
+	return (size_t)length;
+}
+
+/*
+* Collect the index of the replayed record after checking its payload.
+*/
+static int apply(void* context, const char* bytes, const size_t length) {
+	struct replayed* replayed = (struct replayed*)context;
+	char expected[PAYLOAD_LEN + 1];
+	int index;
+
+	if (replayed->n == replayed->fail_at) {
+		errno = EIO;
+		return 1;
+	}
+	if (replayed->n == N_RECORDS) {
+		errno = EOVERFLOW;
+		return 1;
+	}
+	if (length < sizeof "record 000" || sscanf(bytes, "record %3d", &index) != 1 || index < 0 || index >= N_RECORDS
+		|| payload(index, expected) != length || memcmp(expected, bytes, length)) {
+		index = -1;
+	}
+	replayed->indexes[replayed->n++] = index;
+	return 0;
+}
+
+/*
+* Replay the log, then append and commit the records with the indexes from
+* first to first + n - 1, as the storage does on every open.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int write_log(const char* filename, const enum wal_sync sync, const int first, const int n) {
+	struct replayed replayed = { .fail_at = N_RECORDS };
+	char bytes[PAYLOAD_LEN + 1];
+	wal_t wal;
+
+	try(wal = wal_open(filename, sync, 1), NULL, error);
+	try(wal_replay(wal, &apply, &replayed), !0, cleanup);
+	for (int index = first; index < first + n; index++) {
+		unsigned long lsn;
+		try(wal_append(wal, bytes, payload(index, bytes), &lsn), !0, cleanup);
+		try(wal_commit(wal, lsn), !0, cleanup);
+	}
+	try(wal_close(wal), !0, error);
+	return 0;
+
+cleanup:
+	{
+		int error = errno;
+		wal_close(wal);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Replay the log from a new handle collecting the indexes of its records.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int replay_log(const char* filename, struct replayed* replayed) {
+	wal_t wal;
+
+	replayed->n = 0;
+	replayed->fail_at = N_RECORDS;
+	try(wal = wal_open(filename, WAL_SYNC_ALWAYS, 0), NULL, error);
+	try(wal_replay(wal, &apply, replayed), !0, cleanup);
+	try(wal_close(wal), !0, error);
+	return 0;
+
+cleanup:
+	{
+		int error = errno;
+		wal_close(wal);
+		errno = error;
+	}
+error:
+	return 1;
+}
+
+/*
+* Check that the replay yielded the records from 0 to n - 1 in order.
+*
+* @return	0 if it did or return 1 otherwise.
+*/
+static int check_replayed(const struct replayed* replayed, const int n) {
+	if (replayed->n != (size_t)n) {
+		fprintf(stderr, "wal_test: %zu records replayed, %d expected\n", replayed->n, n);
+		return 1;
+	}
+	for (int i = 0; i < n; i++) {
+		if (replayed->indexes[i] != i) {
+			fprintf(stderr, "wal_test: record %d replayed in place of record %d\n", replayed->indexes[i], i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+* Flip the last byte of the payload of the record with the index in the file.
+*
+* @return	0 on success or return 1 and set properly errno on error.
+*/
+static int patch_file(const char* filename, const int index) {
+	char expected[PAYLOAD_LEN + 1];
+	struct stat st;
+	char* bytes;
+	char* found;
+	FILE* stream;
+	size_t length = payload(index, expected);
+
+	try(stat(filename, &st), -1, error);
+	try(bytes = malloc((size_t)st.st_size), NULL, error);
+	try(stream = fopen(filename, "r+"), NULL, cleanup1);
+	try(fread(bytes, 1, (size_t)st.st_size, stream) != (size_t)st.st_size, !0, cleanup2);
+	found = NULL;
+	for (size_t offset = 0; !found && offset + length <= (size_t)st.st_size; offset++) {
+		if (!memcmp(bytes + offset, expected, length)) {
+			found = bytes + offset;
+		}
+	}
+	if (!found) {
+		errno = ENOENT;
+		goto cleanup2;
+	}
+	try(fseek(stream, found - bytes + (long)length - 1, SEEK_SET), -1, cleanup2);
+	try(fputc(found[length - 1] ^ 0x01, stream), EOF, cleanup2);
+	try(fclose(stream), EOF, cleanup1);
+	free(bytes);
+	return 0;
+
+cleanup2:
+	{
+		int error = errno;
+		fclose(stream);
+		errno = error;
+	}
+cleanup1:
+	{
+		int error = errno;
+		free(bytes);
+		errno = error;
+	}
+error:
+	return 1;
+}